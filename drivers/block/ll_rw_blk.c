@@ -284,6 +284,7 @@ void blk_queue_pluggable (request_queue_t * q, plug_device_fn *plug)
 void blk_queue_make_request(request_queue_t * q, make_request_fn * mfn)
 {
 	q->make_request_fn = mfn;
+	q->queue_lock = &io_request_lock;
 }
 
 static inline int ll_new_segment(request_queue_t *q, struct request *req, int max_segments)
@@ -369,9 +370,9 @@ static void generic_unplug_device(void *data)
 	request_queue_t *q = (request_queue_t *) data;
 	unsigned long flags;
 
-	spin_lock_irqsave(&io_request_lock, flags);
+	spin_lock_irqsave(q->queue_lock, flags);
 	__generic_unplug_device(q);
-	spin_unlock_irqrestore(&io_request_lock, flags);
+	spin_unlock_irqrestore(q->queue_lock, flags);
 }
 
 static void blk_init_free_list(request_queue_t *q)
@@ -417,8 +418,10 @@ static int __make_request(request_queue_t * q, int rw, struct buffer_head * bh);
  *    requests on the queue, it is responsible for arranging that the requests
  *    get dealt with eventually.
  *
- *    A global spin lock $io_request_lock must be held while manipulating the
- *    requests on the request queue.
+ *    The queue lock, q->queue_lock, must be held while manipulating the
+ *    requests on the request queue.  It is the global $io_request_lock
+ *    unless the driver gives the queue a lock of its own with
+ *    blk_queue_lock().
  *
  *    The request on the head of the queue is by default assumed to be
  *    potentially active, and it is not considered for re-ordering or merging
@@ -453,12 +456,33 @@ void blk_init_queue(request_queue_t * q, request_fn_proc * rfn)
 	 */
 	q->plug_device_fn 	= generic_plug_device;
 	q->head_active    	= 1;
+	q->queue_lock		= &io_request_lock;
+}
+
+/**
+ * blk_queue_lock - use a lock other than io_request_lock for a queue
+ * @q:    The queue, already set up by blk_init_queue()
+ * @lock: The lock; &q->request_lock for a lock of the queue's own,
+ *        or a lock shared by all queues of one controller
+ *
+ * Description:
+ *    By default every queue is protected by the global io_request_lock,
+ *    which serializes the request handling of all block devices.  A
+ *    driver that calls this is taking @lock instead wherever it used to
+ *    take io_request_lock for the queue: around end_that_request_first()
+ *    and end_that_request_last(), and when taking requests off the queue.
+ *    Its request function is called with @lock held and interrupts
+ *    disabled.
+ **/
+void blk_queue_lock(request_queue_t * q, spinlock_t * lock)
+{
+	q->queue_lock = lock;
 }
 
 
 #define blkdev_free_rq(list) list_entry((list)->next, struct request, table);
 /*
- * Get a free request. io_request_lock must be held and interrupts
+ * Get a free request. The queue lock must be held and interrupts
  * disabled on the way in.
  */
 static inline struct request *get_request(request_queue_t *q, int rw)
@@ -508,9 +532,9 @@ static struct request *__get_request_wait(request_queue_t *q, int rw)
 	add_wait_queue_exclusive(&q->wait_for_request, &wait);
 	for (;;) {
 		__set_current_state(TASK_UNINTERRUPTIBLE);
-		spin_lock_irq(&io_request_lock);
+		spin_lock_irq(q->queue_lock);
 		rq = get_request(q, rw);
-		spin_unlock_irq(&io_request_lock);
+		spin_unlock_irq(q->queue_lock);
 		if (rq)
 			break;
 		generic_unplug_device(q);
@@ -525,9 +549,9 @@ static inline struct request *get_request_wait(request_queue_t *q, int rw)
 {
 	register struct request *rq;
 
-	spin_lock_irq(&io_request_lock);
+	spin_lock_irq(q->queue_lock);
 	rq = get_request(q, rw);
-	spin_unlock_irq(&io_request_lock);
+	spin_unlock_irq(q->queue_lock);
 	if (rq)
 		return rq;
 	return __get_request_wait(q, rw);
@@ -579,6 +603,28 @@ inline void drive_stat_acct (kdev_t dev, int rw,
 		printk(KERN_ERR "drive_stat_acct: cmd not R/W?\n");
 }
 
+/*
+ * Account a completed request: how many there were and how long they
+ * spent between add_request() and completion.  Drivers that finish
+ * requests without end_that_request_last() call this themselves.
+ * Driver private commands never went through add_request(), so only
+ * reads and writes are counted.
+ */
+void drive_stat_done (struct request *req)
+{
+	unsigned int major = MAJOR(req->rq_dev);
+	unsigned int index;
+
+	if (req->cmd != READ && req->cmd != WRITE)
+		return;
+	index = disk_index(req->rq_dev);
+	if ((index >= DK_MAX_DISK) || (major >= DK_MAX_MAJOR))
+		return;
+
+	kstat.dk_drive_done[major][index]++;
+	kstat.dk_drive_ticks[major][index] += jiffies - req->start_time;
+}
+
 /*
  * add-request adds a request to the linked list.
  * It disables interrupts (acquires the request spinlock) so that it can muck
@@ -595,6 +641,7 @@ static inline void add_request(request_queue_t * q, struct request * req,
 	int major;
 
 	drive_stat_acct(req->rq_dev, req->cmd, req->nr_sectors, 1);
+	req->start_time = jiffies;
 
 	/*
 	 * let selected elevator insert the request
@@ -618,7 +665,7 @@ static inline void add_request(request_queue_t * q, struct request * req,
 }
 
 /*
- * Must be called with io_request_lock held and interrupts disabled
+ * Must be called with the queue lock held and interrupts disabled
  */
 void inline blkdev_release_request(struct request *req)
 {
@@ -692,20 +739,25 @@ static inline void attempt_front_merge(request_queue_t * q,
 	attempt_merge(q, blkdev_entry_to_request(prev), max_sectors, max_segments);
 }
 
-static int __make_request(request_queue_t * q, int rw,
-				  struct buffer_head * bh)
+/*
+ * Queue a chain of buffers, linked through b_reqnext, all for the same
+ * device.  The chain is taken under one hold of the queue lock and
+ * the driver is only kicked once at the end; a buffer that continues
+ * the request the previous one went into is appended to it directly,
+ * without another elevator scan.
+ */
+static void __make_request_vec(request_queue_t * q, int rw,
+			       struct buffer_head * bh)
 {
 	unsigned int sector, count;
-	int max_segments = MAX_SEGMENTS;
-	struct request * req = NULL, *freereq = NULL;
+	int max_segments, dev_max_sectors;
+	struct request * req = NULL, *freereq = NULL, *last = NULL;
+	struct buffer_head * next;
 	int rw_ahead, max_sectors, el_ret;
 	struct list_head *head;
 	int latency;
 	elevator_t *elevator = &q->elevator;
 
-	count = bh->b_size >> 9;
-	sector = bh->b_rsector;
-
 	rw_ahead = 0;	/* normal case; gets changed below for READA */
 	switch (rw) {
 		case READA:
@@ -723,8 +775,9 @@ static int __make_request(request_queue_t * q, int rw,
 	   Check this bit only if the buffer was dirty and just locked
 	   down by us so at this point flushpage will block and
 	   won't clear the mapped bit under us. */
-	if (!buffer_mapped(bh))
-		BUG();
+	for (next = bh; next; next = next->b_reqnext)
+		if (!buffer_mapped(next))
+			BUG();
 
 	/*
 	 * Temporary solution - in 2.5 this will be done by the lowlevel
@@ -732,14 +785,18 @@ static int __make_request(request_queue_t * q, int rw,
 	 * high memory - keep the original buffer otherwise.
 	 */
 #if CONFIG_HIGHMEM
-	bh = create_bounce(rw, bh);
+	{
+		struct buffer_head **p;
+
+		for (p = &bh; *p; p = &(*p)->b_reqnext) {
+			next = (*p)->b_reqnext;
+			*p = create_bounce(rw, *p);
+			(*p)->b_reqnext = next;
+		}
+	}
 #endif
 
-/* look for a free request. */
-	/*
-	 * Try to coalesce the new request with old requests
-	 */
-	max_sectors = get_max_sectors(bh->b_rdev);
+	dev_max_sectors = get_max_sectors(bh->b_rdev);
 
 	latency = elevator_request_latency(elevator, rw);
 
@@ -747,9 +804,22 @@ static int __make_request(request_queue_t * q, int rw,
 	 * Now we acquire the request spinlock, we have to be mega careful
 	 * not to schedule or do something nonatomic
 	 */
-again:
-	spin_lock_irq(&io_request_lock);
+	spin_lock_irq(q->queue_lock);
+
+next_bh:
+	next = bh->b_reqnext;
+	bh->b_reqnext = NULL;
+	count = bh->b_size >> 9;
+	sector = bh->b_rsector;
 
+/* look for a free request. */
+	/*
+	 * Try to coalesce the new request with old requests
+	 */
+	max_sectors = dev_max_sectors;
+	max_segments = MAX_SEGMENTS;
+
+again:
 	/*
 	 * skip first entry, for devices with active queue head
 	 */
@@ -762,11 +832,24 @@ again:
 		goto get_rq;
 	}
 
+	/*
+	 * Sequential buffers of a vector: straight onto the end of the
+	 * request the last one went to, if that is still waiting.
+	 */
+	if (last && last->sector + last->nr_sectors == sector &&
+	    last->nr_sectors + count <= max_sectors &&
+	    last->cmd == rw && last->rq_dev == bh->b_rdev &&
+	    &last->queue != head && !last->sem) {
+		req = last;
+		goto back_merge;
+	}
+
 	el_ret = elevator->elevator_merge_fn(q, &req, bh, rw,
 					     &max_sectors, &max_segments);
 	switch (el_ret) {
 
 		case ELEVATOR_BACK_MERGE:
+		back_merge:
 			if (!q->back_merge_fn(q, req, bh, max_segments))
 				break;
 			req->bhtail->b_reqnext = bh;
@@ -775,6 +858,7 @@ again:
 			req->e = elevator;
 			drive_stat_acct(req->rq_dev, req->cmd, count, 0);
 			attempt_back_merge(q, req, max_sectors, max_segments);
+			last = req;
 			goto out;
 
 		case ELEVATOR_FRONT_MERGE:
@@ -788,7 +872,9 @@ again:
 			req->nr_sectors = req->hard_nr_sectors += count;
 			req->e = elevator;
 			drive_stat_acct(req->rq_dev, req->cmd, count, 0);
+			/* may free req into its predecessor */
 			attempt_front_merge(q, head, req, max_sectors, max_segments);
+			last = NULL;
 			goto out;
 		/*
 		 * elevator says don't/can't merge. get new request
@@ -812,11 +898,18 @@ get_rq:
 		req = freereq;
 		freereq = NULL;
 	} else if ((req = get_request(q, rw)) == NULL) {
-		spin_unlock_irq(&io_request_lock);
-		if (rw_ahead)
+		/* let the driver have what we queued so far */
+		if (!q->plugged)
+			(q->request_fn)(q);
+		spin_unlock_irq(q->queue_lock);
+		if (rw_ahead) {
+			bh->b_reqnext = next;
 			goto end_io;
+		}
 
 		freereq = __get_request_wait(q, rw);
+		spin_lock_irq(q->queue_lock);
+		last = NULL;
 		goto again;
 	}
 
@@ -835,15 +928,66 @@ get_rq:
 	req->rq_dev = bh->b_rdev;
 	req->e = elevator;
 	add_request(q, req, head, latency);
+	last = req;
 out:
+	if (next) {
+		bh = next;
+		goto next_bh;
+	}
 	if (!q->plugged)
 		(q->request_fn)(q);
 	if (freereq)
 		blkdev_release_request(freereq);
-	spin_unlock_irq(&io_request_lock);
-	return 0;
+	spin_unlock_irq(q->queue_lock);
+	return;
 end_io:
-	bh->b_end_io(bh, test_bit(BH_Uptodate, &bh->b_state));
+	for ( ; bh; bh = next) {
+		next = bh->b_reqnext;
+		bh->b_reqnext = NULL;
+		bh->b_end_io(bh, test_bit(BH_Uptodate, &bh->b_state));
+	}
+}
+
+static int __make_request(request_queue_t * q, int rw,
+				  struct buffer_head * bh)
+{
+	bh->b_reqnext = NULL;
+	__make_request_vec(q, rw, bh);
+	return 0;
+}
+
+/*
+ * Fail a buffer that lies (partly) beyond the end of its device.
+ */
+static int blk_beyond_end(int rw, struct buffer_head * bh)
+{
+	int major = MAJOR(bh->b_rdev);
+
+	if (blk_size[major]) {
+		unsigned long maxsector = (blk_size[major][MINOR(bh->b_rdev)] << 1) + 1;
+		unsigned int sector, count;
+
+		count = bh->b_size >> 9;
+		sector = bh->b_rsector;
+
+		if (maxsector < count || maxsector - count < sector) {
+			bh->b_state &= (1 << BH_Lock) | (1 << BH_Mapped);
+			if (blk_size[major][MINOR(bh->b_rdev)]) {
+				
+				/* This may well happen - the kernel calls bread()
+				   without checking the size of the device, e.g.,
+				   when mounting a device. */
+				printk(KERN_INFO
+				       "attempt to access beyond end of device\n");
+				printk(KERN_INFO "%s: rw=%d, want=%d, limit=%d\n",
+				       kdevname(bh->b_rdev), rw,
+				       (sector + count)>>1,
+				       blk_size[major][MINOR(bh->b_rdev)]);
+			}
+			bh->b_end_io(bh, 0);
+			return 1;
+		}
+	}
 	return 0;
 }
 
@@ -883,35 +1027,11 @@ end_io:
  * */
 void generic_make_request (int rw, struct buffer_head * bh)
 {
-	int major = MAJOR(bh->b_rdev);
 	request_queue_t *q;
 
 	if (!bh->b_end_io) BUG();
-	if (blk_size[major]) {
-		unsigned long maxsector = (blk_size[major][MINOR(bh->b_rdev)] << 1) + 1;
-		unsigned int sector, count;
-
-		count = bh->b_size >> 9;
-		sector = bh->b_rsector;
-
-		if (maxsector < count || maxsector - count < sector) {
-			bh->b_state &= (1 << BH_Lock) | (1 << BH_Mapped);
-			if (blk_size[major][MINOR(bh->b_rdev)]) {
-				
-				/* This may well happen - the kernel calls bread()
-				   without checking the size of the device, e.g.,
-				   when mounting a device. */
-				printk(KERN_INFO
-				       "attempt to access beyond end of device\n");
-				printk(KERN_INFO "%s: rw=%d, want=%d, limit=%d\n",
-				       kdevname(bh->b_rdev), rw,
-				       (sector + count)>>1,
-				       blk_size[major][MINOR(bh->b_rdev)]);
-			}
-			bh->b_end_io(bh, 0);
-			return;
-		}
-	}
+	if (blk_beyond_end(rw, bh))
+		return;
 
 	/*
 	 * Resolve the mapping until finished. (drivers are
@@ -975,6 +1095,77 @@ void submit_bh(int rw, struct buffer_head * bh)
 	}
 }
 
+/**
+ * submit_bh_vec: submit a vector of buffer_heads for I/O
+ * @rw: whether to %READ or %WRITE, or maybe to %READA (read ahead)
+ * @nr: number of &struct buffer_heads in the array
+ * @bhs: array of pointers to &struct buffer_head
+ *
+ * Does what submit_bh() does for each of the buffers, but runs of
+ * buffers that are adjacent on the same device are handed to the
+ * request queue as a whole: a device using the standard request
+ * queue gets them merged into its requests under one acquisition of
+ * the request lock, see __make_request_vec().  Stacking drivers with
+ * their own make_request function still see one buffer at a time.
+ *
+ * The buffers must be locked and have b_end_io set, as for submit_bh().
+ */
+void submit_bh_vec(int rw, int nr, struct buffer_head * bhs[])
+{
+	struct buffer_head *bh, *first, *tail;
+	request_queue_t *q;
+	int i = 0;
+
+	while (i < nr) {
+		first = tail = NULL;
+		for ( ; i < nr; i++) {
+			bh = bhs[i];
+			if (!test_bit(BH_Lock, &bh->b_state))
+				BUG();
+			if (!bh->b_end_io)
+				BUG();
+			set_bit(BH_Req, &bh->b_state);
+			bh->b_rdev = bh->b_dev;
+			bh->b_rsector = bh->b_blocknr * (bh->b_size>>9);
+
+			if (tail && (bh->b_rdev != tail->b_rdev ||
+				     bh->b_rsector != tail->b_rsector + (tail->b_size>>9)))
+				break;
+			if (rw == WRITE)
+				kstat.pgpgout++;
+			else
+				kstat.pgpgin++;
+			if (blk_beyond_end(rw, bh)) {
+				i++;
+				break;
+			}
+			bh->b_reqnext = NULL;
+			if (tail)
+				tail->b_reqnext = bh;
+			else
+				first = bh;
+			tail = bh;
+		}
+		if (!first)
+			continue;
+
+		q = blk_get_queue(first->b_rdev);
+		if (q && q->make_request_fn == __make_request) {
+			__make_request_vec(q, rw, first);
+			continue;
+		}
+		/* stacking driver or no queue: one at a time */
+		for (bh = first; bh; bh = tail) {
+			tail = bh->b_reqnext;
+			bh->b_reqnext = NULL;
+			generic_make_request(rw, bh);
+		}
+	}
+}
+
+/* buffers ll_rw_block() hands to submit_bh_vec() at a time */
+#define LL_RW_BLOCK_VEC	32
+
 /*
  * Default IO end handler, used by "ll_rw_block()".
  */
@@ -1019,7 +1210,8 @@ void ll_rw_block(int rw, int nr, struct buffer_head * bhs[])
 {
 	unsigned int major;
 	int correct_size;
-	int i;
+	int i, n = 0;
+	struct buffer_head *vec[LL_RW_BLOCK_VEC];
 
 	major = MAJOR(bhs[0]->b_dev);
 
@@ -1082,8 +1274,14 @@ void ll_rw_block(int rw, int nr, struct buffer_head * bhs[])
 			continue;
 		}
 
-		submit_bh(rw, bh);
+		vec[n++] = bh;
+		if (n == LL_RW_BLOCK_VEC) {
+			submit_bh_vec(rw, n, vec);
+			n = 0;
+		}
 	}
+	if (n)
+		submit_bh_vec(rw, n, vec);
 	return;
 
 sorry:
@@ -1142,6 +1340,7 @@ void end_that_request_last(struct request *req)
 		printk("end_that_request_last called with non-dequeued req\n");
 		BUG();
 	}
+	drive_stat_done(req);
 	if (req->sem != NULL)
 		up(req->sem);
 
@@ -1277,11 +1476,13 @@ int __init blk_dev_init(void)
 EXPORT_SYMBOL(io_request_lock);
 EXPORT_SYMBOL(end_that_request_first);
 EXPORT_SYMBOL(end_that_request_last);
+EXPORT_SYMBOL(drive_stat_done);
 EXPORT_SYMBOL(blk_init_queue);
 EXPORT_SYMBOL(blk_get_queue);
 EXPORT_SYMBOL(blk_cleanup_queue);
 EXPORT_SYMBOL(blk_queue_headactive);
 EXPORT_SYMBOL(blk_queue_pluggable);
 EXPORT_SYMBOL(blk_queue_make_request);
+EXPORT_SYMBOL(blk_queue_lock);
 EXPORT_SYMBOL(generic_make_request);
 EXPORT_SYMBOL(blkdev_release_request);
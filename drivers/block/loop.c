@@ -31,6 +31,11 @@
  * max_loop=<1-255> to the kernel on boot.
  * Erik I. Bols, <eriki@himolde.no>, Oct 31, 1999
  *
+ * Requests are no longer serviced from the request function: every loop
+ * device gets a kernel thread which handles the buffer heads handed to
+ * loop_make_request(), and a block device without a transfer function
+ * is just remapped onto the underlying device, without copying anything.
+ *
  * Still To Fix:
  * - Advisory locking is ignored here. 
  * - Should use an own CAP_* category instead of CAP_SYS_ADMIN 
@@ -67,7 +72,6 @@
 #define MAJOR_NR LOOP_MAJOR
 
 #define DEVICE_NAME "loop"
-#define DEVICE_REQUEST do_lo_request
 #define DEVICE_NR(device) (MINOR(device))
 #define DEVICE_ON(device)
 #define DEVICE_OFF(device)
@@ -76,6 +80,7 @@
 #include <linux/blk.h>
 
 #include <linux/malloc.h>
+#include <linux/highmem.h>
 static int max_loop = 8;
 static struct loop_device *loop_dev;
 static int *loop_sizes;
@@ -268,52 +273,34 @@ static int lo_receive(struct loop_device *lo, char *data, int len, loff_t pos,
 	return desc.error;
 }
 
-static void do_lo_request(request_queue_t * q)
+static int lo_blksize(struct loop_device *lo)
 {
-	int	block, offset, len, blksize, size;
-	char	*dest_addr;
-	struct loop_device *lo;
-	struct buffer_head *bh;
-	struct request *current_request;
-	loff_t pos;
-
-repeat:
-	INIT_REQUEST;
-	current_request=CURRENT;
-	blkdev_dequeue_request(current_request);
-	if (MINOR(current_request->rq_dev) >= max_loop)
-		goto error_out;
-	lo = &loop_dev[MINOR(current_request->rq_dev)];
-	if (!lo->lo_dentry || !lo->transfer)
-		goto error_out;
-	if (current_request->cmd == WRITE) {
-		if (lo->lo_flags & LO_FLAGS_READ_ONLY)
-			goto error_out;
-	} else if (current_request->cmd != READ) {
-		printk(KERN_ERR "unknown loop device command (%d)?!?",
-		       current_request->cmd);
-		goto error_out;
-	}
+	int blksize = BLOCK_SIZE;
 
-	dest_addr = current_request->buffer;
-	len = current_request->current_nr_sectors << 9;
-
-	blksize = BLOCK_SIZE;
 	if (blksize_size[MAJOR(lo->lo_device)]) {
 	    blksize = blksize_size[MAJOR(lo->lo_device)][MINOR(lo->lo_device)];
 	    if (!blksize)
 	      blksize = BLOCK_SIZE;
 	}
+	return blksize;
+}
 
-	if (lo->lo_flags & LO_FLAGS_DO_BMAP)
-		goto file_backed;
+/*
+ * Block device with a transfer function: go through the buffer cache
+ * of the underlying device.
+ */
+static int lo_transfer_blkdev(struct loop_device *lo, int cmd, char *data,
+	int len, unsigned long sector, int blksize)
+{
+	int	block, offset, size;
+	struct buffer_head *bh;
 
 	if (blksize < 512) {
-		block = current_request->sector * (512/blksize);
+		block = sector * (512/blksize);
 		offset = 0;
 	} else {
-		block = current_request->sector / (blksize >> 9);
-		offset = (current_request->sector % (blksize >> 9)) << 9;
+		block = sector / (blksize >> 9);
+		offset = (sector % (blksize >> 9)) << 9;
 	}
 	block += lo->lo_offset / blksize;
 	offset += lo->lo_offset % blksize;
@@ -321,7 +308,6 @@ repeat:
 		block++;
 		offset -= blksize;
 	}
-	spin_unlock_irq(&io_request_lock);
 
 	while (len > 0) {
 
@@ -334,62 +320,173 @@ repeat:
 			printk(KERN_ERR "loop: device %s: getblk(-, %d, %d) returned NULL",
 				kdevname(lo->lo_device),
 				block, blksize);
-			goto error_out_lock;
+			return -1;
 		}
-		if (!buffer_uptodate(bh) && ((current_request->cmd == READ) ||
+		if (!buffer_uptodate(bh) && ((cmd == READ) ||
 					(offset || (len < blksize)))) {
 			ll_rw_block(READ, 1, &bh);
 			wait_on_buffer(bh);
 			if (!buffer_uptodate(bh)) {
 				brelse(bh);
-				goto error_out_lock;
+				return -1;
 			}
 		}
 
-		if ((lo->transfer)(lo, current_request->cmd,
-				   bh->b_data + offset,
-				   dest_addr, size, block)) {
+		if ((lo->transfer)(lo, cmd, bh->b_data + offset,
+				   data, size, block)) {
 			printk(KERN_ERR "loop: transfer error block %d\n",
 			       block);
 			brelse(bh);
-			goto error_out_lock;
+			return -1;
 		}
 
-		if (current_request->cmd == WRITE) {
+		if (cmd == WRITE) {
 			mark_buffer_uptodate(bh, 1);
 			mark_buffer_dirty(bh);
 		}
 		brelse(bh);
-		dest_addr += size;
+		data += size;
 		len -= size;
 		offset = 0;
 		block++;
 	}
-	goto done;
+	return 0;
+}
+
+static int loop_handle_bh(struct loop_device *lo, int cmd,
+	struct buffer_head *bh)
+{
+	int	ret, blksize = lo_blksize(lo);
+	char	*data = bh_kmap(bh);
+	loff_t	pos;
+
+	if (!(lo->lo_flags & LO_FLAGS_DO_BMAP))
+		ret = lo_transfer_blkdev(lo, cmd, data, bh->b_size,
+					 bh->b_rsector, blksize);
+	else {
+		pos = ((loff_t)bh->b_rsector << 9) + lo->lo_offset;
+		if (cmd == WRITE)
+			ret = lo_send(lo, data, bh->b_size, pos, blksize);
+		else
+			ret = lo_receive(lo, data, bh->b_size, pos, blksize);
+	}
+	bh_kunmap(bh);
+	return ret;
+}
+
+static struct buffer_head *loop_get_bh(struct loop_device *lo, int cmd)
+{
+	struct buffer_head *bh;
+
+	spin_lock_irq(&lo->lo_lock);
+	bh = lo->lo_bh[cmd];
+	if (bh) {
+		lo->lo_bh[cmd] = bh->b_reqnext;
+		if (lo->lo_bh[cmd] == NULL)
+			lo->lo_bhtail[cmd] = NULL;
+		bh->b_reqnext = NULL;
+	}
+	spin_unlock_irq(&lo->lo_lock);
+	return bh;
+}
+
+/*
+ * The per device thread.  Reads and writes are queued separately,
+ * there is no ordering between in-flight I/O anyway.  On rundown the
+ * queues are drained before the thread exits.
+ */
+static int loop_thread(void *data)
+{
+	struct loop_device *lo = data;
+	struct buffer_head *bh;
+	int	cmd, busy;
+
+	daemonize();
+	exit_files(current);
+
+	sprintf(current->comm, "loop%d", lo->lo_number);
+
+	spin_lock_irq(&current->sigmask_lock);
+	sigfillset(&current->blocked);
+	flush_signals(current);
+	recalc_sigpending(current);
+	spin_unlock_irq(&current->sigmask_lock);
+
+	lo->lo_state = Lo_bound;
+	up(&lo->lo_sem);
+
+	for (;;) {
+		wait_event_interruptible(lo->lo_wait,
+					 lo->lo_bh[READ] != NULL ||
+					 lo->lo_bh[WRITE] != NULL ||
+					 lo->lo_state == Lo_rundown);
+		busy = 0;
+		for (cmd = READ; cmd <= WRITE; cmd++) {
+			bh = loop_get_bh(lo, cmd);
+			if (!bh)
+				continue;
+			busy = 1;
+			bh->b_end_io(bh, !loop_handle_bh(lo, cmd, bh));
+		}
+		if (!busy && lo->lo_state == Lo_rundown)
+			break;
+	}
+
+	lo->lo_state = Lo_unbound;
+	up(&lo->lo_sem);
+	return 0;
+}
+
+static int loop_make_request(request_queue_t *q, int rw, struct buffer_head *bh)
+{
+	struct loop_device *lo;
+	unsigned long flags;
+
+	if (MINOR(bh->b_rdev) >= max_loop)
+		goto error_out;
+	lo = &loop_dev[MINOR(bh->b_rdev)];
+	if (!lo->lo_dentry || !lo->transfer)
+		goto error_out;
+	if (rw == WRITE) {
+		if (lo->lo_flags & LO_FLAGS_READ_ONLY)
+			goto error_out;
+	} else if (rw == READA) {
+		rw = READ;
+	} else if (rw != READ) {
+		printk(KERN_ERR "unknown loop device command (%d)?!?", rw);
+		goto error_out;
+	}
+
+	/*
+	 * Nothing to transform on a block device: hand the buffer to the
+	 * underlying device, generic_make_request() does the rest.
+	 */
+	if (lo->transfer == transfer_none && !(lo->lo_flags & LO_FLAGS_DO_BMAP)
+	    && !(lo->lo_offset & 511)) {
+		bh->b_rdev = lo->lo_device;
+		bh->b_rsector += lo->lo_offset >> 9;
+		return 1;
+	}
+
+	spin_lock_irqsave(&lo->lo_lock, flags);
+	if (lo->lo_state != Lo_bound) {
+		spin_unlock_irqrestore(&lo->lo_lock, flags);
+		goto error_out;
+	}
+	bh->b_reqnext = NULL;
+	if (lo->lo_bhtail[rw])
+		lo->lo_bhtail[rw]->b_reqnext = bh;
+	else
+		lo->lo_bh[rw] = bh;
+	lo->lo_bhtail[rw] = bh;
+	spin_unlock_irqrestore(&lo->lo_lock, flags);
+
+	wake_up_interruptible(&lo->lo_wait);
+	return 0;
 
-file_backed:
-	pos = ((loff_t)current_request->sector << 9) + lo->lo_offset;
-	spin_unlock_irq(&io_request_lock);
-	if (current_request->cmd == WRITE) {
-		if (lo_send(lo, dest_addr, len, pos, blksize))
-			goto error_out_lock;
-	} else {
-		if (lo_receive(lo, dest_addr, len, pos, blksize))
-			goto error_out_lock;
-	}
-done:
-	spin_lock_irq(&io_request_lock);
-	current_request->sector += current_request->current_nr_sectors;
-	current_request->nr_sectors -= current_request->current_nr_sectors;
-	list_add(&current_request->queue, &q->queue_head);
-	end_request(1);
-	goto repeat;
-error_out_lock:
-	spin_lock_irq(&io_request_lock);
 error_out:
-	list_add(&current_request->queue, &q->queue_head);
-	end_request(0);
-	goto repeat;
+	buffer_IO_error(bh);
+	return 0;
 }
 
 static int loop_set_fd(struct loop_device *lo, kdev_t dev, unsigned int arg)
@@ -485,12 +582,38 @@ static int loop_set_fd(struct loop_device *lo, kdev_t dev, unsigned int arg)
 	lo->ioctl = NULL;
 	figure_loop_size(lo);
 
+	lo->lo_bh[READ] = lo->lo_bhtail[READ] = NULL;
+	lo->lo_bh[WRITE] = lo->lo_bhtail[WRITE] = NULL;
+	error = kernel_thread(loop_thread, lo, CLONE_FS | CLONE_FILES | CLONE_SIGHAND);
+	if (error < 0)
+		goto out_unbind;
+	down(&lo->lo_sem);
+	error = 0;
+
  out_putf:
 	fput(file);
  out:
 	if (error)
 		MOD_DEC_USE_COUNT;
 	return error;
+
+ out_unbind:
+	/* no thread, so nothing can have been queued: undo the above */
+	lo->lo_dentry = NULL;
+	if (lo->lo_backing_file != NULL) {
+		/* fput() drops the write access if FMODE_WRITE is set */
+		if ((lo->lo_backing_file->f_mode & FMODE_WRITE) == 0)
+			put_write_access(inode);
+		fput(lo->lo_backing_file);
+		lo->lo_backing_file = NULL;
+	} else {
+		blkdev_put(inode->i_bdev, BDEV_FILE);
+		dput(file->f_dentry);
+	}
+	lo->lo_device = 0;
+	lo->lo_flags = 0;
+	loop_sizes[lo->lo_number] = 0;
+	goto out_putf;
 }
 
 static int loop_release_xfer(struct loop_device *lo)
@@ -532,6 +655,13 @@ static int loop_clr_fd(struct loop_device *lo, kdev_t dev)
 	if (lo->lo_refcnt > 1)	/* we needed one fd for the ioctl */
 		return -EBUSY;
 
+	/* finish what is queued and stop the thread */
+	spin_lock_irq(&lo->lo_lock);
+	lo->lo_state = Lo_rundown;
+	spin_unlock_irq(&lo->lo_lock);
+	wake_up_interruptible(&lo->lo_wait);
+	down(&lo->lo_sem);
+
 	if (S_ISBLK(dentry->d_inode->i_mode))
 		blkdev_put(dentry->d_inode->i_bdev, BDEV_FILE);
 
@@ -767,10 +897,6 @@ int loop_unregister_transfer(int number)
 EXPORT_SYMBOL(loop_register_transfer);
 EXPORT_SYMBOL(loop_unregister_transfer);
 
-static void no_plug_device(request_queue_t *q, kdev_t device)
-{
-}
-
 int __init loop_init(void) 
 {
 	int	i;
@@ -814,12 +940,14 @@ int __init loop_init(void)
 		return -ENOMEM;
 	}		
 
-	blk_init_queue(BLK_DEFAULT_QUEUE(MAJOR_NR), DEVICE_REQUEST);
-	blk_queue_pluggable(BLK_DEFAULT_QUEUE(MAJOR_NR), no_plug_device);
-	blk_queue_headactive(BLK_DEFAULT_QUEUE(MAJOR_NR), 0);
+	blk_queue_make_request(BLK_DEFAULT_QUEUE(MAJOR_NR), loop_make_request);
 	for (i=0; i < max_loop; i++) {
-		memset(&loop_dev[i], 0, sizeof(struct loop_device));
-		loop_dev[i].lo_number = i;
+		struct loop_device *lo = &loop_dev[i];
+		memset(lo, 0, sizeof(struct loop_device));
+		lo->lo_number = i;
+		spin_lock_init(&lo->lo_lock);
+		init_waitqueue_head(&lo->lo_wait);
+		init_MUTEX_LOCKED(&lo->lo_sem);
 	}
 	memset(loop_sizes, 0, max_loop * sizeof(int));
 	memset(loop_blksizes, 0, max_loop * sizeof(int));
@@ -838,7 +966,6 @@ void cleanup_module(void)
 	if (devfs_unregister_blkdev(MAJOR_NR, "loop") != 0)
 		printk(KERN_WARNING "loop: cannot unregister blkdev\n");
 
-	blk_cleanup_queue(BLK_DEFAULT_QUEUE(MAJOR_NR));
 	kfree (loop_dev);
 	kfree (loop_sizes);
 	kfree (loop_blksizes);
@@ -18,6 +18,9 @@
  * 97-9-13 Cosmetic changes
  * 98-5-13 Attempt to make 64-bit-clean on 64-bit machines
  * 99-1-11 Attempt to make 64-bit-clean on 32-bit machines <ankry@mif.pg.gda.pl>
+ * 01-1-xx Several sockets per device, replies matched by handle so they
+ *   may arrive in any order, whole merged requests sent straight from
+ *   the buffers.
  *
  * possible FIXME: make set_sock / set_blksize / set_size / do_it one syscall
  * why not: would need verify_area and friends, would share yet another 
@@ -48,6 +51,7 @@
 #include <linux/nbd.h>
 
 #define LO_MAGIC 0x68797548
+#define NBD_IOV 16		/* buffers per sendmsg/recvmsg */
 
 static int nbd_blksizes[MAX_NBD];
 static int nbd_blksize_bits[MAX_NBD];
@@ -83,15 +87,39 @@ static int nbd_open(struct inode *inode, struct file *file)
 	return 0;
 }
 
+/*
+ * Rebuild the part of an iovec that is left after 'skip' bytes.  The
+ * protocols differ in whether they update the iovec they are given,
+ * so nbd_xmit() never reuses one.
+ */
+static int nbd_iov_skip(struct iovec *from, int nr, int skip,
+			struct iovec *to)
+{
+	int n = 0;
+
+	for ( ; nr > 0; from++, nr--) {
+		if (skip >= from->iov_len) {
+			skip -= from->iov_len;
+			continue;
+		}
+		to[n].iov_base = (char *) from->iov_base + skip;
+		to[n].iov_len = from->iov_len - skip;
+		skip = 0;
+		n++;
+	}
+	return n;
+}
+
 /*
  *  Send or receive packet.
  */
-static int nbd_xmit(int send, struct socket *sock, char *buf, int size)
+static int nbd_xmit(int send, struct socket *sock, struct iovec *iov,
+		    int nr, int size)
 {
 	mm_segment_t oldfs;
-	int result;
+	int result, done = 0;
 	struct msghdr msg;
-	struct iovec iov;
+	struct iovec riov[NBD_IOV];
 	unsigned long flags;
 	sigset_t oldset;
 
@@ -107,32 +135,29 @@ static int nbd_xmit(int send, struct socket *sock, char *buf, int size)
 
 	do {
 		sock->sk->allocation = GFP_BUFFER;
-		iov.iov_base = buf;
-		iov.iov_len = size;
 		msg.msg_name = NULL;
 		msg.msg_namelen = 0;
-		msg.msg_iov = &iov;
-		msg.msg_iovlen = 1;
+		msg.msg_iov = riov;
+		msg.msg_iovlen = nbd_iov_skip(iov, nr, done, riov);
 		msg.msg_control = NULL;
 		msg.msg_controllen = 0;
 		msg.msg_namelen = 0;
 		msg.msg_flags = 0;
 
 		if (send)
-			result = sock_sendmsg(sock, &msg, size);
+			result = sock_sendmsg(sock, &msg, size - done);
 		else
-			result = sock_recvmsg(sock, &msg, size, 0);
+			result = sock_recvmsg(sock, &msg, size - done, 0);
 
 		if (result <= 0) {
 #ifdef PARANOIA
-			printk(KERN_ERR "NBD: %s - sock=%ld at buf=%ld, size=%d returned %d.\n",
-			       send ? "send" : "receive", (long) sock, (long) buf, size, result);
+			printk(KERN_ERR "NBD: %s - sock=%ld at done=%d, size=%d returned %d.\n",
+			       send ? "send" : "receive", (long) sock, done, size, result);
 #endif
 			break;
 		}
-		size -= result;
-		buf += result;
-	} while (size > 0);
+		done += result;
+	} while (done < size);
 
 	spin_lock_irqsave(&current->sigmask_lock, flags);
 	current->blocked = oldset;
@@ -143,120 +168,214 @@ static int nbd_xmit(int send, struct socket *sock, char *buf, int size)
 	return result;
 }
 
+/*
+ * Move the data of a request straight between its buffers and the
+ * socket, up to NBD_IOV buffers per call.  'iov' may already hold
+ * 'nr' entries (the request header) that go out in front.
+ */
+static int nbd_xmit_req(int send, struct socket *sock, struct request *req,
+			struct iovec *iov, int nr, int size)
+{
+	struct buffer_head *bh = req->bh;
+	int result;
+
+	do {
+		for ( ; bh && nr < NBD_IOV; bh = bh->b_reqnext) {
+			iov[nr].iov_base = bh->b_data;
+			iov[nr].iov_len = bh->b_size;
+			size += bh->b_size;
+			nr++;
+		}
+		result = nbd_xmit(send, sock, iov, nr, size);
+		if (result <= 0)
+			return result;
+		nr = 0;
+		size = 0;
+	} while (bh);
+	return result;
+}
+
 #define FAIL( s ) { printk( KERN_ERR "NBD: " s "(result %d)\n", result ); goto error_out; }
 
-void nbd_send_req(struct socket *sock, struct request *req)
+/*
+ * Send one request, header and data.  The handle is the request
+ * pointer, the reply is matched against the connection's queue by it,
+ * so replies may come back in any order.
+ */
+static int nbd_send_req(struct socket *sock, struct request *req)
 {
 	int result;
 	struct nbd_request request;
+	struct iovec iov[NBD_IOV];
 
 	DEBUG("NBD: sending control, ");
 	request.magic = htonl(NBD_REQUEST_MAGIC);
 	request.type = htonl(req->cmd);
 	request.from = cpu_to_be64( (u64) req->sector << 9);
-	request.len = htonl(req->current_nr_sectors << 9);
+	request.len = htonl(req->nr_sectors << 9);
 	memcpy(request.handle, &req, sizeof(req));
 
-	result = nbd_xmit(1, sock, (char *) &request, sizeof(request));
-	if (result <= 0)
-		FAIL("Sendmsg failed for control.");
-
+	iov[0].iov_base = &request;
+	iov[0].iov_len = sizeof(request);
 	if (req->cmd == WRITE) {
 		DEBUG("data, ");
-		result = nbd_xmit(1, sock, req->buffer, req->current_nr_sectors << 9);
-		if (result <= 0)
-			FAIL("Send data failed.");
-	}
-	return;
+		result = nbd_xmit_req(1, sock, req, iov, 1, sizeof(request));
+	} else
+		result = nbd_xmit(1, sock, iov, 1, sizeof(request));
+	if (result <= 0)
+		FAIL("Send request failed.");
+	return 0;
 
       error_out:
-	req->errors++;
+	return -1;
+}
+
+/*
+ * Take the request 'handle' off the connection's queue.
+ */
+static struct request *nbd_find_request(struct nbd_conn *conn,
+					struct request *xreq)
+{
+	struct nbd_device *lo = conn->lo;
+	struct list_head *tmp;
+	struct request *req;
+
+	spin_lock(&lo->queue_lock);
+	for (tmp = conn->queue_head.next; tmp != &conn->queue_head;
+	     tmp = tmp->next) {
+		req = blkdev_entry_to_request(tmp);
+		if (req != xreq)
+			continue;
+		list_del(&req->queue);
+		spin_unlock(&lo->queue_lock);
+		return req;
+	}
+	spin_unlock(&lo->queue_lock);
+	return NULL;
 }
 
-#define HARDFAIL( s ) { printk( KERN_ERR "NBD: " s "(result %d)\n", result ); lo->harderror = result; return NULL; }
-struct request *nbd_read_stat(struct nbd_device *lo)
-		/* NULL returned = something went wrong, inform userspace       */ 
+#define HARDFAIL( s ) { printk( KERN_ERR "NBD: " s "(result %d)\n", result ); lo->harderror = result; goto harderror; }
+static int nbd_read_stat(struct nbd_conn *conn)
+		/* -1 returned = something went wrong, inform userspace       */ 
 {
+	struct nbd_device *lo = conn->lo;
 	int result;
 	struct nbd_reply reply;
-	struct request *xreq, *req;
+	struct request *xreq, *req = NULL;
+	struct iovec iov[NBD_IOV];
 
 	DEBUG("reading control, ");
 	reply.magic = 0;
-	result = nbd_xmit(0, lo->sock, (char *) &reply, sizeof(reply));
+	iov[0].iov_base = &reply;
+	iov[0].iov_len = sizeof(reply);
+	result = nbd_xmit(0, conn->sock, iov, 1, sizeof(reply));
 	if (result <= 0)
 		HARDFAIL("Recv control failed.");
+	if (ntohl(reply.magic) != NBD_REPLY_MAGIC)
+		HARDFAIL("Not enough magic.");
 	memcpy(&xreq, reply.handle, sizeof(xreq));
-	req = blkdev_entry_prev_request(&lo->queue_head);
-
-	if (xreq != req)
-		FAIL("Unexpected handle received.\n");
+	req = nbd_find_request(conn, xreq);
+	if (!req)
+		HARDFAIL("Unexpected handle received.");
 
 	DEBUG("ok, ");
-	if (ntohl(reply.magic) != NBD_REPLY_MAGIC)
-		HARDFAIL("Not enough magic.");
-	if (ntohl(reply.error))
-		FAIL("Other side returned error.");
-	if (req->cmd == READ) {
+	if (ntohl(reply.error)) {
+		printk(KERN_ERR "NBD: Other side returned error.\n");
+		req->errors++;
+	} else if (req->cmd == READ) {
 		DEBUG("data, ");
-		result = nbd_xmit(0, lo->sock, req->buffer, req->current_nr_sectors << 9);
+		result = nbd_xmit_req(0, conn->sock, req, iov, 0, 0);
 		if (result <= 0)
 			HARDFAIL("Recv data failed.");
 	}
 	DEBUG("done.\n");
-	return req;
+	nbd_end_request(req);
+	return 0;
 
-/* Can we get here? Yes, if other side returns error */
-      error_out:
-	req->errors++;
-	return req;
+      harderror:
+	if (req) {
+		req->errors++;
+		nbd_end_request(req);
+	}
+	return -1;
 }
 
-void nbd_do_it(struct nbd_device *lo)
+/*
+ * Fail everything still waiting for a reply on this connection.
+ */
+static void nbd_clear_conn(struct nbd_conn *conn)
 {
+	struct nbd_device *lo = conn->lo;
 	struct request *req;
-	int dequeued;
-
-	down (&lo->queue_lock);
-	while (1) {
-		up (&lo->queue_lock);
-		req = nbd_read_stat(lo);
-		down (&lo->queue_lock);
 
-		if (!req) {
-			printk(KERN_ALERT "req should never be null\n" );
-			goto out;
-		}
+	spin_lock(&lo->queue_lock);
+	while (!list_empty(&conn->queue_head)) {
+		req = blkdev_entry_prev_request(&conn->queue_head);
 #ifdef PARANOIA
-		if (req != blkdev_entry_prev_request(&lo->queue_head)) {
-			printk(KERN_ALERT "NBD: I have problem...\n");
-		}
 		if (lo != &nbd_dev[MINOR(req->rq_dev)]) {
-			printk(KERN_ALERT "NBD: request corrupted!\n");
+			printk(KERN_ALERT "NBD: request corrupted when clearing!\n");
+			list_del(&req->queue);
 			continue;
 		}
-		if (lo->magic != LO_MAGIC) {
-			printk(KERN_ALERT "NBD: nbd_dev[] corrupted: Not enough magic\n");
-			goto out;
-		}
 #endif
 		list_del(&req->queue);
-		up (&lo->queue_lock);
-		
-		dequeued = nbd_end_request(req);
+		spin_unlock(&lo->queue_lock);
+
+		req->errors++;
+		nbd_end_request(req);
 
-		down (&lo->queue_lock);
-		if (!dequeued)
-			list_add(&req->queue, &lo->queue_head);
+		spin_lock(&lo->queue_lock);
 	}
- out:
-	up (&lo->queue_lock);
+	spin_unlock(&lo->queue_lock);
+}
+
+/*
+ * Stop using a connection and fail what is queued on it.
+ */
+static void nbd_kill_conn(struct nbd_conn *conn)
+{
+	/* no more sending on it, then nothing new can get queued */
+	down(&conn->tx_lock);
+	conn->dead = 1;
+	up(&conn->tx_lock);
+	nbd_clear_conn(conn);
+}
+
+/*
+ * Receive replies on one connection until it breaks.
+ */
+static void nbd_do_it(struct nbd_conn *conn)
+{
+#ifdef PARANOIA
+	if (conn->lo->magic != LO_MAGIC) {
+		printk(KERN_ALERT "NBD: nbd_dev[] corrupted: Not enough magic\n");
+		return;
+	}
+#endif
+	while (nbd_read_stat(conn) == 0)
+		;
+	nbd_kill_conn(conn);
+}
+
+static int nbd_recv_thread(void *data)
+{
+	struct nbd_conn *conn = data;
+	struct nbd_device *lo = conn->lo;
+
+	daemonize();
+	exit_files(current);
+	sprintf(current->comm, "nbd%d.%d", (int) (lo - nbd_dev),
+		(int) (conn - lo->conns));
+
+	nbd_do_it(conn);
+
+	up(&lo->recv_done);
+	return 0;
 }
 
 void nbd_clear_que(struct nbd_device *lo)
 {
-	struct request *req;
-	int dequeued;
+	int i;
 
 #ifdef PARANOIA
 	if (lo->magic != LO_MAGIC) {
@@ -265,28 +384,41 @@ void nbd_clear_que(struct nbd_device *lo)
 	}
 #endif
 
-	while (!list_empty(&lo->queue_head)) {
-		req = blkdev_entry_prev_request(&lo->queue_head);
-#ifdef PARANOIA
-		if (!req) {
-			printk( KERN_ALERT "NBD: panic, panic, panic\n" );
-			break;
-		}
-		if (lo != &nbd_dev[MINOR(req->rq_dev)]) {
-			printk(KERN_ALERT "NBD: request corrupted when clearing!\n");
-			continue;
-		}
-#endif
-		req->errors++;
-		list_del(&req->queue);
-		up(&lo->queue_lock);
+	for (i = 0; i < lo->nr_conns; i++)
+		nbd_clear_conn(&lo->conns[i]);
+}
 
-		dequeued = nbd_end_request(req);
+/*
+ * Pick a connection to send on and lock it, preferring one no one is
+ * sending on right now.  Returns NULL if all of them are dead.
+ */
+static struct nbd_conn *nbd_get_conn(struct nbd_device *lo)
+{
+	int i, n = lo->nr_conns, next = lo->next_conn;
+	struct nbd_conn *conn;
 
-		down(&lo->queue_lock);
-		if (!dequeued)
-			list_add(&req->queue, &lo->queue_head);
+	for (i = 0; i < n; i++) {
+		conn = &lo->conns[(next + i) % n];
+		if (conn->dead || down_trylock(&conn->tx_lock))
+			continue;
+		if (!conn->dead)
+			goto found;
+		up(&conn->tx_lock);
+	}
+	for (i = 0; i < n; i++) {
+		conn = &lo->conns[(next + i) % n];
+		if (conn->dead)
+			continue;
+		down(&conn->tx_lock);
+		if (!conn->dead)
+			goto found;
+		up(&conn->tx_lock);
 	}
+	return NULL;
+
+found:
+	lo->next_conn = (conn - lo->conns + 1) % n;
+	return conn;
 }
 
 /*
@@ -304,6 +436,7 @@ static void do_nbd_request(request_queue_t * q)
 	struct request *req;
 	int dev = 0;
 	struct nbd_device *lo;
+	struct nbd_conn *conn;
 
 	while (!QUEUE_EMPTY) {
 		req = CURRENT;
@@ -317,7 +450,7 @@ static void do_nbd_request(request_queue_t * q)
 			FAIL("Minor too big.");		/* Probably can not happen */
 #endif
 		lo = &nbd_dev[dev];
-		if (!lo->file)
+		if (!lo->nr_conns)
 			FAIL("Request when not-ready.");
 		if ((req->cmd == WRITE) && (lo->flags & NBD_READ_ONLY))
 			FAIL("Write on read-only");
@@ -328,22 +461,38 @@ static void do_nbd_request(request_queue_t * q)
 #endif
 		req->errors = 0;
 		blkdev_dequeue_request(req);
-		spin_unlock_irq(&io_request_lock);
-
-		down (&lo->queue_lock);
-		list_add(&req->queue, &lo->queue_head);
-		nbd_send_req(lo->sock, req);	/* Why does this block?         */
-		up (&lo->queue_lock);
+		spin_unlock_irq(q->queue_lock);
+
+		conn = nbd_get_conn(lo);
+		if (!conn) {
+			printk(KERN_ERR "NBD, minor %d: No connection left.\n", dev);
+			req->errors++;
+			nbd_end_request(req);
+			spin_lock_irq(q->queue_lock);
+			continue;
+		}
+		/* queue it first, the reply may beat us back */
+		spin_lock(&lo->queue_lock);
+		list_add(&req->queue, &conn->queue_head);
+		spin_unlock(&lo->queue_lock);
+		if (nbd_send_req(conn->sock, req)) {
+			/* fail it, unless the receiver already did */
+			if (nbd_find_request(conn, req)) {
+				req->errors++;
+				nbd_end_request(req);
+			}
+		}
+		up(&conn->tx_lock);
 
-		spin_lock_irq(&io_request_lock);
+		spin_lock_irq(q->queue_lock);
 		continue;
 
 	      error_out:
 		req->errors++;
 		blkdev_dequeue_request(req);
-		spin_unlock(&io_request_lock);
+		spin_unlock(q->queue_lock);
 		nbd_end_request(req);
-		spin_lock(&io_request_lock);
+		spin_lock(q->queue_lock);
 	}
 	return;
 }
@@ -352,7 +501,8 @@ static int nbd_ioctl(struct inode *inode, struct file *file,
 		     unsigned int cmd, unsigned long arg)
 {
 	struct nbd_device *lo;
-	int dev, error, temp;
+	struct nbd_conn *conn;
+	int dev, error, temp, i, started;
 	struct request sreq ;
 
 	/* Anyone capable of this syscall can do *real bad* things */
@@ -369,37 +519,48 @@ static int nbd_ioctl(struct inode *inode, struct file *file,
 	switch (cmd) {
 	case NBD_DISCONNECT:
 	        printk("NBD_DISCONNECT\n") ;
+		memset(&sreq, 0, sizeof(sreq));
                 sreq.cmd=2 ; /* shutdown command */
-                if (!lo->sock) return -EINVAL ;
-                nbd_send_req(lo->sock,&sreq) ;
+                if (!lo->nr_conns) return -EINVAL ;
+		for (i = 0; i < lo->nr_conns; i++) {
+			conn = &lo->conns[i];
+			down(&conn->tx_lock);
+			if (!conn->dead)
+				nbd_send_req(conn->sock, &sreq);
+			up(&conn->tx_lock);
+		}
                 return 0 ;
  
 	case NBD_CLEAR_SOCK:
-		down(&lo->queue_lock);
-		nbd_clear_que(lo);
-		if (!list_empty(&lo->queue_head)) {
-			up(&lo->queue_lock);
-			printk(KERN_ERR "nbd: Some requests are in progress -> can not turn off.\n");
+		if (lo->active)
 			return -EBUSY;
-		}
-		up(&lo->queue_lock);
-		file = lo->file;
-		if (!file)
+		nbd_clear_que(lo);
+		if (!lo->nr_conns)
 			return -EINVAL;
-		lo->file = NULL;
-		lo->sock = NULL;
-		fput(file);
+		for (i = 0; i < lo->nr_conns; i++) {
+			conn = &lo->conns[i];
+			file = conn->file;
+			conn->file = NULL;
+			conn->sock = NULL;
+			fput(file);
+		}
+		lo->nr_conns = 0;
 		return 0;
 	case NBD_SET_SOCK:
-		if (lo->file)
+		/* every call adds a connection, before NBD_DO_IT */
+		if (lo->active || lo->nr_conns == NBD_MAX_CONNS)
 			return -EBUSY;
 		error = -EINVAL;
 		file = fget(arg);
 		if (file) {
 			inode = file->f_dentry->d_inode;
 			/* N.B. Should verify that it's a socket */
-			lo->file = file;
-			lo->sock = &inode->u.socket_i;
+			conn = &lo->conns[lo->nr_conns];
+			conn->file = file;
+			conn->sock = &inode->u.socket_i;
+			conn->dead = 0;
+			INIT_LIST_HEAD(&conn->queue_head);
+			lo->nr_conns++;
 			error = 0;
 		}
 		return error;
@@ -425,17 +586,37 @@ static int nbd_ioctl(struct inode *inode, struct file *file,
 		nbd_bytesizes[dev] = ((u64) arg) << nbd_blksize_bits[dev];
 		return 0;
 	case NBD_DO_IT:
-		if (!lo->file)
+		if (!lo->nr_conns || lo->active)
 			return -EINVAL;
-		nbd_do_it(lo);
+		lo->active = 1;
+		lo->harderror = 0;
+		started = 0;
+		/* one receiver per extra connection, the first one is ours;
+		   a connection without a receiver is of no use */
+		for (i = 1; i < lo->nr_conns; i++) {
+			if (kernel_thread(nbd_recv_thread, &lo->conns[i],
+					  CLONE_FS | CLONE_FILES | CLONE_SIGHAND) < 0)
+				nbd_kill_conn(&lo->conns[i]);
+			else
+				started++;
+		}
+		nbd_do_it(&lo->conns[0]);
+		while (started--)
+			down(&lo->recv_done);
+		lo->active = 0;
 		return lo->harderror;
 	case NBD_CLEAR_QUE:
 		nbd_clear_que(lo);
 		return 0;
 #ifdef PARANOIA
 	case NBD_PRINT_DEBUG:
-		printk(KERN_INFO "NBD device %d: next = %p, prev = %p. Global: in %d, out %d\n",
-		       dev, lo->queue_head.next, lo->queue_head.prev, requests_in, requests_out);
+		for (i = 0; i < lo->nr_conns; i++)
+			printk(KERN_INFO "NBD device %d.%d: next = %p, prev = %p.%s\n",
+			       dev, i, lo->conns[i].queue_head.next,
+			       lo->conns[i].queue_head.prev,
+			       lo->conns[i].dead ? " dead" : "");
+		printk(KERN_INFO "NBD device %d: Global: in %d, out %d\n",
+		       dev, requests_in, requests_out);
 		return 0;
 #endif
 	case BLKGETSIZE:
@@ -499,17 +680,33 @@ int nbd_init(void)
 	blksize_size[MAJOR_NR] = nbd_blksizes;
 	blk_size[MAJOR_NR] = nbd_sizes;
 	blk_init_queue(BLK_DEFAULT_QUEUE(MAJOR_NR), do_nbd_request);
+	/* nbd has nothing to share with other block devices */
+	blk_queue_lock(BLK_DEFAULT_QUEUE(MAJOR_NR),
+		       &(BLK_DEFAULT_QUEUE(MAJOR_NR))->request_lock);
 #ifndef NBD_PLUGGABLE
 	blk_queue_pluggable(BLK_DEFAULT_QUEUE(MAJOR_NR), nbd_plug_device);
 #endif
 	blk_queue_headactive(BLK_DEFAULT_QUEUE(MAJOR_NR), 0);
 	for (i = 0; i < MAX_NBD; i++) {
+		int j;
+
 		nbd_dev[i].refcnt = 0;
-		nbd_dev[i].file = NULL;
+		nbd_dev[i].nr_conns = 0;
+		nbd_dev[i].next_conn = 0;
+		nbd_dev[i].active = 0;
 		nbd_dev[i].magic = LO_MAGIC;
 		nbd_dev[i].flags = 0;
-		INIT_LIST_HEAD(&nbd_dev[i].queue_head);
-		init_MUTEX(&nbd_dev[i].queue_lock);
+		for (j = 0; j < NBD_MAX_CONNS; j++) {
+			struct nbd_conn *conn = &nbd_dev[i].conns[j];
+			conn->lo = &nbd_dev[i];
+			conn->file = NULL;
+			conn->sock = NULL;
+			conn->dead = 0;
+			INIT_LIST_HEAD(&conn->queue_head);
+			init_MUTEX(&conn->tx_lock);
+		}
+		spin_lock_init(&nbd_dev[i].queue_lock);
+		init_MUTEX_LOCKED(&nbd_dev[i].recv_done);
 		nbd_blksizes[i] = 1024;
 		nbd_blksize_bits[i] = 10;
 		nbd_bytesizes[i] = 0x7ffffc00; /* 2GB */
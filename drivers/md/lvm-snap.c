@@ -28,6 +28,7 @@
 #include <linux/types.h>
 #include <linux/iobuf.h>
 #include <linux/lvm.h>
+#include <linux/init.h>
 
 
 static char *lvm_snap_version __attribute__ ((unused)) = "LVM 0.9 snapshot code (13/11/2000)\n";
@@ -36,6 +37,56 @@ extern const char *const lvm_name;
 extern int lvm_blocksizes[];
 
 void lvm_snapshot_release(lv_t *);
+int lvm_snapshot_alloc_iobuf_pages(struct kiobuf *, int);
+
+/*
+ * Asynchronous copy on write.
+ *
+ * The first write to an origin chunk does not copy the chunk itself.
+ * lvm_map() queues a pending copy for the chunk and parks the write
+ * on it; further writes to the same chunk join it.  lvm_snapd copies
+ * the queued chunks, writes the COW table blocks once per batch, and
+ * only then lets the parked writes go to disk, so the origin never
+ * overwrites data the snapshot does not have yet.
+ *
+ * Pending copies come from a fixed pool.  Writers leave
+ * LVM_SNAP_RESERVE of them to lvm_snapd, which needs them to move
+ * released writes on to the next snapshot of the same origin.
+ */
+#define LVM_SNAP_MAX_PENDING	256
+#define LVM_SNAP_RESERVE	32
+#define LVM_SNAP_PENDING_HASH	64
+#define LVM_SNAP_BATCH		64
+
+typedef struct lvm_snap_pending {
+	struct list_head hash;
+	struct list_head list;		/* queue, batch or free list */
+	lv_t *lv_snap;			/* NULL if free */
+	kdev_t org_dev;
+	ulong org_start;
+	ulong org_pe_start;
+	kdev_t snap_dev;
+	ulong snap_start;
+	struct buffer_head *bh;		/* parked writes, via b_reqnext */
+	struct buffer_head **bh_tail;
+} lvm_snap_pending_t;
+
+static lvm_snap_pending_t lvm_snap_pending[LVM_SNAP_MAX_PENDING];
+static struct list_head lvm_snap_hash[LVM_SNAP_PENDING_HASH];
+static LIST_HEAD(lvm_snap_free);
+static LIST_HEAD(lvm_snap_queue);
+static int lvm_snap_nr_free;
+static lv_t *lvm_snap_current;		/* snapshot lvm_snapd works on */
+static spinlock_t lvm_snap_lock = SPIN_LOCK_UNLOCKED;
+
+static DECLARE_WAIT_QUEUE_HEAD(lvm_snapd_wait);
+static DECLARE_WAIT_QUEUE_HEAD(lvm_snap_free_wait);
+static DECLARE_MUTEX_LOCKED(lvm_snapd_sem);
+static struct task_struct *lvm_snapd_task;
+static int lvm_snapd_exit;
+
+/* lvm_snapd's buffer for chunk copies and COW table writes */
+static struct kiobuf *lvm_snap_iobuf;
 
 uint lvm_pv_get_number(vg_t * vg, kdev_t rdev)
 {
@@ -176,29 +227,6 @@ inline int lvm_get_blksize(kdev_t dev)
 	return correct_size;
 }
 
-#ifdef DEBUG_SNAPSHOT
-static inline void invalidate_snap_cache(unsigned long start, unsigned long nr,
-					 kdev_t dev)
-{
-	struct buffer_head * bh;
-	int sectors_per_block, i, blksize, minor;
-
-	minor = MINOR(dev);
-	blksize = lvm_blocksizes[minor];
-	sectors_per_block = blksize >> 9;
-	nr /= sectors_per_block;
-	start /= sectors_per_block;
-
-	for (i = 0; i < nr; i++)
-	{
-		bh = get_hash_table(dev, start++, blksize);
-		if (bh)
-			bforget(bh);
-	}
-}
-#endif
-
-
 void lvm_snapshot_fill_COW_page(vg_t * vg, lv_t * lv_snap)
 {
 	int 	id = 0, is = lv_snap->lv_remap_ptr;
@@ -223,160 +251,135 @@ void lvm_snapshot_fill_COW_page(vg_t * vg, lv_t * lv_snap)
 
 
 /*
- * writes a COW exception table sector to disk (HM)
+ * writes the COW exception table blocks holding the entries
+ * idx .. idx+nr-1 to disk, each block once (HM)
  *
  */
 
-int lvm_write_COW_table_block(vg_t * vg,
-			      lv_t * lv_snap)
+int lvm_write_COW_table_block(vg_t * vg, lv_t * lv_snap, int idx, int nr)
 {
 	int blksize_snap;
-	int end_of_table;
-	int idx = lv_snap->lv_remap_ptr, idx_COW_table;
+	int end_of_table, end_of_block;
+	int end = idx + nr, idx_COW_table;
 	int nr_pages_tmp;
 	int length_tmp;
 	ulong snap_pe_start, COW_table_sector_offset,
 	      COW_entries_per_pe, COW_chunks_per_pe, COW_entries_per_block;
 	ulong blocks[1];
-	const char * reason;
 	kdev_t snap_phys_dev;
-	struct kiobuf * iobuf = lv_snap->lv_iobuf;
+	struct kiobuf * iobuf = lvm_snap_iobuf;
 	struct page * page_tmp;
 	lv_COW_table_disk_t * lv_COW_table =
 	   ( lv_COW_table_disk_t *) page_address(lv_snap->lv_COW_table_page);
-
-	idx--;
+	int ret = 0;
 
 	COW_chunks_per_pe = LVM_GET_COW_TABLE_CHUNKS_PER_PE(vg, lv_snap);
 	COW_entries_per_pe = LVM_GET_COW_TABLE_ENTRIES_PER_PE(vg, lv_snap);
 
-	/* get physical addresse of destination chunk */
-	snap_phys_dev = lv_snap->lv_block_exception[idx].rdev_new;
-	snap_pe_start = lv_snap->lv_block_exception[idx - (idx % COW_entries_per_pe)].rsector_new - lv_snap->lv_chunk_size;
+	length_tmp = iobuf->length;
+	page_tmp = iobuf->maplist[0];
+        iobuf->maplist[0] = lv_snap->lv_COW_table_page;
+	nr_pages_tmp = iobuf->nr_pages;
+	iobuf->nr_pages = 1;
 
-	blksize_snap = lvm_get_blksize(snap_phys_dev);
+	for ( ; idx < end; idx++) {
+		/* get physical addresse of destination chunk */
+		snap_phys_dev = lv_snap->lv_block_exception[idx].rdev_new;
+		snap_pe_start = lv_snap->lv_block_exception[idx - (idx % COW_entries_per_pe)].rsector_new - lv_snap->lv_chunk_size;
 
-        COW_entries_per_block = blksize_snap / sizeof(lv_COW_table_disk_t);
-        idx_COW_table = idx % COW_entries_per_pe % COW_entries_per_block;
+		blksize_snap = lvm_get_blksize(snap_phys_dev);
 
-	if ( idx_COW_table == 0) memset(lv_COW_table, 0, blksize_snap);
+		COW_entries_per_block = blksize_snap / sizeof(lv_COW_table_disk_t);
+		idx_COW_table = idx % COW_entries_per_pe % COW_entries_per_block;
 
-	/* sector offset into the on disk COW table */
-	COW_table_sector_offset = (idx % COW_entries_per_pe) / (SECTOR_SIZE / sizeof(lv_COW_table_disk_t));
+		if ( idx_COW_table == 0) memset(lv_COW_table, 0, blksize_snap);
 
-        /* COW table block to write next */
-	blocks[0] = (snap_pe_start + COW_table_sector_offset) >> (blksize_snap >> 10);
+		/* sector offset into the on disk COW table */
+		COW_table_sector_offset = (idx % COW_entries_per_pe) / (SECTOR_SIZE / sizeof(lv_COW_table_disk_t));
 
-	/* store new COW_table entry */
-	lv_COW_table[idx_COW_table].pv_org_number = LVM_TO_DISK64(lvm_pv_get_number(vg, lv_snap->lv_block_exception[idx].rdev_org));
-	lv_COW_table[idx_COW_table].pv_org_rsector = LVM_TO_DISK64(lv_snap->lv_block_exception[idx].rsector_org);
-	lv_COW_table[idx_COW_table].pv_snap_number = LVM_TO_DISK64(lvm_pv_get_number(vg, snap_phys_dev));
-	lv_COW_table[idx_COW_table].pv_snap_rsector = LVM_TO_DISK64(lv_snap->lv_block_exception[idx].rsector_new);
+		/* COW table block to write next */
+		blocks[0] = (snap_pe_start + COW_table_sector_offset) >> (blksize_snap >> 10);
 
-	length_tmp = iobuf->length;
-	iobuf->length = blksize_snap;
-	page_tmp = iobuf->maplist[0];
-        iobuf->maplist[0] = lv_snap->lv_COW_table_page;
-	nr_pages_tmp = iobuf->nr_pages;
-	iobuf->nr_pages = 1;
+		/* store new COW_table entry */
+		lv_COW_table[idx_COW_table].pv_org_number = LVM_TO_DISK64(lvm_pv_get_number(vg, lv_snap->lv_block_exception[idx].rdev_org));
+		lv_COW_table[idx_COW_table].pv_org_rsector = LVM_TO_DISK64(lv_snap->lv_block_exception[idx].rsector_org);
+		lv_COW_table[idx_COW_table].pv_snap_number = LVM_TO_DISK64(lvm_pv_get_number(vg, snap_phys_dev));
+		lv_COW_table[idx_COW_table].pv_snap_rsector = LVM_TO_DISK64(lv_snap->lv_block_exception[idx].rsector_new);
 
-	if (brw_kiovec(WRITE, 1, &iobuf, snap_phys_dev,
-		       blocks, blksize_snap) != blksize_snap)
-		goto fail_raw_write;
+		end_of_table = idx % COW_entries_per_pe == COW_entries_per_pe - 1;
+		end_of_block = idx_COW_table == COW_entries_per_block - 1;
 
+		/* more entries for this block follow */
+		if (idx + 1 < end && !end_of_block && !end_of_table)
+			continue;
+
+		iobuf->length = blksize_snap;
+		if (brw_kiovec(WRITE, 1, &iobuf, snap_phys_dev,
+			       blocks, blksize_snap) != blksize_snap)
+			goto fail_raw_write;
+
+		/* initialization of next COW exception table block with
+		   zeroes, unless this batch fills it anyway */
+		if (idx + 1 < end || !(end_of_block || end_of_table))
+			continue;
 
-	/* initialization of next COW exception table block with zeroes */
-	end_of_table = idx % COW_entries_per_pe == COW_entries_per_pe - 1;
-	if (idx_COW_table % COW_entries_per_block == COW_entries_per_block - 1 || end_of_table)
-	{
 		/* don't go beyond the end */
-		if (idx + 1 >= lv_snap->lv_remap_end) goto good_out;
+		if (idx + 1 >= lv_snap->lv_remap_end) break;
 
 		memset(lv_COW_table, 0, blksize_snap);
 
 		if (end_of_table)
 		{
-			idx++;
-			snap_phys_dev = lv_snap->lv_block_exception[idx].rdev_new;
-			snap_pe_start = lv_snap->lv_block_exception[idx - (idx % COW_entries_per_pe)].rsector_new - lv_snap->lv_chunk_size;
+			snap_phys_dev = lv_snap->lv_block_exception[idx + 1].rdev_new;
+			snap_pe_start = lv_snap->lv_block_exception[idx + 1].rsector_new - lv_snap->lv_chunk_size;
 			blksize_snap = lvm_get_blksize(snap_phys_dev);
 			blocks[0] = snap_pe_start >> (blksize_snap >> 10);
 		} else blocks[0]++;
 
+		iobuf->length = blksize_snap;
 		if (brw_kiovec(WRITE, 1, &iobuf, snap_phys_dev,
 			       blocks, blksize_snap) != blksize_snap)
 			goto fail_raw_write;
 	}
 
-
- good_out:
+ out:
 	iobuf->length = length_tmp;
         iobuf->maplist[0] = page_tmp;
 	iobuf->nr_pages = nr_pages_tmp;
-	return 0;
-
-	/* slow path */
- out:
-	lvm_drop_snapshot(lv_snap, reason);
-	return 1;
+	return ret;
 
  fail_raw_write:
-	reason = "write error";
+	ret = 1;
 	goto out;
 }
 
 /*
- * copy on write handler for one snapshot logical volume
+ * copy one original chunk to its place on the snapshot
  *
- * read the original blocks and store it/them on the new one(s).
- * if there is no exception storage space free any longer --> release snapshot.
- *
- * this routine gets called for each _first_ write to a physical chunk.
+ * runs in lvm_snapd, which owns lvm_snap_iobuf.
  */
-int lvm_snapshot_COW(kdev_t org_phys_dev,
-		     unsigned long org_phys_sector,
-		     unsigned long org_pe_start,
-		     unsigned long org_virt_sector,
-		     lv_t * lv_snap)
+static int lvm_snapshot_copy_chunk(lvm_snap_pending_t * p, const char ** reason)
 {
-	const char * reason;
-	unsigned long org_start, snap_start, snap_phys_dev, virt_start, pe_off;
-	int idx = lv_snap->lv_remap_ptr, chunk_size = lv_snap->lv_chunk_size;
-	struct kiobuf * iobuf;
+	kdev_t org_phys_dev = p->org_dev, snap_phys_dev = p->snap_dev;
+	unsigned long org_start = p->org_start, snap_start = p->snap_start;
+	int chunk_size = p->lv_snap->lv_chunk_size;
+	struct kiobuf * iobuf = lvm_snap_iobuf;
 	unsigned long blocks[KIO_MAX_SECTORS];
 	int blksize_snap, blksize_org, min_blksize, max_blksize;
 	int max_sectors, nr_sectors;
 
-	/* check if we are out of snapshot space */
-	if (idx >= lv_snap->lv_remap_end)
-		goto fail_out_of_space;
-
-	/* calculate physical boundaries of source chunk */
-	pe_off = org_pe_start % chunk_size;
-	org_start = org_phys_sector - ((org_phys_sector-pe_off) % chunk_size);
-	virt_start = org_virt_sector - (org_phys_sector - org_start);
-
-	/* calculate physical boundaries of destination chunk */
-	snap_phys_dev = lv_snap->lv_block_exception[idx].rdev_new;
-	snap_start = lv_snap->lv_block_exception[idx].rsector_new;
-
 #ifdef DEBUG_SNAPSHOT
 	printk(KERN_INFO
 	       "%s -- COW: "
-	       "org %02d:%02d faulting %lu start %lu, "
+	       "org %02d:%02d start %lu, "
 	       "snap %02d:%02d start %lu, "
-	       "size %d, pe_start %lu pe_off %lu, virt_sec %lu\n",
+	       "size %d, pe_start %lu\n",
 	       lvm_name,
-	       MAJOR(org_phys_dev), MINOR(org_phys_dev), org_phys_sector,
-	       org_start,
+	       MAJOR(org_phys_dev), MINOR(org_phys_dev), org_start,
 	       MAJOR(snap_phys_dev), MINOR(snap_phys_dev), snap_start,
-	       chunk_size,
-	       org_pe_start, pe_off,
-	       org_virt_sector);
+	       chunk_size, p->org_pe_start);
 #endif
 
-	iobuf = lv_snap->lv_iobuf;
-
 	blksize_org = lvm_get_blksize(org_phys_dev);
 	blksize_snap = lvm_get_blksize(snap_phys_dev);
 	max_blksize = max(blksize_org, blksize_snap);
@@ -404,47 +407,392 @@ int lvm_snapshot_COW(kdev_t org_phys_dev,
 		if (brw_kiovec(WRITE, 1, &iobuf, snap_phys_dev,
 			       blocks, blksize_snap) != (nr_sectors<<9))
 			goto fail_raw_write;
+
+		org_start += nr_sectors;
+		snap_start += nr_sectors;
 	}
+	return 0;
 
-#ifdef DEBUG_SNAPSHOT
-	/* invalidate the logical snapshot buffer cache */
-	invalidate_snap_cache(virt_start, lv_snap->lv_chunk_size,
-			      lv_snap->lv_dev);
-#endif
+ fail_raw_read:
+	*reason = "read error";
+	return 1;
+ fail_raw_write:
+	*reason = "write error";
+	return 1;
+ fail_blksize:
+	*reason = "blocksize error";
+	return 1;
+}
+
+#define pending_hashfn(lv,dev,start) \
+	((((ulong) (lv) >> 6) ^ HASHDEV(dev) ^ (start)) % LVM_SNAP_PENDING_HASH)
+
+static lvm_snap_pending_t * lvm_find_pending(lv_t * lv_snap, kdev_t org_dev,
+					     ulong org_start)
+{
+	struct list_head * hash, * next;
+
+	hash = &lvm_snap_hash[pending_hashfn(lv_snap, org_dev, org_start)];
+	for (next = hash->next; next != hash; next = next->next)
+	{
+		lvm_snap_pending_t * p;
 
-	/* the original chunk is now stored on the snapshot volume
-	   so update the execption table */
-	lv_snap->lv_block_exception[idx].rdev_org = org_phys_dev;
-	lv_snap->lv_block_exception[idx].rsector_org = org_start;
-
-	lvm_hash_link(lv_snap->lv_block_exception + idx,
-		      org_phys_dev, org_start, lv_snap);
-	lv_snap->lv_remap_ptr = idx + 1;
-	if (lv_snap->lv_snapshot_use_rate > 0) {
-		if (lv_snap->lv_remap_ptr * 100 / lv_snap->lv_remap_end >= lv_snap->lv_snapshot_use_rate)
-			wake_up_interruptible(&lv_snap->lv_snapshot_wait);
+		p = list_entry(next, lvm_snap_pending_t, hash);
+		if (p->lv_snap == lv_snap && p->org_start == org_start &&
+		    p->org_dev == org_dev)
+			return p;
+	}
+	return NULL;
+}
+
+/*
+ * Park the origin write bh (already mapped to its PV) on the copy of
+ * its chunk for the first snapshot from lv_snap on that does not
+ * have one yet, queueing the copy if there is none pending.
+ *
+ * Returns 1 if bh was parked, 0 if no snapshot needs a copy and -1 if
+ * no more than 'reserve' pending copies are free.
+ * Called with the origin's lv_snapshot_sem held.
+ */
+static int __lvm_snapshot_hold(lv_t * lv_snap, struct buffer_head * bh,
+			       ulong pe_start, int reserve)
+{
+	for ( ; lv_snap != NULL; lv_snap = lv_snap->lv_snapshot_next)
+	{
+		kdev_t rdev = bh->b_rdev;
+		ulong rsector = bh->b_rsector;
+		ulong org_start, pe_off;
+		int chunk_size = lv_snap->lv_chunk_size;
+		lvm_snap_pending_t * p;
+
+		/* Check for inactive snapshot */
+		if (!(lv_snap->lv_status & LV_ACTIVE)) continue;
+		/* do we still have exception storage for this snapshot? */
+		if (lv_snap->lv_block_exception == NULL) continue;
+		if (lvm_snapshot_remap_block(&rdev, &rsector, pe_start, lv_snap))
+			continue;
+
+		pe_off = pe_start % chunk_size;
+		org_start = bh->b_rsector - ((bh->b_rsector - pe_off) % chunk_size);
+
+		spin_lock(&lvm_snap_lock);
+		p = lvm_find_pending(lv_snap, bh->b_rdev, org_start);
+		if (p == NULL)
+		{
+			if (lvm_snap_nr_free <= reserve)
+			{
+				spin_unlock(&lvm_snap_lock);
+				if (reserve)
+					return -1;
+				/* lvm_snapd itself ran dry, can't happen
+				   with a sane reserve */
+				lvm_drop_snapshot(lv_snap, "too many pending copies");
+				continue;
+			}
+			p = list_entry(lvm_snap_free.next, lvm_snap_pending_t, list);
+			list_del(&p->list);
+			lvm_snap_nr_free--;
+
+			p->lv_snap = lv_snap;
+			p->org_dev = bh->b_rdev;
+			p->org_start = org_start;
+			p->org_pe_start = pe_start;
+			p->bh = NULL;
+			p->bh_tail = &p->bh;
+			list_add(&p->hash, &lvm_snap_hash[pending_hashfn(lv_snap, p->org_dev, org_start)]);
+			list_add_tail(&p->list, &lvm_snap_queue);
+			wake_up(&lvm_snapd_wait);
+		}
+		bh->b_reqnext = NULL;
+		*p->bh_tail = bh;
+		p->bh_tail = &bh->b_reqnext;
+		spin_unlock(&lvm_snap_lock);
+		return 1;
 	}
 	return 0;
+}
+
+/*
+ * copy on write for a write to an original logical volume
+ *
+ * returns 1 if the write has been parked until the snapshots have a
+ * copy of the chunk, 0 if it can go to disk right away.  Only waits
+ * if too many copies are pending already.
+ */
+int lvm_snapshot_hold_write(lv_t * lv_org, struct buffer_head * bh,
+			    ulong pe_start)
+{
+	int ret, reserve = LVM_SNAP_RESERVE;
 
-	/* slow path */
+	/* lvm_snapd writing out pages to free memory must not wait
+	   for itself */
+	if (current == lvm_snapd_task)
+		reserve = 0;
+
+	for (;;)
+	{
+		down(&lv_org->lv_snapshot_sem);
+		ret = __lvm_snapshot_hold(lv_org->lv_snapshot_next, bh,
+					  pe_start, reserve);
+		up(&lv_org->lv_snapshot_sem);
+		if (ret >= 0)
+			return ret;
+		wait_event(lvm_snap_free_wait,
+			   lvm_snap_nr_free > LVM_SNAP_RESERVE);
+	}
+}
+
+int lvm_snapshot_busy(lv_t * lv_snap)
+{
+	int i, busy = 0;
+
+	spin_lock(&lvm_snap_lock);
+	if (lvm_snap_current == lv_snap)
+		busy = 1;
+	for (i = 0; i < LVM_SNAP_MAX_PENDING; i++)
+		if (lvm_snap_pending[i].lv_snap == lv_snap)
+			busy = 1;
+	spin_unlock(&lvm_snap_lock);
+	return busy;
+}
+
+/*
+ * wait for the pending copies of a snapshot which is no longer
+ * active, before it goes away
+ */
+void lvm_snapshot_sync(lv_t * lv_snap)
+{
+	wait_event(lvm_snap_free_wait, !lvm_snapshot_busy(lv_snap));
+}
+
+/*
+ * Copy a batch of queued chunks of one snapshot, then commit them
+ * with one COW table update and let the parked writes go on to the
+ * next snapshot, or to disk.
+ */
+static void lvm_snapshot_copy_batch(lv_t * lv_snap, struct list_head * batch,
+				    int nr)
+{
+	lv_t * lv_org = lv_snap->lv_snapshot_org;
+	vg_t * vg = lv_snap->vg;
+	const char * reason = NULL;
+	struct list_head * entry;
+	lvm_snap_pending_t * p;
+	int idx, i, dead = 0;
+
+	/* find the places on the snapshot */
+	down(&lv_org->lv_snapshot_sem);
+	idx = lv_snap->lv_remap_ptr;
+	if (lv_snap->lv_block_exception == NULL)
+		dead = 1;
+	else if (idx + nr > lv_snap->lv_remap_end)
+		reason = "out of space";
+	else
+		for (i = 0, entry = batch->next; entry != batch;
+		     i++, entry = entry->next)
+		{
+			p = list_entry(entry, lvm_snap_pending_t, list);
+			p->snap_dev = lv_snap->lv_block_exception[idx + i].rdev_new;
+			p->snap_start = lv_snap->lv_block_exception[idx + i].rsector_new;
+		}
+	up(&lv_org->lv_snapshot_sem);
+
+	/* the parked writes keep the origin chunks unchanged meanwhile */
+	if (!dead && !reason)
+		for (entry = batch->next; entry != batch; entry = entry->next)
+		{
+			p = list_entry(entry, lvm_snap_pending_t, list);
+			if (lvm_snapshot_copy_chunk(p, &reason))
+				break;
+		}
+
+	down(&lv_org->lv_snapshot_sem);
+	/* the snapshot may have been dropped in the meantime */
+	if (!dead && lv_snap->lv_block_exception != NULL)
+	{
+		if (!reason)
+		{
+			for (i = 0, entry = batch->next; entry != batch;
+			     i++, entry = entry->next)
+			{
+				p = list_entry(entry, lvm_snap_pending_t, list);
+				lv_snap->lv_block_exception[idx + i].rdev_org = p->org_dev;
+				lv_snap->lv_block_exception[idx + i].rsector_org = p->org_start;
+			}
+			if (lvm_write_COW_table_block(vg, lv_snap, idx, nr))
+				reason = "write error";
+		}
+		if (reason)
+			lvm_drop_snapshot(lv_snap, reason);
+		else
+		{
+			down(&lv_snap->lv_snapshot_sem);
+			for (i = idx; i < idx + nr; i++)
+				lvm_hash_link(lv_snap->lv_block_exception + i,
+					      lv_snap->lv_block_exception[i].rdev_org,
+					      lv_snap->lv_block_exception[i].rsector_org,
+					      lv_snap);
+			lv_snap->lv_remap_ptr = idx + nr;
+			up(&lv_snap->lv_snapshot_sem);
+			if (lv_snap->lv_snapshot_use_rate > 0) {
+				if (lv_snap->lv_remap_ptr * 100 / lv_snap->lv_remap_end >= lv_snap->lv_snapshot_use_rate)
+					wake_up_interruptible(&lv_snap->lv_snapshot_wait);
+			}
+		}
+	}
+
+	/*
+	 * Release the parked writes.  This stays under the origin's
+	 * semaphore, so that a later write to the same chunk can't get
+	 * to disk before them.
+	 */
+	while (!list_empty(batch))
+	{
+		struct buffer_head * bh, * next;
+		ulong pe_start;
+
+		p = list_entry(batch->next, lvm_snap_pending_t, list);
+		spin_lock(&lvm_snap_lock);
+		list_del(&p->hash);
+		list_del(&p->list);
+		bh = p->bh;
+		pe_start = p->org_pe_start;
+		p->lv_snap = NULL;
+		list_add(&p->list, &lvm_snap_free);
+		lvm_snap_nr_free++;
+		spin_unlock(&lvm_snap_lock);
+
+		for ( ; bh != NULL; bh = next)
+		{
+			next = bh->b_reqnext;
+			bh->b_reqnext = NULL;
+			if (!__lvm_snapshot_hold(lv_snap->lv_snapshot_next, bh,
+						 pe_start, 0))
+				generic_make_request(WRITE, bh);
+		}
+	}
+	up(&lv_org->lv_snapshot_sem);
+	wake_up(&lvm_snap_free_wait);
+}
+
+static void lvm_snapshot_run_queue(void)
+{
+	struct list_head batch, * entry;
+
+	while (!list_empty(&lvm_snap_queue))
+	{
+		lvm_snap_pending_t * p;
+		lv_t * lv_snap;
+		int nr = 0;
+
+		/* take up to LVM_SNAP_BATCH queued copies of the first
+		   snapshot, in the order they were queued */
+		INIT_LIST_HEAD(&batch);
+		spin_lock(&lvm_snap_lock);
+		lv_snap = list_entry(lvm_snap_queue.next, lvm_snap_pending_t, list)->lv_snap;
+		for (entry = lvm_snap_queue.next;
+		     entry != &lvm_snap_queue && nr < LVM_SNAP_BATCH; )
+		{
+			p = list_entry(entry, lvm_snap_pending_t, list);
+			entry = entry->next;
+			if (p->lv_snap != lv_snap)
+				continue;
+			list_del(&p->list);
+			list_add_tail(&p->list, &batch);
+			nr++;
+		}
+		lvm_snap_current = lv_snap;
+		spin_unlock(&lvm_snap_lock);
+
+		lvm_snapshot_copy_batch(lv_snap, &batch, nr);
+
+		/* lvm_snapshot_sync() may free lv_snap now */
+		spin_lock(&lvm_snap_lock);
+		lvm_snap_current = NULL;
+		spin_unlock(&lvm_snap_lock);
+		wake_up(&lvm_snap_free_wait);
+	}
+}
+
+static int lvm_snapd(void * unused)
+{
+	struct task_struct * tsk = current;
+
+	daemonize();
+	strcpy(tsk->comm, "lvm_snapd");
+
+	/* avoid getting signals */
+	spin_lock_irq(&tsk->sigmask_lock);
+	flush_signals(tsk);
+	sigfillset(&tsk->blocked);
+	recalc_sigpending(tsk);
+	spin_unlock_irq(&tsk->sigmask_lock);
+
+	lvm_snapd_task = tsk;
+	up(&lvm_snapd_sem);
+
+	for (;;)
+	{
+		wait_event_interruptible(lvm_snapd_wait,
+					 !list_empty(&lvm_snap_queue) ||
+					 lvm_snapd_exit);
+		if (list_empty(&lvm_snap_queue) && lvm_snapd_exit)
+			break;
+		lvm_snapshot_run_queue();
+		run_task_queue(&tq_disk);
+	}
+
+	lvm_snapd_task = NULL;
+	up(&lvm_snapd_sem);
+	return 0;
+}
+
+int __init lvm_snapshot_init(void)
+{
+	int err, i;
+
+	err = alloc_kiovec(1, &lvm_snap_iobuf);
+	if (err)
+		goto out;
+
+	err = lvm_snapshot_alloc_iobuf_pages(lvm_snap_iobuf,
+					     KIO_MAX_SECTORS << (PAGE_SHIFT-9));
+	if (err)
+		goto out_free_kiovec;
+
+	for (i = 0; i < LVM_SNAP_PENDING_HASH; i++)
+		INIT_LIST_HEAD(lvm_snap_hash + i);
+	for (i = 0; i < LVM_SNAP_MAX_PENDING; i++)
+		list_add(&lvm_snap_pending[i].list, &lvm_snap_free);
+	lvm_snap_nr_free = LVM_SNAP_MAX_PENDING;
+
+	lvm_snapd_exit = 0;
+	err = kernel_thread(lvm_snapd, NULL, CLONE_FS | CLONE_FILES | CLONE_SIGHAND);
+	if (err < 0)
+		goto out_free_kiovec;
+	down(&lvm_snapd_sem);
+	err = 0;
  out:
-	lvm_drop_snapshot(lv_snap, reason);
-	return 1;
+	return err;
 
- fail_out_of_space:
-	reason = "out of space";
-	goto out;
- fail_raw_read:
-	reason = "read error";
-	goto out;
- fail_raw_write:
-	reason = "write error";
-	goto out;
- fail_blksize:
-	reason = "blocksize error";
+ out_free_kiovec:
+	unmap_kiobuf(lvm_snap_iobuf);
+	free_kiovec(1, &lvm_snap_iobuf);
+	lvm_snap_iobuf = NULL;
 	goto out;
 }
 
+void lvm_snapshot_exit(void)
+{
+	lvm_snapd_exit = 1;
+	wake_up(&lvm_snapd_wait);
+	down(&lvm_snapd_sem);
+
+	unmap_kiobuf(lvm_snap_iobuf);
+	free_kiovec(1, &lvm_snap_iobuf);
+	lvm_snap_iobuf = NULL;
+}
+
 int lvm_snapshot_alloc_iobuf_pages(struct kiobuf * iobuf, int sectors)
 {
 	int bytes, nr_pages, err, i;
@@ -488,18 +836,34 @@ static int calc_max_buckets(void)
 	return mem;
 }
 
+/*
+ * The exception hash is sized for all the exceptions the snapshot has
+ * room for, and reallocated when the snapshot is extended or reduced.
+ * lvm_snapd can't grow it on the fly: vmalloc() may have to write out
+ * pages of the very origin whose writes lvm_snapd holds back.
+ */
+#define LVM_SNAP_MIN_BUCKETS	1024
+
+static unsigned long lvm_snapshot_hash_buckets(unsigned long nr)
+{
+	unsigned long buckets = LVM_SNAP_MIN_BUCKETS, max_buckets;
+
+	max_buckets = calc_max_buckets();
+	while (max_buckets & (max_buckets-1))
+		max_buckets &= (max_buckets-1);
+
+	while (buckets < nr && buckets < max_buckets)
+		buckets <<= 1;
+	return min(buckets, max_buckets);
+}
+
 int lvm_snapshot_alloc_hash_table(lv_t * lv)
 {
 	int err;
-	unsigned long buckets, max_buckets, size;
+	unsigned long buckets, size;
 	struct list_head * hash;
 
-	buckets = lv->lv_remap_end;
-	max_buckets = calc_max_buckets();
-	buckets = min(buckets, max_buckets);
-	while (buckets & (buckets-1))
-		buckets &= (buckets-1);
-
+	buckets = lvm_snapshot_hash_buckets(lv->lv_remap_end);
 	size = buckets * sizeof(struct list_head);
 
 	err = -ENOMEM;
@@ -520,34 +884,25 @@ int lvm_snapshot_alloc_hash_table(lv_t * lv)
 
 int lvm_snapshot_alloc(lv_t * lv_snap)
 {
-	int err, blocksize, max_sectors;
-
-	err = alloc_kiovec(1, &lv_snap->lv_iobuf);
-	if (err)
-		goto out;
-
-	blocksize = lvm_blocksizes[MINOR(lv_snap->lv_dev)];
-	max_sectors = KIO_MAX_SECTORS << (PAGE_SHIFT-9);
+	int err;
 
-	err = lvm_snapshot_alloc_iobuf_pages(lv_snap->lv_iobuf, max_sectors);
-	if (err)
-		goto out_free_kiovec;
+	/* chunk copies go through lvm_snapd's buffer */
+	lv_snap->lv_iobuf = NULL;
 
 	err = lvm_snapshot_alloc_hash_table(lv_snap);
 	if (err)
-		goto out_free_kiovec;
-
+		goto out;
 
-		lv_snap->lv_COW_table_page = alloc_page(GFP_KERNEL);
-		if (!lv_snap->lv_COW_table_page)
-			goto out_free_kiovec;
+	err = -ENOMEM;
+	lv_snap->lv_COW_table_page = alloc_page(GFP_KERNEL);
+	if (!lv_snap->lv_COW_table_page)
+		goto out_free_hash;
+	err = 0;
 
  out:
 	return err;
 
- out_free_kiovec:
-	unmap_kiobuf(lv_snap->lv_iobuf);
-	free_kiovec(1, &lv_snap->lv_iobuf);
+ out_free_hash:
 	vfree(lv_snap->lv_snapshot_hash_table);
 	lv_snap->lv_snapshot_hash_table = NULL;
 	goto out;
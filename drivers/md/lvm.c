@@ -252,10 +252,13 @@ static void lvm_init_vars(void);
 extern inline int lvm_get_blksize(kdev_t);
 extern int lvm_snapshot_alloc(lv_t *);
 extern void lvm_snapshot_fill_COW_page(vg_t *, lv_t *);
-extern int lvm_snapshot_COW(kdev_t, ulong, ulong, ulong, lv_t *);
+extern int lvm_snapshot_hold_write(lv_t *, struct buffer_head *, ulong);
+extern void lvm_snapshot_sync(lv_t *);
+extern int lvm_snapshot_busy(lv_t *);
 extern int lvm_snapshot_remap_block(kdev_t *, ulong *, ulong, lv_t *);
 extern void lvm_snapshot_release(lv_t *); 
-extern int lvm_write_COW_table_block(vg_t *, lv_t *);
+extern int lvm_snapshot_init(void);
+extern void lvm_snapshot_exit(void);
 extern inline void lvm_hash_link(lv_block_exception_t *, kdev_t, ulong, lv_t *);
 extern int lvm_snapshot_alloc_hash_table(lv_t *);
 extern void lvm_drop_snapshot(lv_t *, char *);
@@ -410,8 +413,13 @@ int __init lvm_init(void)
 {
 	struct gendisk *gendisk_ptr = NULL;
 
+	if (lvm_snapshot_init() < 0) {
+		printk(KERN_ERR "%s -- lvm_snapshot_init failed\n", lvm_name);
+		return -ENOMEM;
+	}
 	if (register_chrdev(LVM_CHAR_MAJOR, lvm_name, &lvm_chr_fops) < 0) {
 		printk(KERN_ERR "%s -- register_chrdev failed\n", lvm_name);
+		lvm_snapshot_exit();
 		return -EIO;
 	}
 #ifdef BLOCK_DEVICE_OPERATIONS
@@ -423,6 +431,7 @@ int __init lvm_init(void)
 		printk("%s -- register_blkdev failed\n", lvm_name);
 		if (unregister_chrdev(LVM_CHAR_MAJOR, lvm_name) < 0)
 			printk(KERN_ERR "%s -- unregister_chrdev failed\n", lvm_name);
+		lvm_snapshot_exit();
 		return -EIO;
 	}
 
@@ -532,6 +541,8 @@ void cleanup_module(void)
 	lvm_hd_name_ptr = NULL;
 #endif
 
+	lvm_snapshot_exit();
+
 	printk(KERN_INFO "%s -- Module successfully deactivated\n", lvm_name);
 
 	return;
@@ -1655,54 +1666,27 @@ lvm_second_remap:
 	else
 		lv->lv_current_pe[index].reads++;
 
+	bh->b_rdev = rdev_tmp;
+	bh->b_rsector = rsector_tmp;
+
 	/* snapshot volume exception handling on physical device address base */
 	if (lv->lv_access & (LV_SNAPSHOT|LV_SNAPSHOT_ORG)) {
 		/* original logical volume */
 		if (lv->lv_access & LV_SNAPSHOT_ORG) {
+			/* hold the write back until all snapshots
+			   have a copy of the chunk */
 			if (rw == WRITE || rw == WRITEA)
-			{
-				lv_t *lv_ptr;
-
-				/* start with first snapshot and loop thrugh all of them */
-				for (lv_ptr = lv->lv_snapshot_next;
-				     lv_ptr != NULL;
-				     lv_ptr = lv_ptr->lv_snapshot_next) {
-					/* Check for inactive snapshot */
-					if (!(lv_ptr->lv_status & LV_ACTIVE)) continue;
-					down(&lv->lv_snapshot_org->lv_snapshot_sem);
-					/* do we still have exception storage for this snapshot free? */
-					if (lv_ptr->lv_block_exception != NULL) {
-						rdev_sav = rdev_tmp;
-						rsector_sav = rsector_tmp;
-						if (!lvm_snapshot_remap_block(&rdev_tmp,
-									      &rsector_tmp,
-									      pe_start,
-									      lv_ptr)) {
-							/* create a new mapping */
-							if (!(ret = lvm_snapshot_COW(rdev_tmp,
-									       	     rsector_tmp,
-									             pe_start,
-									             rsector_sav,
-									             lv_ptr)))
-								ret = lvm_write_COW_table_block(vg_this,
-												lv_ptr);
-						}
-						rdev_tmp = rdev_sav;
-						rsector_tmp = rsector_sav;
-					}
-					up(&lv->lv_snapshot_org->lv_snapshot_sem);
-				}
-			}
+				ret = lvm_snapshot_hold_write(lv, bh, pe_start);
 		} else {
 			/* remap snapshot logical volume */
 			down(&lv->lv_snapshot_sem);
 			if (lv->lv_block_exception != NULL)
-				lvm_snapshot_remap_block(&rdev_tmp, &rsector_tmp, pe_start, lv);
+				lvm_snapshot_remap_block(&bh->b_rdev,
+							 &bh->b_rsector,
+							 pe_start, lv);
 			up(&lv->lv_snapshot_sem);
 		}
 	}
-	bh->b_rdev = rdev_tmp;
-	bh->b_rsector = rsector_tmp;
 
 	return ret;
 } /* lvm_map() */
@@ -1754,8 +1738,13 @@ static int lvm_make_request_fn(request_queue_t *q,
 			       int rw,
 			       struct buffer_head *bh)
 {
-	if (lvm_map(bh, rw)<0)
+	int ret = lvm_map(bh, rw);
+
+	if (ret < 0)
 		return 0; /* failure, buffer_IO_error has been called, don't recurse */
+	else if (ret > 0)
+		return 0; /* held back for snapshot copy on write, lvm_snapd
+			     will submit it */
 	else
 		return 1; /* all ok, mapping done, call lower level driver */
 }
@@ -2518,7 +2507,14 @@ static int lvm_do_lv_remove(int minor, char *lv_name, int l)
 	/* sync the buffers */
 	fsync_dev(lv_ptr->lv_dev);
 
-	lv_ptr->lv_status &= ~LV_ACTIVE;
+	if (lv_ptr->lv_access & LV_SNAPSHOT) {
+		/* lvm_map() checks this under the origin's semaphore
+		   before it queues a copy for the snapshot */
+		down(&lv_ptr->lv_snapshot_org->lv_snapshot_sem);
+		lv_ptr->lv_status &= ~LV_ACTIVE;
+		up(&lv_ptr->lv_snapshot_org->lv_snapshot_sem);
+	} else
+		lv_ptr->lv_status &= ~LV_ACTIVE;
 
 	/* invalidate the buffers */
 	invalidate_buffers(lv_ptr->lv_dev);
@@ -2548,6 +2544,18 @@ static int lvm_do_lv_remove(int minor, char *lv_name, int l)
 		vfree(lv_ptr->lv_current_pe);
 	/* LV_SNAPSHOT */
 	} else {
+		lv_t *lv_org = lv_ptr->lv_snapshot_org;
+
+		/* let lvm_snapd finish the copies queued for it, and
+		   make sure none is left once we hold the semaphore */
+		lvm_snapshot_sync(lv_ptr);
+		down(&lv_org->lv_snapshot_sem);
+		while (lvm_snapshot_busy(lv_ptr)) {
+			up(&lv_org->lv_snapshot_sem);
+			lvm_snapshot_sync(lv_ptr);
+			down(&lv_org->lv_snapshot_sem);
+		}
+
 		/* remove this snapshot logical volume from the chain */
 		lv_ptr->lv_snapshot_prev->lv_snapshot_next = lv_ptr->lv_snapshot_next;
 		if (lv_ptr->lv_snapshot_next != NULL) {
@@ -2555,9 +2563,10 @@ static int lvm_do_lv_remove(int minor, char *lv_name, int l)
 			    lv_ptr->lv_snapshot_prev;
 		}
 		/* no more snapshots? */
-		if (lv_ptr->lv_snapshot_org->lv_snapshot_next == NULL)
-			lv_ptr->lv_snapshot_org->lv_access &= ~LV_SNAPSHOT_ORG;
+		if (lv_org->lv_snapshot_next == NULL)
+			lv_org->lv_access &= ~LV_SNAPSHOT_ORG;
 		lvm_snapshot_release(lv_ptr);
+		up(&lv_org->lv_snapshot_sem);
 	}
 
 #ifdef	CONFIG_DEVFS_FS
@@ -72,11 +72,19 @@ static mdk_personality_t *pers[MAX_PERSONALITY];
  * speed limit - in case reconstruction slows down your system despite
  * idle IO detection.
  *
- * you can change it via /proc/sys/dev/raid/speed_limit_min and _max.
+ * Between the two the speed adapts to the foreground load: while the
+ * average request on the member disks takes longer than latency_target
+ * milliseconds the reconstruction backs off, when it is below that it
+ * speeds up again, see md_sync_adapt().
+ *
+ * you can change it via /proc/sys/dev/raid/speed_limit_min, _max and
+ * latency_target.  The SET_SYNC_SPEED ioctl overrides speed_limit_max
+ * for a single array.
  */
 
 static int sysctl_speed_limit_min = 100;
 static int sysctl_speed_limit_max = 100000;
+static int sysctl_latency_target = 30;
 
 static struct ctl_table_header *raid_table_header;
 
@@ -85,6 +93,8 @@ static ctl_table raid_table[] = {
 	 &sysctl_speed_limit_min, sizeof(int), 0644, NULL, &proc_dointvec},
 	{DEV_RAID_SPEED_LIMIT_MAX, "speed_limit_max",
 	 &sysctl_speed_limit_max, sizeof(int), 0644, NULL, &proc_dointvec},
+	{DEV_RAID_LATENCY_TARGET, "latency_target",
+	 &sysctl_latency_target, sizeof(int), 0644, NULL, &proc_dointvec},
 	{0}
 };
 
@@ -108,6 +118,12 @@ static int md_hardsect_sizes[MAX_MD_DEVS];
 static int md_maxreadahead[MAX_MD_DEVS];
 static mdk_thread_t *md_recovery_thread;
 
+static int md_bitmap_create(mddev_t *mddev);
+static void md_bitmap_free(mddev_t *mddev);
+static int md_bitmap_status(char *page, mddev_t *mddev);
+static unsigned long md_bitmap_clean_blocks(mddev_t *mddev, unsigned long j,
+						unsigned long max_blocks);
+
 int md_size[MAX_MD_DEVS];
 
 extern struct block_device_operations md_fops;
@@ -748,6 +764,7 @@ static void free_mddev (mddev_t *mddev)
 	del_mddev_mapping(mddev, MKDEV(MD_MAJOR, mdidx(mddev)));
 	md_list_del(&mddev->all_mddevs);
 	MD_INIT_LIST_HEAD(&mddev->all_mddevs);
+	md_bitmap_free(mddev);
 	kfree(mddev);
 	MOD_DEC_USE_COUNT;
 }
@@ -1443,7 +1460,7 @@ static int analyze_sbs (mddev_t * mddev)
 	}
 
 	if ((sb->state != (1 << MD_SB_CLEAN)) && ((sb->level == 1) ||
-			(sb->level == 4) || (sb->level == 5)))
+			(sb->level == 4) || (sb->level == 5) || (sb->level == 10)))
 		printk (NOT_CLEAN_IGNORE, mdidx(mddev));
 
 	return 0;
@@ -1509,6 +1526,13 @@ static int device_size_calculation (mddev_t * mddev)
 		case 5:
 			data_disks = sb->raid_disks-1;
 			break;
+		case 10:
+			/*
+			 * only a guess for the readahead below, raid10
+			 * sets md_size itself from its copy layout
+			 */
+			data_disks = sb->raid_disks;
+			break;
 		default:
 			printk (UNKNOWN_LEVEL, mdidx(mddev), sb->level);
 			goto abort;
@@ -1517,7 +1541,8 @@ static int device_size_calculation (mddev_t * mddev)
 		md_size[mdidx(mddev)] = sb->size * data_disks;
 
 	readahead = MD_READAHEAD;
-	if ((sb->level == 0) || (sb->level == 4) || (sb->level == 5)) {
+	if ((sb->level == 0) || (sb->level == 4) || (sb->level == 5) ||
+			(sb->level == 10)) {
 		readahead = (mddev->sb->chunk_size>>PAGE_SHIFT) * 4 * data_disks;
 		if (readahead < data_disks * (MAX_SECTORS>>(PAGE_SHIFT-9))*2)
 			readahead = data_disks * (MAX_SECTORS>>(PAGE_SHIFT-9))*2;
@@ -1650,12 +1675,17 @@ static int do_md_run (mddev_t * mddev)
 	md_blocksizes[mdidx(mddev)] = 1024;
 	if (md_blocksizes[mdidx(mddev)] < md_hardsect_sizes[mdidx(mddev)])
 		md_blocksizes[mdidx(mddev)] = md_hardsect_sizes[mdidx(mddev)];
+	if (md_bitmap_create(mddev))
+		printk(KERN_WARNING "md%d: no memory for the bitmap\n",
+			mdidx(mddev));
+
 	mddev->pers = pers[pnum];
 
 	err = mddev->pers->run(mddev);
 	if (err) {
 		printk("pers->run() failed ...\n");
 		mddev->pers = NULL;
+		md_bitmap_free(mddev);
 		return -EINVAL;
 	}
 
@@ -2787,6 +2817,14 @@ static int md_ioctl (struct inode *inode, struct file *file,
 			err = set_disk_faulty(mddev, (kdev_t)arg);
 			goto done_unlock;
 
+		case SET_SYNC_SPEED:
+			if (arg > INT_MAX) {
+				err = -EINVAL;
+				goto abort_unlock;
+			}
+			mddev->sync_speed_max = arg;
+			goto done_unlock;
+
 		case RUN_ARRAY:
 		{
 /* The data is never used....
@@ -3045,13 +3083,24 @@ static int status_unused (char * page)
 }
 
 
+/*
+ * Number of blocks md_do_sync() walks.  That is the size of one member
+ * disk, except for raid10 whose sync_request works on array blocks.
+ */
+static unsigned long sync_max_blocks (mddev_t * mddev)
+{
+	if (mddev->sb->level == 10)
+		return md_size[mdidx(mddev)];
+	return mddev->sb->size;
+}
+
 static int status_resync (char * page, mddev_t * mddev)
 {
 	int sz = 0;
 	unsigned long max_blocks, resync, res, dt, db, rt;
 
 	resync = mddev->curr_resync - atomic_read(&mddev->recovery_active);
-	max_blocks = mddev->sb->size;
+	max_blocks = sync_max_blocks(mddev);
 
 	/*
 	 * Should not happen.
@@ -3102,6 +3151,13 @@ static int status_resync (char * page, mddev_t * mddev)
 
 	sz += sprintf(page + sz, " speed=%ldK/sec", db/dt);
 
+	/*
+	 * what the speed is adapting to, see md_sync_adapt()
+	 */
+	sz += sprintf(page + sz, " target=%dK/sec fg=%luK/sec lat=%lums",
+			mddev->sync_target, mddev->sync_fg_rate,
+			mddev->sync_latency);
+
 	return sz;
 }
 
@@ -3161,6 +3217,8 @@ static int md_status_read_proc(char *page, char **start, off_t off,
 		}
 
 		sz += mddev->pers->status (page+sz, mddev);
+		if (mddev->bitmap)
+			sz += md_bitmap_status(page+sz, mddev);
 
 		sz += sprintf(page+sz, "\n      ");
 		if (mddev->curr_resync) {
@@ -3238,14 +3296,20 @@ void md_sync_acct(kdev_t dev, unsigned long nr_sectors)
 	sync_io[major][index] += nr_sectors;
 }
 
-static int is_mddev_idle (mddev_t *mddev)
+/*
+ * I/O on the members of an array since the last call: the sectors
+ * that were not resync I/O, and the number of requests completed and
+ * the jiffies they took (drive_stat_done()).  The counters are those
+ * of the whole disk, so I/O to other partitions counts as well.
+ */
+static void sample_mddev_io (mddev_t *mddev, unsigned long *fg,
+				unsigned long *done, unsigned long *ticks)
 {
 	mdk_rdev_t * rdev;
 	struct md_list_head *tmp;
-	int idle;
 	unsigned long curr_events;
 
-	idle = 1;
+	*fg = *done = *ticks = 0;
 	ITERATE_RDEV(mddev,rdev,tmp) {
 		int major = MAJOR(rdev->dev);
 		int idx = disk_index(rdev->dev);
@@ -3256,14 +3320,459 @@ static int is_mddev_idle (mddev_t *mddev)
 		curr_events = kstat.dk_drive_rblk[major][idx] +
 						kstat.dk_drive_wblk[major][idx] ;
 		curr_events -= sync_io[major][idx];
-//		printk("events(major: %d, idx: %d): %ld\n", major, idx, curr_events);
-		if (curr_events != rdev->last_events) {
-//			printk("!I(%ld)", curr_events - rdev->last_events);
-			rdev->last_events = curr_events;
-			idle = 0;
+		if ((long)(curr_events - rdev->last_events) > 0)
+			*fg += curr_events - rdev->last_events;
+		rdev->last_events = curr_events;
+
+		curr_events = kstat.dk_drive_done[major][idx];
+		*done += curr_events - rdev->last_done;
+		rdev->last_done = curr_events;
+
+		curr_events = kstat.dk_drive_ticks[major][idx];
+		*ticks += curr_events - rdev->last_ticks;
+		rdev->last_ticks = curr_events;
+	}
+}
+
+static int md_sync_speed_max (mddev_t *mddev)
+{
+	if (mddev->sync_speed_max)
+		return mddev->sync_speed_max;
+	return sysctl_speed_limit_max;
+}
+
+/*
+ * Move the resync speed goal, 'dt' jiffies after the last call:
+ *  - no foreground I/O on the members: as fast as allowed,
+ *  - foreground I/O and member requests slower than latency_target:
+ *    halve it,
+ *  - foreground I/O but latency is fine: creep up by speed_limit_min.
+ */
+static void md_sync_adapt (mddev_t *mddev, unsigned long dt)
+{
+	unsigned long fg, done, ticks;
+	int min = sysctl_speed_limit_min, max = md_sync_speed_max(mddev);
+	int target = mddev->sync_target;
+
+	sample_mddev_io(mddev, &fg, &done, &ticks);
+	mddev->sync_fg_rate = (fg / 2) * HZ / (dt + 1);
+	mddev->sync_latency = done ? ticks * 1000 / HZ / done : 0;
+
+	if (!fg)
+		target = max;
+	else if (mddev->sync_latency > sysctl_latency_target)
+		target /= 2;
+	else
+		target += min;
+
+	if (target > max)
+		target = max;
+	if (target < min)
+		target = min;
+	mddev->sync_target = target;
+}
+
+/*
+ * Write-intent bitmap.
+ *
+ * RAID1/4/5 arrays with persistent superblocks keep a bitmap behind the
+ * superblock of every member, one bit per region of the members.  A bit
+ * goes to disk before the first write to its region is issued, and is
+ * cleared lazily by mdbitmapd once the region has been quiet for two
+ * passes.  After an unclean shutdown md_do_sync() then only has to
+ * resync the regions whose bit is set.
+ *
+ * Setting bits is batched: the first writer that needs its block of the
+ * bitmap on disk writes out everything that got dirtied up to then, the
+ * writers arriving meanwhile wait for that flush (or the next one).
+ */
+#define MD_BITMAP_MAX_REGIONS	(128*1024)
+#define MD_BITMAP_CLEAN_DELAY	(5*HZ)
+
+static mdk_thread_t *md_bitmap_thread;
+static struct timer_list md_bitmap_timer;
+
+static void md_bitmap_end_io(struct buffer_head *bh, int uptodate)
+{
+	md_bitmap_t *bm = bh->b_private;
+
+	mark_buffer_uptodate(bh, uptodate);
+	unlock_buffer(bh);
+	if (atomic_dec_and_test(&bm->io_pending))
+		wake_up(&bm->io_wait);
+}
+
+static void md_bitmap_submit(md_bitmap_t *bm, struct buffer_head *bh,
+			int rw, mdk_rdev_t *rdev, int block, char *data)
+{
+	memset(bh, 0, sizeof(*bh));
+	init_waitqueue_head(&bh->b_wait);
+	bh->b_size = MD_BITMAP_BLOCK_BYTES;
+	bh->b_data = data;
+	bh->b_page = virt_to_page(data);
+	bh->b_dev = bh->b_rdev = rdev->dev;
+	bh->b_rsector = (rdev->sb_offset + MD_SB_BLOCKS) * 2 +
+				block * (MD_BITMAP_BLOCK_BYTES >> 9);
+	bh->b_blocknr = bh->b_rsector / (MD_BITMAP_BLOCK_BYTES >> 9);
+	bh->b_state = (1 << BH_Req) | (1 << BH_Mapped) | (1 << BH_Lock);
+	if (rw == WRITE)
+		bh->b_state |= (1 << BH_Uptodate) | (1 << BH_Dirty);
+	bh->b_end_io = md_bitmap_end_io;
+	bh->b_private = bm;
+	atomic_set(&bh->b_count, 1);
+
+	atomic_inc(&bm->io_pending);
+	generic_make_request(rw, bh);
+}
+
+/* Drop our bias on io_pending and wait for the I/O to finish */
+static void md_bitmap_wait(md_bitmap_t *bm)
+{
+	if (atomic_dec_and_test(&bm->io_pending))
+		return;
+	run_task_queue(&tq_disk);
+	wait_event(bm->io_wait, !md_atomic_read(&bm->io_pending));
+}
+
+/*
+ * Write the blocks of the map changed after sequence number 'from'
+ * to all members.  Only one flusher runs at a time.
+ */
+static void md_bitmap_write(mddev_t *mddev, unsigned long from)
+{
+	md_bitmap_t *bm = mddev->bitmap;
+	struct md_list_head *tmp;
+	mdk_rdev_t *rdev;
+	int b, i, n = 0;
+
+	md_atomic_set(&bm->io_pending, 1);
+	for (b = 0; b < bm->nblocks; b++) {
+		if (bm->block_seq[b] <= from)
+			continue;
+		ITERATE_RDEV(mddev,rdev,tmp) {
+			if (rdev->faulty || n == bm->nblocks * MD_SB_DISKS)
+				continue;
+			md_bitmap_submit(bm, bm->bhs + n++, WRITE, rdev, b,
+				(char *) bm->map + b * MD_BITMAP_BLOCK_BYTES);
+		}
+	}
+	md_bitmap_wait(bm);
+
+	for (i = 0; i < n; i++)
+		if (!buffer_uptodate(bm->bhs + i))
+			md_error(mddev_to_kdev(mddev), bm->bhs[i].b_dev);
+}
+
+/*
+ * Get everything dirtied so far onto the disks, or wait for
+ * whoever is doing that already.
+ */
+static void md_bitmap_flush(mddev_t *mddev)
+{
+	md_bitmap_t *bm = mddev->bitmap;
+	unsigned long flags, from, target;
+
+	for (;;) {
+		wait_event(bm->wait, !bm->flushing);
+		md_spin_lock_irqsave(&bm->lock, flags);
+		if (!bm->flushing)
+			break;
+		md_spin_unlock_irqrestore(&bm->lock, flags);
+	}
+	if (bm->seq_written == bm->seq_dirty) {
+		md_spin_unlock_irqrestore(&bm->lock, flags);
+		return;
+	}
+	bm->flushing = 1;
+	from = bm->seq_written;
+	target = bm->seq_dirty;
+	md_spin_unlock_irqrestore(&bm->lock, flags);
+
+	md_bitmap_write(mddev, from);
+
+	md_spin_lock_irqsave(&bm->lock, flags);
+	bm->seq_written = target;
+	bm->flushing = 0;
+	md_spin_unlock_irqrestore(&bm->lock, flags);
+	wake_up(&bm->wait);
+}
+
+/*
+ * Called by the personality before it issues a write.  Marks the
+ * regions covered by the write and returns once their bits are on
+ * disk.  May sleep.
+ */
+void md_bitmap_startwrite(mddev_t *mddev, unsigned long sector,
+				unsigned long nr_sectors)
+{
+	md_bitmap_t *bm = mddev->bitmap;
+	unsigned long r, first, last, flags, need = 0;
+
+	if (!bm)
+		return;
+	first = (sector >> 1) >> bm->shift;
+	last = ((sector + nr_sectors - 1) >> 1) >> bm->shift;
+	if (last >= bm->nregions)
+		last = bm->nregions - 1;
+
+	md_spin_lock_irqsave(&bm->lock, flags);
+	for (r = first; r <= last; r++) {
+		int b = r / MD_BITMAP_BLOCK_BITS;
+
+		bm->pending[r]++;
+		set_bit(r, bm->recent);
+		if (!test_and_set_bit(r, bm->map))
+			bm->block_seq[b] = ++bm->seq_dirty;
+		if (bm->block_seq[b] > need)
+			need = bm->block_seq[b];
+	}
+	md_spin_unlock_irqrestore(&bm->lock, flags);
+
+	while (bm->seq_written < need)
+		md_bitmap_flush(mddev);
+}
+
+/*
+ * Called when a write started by md_bitmap_startwrite() has completed,
+ * possibly from interrupt context.  The bits are cleared later.
+ */
+void md_bitmap_endwrite(mddev_t *mddev, unsigned long sector,
+				unsigned long nr_sectors)
+{
+	md_bitmap_t *bm = mddev->bitmap;
+	unsigned long r, first, last, flags;
+
+	if (!bm)
+		return;
+	first = (sector >> 1) >> bm->shift;
+	last = ((sector + nr_sectors - 1) >> 1) >> bm->shift;
+	if (last >= bm->nregions)
+		last = bm->nregions - 1;
+
+	md_spin_lock_irqsave(&bm->lock, flags);
+	for (r = first; r <= last; r++) {
+		if (bm->pending[r])
+			bm->pending[r]--;
+		else
+			printk(KERN_ERR "md%d: bitmap region %lu underflow\n",
+				mdidx(mddev), r);
+	}
+	md_spin_unlock_irqrestore(&bm->lock, flags);
+}
+
+/*
+ * Clear the bits of regions that had no writes since the last pass.
+ * Nothing is cleared while the array is degraded or has not been
+ * resynced yet, those bits are needed later.
+ */
+static void md_bitmap_clean(mddev_t *mddev)
+{
+	md_bitmap_t *bm = mddev->bitmap;
+	mdp_super_t *sb = mddev->sb;
+	unsigned long r, flags;
+	int cleared = 0;
+
+	if (bm->resync_pending || mddev->curr_resync || mddev->ro ||
+	    sb->active_disks < sb->raid_disks)
+		return;
+
+	md_spin_lock_irqsave(&bm->lock, flags);
+	for (r = 0; r < bm->nregions; r++) {
+		if (!(r % BITS_PER_LONG) && !bm->map[r / BITS_PER_LONG]) {
+			r += BITS_PER_LONG - 1;
+			continue;
+		}
+		if (!test_bit(r, bm->map) || bm->pending[r])
+			continue;
+		if (test_and_clear_bit(r, bm->recent))
+			continue;
+		clear_bit(r, bm->map);
+		bm->block_seq[r / MD_BITMAP_BLOCK_BITS] = ++bm->seq_dirty;
+		cleared++;
+	}
+	md_spin_unlock_irqrestore(&bm->lock, flags);
+
+	if (cleared)
+		md_bitmap_flush(mddev);
+}
+
+static void md_bitmap_daemon(void *data)
+{
+	struct md_list_head *tmp;
+	mddev_t *mddev;
+
+	ITERATE_MDDEV(mddev,tmp) {
+		if (!mddev->bitmap || down_trylock(&mddev->reconfig_sem))
+			continue;
+		if (mddev->bitmap && mddev->pers)
+			md_bitmap_clean(mddev);
+		unlock_mddev(mddev);
+	}
+}
+
+static void md_bitmap_tick(unsigned long data)
+{
+	md_wakeup_thread(md_bitmap_thread);
+	mod_timer(&md_bitmap_timer, jiffies + MD_BITMAP_CLEAN_DELAY);
+}
+
+/*
+ * Number of blocks from block j on that md_do_sync() can skip,
+ * zero if j itself is in a dirty region.
+ */
+static unsigned long md_bitmap_clean_blocks(mddev_t *mddev, unsigned long j,
+						unsigned long max_blocks)
+{
+	md_bitmap_t *bm = mddev->bitmap;
+	unsigned long r = j >> bm->shift, end;
+
+	while (r < bm->nregions && !test_bit(r, bm->map))
+		r++;
+	end = r << bm->shift;
+	if (end > max_blocks)
+		end = max_blocks;
+	return end > j ? end - j : 0;
+}
+
+/*
+ * OR together the bitmaps of all members, a member that missed
+ * some updates can only have fewer bits set.
+ */
+static int md_bitmap_read(mddev_t *mddev, md_bitmap_t *bm)
+{
+	struct md_list_head *tmp;
+	mdk_rdev_t *rdev;
+	unsigned long *buf;
+	int b, i, good = 0, size = bm->nblocks * MD_BITMAP_BLOCK_BYTES;
+
+	buf = kmalloc(size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	ITERATE_RDEV(mddev,rdev,tmp) {
+		if (rdev->faulty)
+			continue;
+		md_atomic_set(&bm->io_pending, 1);
+		for (b = 0; b < bm->nblocks; b++)
+			md_bitmap_submit(bm, bm->bhs + b, READ, rdev, b,
+				(char *) buf + b * MD_BITMAP_BLOCK_BYTES);
+		md_bitmap_wait(bm);
+		for (b = 0; b < bm->nblocks; b++)
+			if (!buffer_uptodate(bm->bhs + b))
+				break;
+		if (b < bm->nblocks) {
+			printk(KERN_WARNING "md%d: could not read bitmap from %s\n",
+				mdidx(mddev), partition_name(rdev->dev));
+			continue;
 		}
+		for (i = 0; i < size / sizeof(long); i++)
+			bm->map[i] |= buf[i];
+		good++;
 	}
-	return idle;
+	kfree(buf);
+	return good ? 0 : -EIO;
+}
+
+static void md_bitmap_free(mddev_t *mddev)
+{
+	md_bitmap_t *bm = mddev->bitmap;
+
+	if (!bm)
+		return;
+	mddev->bitmap = NULL;
+	if (bm->map)
+		kfree(bm->map);
+	if (bm->recent)
+		kfree(bm->recent);
+	if (bm->block_seq)
+		kfree(bm->block_seq);
+	if (bm->bhs)
+		kfree(bm->bhs);
+	if (bm->pending)
+		vfree(bm->pending);
+	kfree(bm);
+}
+
+/*
+ * Set up the bitmap of an array about to be run.  If it was not shut
+ * down cleanly, pick up the bitmap left on disk, or mark everything
+ * dirty if there is none.  All of the map goes to disk before the
+ * first write.
+ */
+static int md_bitmap_create(mddev_t *mddev)
+{
+	mdp_super_t *sb = mddev->sb;
+	md_bitmap_t *bm;
+	int shift, b, size;
+
+	if (sb->not_persistent ||
+	    (sb->level != 1 && sb->level != 4 && sb->level != 5))
+		return 0;
+
+	md_bitmap_free(mddev);
+	shift = MD_BITMAP_MIN_SHIFT;
+	while ((sb->size >> shift) >= MD_BITMAP_MAX_REGIONS)
+		shift++;
+
+	bm = kmalloc(sizeof(*bm), GFP_KERNEL);
+	if (!bm)
+		return -ENOMEM;
+	memset(bm, 0, sizeof(*bm));
+	mddev->bitmap = bm;
+
+	bm->shift = shift;
+	bm->nregions = (sb->size + (1 << shift) - 1) >> shift;
+	bm->nblocks = (bm->nregions + MD_BITMAP_BLOCK_BITS - 1) /
+						MD_BITMAP_BLOCK_BITS;
+	size = bm->nblocks * MD_BITMAP_BLOCK_BYTES;
+	spin_lock_init(&bm->lock);
+	md_init_waitqueue_head(&bm->wait);
+	md_init_waitqueue_head(&bm->io_wait);
+
+	bm->map = kmalloc(size, GFP_KERNEL);
+	bm->recent = kmalloc(size, GFP_KERNEL);
+	bm->block_seq = kmalloc(bm->nblocks * sizeof(long), GFP_KERNEL);
+	bm->bhs = kmalloc(bm->nblocks * MD_SB_DISKS *
+				sizeof(struct buffer_head), GFP_KERNEL);
+	bm->pending = vmalloc(bm->nregions * sizeof(unsigned short));
+	if (!bm->map || !bm->recent || !bm->block_seq || !bm->bhs ||
+	    !bm->pending) {
+		md_bitmap_free(mddev);
+		return -ENOMEM;
+	}
+	memset(bm->map, 0, size);
+	memset(bm->recent, 0, size);
+	memset(bm->pending, 0, bm->nregions * sizeof(unsigned short));
+
+	if (!(sb->state & (1 << MD_SB_CLEAN))) {
+		bm->resync_pending = 1;
+		if (sb->bitmap_shift != shift || md_bitmap_read(mddev, bm)) {
+			printk(KERN_INFO "md%d: no usable bitmap, full resync\n",
+				mdidx(mddev));
+			memset(bm->map, 0xff, size);
+		}
+	}
+	sb->bitmap_shift = shift;
+
+	for (b = 0; b < bm->nblocks; b++)
+		bm->block_seq[b] = 1;
+	bm->seq_dirty = 1;
+	bm->seq_written = 0;
+
+	printk(KERN_INFO "md%d: write-intent bitmap, %lu regions of %dkB\n",
+		mdidx(mddev), bm->nregions, 1 << shift);
+	return 0;
+}
+
+static int md_bitmap_status(char *page, mddev_t *mddev)
+{
+	md_bitmap_t *bm = mddev->bitmap;
+	unsigned long r, dirty = 0;
+
+	for (r = 0; r < bm->nregions; r++)
+		if (test_bit(r, bm->map))
+			dirty++;
+	return sprintf(page, "\n      bitmap: %lu/%lu regions dirty (%dkB each)",
+			dirty, bm->nregions, 1 << bm->shift);
 }
 
 MD_DECLARE_WAIT_QUEUE_HEAD(resync_wait);
@@ -3280,6 +3789,7 @@ void md_done_sync(mddev_t *mddev, int blocks, int ok)
 
 #define SYNC_MARKS	10
 #define	SYNC_MARK_STEP	(3*HZ)
+#define	SYNC_SAMPLE_STEP	(HZ/2)
 int md_do_sync(mddev_t *mddev, mdp_disk_t *spare)
 {
 	mddev_t *mddev2;
@@ -3290,7 +3800,7 @@ int md_do_sync(mddev_t *mddev, mdp_disk_t *spare)
 	unsigned long mark_cnt[SYNC_MARKS];	
 	int last_mark,m;
 	struct md_list_head *tmp;
-	unsigned long last_check;
+	unsigned long last_check, last_sample, fg, done, ticks;
 
 
 	err = down_interruptible(&mddev->resync_sem);
@@ -3320,19 +3830,24 @@ recheck:
 
 	mddev->curr_resync = 1;
 
-	max_blocks = mddev->sb->size;
+	max_blocks = sync_max_blocks(mddev);
 
 	printk(KERN_INFO "md: syncing RAID array md%d\n", mdidx(mddev));
 	printk(KERN_INFO "md: minimum _guaranteed_ reconstruction speed: %d KB/sec/disc.\n",
 						sysctl_speed_limit_min);
-	printk(KERN_INFO "md: using maximum available idle IO bandwith (but not more than %d KB/sec) for reconstruction.\n", sysctl_speed_limit_max);
+	printk(KERN_INFO "md: using maximum available idle IO bandwith (but not more than %d KB/sec) for reconstruction.\n", md_sync_speed_max(mddev));
+	printk(KERN_INFO "md: backing off while member requests take longer than %d ms.\n", sysctl_latency_target);
 
 	/*
 	 * Resync has low priority.
 	 */
 	current->nice = 19;
 
-	is_mddev_idle(mddev); /* this also initializes IO event counters */
+	sample_mddev_io(mddev, &fg, &done, &ticks); /* initialize counters */
+	last_sample = jiffies;
+	mddev->sync_target = md_sync_speed_max(mddev);
+	mddev->sync_fg_rate = 0;
+	mddev->sync_latency = 0;
 	for (m = 0; m < SYNC_MARKS; m++) {
 		mark[m] = jiffies;
 		mark_cnt[m] = 0;
@@ -3353,6 +3868,26 @@ recheck:
 	for (j = 0; j < max_blocks;) {
 		int blocks;
 
+		/*
+		 * A resync after an unclean shutdown only has to cover
+		 * the regions marked in the bitmap.  Block 0 always goes
+		 * to the personality, which initializes itself there.
+		 */
+		if (!spare && j && mddev->bitmap) {
+			unsigned long skip;
+
+			skip = md_bitmap_clean_blocks(mddev, j, max_blocks);
+			if (skip) {
+				/* don't count skipped blocks as speed */
+				for (m = 0; m < SYNC_MARKS; m++)
+					mark_cnt[m] += skip;
+				mddev->resync_mark_cnt += skip;
+				j += skip;
+				mddev->curr_resync = j;
+				continue;
+			}
+		}
+
 		blocks = mddev->pers->sync_request(mddev, j);
 
 		if (blocks < 0) {
@@ -3393,8 +3928,8 @@ recheck:
 
 		/*
 		 * this loop exits only if either when we are slower than
-		 * the 'hard' speed limit, or the system was IO-idle for
-		 * a jiffy.
+		 * the 'hard' speed limit, or slower than the goal the
+		 * foreground I/O on the members leaves us.
 		 * the system might be non-idle CPU-wise, but we only care
 		 * about not overloading the IO subsystem. (things like an
 		 * e2fsck being done on the RAID array should execute fast)
@@ -3403,13 +3938,17 @@ repeat:
 		if (md_need_resched(current))
 			schedule();
 
+		if (jiffies - last_sample >= SYNC_SAMPLE_STEP) {
+			md_sync_adapt(mddev, jiffies - last_sample);
+			last_sample = jiffies;
+		}
+
 		currspeed = (j-mddev->resync_mark_cnt)/((jiffies-mddev->resync_mark)/HZ +1) +1;
 
 		if (currspeed > sysctl_speed_limit_min) {
 			current->nice = 19;
 
-			if ((currspeed > sysctl_speed_limit_max) ||
-					!is_mddev_idle(mddev)) {
+			if (currspeed > mddev->sync_target) {
 				current->state = TASK_INTERRUPTIBLE;
 				md_schedule_timeout(HZ/4);
 				if (!md_signal_pending(current))
@@ -3420,6 +3959,8 @@ repeat:
 	}
 	fsync_dev(read_disk);
 	printk(KERN_INFO "md: md%d: sync done.\n",mdidx(mddev));
+	if (!spare && mddev->bitmap)
+		mddev->bitmap->resync_pending = 0;
 	err = 0;
 	/*
 	 * this also signals 'finished resyncing' to md_stop
@@ -3632,6 +4173,17 @@ int md__init md_init (void)
 	if (!md_recovery_thread)
 		printk(KERN_ALERT "bug: couldn't allocate md_recovery_thread\n");
 
+	md_bitmap_thread = md_register_thread(md_bitmap_daemon, NULL,
+						"mdbitmapd");
+	if (!md_bitmap_thread)
+		printk(KERN_ALERT "bug: couldn't allocate md_bitmap_thread\n");
+	else {
+		init_timer(&md_bitmap_timer);
+		md_bitmap_timer.function = md_bitmap_tick;
+		md_bitmap_timer.expires = jiffies + MD_BITMAP_CLEAN_DELAY;
+		add_timer(&md_bitmap_timer);
+	}
+
 	md_register_reboot_notifier(&md_notifier);
 	raid_table_header = register_sysctl_table(raid_root_table, 1);
 
@@ -3830,6 +4382,10 @@ void cleanup_module (void)
 	struct gendisk **gendisk_ptr;
 
 	md_unregister_thread(md_recovery_thread);
+	if (md_bitmap_thread) {
+		del_timer_sync(&md_bitmap_timer);
+		md_unregister_thread(md_bitmap_thread);
+	}
 	devfs_unregister(devfs_handle);
 
 	devfs_unregister_blkdev(MAJOR_NR,"md");
@@ -3872,6 +4428,8 @@ MD_EXPORT_SYMBOL(md_do_sync);
 MD_EXPORT_SYMBOL(md_sync_acct);
 MD_EXPORT_SYMBOL(md_done_sync);
 MD_EXPORT_SYMBOL(md_recover_arrays);
+MD_EXPORT_SYMBOL(md_bitmap_startwrite);
+MD_EXPORT_SYMBOL(md_bitmap_endwrite);
 MD_EXPORT_SYMBOL(md_register_thread);
 MD_EXPORT_SYMBOL(md_unregister_thread);
 MD_EXPORT_SYMBOL(md_update_sb);
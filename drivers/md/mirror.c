@@ -0,0 +1,324 @@
+/*
+ * mirror.c : Multiple Devices driver for Linux
+ *
+ * Copyright (C) 1999, 2000 Ingo Molnar, Red Hat
+ *
+ * Copyright (C) 1996, 1997, 1998 Ingo Molnar, Miguel de Icaza, Gadi Oxman
+ *
+ * The buffer_head pool and the resync window of RAID-1, shared with
+ * RAID-10.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example /usr/src/linux/COPYING); if not, write to the Free
+ * Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/module.h>
+#include <linux/malloc.h>
+#include <linux/raid/mirror.h>
+
+void mirror_init_bh_pool(struct mirror_bh_pool *pool, md_wait_queue_head_t *wait)
+{
+	pool->lock = MD_SPIN_LOCK_UNLOCKED;
+	pool->freebh = NULL;
+	pool->freebh_cnt = 0;
+	pool->wait = wait;
+}
+
+struct buffer_head *mirror_alloc_bh(struct mirror_bh_pool *pool, int cnt)
+{
+	/* return a linked list of "cnt" struct buffer_heads.
+	 * don't take any off the free list unless we know we can
+	 * get all we need, otherwise we could deadlock
+	 */
+	struct buffer_head *bh=NULL;
+
+	while(cnt) {
+		struct buffer_head *t;
+		md_spin_lock_irq(&pool->lock);
+		if (pool->freebh_cnt >= cnt)
+			while (cnt) {
+				t = pool->freebh;
+				pool->freebh = t->b_next;
+				t->b_next = bh;
+				bh = t;
+				t->b_state = 0;
+				pool->freebh_cnt--;
+				cnt--;
+			}
+		md_spin_unlock_irq(&pool->lock);
+		if (cnt == 0)
+			break;
+		t = (struct buffer_head *)kmalloc(sizeof(struct buffer_head), GFP_BUFFER);
+		if (t) {
+			memset(t, 0, sizeof(*t));
+			t->b_next = bh;
+			bh = t;
+			cnt--;
+		} else
+			wait_event(*pool->wait, pool->freebh_cnt >= cnt);
+	}
+	return bh;
+}
+
+void mirror_free_bh(struct mirror_bh_pool *pool, struct buffer_head *bh)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&pool->lock, flags);
+	while (bh) {
+		struct buffer_head *t = bh;
+		bh=bh->b_next;
+		if (t->b_pprev == NULL)
+			kfree(t);
+		else {
+			t->b_next= pool->freebh;
+			pool->freebh = t;
+			pool->freebh_cnt++;
+		}
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+	wake_up(pool->wait);
+}
+
+int mirror_grow_bh(struct mirror_bh_pool *pool, int cnt)
+{
+	/* allocate cnt buffer_heads, possibly less if kalloc fails */
+	int i = 0;
+
+	while (i < cnt) {
+		struct buffer_head *bh;
+		bh = kmalloc(sizeof(*bh), GFP_KERNEL);
+		if (!bh) break;
+		memset(bh, 0, sizeof(*bh));
+
+		md_spin_lock_irq(&pool->lock);
+		bh->b_pprev = &pool->freebh;
+		bh->b_next = pool->freebh;
+		pool->freebh = bh;
+		pool->freebh_cnt++;
+		md_spin_unlock_irq(&pool->lock);
+
+		i++;
+	}
+	return i;
+}
+
+int mirror_shrink_bh(struct mirror_bh_pool *pool, int cnt)
+{
+	/* discard cnt buffer_heads, if we can find them */
+	int i = 0;
+
+	md_spin_lock_irq(&pool->lock);
+	while ((i < cnt) && pool->freebh) {
+		struct buffer_head *bh = pool->freebh;
+		pool->freebh = bh->b_next;
+		kfree(bh);
+		i++;
+		pool->freebh_cnt--;
+	}
+	md_spin_unlock_irq(&pool->lock);
+	return i;
+}
+
+/*
+ * The resync window.
+ *
+ * We need to make sure that no normal I/O request - particularly write
+ * requests - conflict with active sync requests.
+ * This is achieved by conceptually dividing the device space into a
+ * number of sections:
+ *  DONE: 0 .. a-1     These blocks are in-sync
+ *  ACTIVE: a.. b-1    These blocks may have active sync requests, but
+ *                     no normal IO requests
+ *  READY: b .. c-1    These blocks have no normal IO requests - sync
+ *                     request may be happening
+ *  PENDING: c .. d-1  These blocks may have IO requests, but no new
+ *                     ones will be added
+ *  FUTURE:  d .. end  These blocks are not to be considered yet. IO may
+ *                     be happening, but not sync
+ *
+ * We keep a
+ *   phase    which flips (0 or 1) each time d moves and
+ * a count of:
+ *   z =  active io requests in FUTURE since d moved - marked with
+ *        current phase
+ *   y =  active io requests in FUTURE before d moved, or PENDING -
+ *        marked with previous phase
+ *   x =  active sync requests in READY
+ *   w =  active sync requests in ACTIVE
+ *   v =  active io requests in DONE
+ *
+ * Normally, a=b=c=d=0 and z= active io requests
+ *   or a=b=c=d=END and v= active io requests
+ * Allowed changes to a,b,c,d:
+ * A:  c==d &&  y==0 -> d+=window, y=z, z=0, phase=!phase
+ * B:  y==0 -> c=d
+ * C:   b=c, w+=x, x=0
+ * D:  w==0 -> a=b
+ * E: a==b==c==d==end -> a=b=c=d=0, z=v, v=0
+ *
+ * At start of sync we apply A.
+ * When y reaches 0, we apply B then A then being sync requests
+ * When sync point reaches c-1, we wait for y==0, and W==0, and
+ * then apply apply B then A then D then C.
+ * Finally, we apply E
+ */
+
+void mirror_init_window(struct mirror_window *w)
+{
+	memset(w, 0, sizeof(*w));
+	w->segment_lock = MD_SPIN_LOCK_UNLOCKED;
+	init_waitqueue_head(&w->wait_done);
+	init_waitqueue_head(&w->wait_ready);
+}
+
+/*
+ * A normal request for 'sector' is starting.  Waits until the sector is
+ * out of the way of the sync, and returns the phase to mark the request
+ * with.
+ */
+int mirror_io_start(struct mirror_window *w, unsigned long sector)
+{
+	int phase = 0;
+
+	spin_lock_irq(&w->segment_lock);
+	wait_event_lock_irq(w->wait_done,
+			sector < w->start_active ||
+			sector >= w->start_future,
+			w->segment_lock);
+	if (sector < w->start_active)
+		w->cnt_done++;
+	else {
+		w->cnt_future++;
+		phase = w->phase;
+	}
+	spin_unlock_irq(&w->segment_lock);
+	return phase;
+}
+
+void mirror_io_done(struct mirror_window *w, unsigned long sector, int phase)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&w->segment_lock, flags);
+	if (sector < w->start_active)
+		w->cnt_done--;
+	else if (sector >= w->start_future && w->phase == phase)
+		w->cnt_future--;
+	else if (!--w->cnt_pending)
+		wake_up(&w->wait_ready);
+
+	spin_unlock_irqrestore(&w->segment_lock, flags);
+}
+
+/*
+ * A sync is starting at sector 0, with buffers for twice 'window'
+ * sectors.  The caller allocates them beforehand: we must not sleep
+ * for memory with the segment lock held.
+ */
+void mirror_sync_begin(struct mirror_window *w, int window)
+{
+	spin_lock_irq(&w->segment_lock);
+	w->start_active = 0;
+	w->start_ready = 0;
+	w->start_pending = 0;
+	w->start_future = 0;
+	w->phase = 0;
+	w->window = window;
+	w->cnt_future += w->cnt_done+w->cnt_pending;
+	w->cnt_done = w->cnt_pending = 0;
+	if (w->cnt_ready || w->cnt_active)
+		MD_BUG();
+	spin_unlock_irq(&w->segment_lock);
+}
+
+/*
+ * A sync request for 'sector' is starting: move the window along
+ * until the sector is in READY.
+ */
+void mirror_sync_start(struct mirror_window *w, unsigned long sector)
+{
+	spin_lock_irq(&w->segment_lock);
+	while (sector >= w->start_pending) {
+		wait_event_lock_irq(w->wait_done,
+					!w->cnt_active,
+					w->segment_lock);
+		wait_event_lock_irq(w->wait_ready,
+					!w->cnt_pending,
+					w->segment_lock);
+		w->start_active = w->start_ready;
+		w->start_ready = w->start_pending;
+		w->start_pending = w->start_future;
+		w->start_future = w->start_future+w->window;
+		// Note: falling off the end is not a problem
+		w->phase = w->phase ^1;
+		w->cnt_active = w->cnt_ready;
+		w->cnt_ready = 0;
+		w->cnt_pending = w->cnt_future;
+		w->cnt_future = 0;
+		wake_up(&w->wait_done);
+	}
+	w->cnt_ready++;
+	spin_unlock_irq(&w->segment_lock);
+}
+
+void mirror_sync_done(struct mirror_window *w, unsigned long sector)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&w->segment_lock, flags);
+	if (sector >= w->start_ready)
+		--w->cnt_ready;
+	else if (sector >= w->start_active) {
+		if (!--w->cnt_active) {
+			w->start_active = w->start_ready;
+			wake_up(&w->wait_done);
+		}
+	}
+	spin_unlock_irqrestore(&w->segment_lock, flags);
+}
+
+/*
+ * The sync is over, at or before 'end'.  This sleeps, so the caller
+ * must not hold any spinlock.
+ */
+void mirror_close_sync(struct mirror_window *w, unsigned long end)
+{
+	/* If reconstruction was interrupted, we need to close the "active" and "pending"
+	 * holes.
+	 * we know that there are no active rebuild requests, os cnt_active == cnt_ready ==0
+	 */
+	/* this is really needed when recovery stops too... */
+	spin_lock_irq(&w->segment_lock);
+	w->start_active = w->start_pending;
+	w->start_ready = w->start_pending;
+	wait_event_lock_irq(w->wait_ready, !w->cnt_pending, w->segment_lock);
+	w->start_active =w->start_ready = w->start_pending = w->start_future;
+	w->start_future = end;
+	w->cnt_pending = w->cnt_future;
+	w->cnt_future = 0;
+	w->phase = w->phase ^1;
+	wait_event_lock_irq(w->wait_ready, !w->cnt_pending, w->segment_lock);
+	w->start_active = w->start_ready = w->start_pending = w->start_future = 0;
+	w->phase = 0;
+	w->cnt_future = w->cnt_done;
+	w->cnt_done = 0;
+	spin_unlock_irq(&w->segment_lock);
+	wake_up(&w->wait_done);
+}
+
+MD_EXPORT_SYMBOL(mirror_init_bh_pool);
+MD_EXPORT_SYMBOL(mirror_alloc_bh);
+MD_EXPORT_SYMBOL(mirror_free_bh);
+MD_EXPORT_SYMBOL(mirror_grow_bh);
+MD_EXPORT_SYMBOL(mirror_shrink_bh);
+MD_EXPORT_SYMBOL(mirror_init_window);
+MD_EXPORT_SYMBOL(mirror_io_start);
+MD_EXPORT_SYMBOL(mirror_io_done);
+MD_EXPORT_SYMBOL(mirror_sync_begin);
+MD_EXPORT_SYMBOL(mirror_sync_start);
+MD_EXPORT_SYMBOL(mirror_sync_done);
+MD_EXPORT_SYMBOL(mirror_close_sync);
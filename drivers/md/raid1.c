@@ -51,104 +51,6 @@ static mdk_personality_t raid1_personality;
 static md_spinlock_t retry_list_lock = MD_SPIN_LOCK_UNLOCKED;
 struct raid1_bh *raid1_retry_list = NULL, **raid1_retry_tail;
 
-static struct buffer_head *raid1_alloc_bh(raid1_conf_t *conf, int cnt)
-{
-	/* return a linked list of "cnt" struct buffer_heads.
-	 * don't take any off the free list unless we know we can
-	 * get all we need, otherwise we could deadlock
-	 */
-	struct buffer_head *bh=NULL;
-
-	while(cnt) {
-		struct buffer_head *t;
-		md_spin_lock_irq(&conf->device_lock);
-		if (conf->freebh_cnt >= cnt)
-			while (cnt) {
-				t = conf->freebh;
-				conf->freebh = t->b_next;
-				t->b_next = bh;
-				bh = t;
-				t->b_state = 0;
-				conf->freebh_cnt--;
-				cnt--;
-			}
-		md_spin_unlock_irq(&conf->device_lock);
-		if (cnt == 0)
-			break;
-		t = (struct buffer_head *)kmalloc(sizeof(struct buffer_head), GFP_BUFFER);
-		if (t) {
-			memset(t, 0, sizeof(*t));
-			t->b_next = bh;
-			bh = t;
-			cnt--;
-		} else {
-			PRINTK("waiting for %d bh\n", cnt);
-			wait_event(conf->wait_buffer, conf->freebh_cnt >= cnt);
-		}
-	}
-	return bh;
-}
-
-static inline void raid1_free_bh(raid1_conf_t *conf, struct buffer_head *bh)
-{
-	unsigned long flags;
-	spin_lock_irqsave(&conf->device_lock, flags);
-	while (bh) {
-		struct buffer_head *t = bh;
-		bh=bh->b_next;
-		if (t->b_pprev == NULL)
-			kfree(t);
-		else {
-			t->b_next= conf->freebh;
-			conf->freebh = t;
-			conf->freebh_cnt++;
-		}
-	}
-	spin_unlock_irqrestore(&conf->device_lock, flags);
-	wake_up(&conf->wait_buffer);
-}
-
-static int raid1_grow_bh(raid1_conf_t *conf, int cnt)
-{
-	/* allocate cnt buffer_heads, possibly less if kalloc fails */
-	int i = 0;
-
-	while (i < cnt) {
-		struct buffer_head *bh;
-		bh = kmalloc(sizeof(*bh), GFP_KERNEL);
-		if (!bh) break;
-		memset(bh, 0, sizeof(*bh));
-
-		md_spin_lock_irq(&conf->device_lock);
-		bh->b_pprev = &conf->freebh;
-		bh->b_next = conf->freebh;
-		conf->freebh = bh;
-		conf->freebh_cnt++;
-		md_spin_unlock_irq(&conf->device_lock);
-
-		i++;
-	}
-	return i;
-}
-
-static int raid1_shrink_bh(raid1_conf_t *conf, int cnt)
-{
-	/* discard cnt buffer_heads, if we can find them */
-	int i = 0;
-
-	md_spin_lock_irq(&conf->device_lock);
-	while ((i < cnt) && conf->freebh) {
-		struct buffer_head *bh = conf->freebh;
-		conf->freebh = bh->b_next;
-		kfree(bh);
-		i++;
-		conf->freebh_cnt--;
-	}
-	md_spin_unlock_irq(&conf->device_lock);
-	return i;
-}
-		
-
 static struct raid1_bh *raid1_alloc_r1bh(raid1_conf_t *conf)
 {
 	struct raid1_bh *r1_bh = NULL;
@@ -191,7 +93,7 @@ static inline void raid1_free_r1bh(struct raid1_bh *r1_bh)
 	} else {
 		kfree(r1_bh);
 	}
-	raid1_free_bh(conf, bh);
+	mirror_free_bh(&conf->pool, bh);
 }
 
 static int raid1_grow_r1bh (raid1_conf_t *conf, int cnt)
@@ -240,7 +142,7 @@ static inline void raid1_free_buf(struct raid1_bh *r1_bh)
 	r1_bh->next_r1 = conf->freebuf;
 	conf->freebuf = r1_bh;
 	spin_unlock_irqrestore(&conf->device_lock, flags);
-	raid1_free_bh(conf, bh);
+	mirror_free_bh(&conf->pool, bh);
 }
 
 static struct raid1_bh *raid1_alloc_buf(raid1_conf_t *conf)
@@ -261,7 +163,6 @@ static int raid1_grow_buffers (raid1_conf_t *conf, int cnt)
 {
 	int i = 0;
 
-	md_spin_lock_irq(&conf->device_lock);
 	while (i < cnt) {
 		struct raid1_bh *r1_bh;
 		struct page *page;
@@ -278,11 +179,13 @@ static int raid1_grow_buffers (raid1_conf_t *conf, int cnt)
 		memset(r1_bh, 0, sizeof(*r1_bh));
 		r1_bh->bh_req.b_page = page;
 		r1_bh->bh_req.b_data = page_address(page);
+
+		md_spin_lock_irq(&conf->device_lock);
 		r1_bh->next_r1 = conf->freebuf;
 		conf->freebuf = r1_bh;
+		md_spin_unlock_irq(&conf->device_lock);
 		i++;
 	}
-	md_spin_unlock_irq(&conf->device_lock);
 	return i;
 }
 
@@ -336,35 +239,6 @@ static void raid1_reschedule_retry (struct raid1_bh *r1_bh)
 }
 
 
-static void inline io_request_done(unsigned long sector, raid1_conf_t *conf, int phase)
-{
-	unsigned long flags;
-	spin_lock_irqsave(&conf->segment_lock, flags);
-	if (sector < conf->start_active)
-		conf->cnt_done--;
-	else if (sector >= conf->start_future && conf->phase == phase)
-		conf->cnt_future--;
-	else if (!--conf->cnt_pending)
-		wake_up(&conf->wait_ready);
-
-	spin_unlock_irqrestore(&conf->segment_lock, flags);
-}
-
-static void inline sync_request_done (unsigned long sector, raid1_conf_t *conf)
-{
-	unsigned long flags;
-	spin_lock_irqsave(&conf->segment_lock, flags);
-	if (sector >= conf->start_ready)
-		--conf->cnt_ready;
-	else if (sector >= conf->start_active) {
-		if (!--conf->cnt_active) {
-			conf->start_active = conf->start_ready;
-			wake_up(&conf->wait_done);
-		}
-	}
-	spin_unlock_irqrestore(&conf->segment_lock, flags);
-}
-
 /*
  * raid1_end_bh_io() is called when we have finished servicing a mirrored
  * operation and are ready to return a success/failure code to the buffer
@@ -374,8 +248,10 @@ static void raid1_end_bh_io (struct raid1_bh *r1_bh, int uptodate)
 {
 	struct buffer_head *bh = r1_bh->master_bh;
 
-	io_request_done(bh->b_rsector, mddev_to_conf(r1_bh->mddev),
+	mirror_io_done(&mddev_to_conf(r1_bh->mddev)->sync_window, bh->b_rsector,
 			test_bit(R1BH_SyncPhase, &r1_bh->state));
+	if (r1_bh->cmd == WRITE)
+		md_bitmap_endwrite(r1_bh->mddev, bh->b_rsector, bh->b_size >> 9);
 
 	bh->b_end_io(bh, uptodate);
 	raid1_free_r1bh(r1_bh);
@@ -567,21 +443,17 @@ static int raid1_make_request (mddev_t *mddev, int rw,
 	if (rw == READA)
 		rw = READ;
 
+	/*
+	 * get the region into the write-intent bitmap before
+	 * anything reaches the mirrors
+	 */
+	if (rw == WRITE)
+		md_bitmap_startwrite(mddev, bh->b_rsector, bh->b_size >> 9);
+
 	r1_bh = raid1_alloc_r1bh (conf);
 
-	spin_lock_irq(&conf->segment_lock);
-	wait_event_lock_irq(conf->wait_done,
-			bh->b_rsector < conf->start_active ||
-			bh->b_rsector >= conf->start_future,
-			conf->segment_lock);
-	if (bh->b_rsector < conf->start_active) 
-		conf->cnt_done++;
-	else {
-		conf->cnt_future++;
-		if (conf->phase)
-			set_bit(R1BH_SyncPhase, &r1_bh->state);
-	}
-	spin_unlock_irq(&conf->segment_lock);
+	if (mirror_io_start(&conf->sync_window, bh->b_rsector))
+		set_bit(R1BH_SyncPhase, &r1_bh->state);
 	
 	/*
 	 * i think the read and write branch should be separated completely,
@@ -616,7 +488,7 @@ static int raid1_make_request (mddev_t *mddev, int rw,
 	 * WRITE:
 	 */
 
-	bhl = raid1_alloc_bh(conf, conf->raid_disks);
+	bhl = mirror_alloc_bh(&conf->pool, conf->raid_disks);
 	for (i = 0; i < disks; i++) {
 		struct buffer_head *mbh;
 		if (!conf->mirrors[i].operational) 
@@ -665,7 +537,7 @@ static int raid1_make_request (mddev_t *mddev, int rw,
 		r1_bh->mirror_bh_list = mbh;
 		sum_bhs++;
 	}
-	if (bhl) raid1_free_bh(conf,bhl);
+	if (bhl) mirror_free_bh(&conf->pool, bhl);
 	md_atomic_set(&r1_bh->remaining, sum_bhs);
 
 	/*
@@ -798,32 +670,6 @@ static void print_raid1_conf (raid1_conf_t *conf)
 	}
 }
 
-static void close_sync(raid1_conf_t *conf)
-{
-	mddev_t *mddev = conf->mddev;
-	/* If reconstruction was interrupted, we need to close the "active" and "pending"
-	 * holes.
-	 * we know that there are no active rebuild requests, os cnt_active == cnt_ready ==0
-	 */
-	/* this is really needed when recovery stops too... */
-	spin_lock_irq(&conf->segment_lock);
-	conf->start_active = conf->start_pending;
-	conf->start_ready = conf->start_pending;
-	wait_event_lock_irq(conf->wait_ready, !conf->cnt_pending, conf->segment_lock);
-	conf->start_active =conf->start_ready = conf->start_pending = conf->start_future;
-	conf->start_future = mddev->sb->size+1;
-	conf->cnt_pending = conf->cnt_future;
-	conf->cnt_future = 0;
-	conf->phase = conf->phase ^1;
-	wait_event_lock_irq(conf->wait_ready, !conf->cnt_pending, conf->segment_lock);
-	conf->start_active = conf->start_ready = conf->start_pending = conf->start_future = 0;
-	conf->phase = 0;
-	conf->cnt_future = conf->cnt_done;;
-	conf->cnt_done = 0;
-	spin_unlock_irq(&conf->segment_lock);
-	wake_up(&conf->wait_done);
-}
-
 static int raid1_diskop(mddev_t *mddev, mdp_disk_t **d, int state)
 {
 	int err = 0;
@@ -834,6 +680,12 @@ static int raid1_diskop(mddev_t *mddev, mdp_disk_t **d, int state)
 	mdp_disk_t *failed_desc, *spare_desc, *added_desc;
 
 	print_raid1_conf(conf);
+	/*
+	 * The spare is done syncing, one way or the other.  This
+	 * sleeps, so do it before taking the device lock.
+	 */
+	if (state == DISKOP_SPARE_ACTIVE || state == DISKOP_SPARE_INACTIVE)
+		mirror_close_sync(&conf->sync_window, mddev->sb->size+1);
 	md_spin_lock_irq(&conf->device_lock);
 	/*
 	 * find the disk ...
@@ -936,7 +788,6 @@ static int raid1_diskop(mddev_t *mddev, mdp_disk_t **d, int state)
 	 * Deactivate a spare disk:
 	 */
 	case DISKOP_SPARE_INACTIVE:
-		close_sync(conf);
 		sdisk = conf->mirrors + spare_disk;
 		sdisk->operational = 0;
 		sdisk->write_only = 0;
@@ -949,7 +800,6 @@ static int raid1_diskop(mddev_t *mddev, mdp_disk_t **d, int state)
 	 * property)
 	 */
 	case DISKOP_SPARE_ACTIVE:
-		close_sync(conf);
 		sdisk = conf->mirrors + spare_disk;
 		fdisk = conf->mirrors + failed_disk;
 
@@ -1130,7 +980,7 @@ static void raid1d (void *data)
 				int sectors = bh->b_size >> 9;
 				
 				conf = mddev_to_conf(mddev);
-				bhl = raid1_alloc_bh(conf, conf->raid_disks); /* don't really need this many */
+				bhl = mirror_alloc_bh(&conf->pool, conf->raid_disks); /* don't really need this many */
 				for (i = 0; i < disks ; i++) {
 					if (!conf->mirrors[i].operational)
 						continue;
@@ -1174,7 +1024,7 @@ static void raid1d (void *data)
 					sum_bhs++;
 				}
 				md_atomic_set(&r1_bh->remaining, sum_bhs);
-				if (bhl) raid1_free_bh(conf, bhl);
+				if (bhl) mirror_free_bh(&conf->pool, bhl);
 				mbh = r1_bh->mirror_bh_list;
 				while (mbh) {
 					struct buffer_head *bh1 = mbh;
@@ -1240,7 +1090,7 @@ static void raid1syncd (void *data)
 		conf->resync_mirrors = 0;
 	}
 
-	close_sync(conf);
+	mirror_close_sync(&conf->sync_window, mddev->sb->size+1);
 
 	up(&mddev->recovery_sem);
 	raid1_shrink_buffers(conf);
@@ -1249,45 +1099,9 @@ static void raid1syncd (void *data)
 /*
  * perform a "sync" on one "block"
  *
- * We need to make sure that no normal I/O request - particularly write
- * requests - conflict with active sync requests.
- * This is achieved by conceptually dividing the device space into a
- * number of sections:
- *  DONE: 0 .. a-1     These blocks are in-sync
- *  ACTIVE: a.. b-1    These blocks may have active sync requests, but
- *                     no normal IO requests
- *  READY: b .. c-1    These blocks have no normal IO requests - sync
- *                     request may be happening
- *  PENDING: c .. d-1  These blocks may have IO requests, but no new
- *                     ones will be added
- *  FUTURE:  d .. end  These blocks are not to be considered yet. IO may
- *                     be happening, but not sync
- *
- * We keep a
- *   phase    which flips (0 or 1) each time d moves and
- * a count of:
- *   z =  active io requests in FUTURE since d moved - marked with
- *        current phase
- *   y =  active io requests in FUTURE before d moved, or PENDING -
- *        marked with previous phase
- *   x =  active sync requests in READY
- *   w =  active sync requests in ACTIVE
- *   v =  active io requests in DONE
- *
- * Normally, a=b=c=d=0 and z= active io requests
- *   or a=b=c=d=END and v= active io requests
- * Allowed changes to a,b,c,d:
- * A:  c==d &&  y==0 -> d+=window, y=z, z=0, phase=!phase
- * B:  y==0 -> c=d
- * C:   b=c, w+=x, x=0
- * D:  w==0 -> a=b
- * E: a==b==c==d==end -> a=b=c=d=0, z=v, v=0
- *
- * At start of sync we apply A.
- * When y reaches 0, we apply B then A then being sync requests
- * When sync point reaches c-1, we wait for y==0, and W==0, and
- * then apply apply B then A then D then C.
- * Finally, we apply E
+ * The window that keeps normal I/O requests - particularly writes -
+ * away from the blocks with active sync requests is described in
+ * mirror.c.
  *
  * The sync request simply issues a "read" against a working drive
  * This is marked so that on completion the raid1d thread is woken to
@@ -1303,51 +1117,17 @@ static int raid1_sync_request (mddev_t *mddev, unsigned long block_nr)
 	int bsize;
 	int disk;
 
-	spin_lock_irq(&conf->segment_lock);
 	if (!block_nr) {
 		/* initialize ...*/
 		int buffs;
-		conf->start_active = 0;
-		conf->start_ready = 0;
-		conf->start_pending = 0;
-		conf->start_future = 0;
-		conf->phase = 0;
 		/* we want enough buffers to hold twice the window of 128*/
 		buffs = 128 *2 / (PAGE_SIZE>>9);
 		buffs = raid1_grow_buffers(conf, buffs);
 		if (buffs < 2)
 			goto nomem;
-		
-		conf->window = buffs*(PAGE_SIZE>>9)/2;
-		conf->cnt_future += conf->cnt_done+conf->cnt_pending;
-		conf->cnt_done = conf->cnt_pending = 0;
-		if (conf->cnt_ready || conf->cnt_active)
-			MD_BUG();
-	}
-	while ((block_nr<<1) >= conf->start_pending) {
-		PRINTK("wait .. sect=%lu start_active=%d ready=%d pending=%d future=%d, cnt_done=%d active=%d ready=%d pending=%d future=%d\n",
-			block_nr<<1, conf->start_active, conf->start_ready, conf->start_pending, conf->start_future,
-			conf->cnt_done, conf->cnt_active, conf->cnt_ready, conf->cnt_pending, conf->cnt_future);
-		wait_event_lock_irq(conf->wait_done,
-					!conf->cnt_active,
-					conf->segment_lock);
-		wait_event_lock_irq(conf->wait_ready,
-					!conf->cnt_pending,
-					conf->segment_lock);
-		conf->start_active = conf->start_ready;
-		conf->start_ready = conf->start_pending;
-		conf->start_pending = conf->start_future;
-		conf->start_future = conf->start_future+conf->window;
-		// Note: falling off the end is not a problem
-		conf->phase = conf->phase ^1;
-		conf->cnt_active = conf->cnt_ready;
-		conf->cnt_ready = 0;
-		conf->cnt_pending = conf->cnt_future;
-		conf->cnt_future = 0;
-		wake_up(&conf->wait_done);
+		mirror_sync_begin(&conf->sync_window, buffs*(PAGE_SIZE>>9)/2);
 	}
-	conf->cnt_ready++;
-	spin_unlock_irq(&conf->segment_lock);
+	mirror_sync_start(&conf->sync_window, block_nr<<1);
 		
 
 	/* If reconstructing, and >1 working disc,
@@ -1402,7 +1182,6 @@ static int raid1_sync_request (mddev_t *mddev, unsigned long block_nr)
 
 nomem:
 	raid1_shrink_buffers(conf);
-	spin_unlock_irq(&conf->segment_lock);
 	return -ENOMEM;
 }
 
@@ -1432,7 +1211,7 @@ static void end_sync_write(struct buffer_head *bh, int uptodate)
  		unsigned long sect = bh->b_blocknr * (bh->b_size>>9);
 		int size = bh->b_size;
 		raid1_free_buf(r1_bh);
-		sync_request_done(sect, mddev_to_conf(mddev));
+		mirror_sync_done(&mddev_to_conf(mddev)->sync_window, sect);
 		md_done_sync(mddev,size>>10, uptodate);
 	}
 }
@@ -1654,10 +1433,9 @@ static int raid1_run (mddev_t *mddev)
 	conf->mddev = mddev;
 	conf->device_lock = MD_SPIN_LOCK_UNLOCKED;
 
-	conf->segment_lock = MD_SPIN_LOCK_UNLOCKED;
 	init_waitqueue_head(&conf->wait_buffer);
-	init_waitqueue_head(&conf->wait_done);
-	init_waitqueue_head(&conf->wait_ready);
+	mirror_init_bh_pool(&conf->pool, &conf->wait_buffer);
+	mirror_init_window(&conf->sync_window);
 
 	if (!conf->working_disks) {
 		printk(NONE_OPERATIONAL, mdidx(mddev));
@@ -1674,7 +1452,7 @@ static int raid1_run (mddev_t *mddev)
 	 * even if kmalloc starts failing
 	 */
 	if (raid1_grow_r1bh(conf, 16) < 16 ||
-	    raid1_grow_bh(conf, 16*conf->raid_disks)< 16*conf->raid_disks) {
+	    mirror_grow_bh(&conf->pool, 16*conf->raid_disks)< 16*conf->raid_disks) {
 		printk(MEM_ERROR, mdidx(mddev));
 		goto out_free_conf;
 	}
@@ -1776,7 +1554,7 @@ static int raid1_run (mddev_t *mddev)
 
 out_free_conf:
 	raid1_shrink_r1bh(conf);
-	raid1_shrink_bh(conf, conf->freebh_cnt);
+	mirror_shrink_bh(&conf->pool, conf->pool.freebh_cnt);
 	raid1_shrink_buffers(conf);
 	kfree(conf);
 	mddev->private = NULL;
@@ -1838,7 +1616,7 @@ static int raid1_stop (mddev_t *mddev)
 	if (conf->resync_thread)
 		md_unregister_thread(conf->resync_thread);
 	raid1_shrink_r1bh(conf);
-	raid1_shrink_bh(conf, conf->freebh_cnt);
+	mirror_shrink_bh(&conf->pool, conf->pool.freebh_cnt);
 	raid1_shrink_buffers(conf);
 	kfree(conf);
 	mddev->private = NULL;
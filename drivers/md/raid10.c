@@ -0,0 +1,1584 @@
+/*
+ * raid10.c : Multiple Devices driver for Linux
+ *
+ * RAID-10 management functions: striping over mirrored copies in a
+ * single personality, with 'near' and 'far' copy layouts.
+ *
+ * The buffer_head pool and the resync window are shared with raid1,
+ * see mirror.c.  The disk management follows raid1.c; the block
+ * mapping, read balancing and sync walking are new.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example /usr/src/linux/COPYING); if not, write to the Free
+ * Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/module.h>
+#include <linux/malloc.h>
+#include <linux/raid/raid10.h>
+#include <asm/atomic.h>
+
+#define MAJOR_NR MD_MAJOR
+#define MD_DRIVER
+#define MD_PERSONALITY
+
+/*
+ * The following can be used to debug the driver
+ */
+#define RAID10_DEBUG	0
+
+#if RAID10_DEBUG
+#define PRINTK(x...)   printk(x)
+#define inline
+#define __inline__
+#else
+#define PRINTK(x...)  do { } while (0)
+#endif
+
+
+static mdk_personality_t raid10_personality;
+static md_spinlock_t retry_list_lock = MD_SPIN_LOCK_UNLOCKED;
+struct raid10_bh *raid10_retry_list = NULL, **raid10_retry_tail;
+
+static struct raid10_bh *raid10_alloc_r10bh(raid10_conf_t *conf)
+{
+	struct raid10_bh *r10_bh = NULL;
+
+	do {
+		md_spin_lock_irq(&conf->device_lock);
+		if (conf->freer10) {
+			r10_bh = conf->freer10;
+			conf->freer10 = r10_bh->next_r10;
+			r10_bh->next_r10 = NULL;
+			r10_bh->state = 0;
+			r10_bh->tried = 0;
+			r10_bh->bh_req.b_state = 0;
+		}
+		md_spin_unlock_irq(&conf->device_lock);
+		if (r10_bh)
+			return r10_bh;
+		r10_bh = (struct raid10_bh *) kmalloc(sizeof(struct raid10_bh),
+					GFP_BUFFER);
+		if (r10_bh) {
+			memset(r10_bh, 0, sizeof(*r10_bh));
+			return r10_bh;
+		}
+		wait_event(conf->wait_buffer, conf->freer10);
+	} while (1);
+}
+
+static inline void raid10_free_r10bh(struct raid10_bh *r10_bh)
+{
+	struct buffer_head *bh = r10_bh->mirror_bh_list;
+	raid10_conf_t *conf = mddev_to_conf(r10_bh->mddev);
+
+	r10_bh->mirror_bh_list = NULL;
+
+	if (test_bit(R10BH_PreAlloc, &r10_bh->state)) {
+		unsigned long flags;
+		spin_lock_irqsave(&conf->device_lock, flags);
+		r10_bh->next_r10 = conf->freer10;
+		conf->freer10 = r10_bh;
+		spin_unlock_irqrestore(&conf->device_lock, flags);
+	} else {
+		kfree(r10_bh);
+	}
+	mirror_free_bh(&conf->pool, bh);
+}
+
+static int raid10_grow_r10bh (raid10_conf_t *conf, int cnt)
+{
+	int i = 0;
+
+	while (i < cnt) {
+		struct raid10_bh *r10_bh;
+		r10_bh = (struct raid10_bh*)kmalloc(sizeof(*r10_bh), GFP_KERNEL);
+		if (!r10_bh)
+			break;
+		memset(r10_bh, 0, sizeof(*r10_bh));
+
+		md_spin_lock_irq(&conf->device_lock);
+		set_bit(R10BH_PreAlloc, &r10_bh->state);
+		r10_bh->next_r10 = conf->freer10;
+		conf->freer10 = r10_bh;
+		md_spin_unlock_irq(&conf->device_lock);
+
+		i++;
+	}
+	return i;
+}
+
+static void raid10_shrink_r10bh(raid10_conf_t *conf)
+{
+	md_spin_lock_irq(&conf->device_lock);
+	while (conf->freer10) {
+		struct raid10_bh *r10_bh = conf->freer10;
+		conf->freer10 = r10_bh->next_r10;
+		kfree(r10_bh);
+	}
+	md_spin_unlock_irq(&conf->device_lock);
+}
+
+
+
+static inline void raid10_free_buf(struct raid10_bh *r10_bh)
+{
+	unsigned long flags;
+	struct buffer_head *bh = r10_bh->mirror_bh_list;
+	raid10_conf_t *conf = mddev_to_conf(r10_bh->mddev);
+	r10_bh->mirror_bh_list = NULL;
+
+	spin_lock_irqsave(&conf->device_lock, flags);
+	r10_bh->next_r10 = conf->freebuf;
+	conf->freebuf = r10_bh;
+	spin_unlock_irqrestore(&conf->device_lock, flags);
+	mirror_free_bh(&conf->pool, bh);
+}
+
+static struct raid10_bh *raid10_alloc_buf(raid10_conf_t *conf)
+{
+	struct raid10_bh *r10_bh;
+
+	md_spin_lock_irq(&conf->device_lock);
+	wait_event_lock_irq(conf->wait_buffer, conf->freebuf, conf->device_lock);
+	r10_bh = conf->freebuf;
+	conf->freebuf = r10_bh->next_r10;
+	r10_bh->next_r10= NULL;
+	r10_bh->state = 0;
+	r10_bh->tried = 0;
+	md_spin_unlock_irq(&conf->device_lock);
+
+	return r10_bh;
+}
+
+static int raid10_grow_buffers (raid10_conf_t *conf, int cnt)
+{
+	int i = 0;
+
+	while (i < cnt) {
+		struct raid10_bh *r10_bh;
+		struct page *page;
+
+		page = alloc_page(GFP_KERNEL);
+		if (!page)
+			break;
+
+		r10_bh = (struct raid10_bh *) kmalloc(sizeof(*r10_bh), GFP_KERNEL);
+		if (!r10_bh) {
+			__free_page(page);
+			break;
+		}
+		memset(r10_bh, 0, sizeof(*r10_bh));
+		r10_bh->bh_req.b_page = page;
+		r10_bh->bh_req.b_data = page_address(page);
+
+		md_spin_lock_irq(&conf->device_lock);
+		r10_bh->next_r10 = conf->freebuf;
+		conf->freebuf = r10_bh;
+		md_spin_unlock_irq(&conf->device_lock);
+		i++;
+	}
+	return i;
+}
+
+static void raid10_shrink_buffers (raid10_conf_t *conf)
+{
+	md_spin_lock_irq(&conf->device_lock);
+	while (conf->freebuf) {
+		struct raid10_bh *r10_bh = conf->freebuf;
+		conf->freebuf = r10_bh->next_r10;
+		__free_page(r10_bh->bh_req.b_page);
+		kfree(r10_bh);
+	}
+	md_spin_unlock_irq(&conf->device_lock);
+}
+
+/*
+ * Map an array sector to its copies, in devs[0..copies-1].
+ *
+ * The array is cut into chunks, and chunk 'c' is laid out as if it
+ * were chunks c*near .. c*near+near-1 of a raid0 over all the disks:
+ * the near copies go to consecutive devices, wrapping onto the next
+ * row at the end.  Each far copy of those is 'near' devices further
+ * on, 'stride' sectors further into the device.
+ */
+static void raid10_find_phys (raid10_conf_t *conf, unsigned long array_sector,
+			      struct raid10_copy *devs)
+{
+	unsigned long chunk = array_sector >> conf->chunk_shift;
+	unsigned long stripe = chunk * conf->near_copies;
+	unsigned long sector;
+	int dev, n, f, slot = 0;
+
+	dev = stripe % conf->raid_disks;
+	sector = ((stripe / conf->raid_disks) << conf->chunk_shift) +
+			(array_sector & conf->chunk_mask);
+
+	for (n = 0; n < conf->near_copies; n++) {
+		int d = dev;
+		unsigned long s = sector;
+
+		devs[slot].devnum = d;
+		devs[slot].addr = s;
+		slot++;
+		for (f = 1; f < conf->far_copies; f++) {
+			d += conf->near_copies;
+			if (d >= conf->raid_disks)
+				d -= conf->raid_disks;
+			s += conf->stride;
+			devs[slot].devnum = d;
+			devs[slot].addr = s;
+			slot++;
+		}
+		if (++dev >= conf->raid_disks) {
+			dev = 0;
+			sector += conf->chunk_mask + 1;
+		}
+	}
+}
+
+/*
+ * The mirror a write for slot 'devnum' goes to: the disk itself, or
+ * the spare being rebuilt in its place.
+ */
+static struct mirror_info *raid10_write_mirror (raid10_conf_t *conf, int devnum)
+{
+	struct mirror_info *mirror = conf->mirrors + devnum;
+
+	if (mirror->operational)
+		return mirror;
+	if (conf->spare && conf->spare->operational && conf->spare_for == devnum)
+		return conf->spare;
+	return NULL;
+}
+
+/*
+ * Does every chunk still have a copy on a working disk?  Which disks
+ * hold the copies of a chunk only depends on the disk of its first
+ * copy, chunk*near_copies modulo raid_disks, so the chunks of one
+ * period of raid_disks chunks cover every copy set there is.
+ */
+static int raid10_enough (raid10_conf_t *conf)
+{
+	struct raid10_copy devs[MD_SB_DISKS];
+	unsigned long chunk;
+	int slot;
+
+	for (chunk = 0; chunk < conf->raid_disks; chunk++) {
+		raid10_find_phys(conf, chunk << conf->chunk_shift, devs);
+		for (slot = 0; slot < conf->copies; slot++)
+			if (conf->mirrors[devs[slot].devnum].operational)
+				break;
+		if (slot == conf->copies)
+			return 0;
+	}
+	return 1;
+}
+
+static void raid10_reschedule_retry (struct raid10_bh *r10_bh)
+{
+	unsigned long flags;
+	mddev_t *mddev = r10_bh->mddev;
+	raid10_conf_t *conf = mddev_to_conf(mddev);
+
+	md_spin_lock_irqsave(&retry_list_lock, flags);
+	if (raid10_retry_list == NULL)
+		raid10_retry_tail = &raid10_retry_list;
+	*raid10_retry_tail = r10_bh;
+	raid10_retry_tail = &r10_bh->next_r10;
+	r10_bh->next_r10 = NULL;
+	md_spin_unlock_irqrestore(&retry_list_lock, flags);
+	md_wakeup_thread(conf->thread);
+}
+
+
+/*
+ * raid10_end_bh_io() is called when we have finished servicing a
+ * mirrored operation and are ready to return a success/failure code
+ * to the buffer cache layer.
+ */
+static void raid10_end_bh_io (struct raid10_bh *r10_bh, int uptodate)
+{
+	struct buffer_head *bh = r10_bh->master_bh;
+
+	mirror_io_done(&mddev_to_conf(r10_bh->mddev)->sync_window, r10_bh->sector,
+			test_bit(R10BH_SyncPhase, &r10_bh->state));
+
+	bh->b_end_io(bh, uptodate);
+	raid10_free_r10bh(r10_bh);
+}
+
+void raid10_end_request (struct buffer_head *bh, int uptodate)
+{
+	struct raid10_bh * r10_bh = (struct raid10_bh *)(bh->b_private);
+
+	if (!uptodate)
+		md_error (mddev_to_kdev(r10_bh->mddev), bh->b_dev);
+	else
+		set_bit (R10BH_Uptodate, &r10_bh->state);
+
+	if (r10_bh->cmd == READ) {
+		if (uptodate) {
+			raid10_end_bh_io(r10_bh, uptodate);
+			return;
+		}
+		/*
+		 * oops, read error, raid10d will try another copy:
+		 */
+		printk(KERN_ERR "raid10: %s: rescheduling sector %lu\n",
+			 partition_name(bh->b_dev), r10_bh->sector);
+		raid10_reschedule_retry(r10_bh);
+		return;
+	}
+
+	/*
+	 * WRITE: done when every copy is done.
+	 */
+	if (atomic_dec_and_test(&r10_bh->remaining))
+		raid10_end_bh_io(r10_bh, test_bit(R10BH_Uptodate, &r10_bh->state));
+}
+
+/*
+ * Pick the copy to read from, as raid1_read_balance() does for whole
+ * mirrors: a sequential read stays on the disk whose head is already
+ * there, anything else goes to the disk with the nearest head.
+ *
+ * A sequential stream that crosses into a new chunk is handed to the
+ * next copy, so one reader keeps every copy busy instead of leaving
+ * all but one disk of each mirror idle.
+ *
+ * While resyncing all reads go to the first readable copy, which is
+ * the one the resync copies from.  Copies already tried (r10_bh->tried)
+ * are skipped.  Returns the slot in r10_bh->devs[], or -1.
+ */
+static int raid10_read_balance (raid10_conf_t *conf, struct raid10_bh *r10_bh, int sectors)
+{
+	unsigned long best_dist = ~0UL;
+	int slot, best = -1, seq = -1;
+
+	for (slot = 0; slot < conf->copies; slot++) {
+		struct mirror_info *mirror = conf->mirrors + r10_bh->devs[slot].devnum;
+		unsigned long addr = r10_bh->devs[slot].addr;
+		unsigned long dist;
+
+		if (!mirror->operational || mirror->write_only ||
+		    test_bit(slot, &r10_bh->tried))
+			continue;
+		if (conf->resync_mirrors) {
+			best = slot;
+			break;
+		}
+		if (addr == mirror->head_position) {
+			seq = slot;
+			break;
+		}
+		dist = addr > mirror->head_position ?
+			addr - mirror->head_position :
+			mirror->head_position - addr;
+		if (dist < best_dist) {
+			best_dist = dist;
+			best = slot;
+		}
+	}
+
+	if (seq >= 0) {
+		best = seq;
+		if (!(r10_bh->sector & conf->chunk_mask)) {
+			for (slot = seq+1; slot != seq; slot++) {
+				struct mirror_info *mirror;
+
+				if (slot == conf->copies) {
+					slot = -1;
+					continue;
+				}
+				mirror = conf->mirrors + r10_bh->devs[slot].devnum;
+				if (mirror->operational && !mirror->write_only &&
+				    !test_bit(slot, &r10_bh->tried)) {
+					best = slot;
+					break;
+				}
+			}
+		}
+	}
+
+	if (best >= 0)
+		conf->mirrors[r10_bh->devs[best].devnum].head_position =
+			r10_bh->devs[best].addr + sectors;
+	return best;
+}
+
+static int raid10_make_request (mddev_t *mddev, int rw,
+				struct buffer_head * bh)
+{
+	raid10_conf_t *conf = mddev_to_conf(mddev);
+	struct buffer_head *bh_req, *bhl;
+	struct raid10_bh * r10_bh;
+	int slot, sum_bhs = 0, sectors;
+
+	if (!buffer_locked(bh))
+		BUG();
+
+	sectors = bh->b_size >> 9;
+	if ((bh->b_rsector & conf->chunk_mask) + sectors > conf->chunk_mask + 1) {
+		printk(KERN_ERR "raid10: md%d: request for sector %lu crosses a chunk\n",
+		       mdidx(mddev), bh->b_rsector);
+		bh->b_end_io(bh, 0);
+		return 0;
+	}
+
+	/*
+	 * make_request() can abort the operation when READA is being
+	 * used and no empty request is available.
+	 *
+	 * Currently, just replace the command with READ/WRITE.
+	 */
+	if (rw == READA)
+		rw = READ;
+
+	r10_bh = raid10_alloc_r10bh (conf);
+
+	if (mirror_io_start(&conf->sync_window, bh->b_rsector))
+		set_bit(R10BH_SyncPhase, &r10_bh->state);
+
+	r10_bh->master_bh = bh;
+	r10_bh->mddev = mddev;
+	r10_bh->cmd = rw;
+	r10_bh->sector = bh->b_rsector;
+	raid10_find_phys(conf, r10_bh->sector, r10_bh->devs);
+
+	if (rw == READ) {
+		struct mirror_info *mirror;
+
+		slot = raid10_read_balance(conf, r10_bh, sectors);
+		if (slot < 0) {
+			raid10_end_bh_io(r10_bh, 0);
+			return 0;
+		}
+		r10_bh->read_slot = slot;
+		mirror = conf->mirrors + r10_bh->devs[slot].devnum;
+
+		bh_req = &r10_bh->bh_req;
+		memcpy(bh_req, bh, sizeof(*bh));
+		bh_req->b_rsector = r10_bh->devs[slot].addr;
+		bh_req->b_blocknr = bh_req->b_rsector / sectors;
+		bh_req->b_dev = mirror->dev;
+		bh_req->b_rdev = mirror->dev;
+		bh_req->b_end_io = raid10_end_request;
+		bh_req->b_private = r10_bh;
+		generic_make_request (rw, bh_req);
+		return 0;
+	}
+
+	/*
+	 * WRITE: one buffer_head per copy, as raid1 does per mirror.
+	 */
+	bhl = mirror_alloc_bh(&conf->pool, conf->copies);
+	for (slot = 0; slot < conf->copies; slot++) {
+		struct mirror_info *mirror;
+		struct buffer_head *mbh;
+
+		mirror = raid10_write_mirror(conf, r10_bh->devs[slot].devnum);
+		if (!mirror)
+			continue;
+
+ 		mbh = bhl;
+		if (mbh == NULL) {
+			MD_BUG();
+			break;
+		}
+		bhl = mbh->b_next;
+		mbh->b_next = NULL;
+		mbh->b_this_page = (struct buffer_head *)1;
+
+		mbh->b_rsector	  = r10_bh->devs[slot].addr;
+		mbh->b_blocknr    = mbh->b_rsector / sectors;
+		mbh->b_dev        = mirror->dev;
+		mbh->b_rdev	  = mirror->dev;
+		mbh->b_state      = (1<<BH_Req) | (1<<BH_Dirty) |
+						(1<<BH_Mapped) | (1<<BH_Lock);
+
+		atomic_set(&mbh->b_count, 1);
+ 		mbh->b_size       = bh->b_size;
+ 		mbh->b_page	  = bh->b_page;
+ 		mbh->b_data	  = bh->b_data;
+ 		mbh->b_list       = BUF_LOCKED;
+ 		mbh->b_end_io     = raid10_end_request;
+ 		mbh->b_private    = r10_bh;
+
+		mbh->b_next = r10_bh->mirror_bh_list;
+		r10_bh->mirror_bh_list = mbh;
+		sum_bhs++;
+	}
+	if (bhl) mirror_free_bh(&conf->pool, bhl);
+	if (!sum_bhs) {
+		raid10_end_bh_io(r10_bh, 0);
+		return 0;
+	}
+	md_atomic_set(&r10_bh->remaining, sum_bhs);
+
+	/*
+	 * start the requests only now, see raid1_make_request()
+	 */
+	bh = r10_bh->mirror_bh_list;
+	while(bh) {
+		struct buffer_head *bh2 = bh;
+		bh = bh->b_next;
+		generic_make_request(rw, bh2);
+	}
+	return (0);
+}
+
+static int raid10_status (char *page, mddev_t *mddev)
+{
+	raid10_conf_t *conf = mddev_to_conf(mddev);
+	int sz = 0, i;
+
+	sz += sprintf (page+sz, " %dK chunks", mddev->sb->chunk_size >> 10);
+	if (conf->near_copies > 1)
+		sz += sprintf (page+sz, " %d near-copies", conf->near_copies);
+	if (conf->far_copies > 1)
+		sz += sprintf (page+sz, " %d far-copies", conf->far_copies);
+	sz += sprintf (page+sz, " [%d/%d] [", conf->raid_disks,
+						 conf->working_disks);
+	for (i = 0; i < conf->raid_disks; i++)
+		sz += sprintf (page+sz, "%s",
+			conf->mirrors[i].operational ? "U" : "_");
+	sz += sprintf (page+sz, "]");
+	return sz;
+}
+
+#define LAST_DISK KERN_ALERT \
+"raid10: %s holds the last copy of some data, not failing it.\n"
+
+#define DISK_FAILED KERN_ALERT \
+"raid10: Disk failure on %s, disabling device. \n" \
+"	Operation continuing on %d devices\n"
+
+static void mark_disk_bad (mddev_t *mddev, int failed)
+{
+	raid10_conf_t *conf = mddev_to_conf(mddev);
+	struct mirror_info *mirror = conf->mirrors+failed;
+	mdp_super_t *sb = mddev->sb;
+
+	mirror->operational = 0;
+	mark_disk_faulty(sb->disks+mirror->number);
+	mark_disk_nonsync(sb->disks+mirror->number);
+	mark_disk_inactive(sb->disks+mirror->number);
+	sb->active_disks--;
+	sb->working_disks--;
+	sb->failed_disks++;
+	mddev->sb_dirty = 1;
+	md_wakeup_thread(conf->thread);
+	conf->working_disks--;
+	printk (DISK_FAILED, partition_name (mirror->dev),
+				 conf->working_disks);
+}
+
+static int raid10_error (mddev_t *mddev, kdev_t dev)
+{
+	raid10_conf_t *conf = mddev_to_conf(mddev);
+	struct mirror_info * mirrors = conf->mirrors;
+	int i;
+
+	for (i = 0; i < MD_SB_DISKS; i++) {
+		if (mirrors[i].dev != dev || !mirrors[i].operational)
+			continue;
+		if (i < conf->raid_disks) {
+			/*
+			 * we can do nothing if this disk has the only
+			 * working copy of something
+			 */
+			mirrors[i].operational = 0;
+			if (!raid10_enough(conf)) {
+				mirrors[i].operational = 1;
+				printk (LAST_DISK, partition_name(dev));
+				return 0;
+			}
+			mirrors[i].operational = 1;
+		}
+		mark_disk_bad(mddev, i);
+		break;
+	}
+	return 0;
+}
+
+#undef LAST_DISK
+#undef DISK_FAILED
+
+
+static void print_raid10_conf (raid10_conf_t *conf)
+{
+	int i;
+	struct mirror_info *tmp;
+
+	printk("RAID10 conf printout:\n");
+	if (!conf) {
+		printk("(conf==NULL)\n");
+		return;
+	}
+	printk(" --- wd:%d rd:%d nd:%d nc:%d fc:%d\n", conf->working_disks,
+			 conf->raid_disks, conf->nr_disks,
+			 conf->near_copies, conf->far_copies);
+
+	for (i = 0; i < MD_SB_DISKS; i++) {
+		tmp = conf->mirrors + i;
+		printk(" disk %d, s:%d, o:%d, n:%d rd:%d us:%d dev:%s\n",
+			i, tmp->spare,tmp->operational,
+			tmp->number,tmp->raid_disk,tmp->used_slot,
+			partition_name(tmp->dev));
+	}
+}
+
+/*
+ * The first slot in the 'low' area without a working disk, which is
+ * where the spare goes when it is activated.
+ */
+static int raid10_failed_slot (raid10_conf_t *conf)
+{
+	struct mirror_info *tmp;
+	int i;
+
+	for (i = 0; i < conf->raid_disks; i++) {
+		tmp = conf->mirrors + i;
+		if ((!tmp->operational && !tmp->spare) || !tmp->used_slot)
+			return i;
+	}
+	return -1;
+}
+
+static int raid10_diskop(mddev_t *mddev, mdp_disk_t **d, int state)
+{
+	int err = 0;
+	int i, failed_disk=-1, spare_disk=-1, removed_disk=-1, added_disk=-1;
+	raid10_conf_t *conf = mddev->private;
+	struct mirror_info *tmp, *sdisk, *fdisk, *rdisk, *adisk;
+	mdp_super_t *sb = mddev->sb;
+	mdp_disk_t *failed_desc, *spare_desc, *added_desc;
+
+	print_raid10_conf(conf);
+	/*
+	 * The spare is done syncing, one way or the other.  This
+	 * sleeps, so do it before taking the device lock.
+	 */
+	if (state == DISKOP_SPARE_ACTIVE || state == DISKOP_SPARE_INACTIVE)
+		mirror_close_sync(&conf->sync_window, (md_size[mdidx(mddev)] << 1) + 1);
+	md_spin_lock_irq(&conf->device_lock);
+	/*
+	 * find the disk ...
+	 */
+	switch (state) {
+
+	case DISKOP_SPARE_ACTIVE:
+	case DISKOP_SPARE_WRITE:
+
+		/*
+		 * Find the failed disk the spare is going to replace.
+		 */
+		failed_disk = raid10_failed_slot(conf);
+		if (failed_disk == -1) {
+			MD_BUG();
+			err = 1;
+			goto abort;
+		}
+		/* fall through */
+
+	case DISKOP_SPARE_INACTIVE:
+
+		/*
+		 * Find the spare disk ... (can only be in the 'high'
+		 * area of the array)
+		 */
+		for (i = conf->raid_disks; i < MD_SB_DISKS; i++) {
+			tmp = conf->mirrors + i;
+			if (tmp->spare && tmp->number == (*d)->number) {
+				spare_disk = i;
+				break;
+			}
+		}
+		if (spare_disk == -1) {
+			MD_BUG();
+			err = 1;
+			goto abort;
+		}
+		break;
+
+	case DISKOP_HOT_REMOVE_DISK:
+
+		for (i = 0; i < MD_SB_DISKS; i++) {
+			tmp = conf->mirrors + i;
+			if (tmp->used_slot && (tmp->number == (*d)->number)) {
+				if (tmp->operational) {
+					err = -EBUSY;
+					goto abort;
+				}
+				removed_disk = i;
+				break;
+			}
+		}
+		if (removed_disk == -1) {
+			MD_BUG();
+			err = 1;
+			goto abort;
+		}
+		break;
+
+	case DISKOP_HOT_ADD_DISK:
+
+		for (i = conf->raid_disks; i < MD_SB_DISKS; i++) {
+			tmp = conf->mirrors + i;
+			if (!tmp->used_slot) {
+				added_disk = i;
+				break;
+			}
+		}
+		if (added_disk == -1) {
+			MD_BUG();
+			err = 1;
+			goto abort;
+		}
+		break;
+	}
+
+	switch (state) {
+	/*
+	 * Switch the spare disk to write-only mode.  Writes for the
+	 * failed slot go to it from now on.
+	 */
+	case DISKOP_SPARE_WRITE:
+		sdisk = conf->mirrors + spare_disk;
+		sdisk->operational = 1;
+		sdisk->write_only = 1;
+		conf->spare = sdisk;
+		conf->spare_for = failed_disk;
+		break;
+	/*
+	 * Deactivate a spare disk:
+	 */
+	case DISKOP_SPARE_INACTIVE:
+		sdisk = conf->mirrors + spare_disk;
+		sdisk->operational = 0;
+		sdisk->write_only = 0;
+		conf->spare = NULL;
+		break;
+	/*
+	 * Activate (mark read-write) the (now sync) spare disk,
+	 * which means we switch it's 'raid position' (->raid_disk)
+	 * with the failed disk, exactly as raid1 does.
+	 */
+	case DISKOP_SPARE_ACTIVE:
+		sdisk = conf->mirrors + spare_disk;
+		fdisk = conf->mirrors + failed_disk;
+
+		spare_desc = &sb->disks[sdisk->number];
+		failed_desc = &sb->disks[fdisk->number];
+
+		if (spare_desc != *d) {
+			MD_BUG();
+			err = 1;
+			goto abort;
+		}
+
+		if (spare_desc->raid_disk != sdisk->raid_disk) {
+			MD_BUG();
+			err = 1;
+			goto abort;
+		}
+
+		if (sdisk->raid_disk != spare_disk) {
+			MD_BUG();
+			err = 1;
+			goto abort;
+		}
+
+		if (failed_desc->raid_disk != fdisk->raid_disk) {
+			MD_BUG();
+			err = 1;
+			goto abort;
+		}
+
+		if (fdisk->raid_disk != failed_disk) {
+			MD_BUG();
+			err = 1;
+			goto abort;
+		}
+
+		conf->spare = NULL;
+
+		/*
+		 * do the switch finally
+		 */
+		xchg_values(*spare_desc, *failed_desc);
+		xchg_values(*fdisk, *sdisk);
+
+		/*
+		 * (careful, 'failed' and 'spare' are switched from now on)
+		 *
+		 * we want to preserve linear numbering and we want to
+		 * give the proper raid_disk number to the now activated
+		 * disk. (this means we switch back these values)
+		 */
+
+		xchg_values(spare_desc->raid_disk, failed_desc->raid_disk);
+		xchg_values(sdisk->raid_disk, fdisk->raid_disk);
+		xchg_values(spare_desc->number, failed_desc->number);
+		xchg_values(sdisk->number, fdisk->number);
+
+		*d = failed_desc;
+
+		if (sdisk->dev == MKDEV(0,0))
+			sdisk->used_slot = 0;
+		/*
+		 * this really activates the spare.
+		 */
+		fdisk->spare = 0;
+		fdisk->write_only = 0;
+		fdisk->head_position = 0;
+
+		conf->working_disks++;
+
+		break;
+
+	case DISKOP_HOT_REMOVE_DISK:
+		rdisk = conf->mirrors + removed_disk;
+
+		if (rdisk->spare && (removed_disk < conf->raid_disks)) {
+			MD_BUG();
+			err = 1;
+			goto abort;
+		}
+		rdisk->dev = MKDEV(0,0);
+		rdisk->used_slot = 0;
+		conf->nr_disks--;
+		break;
+
+	case DISKOP_HOT_ADD_DISK:
+		adisk = conf->mirrors + added_disk;
+		added_desc = *d;
+
+		if (added_disk != added_desc->number) {
+			MD_BUG();
+			err = 1;
+			goto abort;
+		}
+
+		adisk->number = added_desc->number;
+		adisk->raid_disk = added_desc->raid_disk;
+		adisk->dev = MKDEV(added_desc->major,added_desc->minor);
+
+		adisk->operational = 0;
+		adisk->write_only = 0;
+		adisk->spare = 1;
+		adisk->used_slot = 1;
+		adisk->head_position = 0;
+		conf->nr_disks++;
+
+		break;
+
+	default:
+		MD_BUG();
+		err = 1;
+		goto abort;
+	}
+abort:
+	md_spin_unlock_irq(&conf->device_lock);
+	if (state == DISKOP_SPARE_ACTIVE || state == DISKOP_SPARE_INACTIVE)
+		raid10_shrink_buffers(conf);
+
+	print_raid10_conf(conf);
+	return err;
+}
+
+/*
+ * Does a sync need to write copy 'slot' of this block?  A resync
+ * rewrites every working copy from the one it read, a rebuild only
+ * the copies that live on the failed slot the spare is replacing.
+ */
+static int raid10_sync_target (raid10_conf_t *conf, struct raid10_bh *r10_bh, int slot)
+{
+	int devnum = r10_bh->devs[slot].devnum;
+
+	if (conf->resync_mirrors && conf->mirrors[devnum].operational)
+		return 1;
+	return !conf->mirrors[devnum].operational && conf->spare &&
+		conf->spare->operational && conf->spare_for == devnum;
+}
+
+static void raid10_sync_read (raid10_conf_t *conf, struct raid10_bh *r10_bh, int slot)
+{
+	struct mirror_info *mirror = conf->mirrors + r10_bh->devs[slot].devnum;
+	struct buffer_head *bh = &r10_bh->bh_req;
+
+	r10_bh->read_slot = slot;
+	bh->b_rsector = r10_bh->devs[slot].addr;
+	bh->b_blocknr = bh->b_rsector / (bh->b_size >> 9);
+	bh->b_dev = mirror->dev;
+	bh->b_rdev = mirror->dev;
+	bh->b_state = (1<<BH_Req) | (1<<BH_Mapped) | (1<<BH_Lock);
+	generic_make_request(READ, bh);
+	md_sync_acct(bh->b_dev, bh->b_size/512);
+}
+
+/*
+ * A sync block that needs no (more) I/O.
+ */
+static void raid10_sync_done (struct raid10_bh *r10_bh, int ok)
+{
+	mddev_t *mddev = r10_bh->mddev;
+	unsigned long sect = r10_bh->sector;
+	int size = r10_bh->bh_req.b_size;
+
+	raid10_free_buf(r10_bh);
+	mirror_sync_done(&mddev_to_conf(mddev)->sync_window, sect);
+	md_done_sync(mddev, size>>10, ok);
+}
+
+#define IO_ERROR KERN_ALERT \
+"raid10: md%d: unrecoverable I/O read error for sector %lu\n"
+
+#define REDIRECT_SECTOR KERN_ERR \
+"raid10: md%d: redirecting sector %lu to another copy\n"
+
+/*
+ * This is a kernel thread which:
+ *
+ *	1.	Retries failed read operations on other copies.
+ *	2.	Updates the raid superblock when problems encounter.
+ *	3.	Performs writes following reads for array syncronising.
+ */
+static void end_sync_write(struct buffer_head *bh, int uptodate);
+static void end_sync_read(struct buffer_head *bh, int uptodate);
+
+static void raid10d (void *data)
+{
+	raid10_conf_t *conf = data;
+	struct raid10_bh *r10_bh;
+	struct buffer_head *bh;
+	unsigned long flags;
+	mddev_t *mddev;
+	int slot;
+
+	if (conf->mddev->sb_dirty) {
+		conf->mddev->sb_dirty = 0;
+		md_update_sb(conf->mddev);
+	}
+
+	for (;;) {
+		md_spin_lock_irqsave(&retry_list_lock, flags);
+		r10_bh = raid10_retry_list;
+		if (!r10_bh)
+			break;
+		raid10_retry_list = r10_bh->next_r10;
+		md_spin_unlock_irqrestore(&retry_list_lock, flags);
+
+		mddev = r10_bh->mddev;
+		conf = mddev_to_conf(mddev);
+		if (mddev->sb_dirty) {
+			printk(KERN_INFO "dirty sb detected, updating.\n");
+			mddev->sb_dirty = 0;
+			md_update_sb(mddev);
+		}
+		bh = &r10_bh->bh_req;
+		switch(r10_bh->cmd) {
+		case SPECIAL:
+			if (test_bit(R10BH_Uptodate, &r10_bh->state)) {
+				/*
+				 * we have the block, write it to every
+				 * copy that needs it
+				 */
+				int sum_bhs = 0;
+				struct buffer_head *bhl, *mbh;
+
+				bhl = mirror_alloc_bh(&conf->pool, conf->copies);
+				for (slot = 0; slot < conf->copies; slot++) {
+					struct mirror_info *mirror;
+
+					if (slot == r10_bh->read_slot ||
+					    !raid10_sync_target(conf, r10_bh, slot))
+						continue;
+					mirror = raid10_write_mirror(conf, r10_bh->devs[slot].devnum);
+					if (!mirror)
+						continue;
+					mbh = bhl;
+					if (!mbh) {
+						MD_BUG();
+						break;
+					}
+					bhl = mbh->b_next;
+					mbh->b_this_page = (struct buffer_head *)1;
+
+					mbh->b_rsector	  = r10_bh->devs[slot].addr;
+					mbh->b_blocknr    = mbh->b_rsector / (bh->b_size >> 9);
+					mbh->b_dev        = mirror->dev;
+					mbh->b_rdev	  = mirror->dev;
+					mbh->b_state      = (1<<BH_Req) | (1<<BH_Dirty) |
+						(1<<BH_Mapped) | (1<<BH_Lock);
+					atomic_set(&mbh->b_count, 1);
+					mbh->b_size       = bh->b_size;
+					mbh->b_page	  = bh->b_page;
+					mbh->b_data	  = bh->b_data;
+					mbh->b_list       = BUF_LOCKED;
+					mbh->b_end_io     = end_sync_write;
+					mbh->b_private    = r10_bh;
+
+					mbh->b_next = r10_bh->mirror_bh_list;
+					r10_bh->mirror_bh_list = mbh;
+
+					sum_bhs++;
+				}
+				if (bhl) mirror_free_bh(&conf->pool, bhl);
+				if (!sum_bhs) {
+					/* the targets went away meanwhile */
+					raid10_sync_done(r10_bh, 1);
+					break;
+				}
+				md_atomic_set(&r10_bh->remaining, sum_bhs);
+				mbh = r10_bh->mirror_bh_list;
+				while (mbh) {
+					struct buffer_head *bh1 = mbh;
+					mbh = mbh->b_next;
+					generic_make_request(WRITE, bh1);
+					md_sync_acct(bh1->b_dev, bh1->b_size/512);
+				}
+			} else {
+				set_bit(r10_bh->read_slot, &r10_bh->tried);
+				slot = raid10_read_balance(conf, r10_bh, bh->b_size >> 9);
+				if (slot < 0) {
+					printk (IO_ERROR, mdidx(mddev), r10_bh->sector);
+					raid10_sync_done(r10_bh, 0);
+				} else {
+					printk (REDIRECT_SECTOR, mdidx(mddev), r10_bh->sector);
+					raid10_sync_read(conf, r10_bh, slot);
+				}
+			}
+			break;
+		case READ:
+			set_bit(r10_bh->read_slot, &r10_bh->tried);
+			slot = raid10_read_balance(conf, r10_bh, bh->b_size >> 9);
+			if (slot < 0) {
+				printk (IO_ERROR, mdidx(mddev), r10_bh->sector);
+				raid10_end_bh_io(r10_bh, 0);
+			} else {
+				struct mirror_info *mirror;
+
+				printk (REDIRECT_SECTOR, mdidx(mddev), r10_bh->sector);
+				mirror = conf->mirrors + r10_bh->devs[slot].devnum;
+				r10_bh->read_slot = slot;
+				bh->b_rsector = r10_bh->devs[slot].addr;
+				bh->b_blocknr = bh->b_rsector / (bh->b_size >> 9);
+				bh->b_dev = mirror->dev;
+				bh->b_rdev = mirror->dev;
+				generic_make_request (READ, bh);
+			}
+			break;
+		}
+	}
+	md_spin_unlock_irqrestore(&retry_list_lock, flags);
+}
+#undef IO_ERROR
+#undef REDIRECT_SECTOR
+
+/*
+ * Private kernel thread to reconstruct mirrors after an unclean
+ * shutdown.
+ */
+static void raid10syncd (void *data)
+{
+	raid10_conf_t *conf = data;
+	mddev_t *mddev = conf->mddev;
+
+	if (!conf->resync_mirrors)
+		return;
+	if (conf->resync_mirrors == 2)
+		return;
+	down(&mddev->recovery_sem);
+	if (!md_do_sync(mddev, NULL)) {
+		/*
+		 * Only if everything went Ok.
+		 */
+		conf->resync_mirrors = 0;
+	}
+
+	mirror_close_sync(&conf->sync_window, (md_size[mdidx(mddev)] << 1) + 1);
+
+	up(&mddev->recovery_sem);
+	raid10_shrink_buffers(conf);
+}
+
+/*
+ * perform a "sync" on one "block"
+ *
+ * Unlike raid1, 'block_nr' is a block of the array, not of the member
+ * disks: the copies of one array block sit at different offsets on
+ * different disks, so md_do_sync() walks the array address space for
+ * us.  The window that keeps normal I/O away from the blocks being
+ * synced is the one in mirror.c, in array sectors.
+ *
+ * The sync request reads one good copy; on completion raid10d writes
+ * it to the copies that need it.  Blocks that need no writing (during
+ * a rebuild, those with no copy on the failed slot) finish at once.
+ */
+static int raid10_sync_request (mddev_t *mddev, unsigned long block_nr)
+{
+	raid10_conf_t *conf = mddev_to_conf(mddev);
+	struct raid10_bh *r10_bh;
+	struct buffer_head *bh;
+	int bsize, slot;
+
+	if (!block_nr) {
+		/* initialize ...*/
+		int buffs;
+		/* we want enough buffers to hold twice the window of 128*/
+		buffs = 128 *2 / (PAGE_SIZE>>9);
+		buffs = raid10_grow_buffers(conf, buffs);
+		if (buffs < 2)
+			goto nomem;
+		mirror_sync_begin(&conf->sync_window, buffs*(PAGE_SIZE>>9)/2);
+	}
+	mirror_sync_start(&conf->sync_window, block_nr<<1);
+
+	r10_bh = raid10_alloc_buf (conf);
+	r10_bh->master_bh = NULL;
+	r10_bh->mddev = mddev;
+	r10_bh->cmd = SPECIAL;
+	r10_bh->sector = block_nr<<1;
+	bh = &r10_bh->bh_req;
+
+	/*
+	 * chunks are at least a page, so an aligned block of up to a
+	 * page never crosses one
+	 */
+	bh->b_blocknr = block_nr;
+	bsize = 1024;
+	while (!(bh->b_blocknr & 1) && bsize < PAGE_SIZE
+			&& (bh->b_blocknr+2)*(bsize>>10) < md_size[mdidx(mddev)]) {
+		bh->b_blocknr >>= 1;
+		bsize <<= 1;
+	}
+	bh->b_size = bsize;
+	bh->b_list = BUF_LOCKED;
+	if (!bh->b_page)
+		BUG();
+	if (!bh->b_data)
+		BUG();
+	if (bh->b_data != page_address(bh->b_page))
+		BUG();
+	bh->b_end_io = end_sync_read;
+	bh->b_private = r10_bh;
+	init_waitqueue_head(&bh->b_wait);
+
+	raid10_find_phys(conf, r10_bh->sector, r10_bh->devs);
+	slot = raid10_read_balance(conf, r10_bh, bsize >> 9);
+	if (slot >= 0) {
+		int i;
+
+		for (i = 0; i < conf->copies; i++)
+			if (i != slot && raid10_sync_target(conf, r10_bh, i))
+				break;
+		if (i == conf->copies) {
+			raid10_sync_done(r10_bh, 1);
+			return (bsize >> 10);
+		}
+		raid10_sync_read(conf, r10_bh, slot);
+	} else {
+		printk(KERN_ALERT "raid10: md%d: no readable copy of sector %lu\n",
+		       mdidx(mddev), r10_bh->sector);
+		raid10_sync_done(r10_bh, 0);
+	}
+
+	return (bsize >> 10);
+
+nomem:
+	raid10_shrink_buffers(conf);
+	return -ENOMEM;
+}
+
+static void end_sync_read(struct buffer_head *bh, int uptodate)
+{
+	struct raid10_bh * r10_bh = (struct raid10_bh *)(bh->b_private);
+
+	/* we have read a block, now it needs to be re-written,
+	 * or re-read if the read failed.
+	 * We don't do much here, just schedule handling by raid10d
+	 */
+	if (!uptodate)
+		md_error (mddev_to_kdev(r10_bh->mddev), bh->b_dev);
+	else
+		set_bit(R10BH_Uptodate, &r10_bh->state);
+	raid10_reschedule_retry(r10_bh);
+}
+
+static void end_sync_write(struct buffer_head *bh, int uptodate)
+{
+ 	struct raid10_bh * r10_bh = (struct raid10_bh *)(bh->b_private);
+
+	if (!uptodate)
+ 		md_error (mddev_to_kdev(r10_bh->mddev), bh->b_dev);
+	if (atomic_dec_and_test(&r10_bh->remaining))
+		raid10_sync_done(r10_bh, uptodate);
+}
+
+#define INVALID_LEVEL KERN_WARNING \
+"raid10: md%d: raid level not set to 10 (%d)\n"
+
+#define INVALID_LAYOUT KERN_ERR \
+"raid10: md%d: %d near and %d far copies do not fit on %d disks\n"
+
+#define ERRORS KERN_ERR \
+"raid10: disabled mirror %s (errors detected)\n"
+
+#define NOT_IN_SYNC KERN_ERR \
+"raid10: disabled mirror %s (not in sync)\n"
+
+#define INCONSISTENT KERN_ERR \
+"raid10: disabled mirror %s (inconsistent descriptor)\n"
+
+#define ALREADY_RUNNING KERN_ERR \
+"raid10: disabled mirror %s (mirror %d already operational)\n"
+
+#define OPERATIONAL KERN_INFO \
+"raid10: device %s operational as mirror %d\n"
+
+#define MEM_ERROR KERN_ERR \
+"raid10: couldn't allocate memory for md%d\n"
+
+#define SPARE KERN_INFO \
+"raid10: spare disk %s\n"
+
+#define NOT_ENOUGH KERN_ERR \
+"raid10: not enough operational mirrors for md%d\n"
+
+#define ARRAY_IS_ACTIVE KERN_INFO \
+"raid10: raid set md%d active with %d out of %d devices, %d near/%d far copies\n"
+
+#define THREAD_ERROR KERN_ERR \
+"raid10: couldn't allocate thread for md%d\n"
+
+#define START_RESYNC KERN_WARNING \
+"raid10: raid set md%d not clean; reconstructing mirrors\n"
+
+static int raid10_run (mddev_t *mddev)
+{
+	raid10_conf_t *conf;
+	int i, j, disk_idx, chunk_sects;
+	unsigned long chunks;
+	struct mirror_info *disk;
+	mdp_super_t *sb = mddev->sb;
+	mdp_disk_t *descriptor;
+	mdk_rdev_t *rdev;
+	struct md_list_head *tmp;
+	int start_recovery = 0;
+
+	MOD_INC_USE_COUNT;
+
+	if (sb->level != 10) {
+		printk(INVALID_LEVEL, mdidx(mddev), sb->level);
+		goto out;
+	}
+	/*
+	 * [whatever we allocate in raid10_run(), should be freed in
+	 * raid10_stop()]
+	 */
+	conf = kmalloc(sizeof(raid10_conf_t), GFP_KERNEL);
+	mddev->private = conf;
+	if (!conf) {
+		printk(MEM_ERROR, mdidx(mddev));
+		goto out;
+	}
+	memset(conf, 0, sizeof(*conf));
+
+	conf->raid_disks = sb->raid_disks;
+	conf->near_copies = RAID10_NEAR_COPIES(sb->layout);
+	conf->far_copies = RAID10_FAR_COPIES(sb->layout);
+	conf->copies = conf->near_copies * conf->far_copies;
+	if (conf->copies < 2 || conf->copies > conf->raid_disks) {
+		printk(INVALID_LAYOUT, mdidx(mddev), conf->near_copies,
+		       conf->far_copies, conf->raid_disks);
+		goto out_free_conf;
+	}
+	chunk_sects = sb->chunk_size >> 9;
+	conf->chunk_mask = chunk_sects - 1;
+	conf->chunk_shift = ffz(~chunk_sects);
+
+	ITERATE_RDEV(mddev,rdev,tmp) {
+		if (rdev->faulty) {
+			printk(ERRORS, partition_name(rdev->dev));
+		} else {
+			if (!rdev->sb) {
+				MD_BUG();
+				continue;
+			}
+		}
+		if (rdev->desc_nr == -1) {
+			MD_BUG();
+			continue;
+		}
+		descriptor = &sb->disks[rdev->desc_nr];
+		disk_idx = descriptor->raid_disk;
+		disk = conf->mirrors + disk_idx;
+
+		if (disk_faulty(descriptor)) {
+			disk->number = descriptor->number;
+			disk->raid_disk = disk_idx;
+			disk->dev = rdev->dev;
+			disk->operational = 0;
+			disk->write_only = 0;
+			disk->spare = 0;
+			disk->used_slot = 1;
+			disk->head_position = 0;
+			continue;
+		}
+		if (disk_active(descriptor)) {
+			if (!disk_sync(descriptor)) {
+				printk(NOT_IN_SYNC,
+					partition_name(rdev->dev));
+				continue;
+			}
+			if ((descriptor->number > MD_SB_DISKS) ||
+					 (disk_idx >= sb->raid_disks)) {
+
+				printk(INCONSISTENT,
+					partition_name(rdev->dev));
+				continue;
+			}
+			if (disk->operational) {
+				printk(ALREADY_RUNNING,
+					partition_name(rdev->dev),
+					disk_idx);
+				continue;
+			}
+			printk(OPERATIONAL, partition_name(rdev->dev),
+ 					disk_idx);
+			disk->number = descriptor->number;
+			disk->raid_disk = disk_idx;
+			disk->dev = rdev->dev;
+			disk->operational = 1;
+			disk->write_only = 0;
+			disk->spare = 0;
+			disk->used_slot = 1;
+			disk->head_position = 0;
+			conf->working_disks++;
+		} else {
+		/*
+		 * Must be a spare disk ..
+		 */
+			printk(SPARE, partition_name(rdev->dev));
+			disk->number = descriptor->number;
+			disk->raid_disk = disk_idx;
+			disk->dev = rdev->dev;
+			disk->operational = 0;
+			disk->write_only = 0;
+			disk->spare = 1;
+			disk->used_slot = 1;
+			disk->head_position = 0;
+		}
+	}
+	conf->nr_disks = sb->nr_disks;
+	conf->mddev = mddev;
+	conf->device_lock = MD_SPIN_LOCK_UNLOCKED;
+
+	init_waitqueue_head(&conf->wait_buffer);
+	mirror_init_bh_pool(&conf->pool, &conf->wait_buffer);
+	mirror_init_window(&conf->sync_window);
+
+	if (!conf->working_disks || !raid10_enough(conf)) {
+		printk(NOT_ENOUGH, mdidx(mddev));
+		goto out_free_conf;
+	}
+
+	/*
+	 * Each device holds 'far' sections of whole chunks; the array
+	 * is as many chunks as fit 'near' times into one section of
+	 * every device.
+	 */
+	conf->stride = ((unsigned long) sb->size * 2 / conf->far_copies) & ~conf->chunk_mask;
+	chunks = (conf->stride >> conf->chunk_shift) * conf->raid_disks / conf->near_copies;
+	md_size[mdidx(mddev)] = (chunks << conf->chunk_shift) >> 1;
+
+	/* pre-allocate some buffer_head structures, see raid1_run() */
+	if (raid10_grow_r10bh(conf, 16) < 16 ||
+	    mirror_grow_bh(&conf->pool, 16*conf->copies)< 16*conf->copies) {
+		printk(MEM_ERROR, mdidx(mddev));
+		goto out_free_conf;
+	}
+
+	for (i = 0; i < MD_SB_DISKS; i++) {
+
+		descriptor = sb->disks+i;
+		disk_idx = descriptor->raid_disk;
+		disk = conf->mirrors + disk_idx;
+
+		if (disk_faulty(descriptor) && (disk_idx < conf->raid_disks) &&
+				!disk->used_slot) {
+
+			disk->number = descriptor->number;
+			disk->raid_disk = disk_idx;
+			disk->dev = MKDEV(0,0);
+
+			disk->operational = 0;
+			disk->write_only = 0;
+			disk->spare = 0;
+			disk->used_slot = 1;
+			disk->head_position = 0;
+		}
+	}
+
+	if (conf->working_disks != sb->raid_disks) {
+		printk(KERN_ALERT "raid10: md%d, not all disks are operational -- trying to recover array\n", mdidx(mddev));
+		start_recovery = 1;
+	}
+
+	{
+		const char * name = "raid10d";
+
+		conf->thread = md_register_thread(raid10d, conf, name);
+		if (!conf->thread) {
+			printk(THREAD_ERROR, mdidx(mddev));
+			goto out_free_conf;
+		}
+	}
+
+	if (!start_recovery && !(sb->state & (1 << MD_SB_CLEAN))) {
+		const char * name = "raid10syncd";
+
+		conf->resync_thread = md_register_thread(raid10syncd, conf,name);
+		if (!conf->resync_thread) {
+			printk(THREAD_ERROR, mdidx(mddev));
+			goto out_free_conf;
+		}
+
+		printk(START_RESYNC, mdidx(mddev));
+		conf->resync_mirrors = 1;
+		md_wakeup_thread(conf->resync_thread);
+	}
+
+	/*
+	 * Regenerate the "device is in sync with the raid set" bit for
+	 * each device.
+	 */
+	for (i = 0; i < MD_SB_DISKS; i++) {
+		mark_disk_nonsync(sb->disks+i);
+		for (j = 0; j < sb->raid_disks; j++) {
+			if (!conf->mirrors[j].operational)
+				continue;
+			if (sb->disks[i].number == conf->mirrors[j].number)
+				mark_disk_sync(sb->disks+i);
+		}
+	}
+	sb->active_disks = conf->working_disks;
+
+	if (start_recovery)
+		md_recover_arrays();
+
+
+	printk(ARRAY_IS_ACTIVE, mdidx(mddev), sb->active_disks, sb->raid_disks,
+	       conf->near_copies, conf->far_copies);
+	/*
+	 * Ok, everything is just fine now
+	 */
+	return 0;
+
+out_free_conf:
+	raid10_shrink_r10bh(conf);
+	mirror_shrink_bh(&conf->pool, conf->pool.freebh_cnt);
+	raid10_shrink_buffers(conf);
+	kfree(conf);
+	mddev->private = NULL;
+out:
+	MOD_DEC_USE_COUNT;
+	return -EIO;
+}
+
+#undef INVALID_LEVEL
+#undef INVALID_LAYOUT
+#undef ERRORS
+#undef NOT_IN_SYNC
+#undef INCONSISTENT
+#undef ALREADY_RUNNING
+#undef OPERATIONAL
+#undef MEM_ERROR
+#undef SPARE
+#undef NOT_ENOUGH
+#undef ARRAY_IS_ACTIVE
+#undef THREAD_ERROR
+#undef START_RESYNC
+
+static int raid10_stop_resync (mddev_t *mddev)
+{
+	raid10_conf_t *conf = mddev_to_conf(mddev);
+
+	if (conf->resync_thread) {
+		if (conf->resync_mirrors) {
+			conf->resync_mirrors = 2;
+			md_interrupt_thread(conf->resync_thread);
+
+			printk(KERN_INFO "raid10: mirror resync was not fully finished, restarting next time.\n");
+			return 1;
+		}
+		return 0;
+	}
+	return 0;
+}
+
+static int raid10_restart_resync (mddev_t *mddev)
+{
+	raid10_conf_t *conf = mddev_to_conf(mddev);
+
+	if (conf->resync_mirrors) {
+		if (!conf->resync_thread) {
+			MD_BUG();
+			return 0;
+		}
+		conf->resync_mirrors = 1;
+		md_wakeup_thread(conf->resync_thread);
+		return 1;
+	}
+	return 0;
+}
+
+static int raid10_stop (mddev_t *mddev)
+{
+	raid10_conf_t *conf = mddev_to_conf(mddev);
+
+	md_unregister_thread(conf->thread);
+	if (conf->resync_thread)
+		md_unregister_thread(conf->resync_thread);
+	raid10_shrink_r10bh(conf);
+	mirror_shrink_bh(&conf->pool, conf->pool.freebh_cnt);
+	raid10_shrink_buffers(conf);
+	kfree(conf);
+	mddev->private = NULL;
+	MOD_DEC_USE_COUNT;
+	return 0;
+}
+
+static mdk_personality_t raid10_personality=
+{
+	name:		"raid10",
+	make_request:	raid10_make_request,
+	run:		raid10_run,
+	stop:		raid10_stop,
+	status:		raid10_status,
+	error_handler:	raid10_error,
+	diskop:		raid10_diskop,
+	stop_resync:	raid10_stop_resync,
+	restart_resync:	raid10_restart_resync,
+	sync_request:	raid10_sync_request
+};
+
+static int md__init raid10_init (void)
+{
+	return register_md_personality (RAID10, &raid10_personality);
+}
+
+static void raid10_exit (void)
+{
+	unregister_md_personality (RAID10);
+}
+
+module_init(raid10_init);
+module_exit(raid10_exit);
@@ -37,6 +37,14 @@ static mdk_personality_t raid5_personality;
 #define HASH_MASK		(NR_HASH - 1)
 #define stripe_hash(conf, sect)	((conf)->stripe_hashtbl[((sect) / ((conf)->buffer_size >> 9)) & HASH_MASK])
 
+/*
+ * How long a partial-stripe write may wait for the rest of its
+ * stripe before we give up and pre-read, and how full the stripe
+ * cache may get before delayed stripes are started regardless.
+ */
+#define RAID5_WRITE_DELAY	(HZ/50 + 1)
+#define RAID5_DELAY_THRESHOLD(conf)	((conf)->max_nr_stripes * 3 / 4)
+
 /*
  * The following can be used to debug the driver
  */
@@ -66,9 +74,22 @@ static inline void __release_stripe(raid5_conf_t *conf, struct stripe_head *sh)
 		if (atomic_read(&conf->active_stripes)==0)
 			BUG();
 		if (test_bit(STRIPE_HANDLE, &sh->state)) {
+			/* if there is a backlog already, get a helper going */
+			if (conf->nr_workers && !list_empty(&conf->handle_list)) {
+				md_wakeup_thread(conf->workers[conf->next_worker]);
+				if (++conf->next_worker == conf->nr_workers)
+					conf->next_worker = 0;
+			}
 			list_add_tail(&sh->lru, &conf->handle_list);
 			md_wakeup_thread(conf->thread);
 		}
+		else if (test_bit(STRIPE_DELAYED, &sh->state)) {
+			list_add_tail(&sh->lru, &conf->delayed_list);
+			if (!timer_pending(&conf->delay_timer))
+				mod_timer(&conf->delay_timer, sh->expires);
+			if (atomic_read(&conf->active_stripes) >= RAID5_DELAY_THRESHOLD(conf))
+				md_wakeup_thread(conf->thread);
+		}
 		else {
 			list_add_tail(&sh->lru, &conf->inactive_list);
 			atomic_dec(&conf->active_stripes);
@@ -288,17 +309,24 @@ static struct stripe_head *get_active_stripe(raid5_conf_t *conf, unsigned long s
 			if (noblock && sh == NULL)
 				break;
 			if (!sh) {
+				/* delayed writes must not starve us of stripes */
+				if (!list_empty(&conf->delayed_list))
+					md_wakeup_thread(conf->thread);
 				wait_event_lock_irq(conf->wait_for_stripe,
 						    !list_empty(&conf->inactive_list),
 						    conf->device_lock);
-			} else
+			} else {
 				init_stripe(sh, sector);
+				atomic_inc(&conf->cache_misses);
+			}
 		} else {
+			atomic_inc(&conf->cache_hits);
 			if (atomic_read(&sh->count)) {
 				if (!list_empty(&sh->lru))
 					BUG();
 			} else {
-				if (!test_bit(STRIPE_HANDLE, &sh->state))
+				if (!test_bit(STRIPE_HANDLE, &sh->state) &&
+				    !test_bit(STRIPE_DELAYED, &sh->state))
 					atomic_inc(&conf->active_stripes);
 				if (list_empty(&sh->lru))
 					BUG();
@@ -808,7 +836,7 @@ static void handle_stripe(struct stripe_head *sh)
 	int i;
 	int syncing;
 	int locked=0, uptodate=0, to_read=0, to_write=0, failed=0, written=0;
-	int failed_num=0;
+	int failed_num=0, writes_done=0, delayed=0;
 	struct buffer_head *bh;
 
 	PRINTK("handling stripe %ld, cnt=%d, pd_idx=%d\n", sh->sector, atomic_read(&sh->count), sh->pd_idx);
@@ -870,6 +898,7 @@ static void handle_stripe(struct stripe_head *sh)
 				sh->bh_write[i] = bh->b_reqnext;
 				bh->b_reqnext = return_fail;
 				return_fail = bh;
+				writes_done++;
 			}
 			/* fail any reads if this device is non-operational */
 			if (!conf->disks[i].operational) {
@@ -915,6 +944,7 @@ static void handle_stripe(struct stripe_head *sh)
 			    wbh->b_reqnext = return_ok;
 			    return_ok = wbh;
 			    wbh = wbh2;
+			    writes_done++;
 			}
 		    }
 		}
@@ -970,6 +1000,21 @@ static void handle_stripe(struct stripe_head *sh)
 			}
 		}
 		PRINTK("for sector %ld, rmw=%d rcw=%d\n", sh->sector, rmw, rcw);
+		if (rmw > 0 && rcw > 0 && locked == 0 && failed == 0 && !syncing &&
+		    !test_bit(STRIPE_PREREAD_ACTIVE, &sh->state)) {
+			/*
+			 * Both methods need a pre-read.  Hold the stripe back
+			 * for a little while; if the rest of it is written in
+			 * the meantime we get away with no reads at all.
+			 */
+			PRINTK("delaying partial write of stripe %ld\n", sh->sector);
+			if (!test_and_set_bit(STRIPE_DELAYED, &sh->state)) {
+				sh->expires = jiffies + RAID5_WRITE_DELAY;
+				atomic_inc(&conf->delayed_writes);
+			}
+			delayed = 1;
+			goto write_delayed;
+		}
 		set_bit(STRIPE_HANDLE, &sh->state);
 		if (rmw < rcw && rmw > 0)
 			/* prefer read-modify-write, but need to get some data */
@@ -1000,6 +1045,11 @@ static void handle_stripe(struct stripe_head *sh)
 		/* now if nothing is locked, and if we have enough data, we can start a write request */
 		if (locked == 0 && (rcw == 0 ||rmw == 0)) {
 			PRINTK("Computing parity...\n");
+			if (rcw == 0)
+				atomic_inc(to_write == disks-1 ? &conf->full_writes : &conf->rcw_writes);
+			else
+				atomic_inc(&conf->rmw_writes);
+			clear_bit(STRIPE_PREREAD_ACTIVE, &sh->state);
 			compute_parity(sh, rcw==0 ? RECONSTRUCT_WRITE : READ_MODIFY_WRITE);
 			/* now every locked buffer is ready to be written */
 			for (i=disks; i--;)
@@ -1013,6 +1063,9 @@ static void handle_stripe(struct stripe_head *sh)
 				}
 		}
 	}
+write_delayed:
+	if (!delayed)
+		clear_bit(STRIPE_DELAYED, &sh->state);
 
 	/* maybe we need to check and possibly fix the parity for this stripe
 	 * Any reads will already have been scheduled, so we just see if enough data
@@ -1065,6 +1118,8 @@ static void handle_stripe(struct stripe_head *sh)
 	
 	spin_unlock(&sh->lock);
 
+	while (writes_done--)
+		md_bitmap_endwrite(conf->mddev, sh->sector, sh->size >> 9);
 	while ((bh=return_ok)) {
 		return_ok = bh->b_reqnext;
 		bh->b_reqnext = NULL;
@@ -1125,6 +1180,8 @@ static int raid5_make_request (mddev_t *mddev, int rw, struct buffer_head * bh)
 			raid_disks, data_disks, &dd_idx, &pd_idx, conf);
 
 	PRINTK("raid5_make_request, sector %lu\n", new_sector);
+	if (rw == WRITE)
+		md_bitmap_startwrite(mddev, new_sector, bh->b_size >> 9);
 	sh = get_active_stripe(conf, new_sector, bh->b_size, read_ahead);
 	if (sh) {
 		sh->pd_idx = pd_idx;
@@ -1132,8 +1189,11 @@ static int raid5_make_request (mddev_t *mddev, int rw, struct buffer_head * bh)
 		add_stripe_bh(sh, bh, dd_idx, rw);
 		handle_stripe(sh);
 		release_stripe(sh);
-	} else
+	} else {
+		if (rw == WRITE)
+			md_bitmap_endwrite(mddev, new_sector, bh->b_size >> 9);
 		bh->b_end_io(bh, test_bit(BH_Uptodate, &bh->b_state));
+	}
 	return 0;
 }
 
@@ -1187,27 +1247,49 @@ static int raid5_sync_request (mddev_t *mddev, unsigned long block_nr)
 }
 
 /*
- * This is our raid5 kernel thread.
- *
- * We scan the hash table for stripes which can be handled now.
- * During the scan, completed stripes are saved for us by the interrupt
- * handler, so that they will not have to wait for our next wakeup.
+ * Move delayed stripes whose time is up onto the handle_list, or all
+ * of them if the stripe cache is getting full or someone is waiting
+ * for a free stripe.  Called with device_lock held.
  */
-static void raid5d (void *data)
+static void raid5_activate_delayed(raid5_conf_t *conf)
 {
-	struct stripe_head *sh;
-	raid5_conf_t *conf = data;
-	mddev_t *mddev = conf->mddev;
-	int handled;
-
-	PRINTK("+++ raid5d active\n");
+	int force = atomic_read(&conf->active_stripes) >= RAID5_DELAY_THRESHOLD(conf) ||
+		waitqueue_active(&conf->wait_for_stripe);
 
-	handled = 0;
+	CHECK_DEVLOCK();
+	while (!list_empty(&conf->delayed_list)) {
+		struct list_head *first = conf->delayed_list.next;
+		struct stripe_head *sh = list_entry(first, struct stripe_head, lru);
 
-	if (mddev->sb_dirty) {
-		mddev->sb_dirty = 0;
-		md_update_sb(mddev);
+		if (!force && time_before(jiffies, sh->expires)) {
+			mod_timer(&conf->delay_timer, sh->expires);
+			break;
+		}
+		list_del_init(first);
+		set_bit(STRIPE_PREREAD_ACTIVE, &sh->state);
+		set_bit(STRIPE_HANDLE, &sh->state);
+		list_add_tail(&sh->lru, &conf->handle_list);
 	}
+}
+
+static void raid5_delay_timeout(unsigned long data)
+{
+	raid5_conf_t *conf = (raid5_conf_t *) data;
+
+	md_wakeup_thread(conf->thread);
+}
+
+/*
+ * Drain the handle_list.  Runs in raid5d and in the worker threads;
+ * md threads hold the kernel lock, which stripe handling does not
+ * need, so drop it while we work or the threads serialize on it.
+ */
+static int raid5_handle_list (raid5_conf_t *conf)
+{
+	struct stripe_head *sh;
+	int handled = 0;
+
+	md_unlock_kernel();
 	md_spin_lock_irq(&conf->device_lock);
 	while (!list_empty(&conf->handle_list)) {
 		struct list_head *first = conf->handle_list.next;
@@ -1225,13 +1307,82 @@ static void raid5d (void *data)
 
 		md_spin_lock_irq(&conf->device_lock);
 	}
-	PRINTK("%d stripes handled\n", handled);
+	md_spin_unlock_irq(&conf->device_lock);
+	md_lock_kernel();
+
+	return handled;
+}
 
+/*
+ * This is our raid5 kernel thread.
+ *
+ * We scan the hash table for stripes which can be handled now.
+ * During the scan, completed stripes are saved for us by the interrupt
+ * handler, so that they will not have to wait for our next wakeup.
+ */
+static void raid5d (void *data)
+{
+	raid5_conf_t *conf = data;
+	mddev_t *mddev = conf->mddev;
+	int handled;
+
+	PRINTK("+++ raid5d active\n");
+
+	if (mddev->sb_dirty) {
+		mddev->sb_dirty = 0;
+		md_update_sb(mddev);
+	}
+	md_spin_lock_irq(&conf->device_lock);
+	raid5_activate_delayed(conf);
 	md_spin_unlock_irq(&conf->device_lock);
 
+	handled = raid5_handle_list(conf);
+	PRINTK("%d stripes handled\n", handled);
+
 	PRINTK("--- raid5d inactive\n");
 }
 
+/*
+ * Helper threads, one per extra CPU.  They only handle stripes;
+ * superblock updates and delayed stripes are left to raid5d.
+ */
+static void raid5_worker (void *data)
+{
+	raid5_handle_list((raid5_conf_t *) data);
+}
+
+static void raid5_start_workers (raid5_conf_t *conf)
+{
+	char name[16];
+	int i, nr = smp_num_cpus - 1;
+
+	if (nr > RAID5_MAX_WORKERS)
+		nr = RAID5_MAX_WORKERS;
+	for (i = 0; i < nr; i++) {
+		sprintf(name, "raid5d/%d", i+1);
+		conf->workers[i] = md_register_thread(raid5_worker, conf, name);
+		if (!conf->workers[i]) {
+			printk(KERN_WARNING "raid5: md%d: could only start %d helper threads\n",
+			       mdidx(conf->mddev), i);
+			break;
+		}
+	}
+	conf->nr_workers = i;
+}
+
+static void raid5_stop_workers (raid5_conf_t *conf)
+{
+	int i, nr = conf->nr_workers;
+
+	md_spin_lock_irq(&conf->device_lock);
+	conf->nr_workers = 0;
+	md_spin_unlock_irq(&conf->device_lock);
+	for (i = 0; i < nr; i++) {
+		md_unregister_thread(conf->workers[i]);
+		conf->workers[i] = NULL;
+	}
+}
+
 /*
  * Private kernel thread for parity reconstruction after an unclean
  * shutdown. Reconstruction on spare drives in case of a failed drive
@@ -1359,7 +1510,11 @@ static int raid5_run (mddev_t *mddev)
 	conf->device_lock = MD_SPIN_LOCK_UNLOCKED;
 	md_init_waitqueue_head(&conf->wait_for_stripe);
 	INIT_LIST_HEAD(&conf->handle_list);
+	INIT_LIST_HEAD(&conf->delayed_list);
 	INIT_LIST_HEAD(&conf->inactive_list);
+	init_timer(&conf->delay_timer);
+	conf->delay_timer.function = raid5_delay_timeout;
+	conf->delay_timer.data = (unsigned long) conf;
 	atomic_set(&conf->active_stripes, 0);
 	conf->buffer_size = PAGE_SIZE; /* good default for rebuild */
 
@@ -1511,6 +1666,8 @@ static int raid5_run (mddev_t *mddev)
 	} else
 		printk(KERN_INFO "raid5: allocated %dkB for md%d\n", memory, mdidx(mddev));
 
+	raid5_start_workers(conf);
+
 	/*
 	 * Regenerate the "device is in sync with the raid set" bit for
 	 * each device.
@@ -1555,6 +1712,7 @@ static int raid5_run (mddev_t *mddev)
 abort:
 	if (conf) {
 		print_raid5_conf(conf);
+		raid5_stop_workers(conf);
 		if (conf->stripe_hashtbl)
 			free_pages((unsigned long) conf->stripe_hashtbl,
 							HASH_PAGES_ORDER);
@@ -1608,6 +1766,8 @@ static int raid5_stop (mddev_t *mddev)
 
 	if (conf->resync_thread)
 		md_unregister_thread(conf->resync_thread);
+	del_timer_sync(&conf->delay_timer);
+	raid5_stop_workers(conf);
 	md_unregister_thread(conf->thread);
 	shrink_stripes(conf, conf->max_nr_stripes);
 	free_pages((unsigned long) conf->stripe_hashtbl, HASH_PAGES_ORDER);
@@ -1663,6 +1823,12 @@ static int raid5_status (char *page, mddev_t *mddev)
 	for (i = 0; i < conf->raid_disks; i++)
 		sz += sprintf (page+sz, "%s", conf->disks[i].operational ? "U" : "_");
 	sz += sprintf (page+sz, "]");
+	sz += sprintf (page+sz, "\n      stripe cache: %d/%d active, %d hits, %d misses;"
+			" writes: %d full, %d rcw, %d rmw, %d delayed",
+			atomic_read(&conf->active_stripes), conf->max_nr_stripes,
+			atomic_read(&conf->cache_hits), atomic_read(&conf->cache_misses),
+			atomic_read(&conf->full_writes), atomic_read(&conf->rcw_writes),
+			atomic_read(&conf->rmw_writes), atomic_read(&conf->delayed_writes));
 #if RAID5_DEBUG
 #define D(x) \
 	sz += sprintf (page+sz, "<"#x":%d>", atomic_read(&conf->x))
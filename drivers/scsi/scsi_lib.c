@@ -457,6 +457,7 @@ static Scsi_Cmnd *__scsi_end_request(Scsi_Cmnd * SCpnt,
 	 * request, wake them up.  Typically used to wake up processes trying
 	 * to swap a page into memory.
 	 */
+	drive_stat_done(req);
 	if (req->sem != NULL) {
 		up(req->sem);
 	}
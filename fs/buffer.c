@@ -84,6 +84,30 @@ static spinlock_t lru_list_lock = SPIN_LOCK_UNLOCKED;
 static int nr_buffers_type[NR_LIST];
 static unsigned long size_buffers_type[NR_LIST];
 
+/*
+ * Per-device writeback.  Every device with dirty buffers gets a slot,
+ * which counts its share of the BUF_DIRTY list and has its own bdflush
+ * thread writing back only that device's buffers, so a slow disk does
+ * not hold up the others.  Slot 0 belongs to bdflush itself: it takes
+ * the devices that did not fit in the table, and covers for slots whose
+ * thread has not been started yet.  A slot is given back when its last
+ * dirty buffer goes away; the thread stays around for the next device.
+ * The counters and slot->dev are protected by lru_list_lock.
+ */
+#define NR_WB_SLOTS	16
+#define WB_ANY		(-1)
+
+struct wb_slot {
+	kdev_t dev;			/* NODEV if free (always for slot 0) */
+	int nr_dirty;
+	unsigned long size_dirty;
+	struct task_struct *tsk;	/* the bdflush thread for this slot */
+	int started;			/* ... has been asked for */
+	int flush_old;			/* kupdate wants aged buffers written */
+};
+static struct wb_slot wb_slots[NR_WB_SLOTS];
+static int wb_need_thread;
+
 static struct buffer_head * unused_list;
 static int nr_unused_buffer_heads;
 static spinlock_t unused_list_lock = SPIN_LOCK_UNLOCKED;
@@ -439,6 +463,45 @@ static __inline__ void __hash_unlink(struct buffer_head *bh)
 	}
 }
 
+/* Find (or claim) the writeback slot of a device, lru_list_lock held */
+static int wb_slot_of(kdev_t dev, int claim)
+{
+	struct wb_slot *slot, *free = NULL;
+
+	if (dev == NODEV)
+		return 0;
+	for (slot = wb_slots + 1; slot < wb_slots + NR_WB_SLOTS; slot++) {
+		if (slot->dev == dev)
+			return slot - wb_slots;
+		if (!free && slot->dev == NODEV)
+			free = slot;
+	}
+	if (!claim || !free)
+		return 0;
+	free->dev = dev;
+	if (!free->started)
+		wb_need_thread = 1;
+	return free - wb_slots;
+}
+
+static inline void wb_account(struct buffer_head * bh, int add)
+{
+	struct wb_slot *slot;
+
+	if (add)
+		bh->b_wb = wb_slot_of(bh->b_dev, 1);
+	slot = wb_slots + bh->b_wb;
+	if (add) {
+		slot->nr_dirty++;
+		slot->size_dirty += bh->b_size;
+	} else {
+		slot->nr_dirty--;
+		slot->size_dirty -= bh->b_size;
+		if (!slot->nr_dirty && bh->b_wb)
+			slot->dev = NODEV;
+	}
+}
+
 static void __insert_into_lru_list(struct buffer_head * bh, int blist)
 {
 	struct buffer_head **bhp = &lru_list[blist];
@@ -453,6 +516,8 @@ static void __insert_into_lru_list(struct buffer_head * bh, int blist)
 	(*bhp)->b_prev_free = bh;
 	nr_buffers_type[blist]++;
 	size_buffers_type[blist] += bh->b_size;
+	if (blist == BUF_DIRTY)
+		wb_account(bh, 1);
 }
 
 static void __remove_from_lru_list(struct buffer_head * bh, int blist)
@@ -467,6 +532,8 @@ static void __remove_from_lru_list(struct buffer_head * bh, int blist)
 		bh->b_next_free = bh->b_prev_free = NULL;
 		nr_buffers_type[blist]--;
 		size_buffers_type[blist] -= bh->b_size;
+		if (blist == BUF_DIRTY)
+			wb_account(bh, 0);
 	}
 }
 
@@ -1061,20 +1128,33 @@ int balance_dirty_state(kdev_t dev)
 	return -1;
 }
 
+static int flush_dirty_buffers(int, int, int);
+static void wakeup_wb_slot(int);
+
 /*
  * if a new dirty buffer is created we need to balance bdflush.
  *
- * in the future we might want to make bdflush aware of different
- * pressures on different devices - thus the (currently unused)
- * 'dev' parameter.
+ * The limits are global, but the work is per device: we kick the
+ * thread of the device being dirtied, and a writer over the hard
+ * limit writes back its own device's buffers, so it is throttled to
+ * the speed of the disk it is writing to rather than some other one.
  */
 void balance_dirty(kdev_t dev)
 {
 	int state = balance_dirty_state(dev);
+	int nr;
 
 	if (state < 0)
 		return;
-	wakeup_bdflush(state);
+	spin_lock(&lru_list_lock);
+	nr = wb_slot_of(dev, 0);
+	spin_unlock(&lru_list_lock);
+
+	wakeup_wb_slot(nr);
+	if (nr)
+		wakeup_wb_slot(0);
+	if (state && current != wb_slots[nr].tsk && current != wb_slots[0].tsk)
+		flush_dirty_buffers(nr, 0, 0);
 }
 
 static __inline__ void __mark_dirty(struct buffer_head *bh)
@@ -1651,8 +1731,10 @@ static int __block_commit_write(struct inode *inode, struct page *page,
 		}
 	}
 
-	if (need_balance_dirty)
+	if (need_balance_dirty) {
+		set_page_dirty_buffers(page);
 		balance_dirty(bh->b_dev);
+	}
 	/*
 	 * is this a partial write that happened to make all buffers
 	 * uptodate then we can optimize away a bogus readpage() for
@@ -1737,8 +1819,7 @@ int block_read_full_page(struct page *page, get_block_t *get_block)
 	}
 
 	/* Stage 3: start the IO */
-	for (i = 0; i < nr; i++)
-		submit_bh(READ, arr[i]);
+	submit_bh_vec(READ, nr, arr);
 
 	return 0;
 }
@@ -2118,11 +2199,11 @@ int brw_kiovec(int rw, int nr, struct kiobuf *iovec[],
 
 				atomic_inc(&iobuf->io_count);
 
-				submit_bh(rw, tmp);
 				/* 
 				 * Wait for IO if we have got too much 
 				 */
 				if (bhind >= KIO_MAX_SECTORS) {
+					submit_bh_vec(rw, bhind, bh);
 					err = wait_kio(rw, bhind, bh, size);
 					if (err >= 0)
 						transferred += err;
@@ -2141,6 +2222,7 @@ int brw_kiovec(int rw, int nr, struct kiobuf *iovec[],
 
 	/* Is there any IO still left to submit? */
 	if (bhind) {
+		submit_bh_vec(rw, bhind, bh);
 		err = wait_kio(rw, bhind, bh, size);
 		if (err >= 0)
 			transferred += err;
@@ -2154,13 +2236,14 @@ int brw_kiovec(int rw, int nr, struct kiobuf *iovec[],
 	return err;
 
  error:
-	/* We got an error allocating the bh'es.  Just free the current
-           buffer_heads and exit. */
-	spin_lock(&unused_list_lock);
-	for (i = bhind; --i >= 0; ) {
-		__put_unused_buffer_head(bh[i]);
+	/* We got an error allocating the bh'es.  Finish what is set up
+	   already, wait_kio() frees the buffer_heads. */
+	if (bhind) {
+		submit_bh_vec(rw, bhind, bh);
+		i = wait_kio(rw, bhind, bh, size);
+		if (i > 0)
+			transferred += i;
 	}
-	spin_unlock(&unused_list_lock);
 	goto finished;
 }
 
@@ -2178,7 +2261,8 @@ int brw_kiovec(int rw, int nr, struct kiobuf *iovec[],
  */
 int brw_page(int rw, struct page *page, kdev_t dev, int b[], int size)
 {
-	struct buffer_head *head, *bh;
+	struct buffer_head *head, *bh, *arr[MAX_BUF_PER_PAGE];
+	int nr = 0;
 
 	if (!PageLocked(page))
 		panic("brw_page: page not locked for I/O");
@@ -2194,14 +2278,12 @@ int brw_page(int rw, struct page *page, kdev_t dev, int b[], int size)
 		set_bit(BH_Mapped, &bh->b_state);
 		bh->b_end_io = end_buffer_io_async;
 		atomic_inc(&bh->b_count);
+		arr[nr++] = bh;
 		bh = bh->b_this_page;
 	} while (bh != head);
 
 	/* Stage 2: start the IO */
-	do {
-		submit_bh(rw, bh);
-		bh = bh->b_this_page;
-	} while (bh != head);
+	submit_bh_vec(rw, nr, arr);
 	return 0;
 }
 
@@ -2419,17 +2501,27 @@ busy_buffer_page:
 
 void show_buffers(void)
 {
+	int nlist;
 #ifdef CONFIG_SMP
 	struct buffer_head * bh;
 	int found = 0, locked = 0, dirty = 0, used = 0, lastused = 0;
 	int protected = 0;
-	int nlist;
 	static char *buf_types[NR_LIST] = { "CLEAN", "LOCKED", "DIRTY", "PROTECTED", };
 #endif
 
 	printk("Buffer memory:   %6dkB\n",
 			atomic_read(&buffermem_pages) << (PAGE_SHIFT-10));
 
+	for (nlist = 0; nlist < NR_WB_SLOTS; nlist++) {
+		struct wb_slot *slot = wb_slots + nlist;
+
+		if (!slot->nr_dirty)
+			continue;
+		printk("%9s: %d dirty buffers, %lu kbyte\n",
+		       nlist ? kdevname(slot->dev) : "shared",
+		       slot->nr_dirty, slot->size_dirty >> 10);
+	}
+
 #ifdef CONFIG_SMP /* trylock does nothing on UP and so we could deadlock */
 	if (!spin_trylock(&lru_list_lock))
 		return;
@@ -2534,18 +2626,36 @@ void __init buffer_init(unsigned long mempages)
  * a limited number of buffers to the disks and then go back to sleep again.
  */
 
+/* Does writeback slot nr (or WB_ANY) write this buffer? */
+static inline int wb_mine(struct buffer_head * bh, int nr)
+{
+	if (nr == WB_ANY || bh->b_wb == nr)
+		return 1;
+	/* bdflush covers for slots that have no thread yet */
+	return !nr && !wb_slots[bh->b_wb].tsk;
+}
+
 /* This is the _only_ function that deals with flushing async writes
    to disk.
    NOTENOTENOTENOTE: we _only_ need to browse the DIRTY lru list
    as all dirty buffers lives _only_ in the DIRTY lru list.
    As we never browse the LOCKED and CLEAN lru lists they are infact
-   completly useless. */
-static int flush_dirty_buffers(int check_flushtime)
-{
-	struct buffer_head * bh, *next;
-	int flushed = 0, i;
+   completly useless.
+
+   We pick up to NRSYNC buffers of one device belonging to writeback
+   slot nr and submit them in one go.  If 'pages' is set, file data is
+   written by page instead: the first such buffer sends out its page and
+   the dirty pages after it in the file, NRSYNC pages at most.  Only the
+   flush threads may do that - a writer throttled in balance_dirty() can
+   hold locks (lock_super() in ext2_new_block(), say) that ->writepage()
+   needs. */
+#define NRSYNC 32
+static int write_some_buffers(int nr, int check_flushtime, int pages)
+{
+	struct buffer_head * bh, *next, *array[NRSYNC];
+	struct page *page = NULL;
+	int count = 0, i, size = 0;
 
- restart:
 	spin_lock(&lru_list_lock);
 	bh = lru_list[BUF_DIRTY];
 	if (!bh)
@@ -2557,47 +2667,97 @@ static int flush_dirty_buffers(int check_flushtime)
 			__refile_buffer(bh);
 			continue;
 		}
-		if (buffer_locked(bh))
+		if (buffer_locked(bh) || !wb_mine(bh, nr))
 			continue;
 
 		if (check_flushtime) {
 			/* The dirty lru list is chronologically ordered so
 			   if the current bh is not yet timed out,
-			   then also all the following bhs
+			   then also all the following bhs of this slot
 			   will be too young. */
 			if (time_before(jiffies, bh->b_flushtime))
-				goto out_unlock;
-		} else {
-			if (++flushed > bdf_prm.b_un.ndirty)
-				goto out_unlock;
+				break;
 		}
+		/* ll_rw_block() wants a single device and block size: it
+		   drops the whole batch if one of them does not match */
+		if (count && (bh->b_dev != array[0]->b_dev ||
+			      bh->b_size != array[0]->b_size))
+			continue;
 
-		/* OK, now we are committed to write it out. */
-		atomic_inc(&bh->b_count);
-		spin_unlock(&lru_list_lock);
-		ll_rw_block(WRITE, 1, &bh);
-		atomic_dec(&bh->b_count);
+		/*
+		 * Only trylock the page: the writer may be holding it
+		 * while it throttles in balance_dirty().
+		 */
+		if (pages && !count && bh->b_page->mapping &&
+		    PageDirty(bh->b_page) && !TryLockPage(bh->b_page)) {
+			page = bh->b_page;
+			page_cache_get(page);
+			size = bh->b_size;
+			break;
+		}
 
-		if (current->need_resched)
-			schedule();
-		goto restart;
+		atomic_inc(&bh->b_count);
+		array[count++] = bh;
+		if (count == NRSYNC)
+			break;
 	}
  out_unlock:
 	spin_unlock(&lru_list_lock);
 
+	if (page) {
+		/*
+		 * Callers count buffers.  If the page was not dirty, its
+		 * buffers still are: report progress so we come back for them.
+		 */
+		count = filemap_write_cluster(page, NRSYNC);
+		return count ? count * (PAGE_CACHE_SIZE / size) : 1;
+	}
+	if (count) {
+		ll_rw_block(WRITE, count, array);
+		for (i = 0; i < count; i++)
+			atomic_dec(&array[i]->b_count);
+	}
+	return count;
+}
+
+/*
+ * Write back the aged buffers of a slot, or up to ndirty of them.
+ */
+static int flush_dirty_buffers(int nr, int check_flushtime, int pages)
+{
+	int flushed = 0, written;
+
+	do {
+		written = write_some_buffers(nr, check_flushtime, pages);
+		flushed += written;
+		if (current->need_resched)
+			schedule();
+	} while (written && (check_flushtime ||
+			     flushed < bdf_prm.b_un.ndirty));
+
 	return flushed;
 }
 
 struct task_struct *bdflush_tsk = 0;
 
+static void wakeup_wb_slot(int nr)
+{
+	struct task_struct *tsk = wb_slots[nr].tsk;
+
+	if (tsk && tsk != current)
+		wake_up_process(tsk);
+}
+
 void wakeup_bdflush(int block)
 {
-	if (current != bdflush_tsk) {
-		wake_up_process(bdflush_tsk);
+	int nr;
 
-		if (block)
-			flush_dirty_buffers(0);
-	}
+	for (nr = 0; nr < NR_WB_SLOTS; nr++)
+		if (!nr || wb_slots[nr].nr_dirty)
+			wakeup_wb_slot(nr);
+
+	if (block && current != bdflush_tsk)
+		flush_dirty_buffers(WB_ANY, 0, 0);
 }
 
 /* 
@@ -2610,12 +2770,24 @@ void wakeup_bdflush(int block)
 
 static int sync_old_buffers(void)
 {
+	int nr;
+
 	lock_kernel();
 	sync_supers(0);
 	sync_inodes(0);
 	unlock_kernel();
 
-	flush_dirty_buffers(1);
+	/* Each device thread writes its own aged buffers... */
+	for (nr = 1; nr < NR_WB_SLOTS; nr++) {
+		struct wb_slot *slot = wb_slots + nr;
+
+		if (slot->tsk && slot->nr_dirty) {
+			slot->flush_old = 1;
+			wake_up_process(slot->tsk);
+		}
+	}
+	/* ... and we do the rest */
+	flush_dirty_buffers(0, 1, 1);
 	/* must really sync all the active I/O request to disk here */
 	run_task_queue(&tq_disk);
 	return 0;
@@ -2680,15 +2852,8 @@ asmlinkage long sys_bdflush(int func, long data)
 	return 0;
 }
 
-/*
- * This is the actual bdflush daemon itself. It used to be started from
- * the syscall above, but now we launch it ourselves internally with
- * kernel_thread(...)  directly after the first thread in init/main.c
- */
-int bdflush(void *sem)
+static void bdflush_setup(struct task_struct *tsk)
 {
-	struct task_struct *tsk = current;
-	int flushed;
 	/*
 	 *	We have a bare-bones task_struct, and really should fill
 	 *	in a few more things so "top" and /proc/2/{exe,root,cwd}
@@ -2697,8 +2862,6 @@ int bdflush(void *sem)
 
 	tsk->session = 1;
 	tsk->pgrp = 1;
-	strcpy(tsk->comm, "bdflush");
-	bdflush_tsk = tsk;
 
 	/* avoid getting signals */
 	spin_lock_irq(&tsk->sigmask_lock);
@@ -2706,13 +2869,82 @@ int bdflush(void *sem)
 	sigfillset(&tsk->blocked);
 	recalc_sigpending(tsk);
 	spin_unlock_irq(&tsk->sigmask_lock);
+}
+
+/*
+ * The writeback thread of one device slot.  Started by bdflush the
+ * first time the slot is claimed, it never exits: once the device has
+ * no dirty buffers left the slot is free for the next one.
+ */
+static int bdflush_dev(void *arg)
+{
+	struct task_struct *tsk = current;
+	int nr = (long) arg;
+	struct wb_slot *slot = wb_slots + nr;
+	int flushed;
+
+	bdflush_setup(tsk);
+	sprintf(tsk->comm, "bdflush/%d", nr);
+	slot->tsk = tsk;
+
+	for (;;) {
+		flushed = 0;
+		if (slot->flush_old) {
+			slot->flush_old = 0;
+			flush_dirty_buffers(nr, 1, 1);
+		}
+		if (balance_dirty_state(NODEV) >= 0)
+			flushed = flush_dirty_buffers(nr, 0, 1);
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!slot->flush_old &&
+		    (!flushed || balance_dirty_state(NODEV) < 0)) {
+			run_task_queue(&tq_disk);
+			schedule();
+		}
+		__set_current_state(TASK_RUNNING);
+	}
+}
+
+static void start_wb_threads(void)
+{
+	int nr;
+
+	wb_need_thread = 0;
+	for (nr = 1; nr < NR_WB_SLOTS; nr++) {
+		if (wb_slots[nr].started || wb_slots[nr].dev == NODEV)
+			continue;
+		wb_slots[nr].started = 1;
+		if (kernel_thread(bdflush_dev, (void *) (long) nr,
+				  CLONE_FS | CLONE_FILES | CLONE_SIGNAL) < 0)
+			wb_slots[nr].started = 0;	/* we cover for it */
+	}
+}
+
+/*
+ * This is the actual bdflush daemon itself. It used to be started from
+ * the syscall above, but now we launch it ourselves internally with
+ * kernel_thread(...)  directly after the first thread in init/main.c
+ */
+int bdflush(void *sem)
+{
+	struct task_struct *tsk = current;
+	int flushed;
+
+	bdflush_setup(tsk);
+	strcpy(tsk->comm, "bdflush");
+	bdflush_tsk = tsk;
+	wb_slots[0].tsk = tsk;
 
 	up((struct semaphore *)sem);
 
 	for (;;) {
 		CHECK_EMERGENCY_SYNC
 
-		flushed = flush_dirty_buffers(0);
+		if (wb_need_thread)
+			start_wb_threads();
+
+		flushed = flush_dirty_buffers(0, 0, 1);
 		if (free_shortage())
 			flushed += page_launder(GFP_KERNEL, 0);
 
@@ -2722,7 +2954,8 @@ int bdflush(void *sem)
 		 * go to sleep waiting a wakeup.
 		 */
 		set_current_state(TASK_INTERRUPTIBLE);
-		if (!flushed || balance_dirty_state(NODEV) < 0) {
+		if (!wb_need_thread &&
+		    (!flushed || balance_dirty_state(NODEV) < 0)) {
 			run_task_queue(&tq_disk);
 			schedule();
 		}
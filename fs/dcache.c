@@ -23,6 +23,7 @@
 #include <linux/init.h>
 #include <linux/smp_lock.h>
 #include <linux/cache.h>
+#include <linux/brlock.h>
 
 #include <asm/uaccess.h>
 
@@ -31,6 +32,22 @@
 
 spinlock_t dcache_lock = SPIN_LOCK_UNLOCKED;
 
+/*
+ * d_lookup() does not take dcache_lock: it walks the hash chain under
+ * the BR_DCACHE_LOCK big-reader lock, which costs a reader nothing but
+ * its own CPU's cache line.  Anybody who puts a dentry on or takes it
+ * off a hash chain, or changes the name or parent of a hashed dentry,
+ * holds dcache_lock and takes BR_DCACHE_LOCK for writing.  d_lookup()
+ * does not look at d_inode, so d_instantiate() only takes dcache_lock.
+ * The DCACHE_REFERENCED bit d_lookup() sets is in d_vfs_flags, which
+ * only sees atomic bitops, not in d_flags.
+ *
+ * Since d_lookup() can bump d_count from zero without dcache_lock, it
+ * leaves the dentry where it is on the LRU list; dput() and the pruning
+ * code sort that out under dcache_lock.  Before a hashed dentry is freed
+ * its d_count is rechecked with the write lock held.
+ */
+
 /* Right now the dcache depends on the kernel lock */
 #define check_lock()	if (!kernel_locked()) BUG()
 
@@ -129,9 +146,6 @@ repeat:
 	if (!atomic_dec_and_lock(&dentry->d_count, &dcache_lock))
 		return;
 
-	/* dput on a free dentry? */
-	if (!list_empty(&dentry->d_lru))
-		BUG();
 	/*
 	 * AV: ->d_delete() is _NOT_ allowed to block now.
 	 */
@@ -142,8 +156,15 @@ repeat:
 	/* Unreachable? Get rid of it */
 	if (list_empty(&dentry->d_hash))
 		goto kill_it;
+	/*
+	 * d_lookup() leaves the dentry on the LRU list, so it may
+	 * still be there; move it to the recent end in that case.
+	 */
+	if (list_empty(&dentry->d_lru))
+		dentry_stat.nr_unused++;
+	else
+		list_del(&dentry->d_lru);
 	list_add(&dentry->d_lru, &dentry_unused);
-	dentry_stat.nr_unused++;
 	/*
 	 * Update the timestamp
 	 */
@@ -152,10 +173,19 @@ repeat:
 	return;
 
 unhash_it:
-	list_del_init(&dentry->d_hash);
+	__d_drop(dentry);
+	/* d_lookup() got it before it went off the hash? Then it's theirs */
+	if (atomic_read(&dentry->d_count)) {
+		spin_unlock(&dcache_lock);
+		return;
+	}
 
 kill_it: {
 		struct dentry *parent;
+		if (!list_empty(&dentry->d_lru)) {
+			list_del(&dentry->d_lru);
+			dentry_stat.nr_unused--;
+		}
 		list_del(&dentry->d_child);
 		/* drops the lock, at that point nobody can reach this dentry */
 		dentry_iput(dentry);
@@ -217,7 +247,7 @@ int d_invalidate(struct dentry * dentry)
 		}
 	}
 
-	list_del_init(&dentry->d_hash);
+	__d_drop(dentry);
 	spin_unlock(&dcache_lock);
 	return 0;
 }
@@ -227,7 +257,7 @@ int d_invalidate(struct dentry * dentry)
 static inline struct dentry * __dget_locked(struct dentry *dentry)
 {
 	atomic_inc(&dentry->d_count);
-	if (atomic_read(&dentry->d_count) == 1) {
+	if (atomic_read(&dentry->d_count) == 1 && !list_empty(&dentry->d_lru)) {
 		dentry_stat.nr_unused--;
 		list_del(&dentry->d_lru);
 		INIT_LIST_HEAD(&dentry->d_lru);		/* make "list_empty()" work */
@@ -300,12 +330,21 @@ restart:
  * This requires that the LRU list has already been
  * removed.
  * Called with dcache_lock, drops it and then regains.
+ * If d_lookup() has picked the dentry up in the meantime
+ * we leave it alone (without dropping the lock); dput()
+ * will put it back on the LRU list.
  */
 static inline void prune_one_dentry(struct dentry * dentry)
 {
 	struct dentry * parent;
 
+	br_write_lock(BR_DCACHE_LOCK);
+	if (atomic_read(&dentry->d_count)) {
+		br_write_unlock(BR_DCACHE_LOCK);
+		return;
+	}
 	list_del_init(&dentry->d_hash);
+	br_write_unlock(BR_DCACHE_LOCK);
 	list_del(&dentry->d_child);
 	dentry_iput(dentry);
 	parent = dentry->d_parent;
@@ -343,17 +382,16 @@ void prune_dcache(int count)
 		dentry = list_entry(tmp, struct dentry, d_lru);
 
 		/* If the dentry was recently referenced, don't free it. */
-		if (dentry->d_flags & DCACHE_REFERENCED) {
-			dentry->d_flags &= ~DCACHE_REFERENCED;
+		if (test_and_clear_bit(DCACHE_REFERENCED, &dentry->d_vfs_flags)) {
 			list_add(&dentry->d_lru, &dentry_unused);
 			count--;
 			continue;
 		}
 		dentry_stat.nr_unused--;
 
-		/* Unused dentry with a count? */
+		/* Picked up by d_lookup() while it was on the list? */
 		if (atomic_read(&dentry->d_count))
-			BUG();
+			continue;
 
 		prune_one_dentry(dentry);
 		if (!--count)
@@ -619,6 +657,7 @@ struct dentry * d_alloc(struct dentry * parent, const struct qstr *name)
 
 	atomic_set(&dentry->d_count, 1);
 	dentry->d_flags = 0;
+	dentry->d_vfs_flags = 0;
 	dentry->d_inode = NULL;
 	dentry->d_parent = NULL;
 	dentry->d_sb = NULL;
@@ -719,7 +758,7 @@ struct dentry * d_lookup(struct dentry * parent, struct qstr * name)
 	struct list_head *head = d_hash(parent,hash);
 	struct list_head *tmp;
 
-	spin_lock(&dcache_lock);
+	br_read_lock(BR_DCACHE_LOCK);
 	tmp = head->next;
 	for (;;) {
 		struct dentry * dentry = list_entry(tmp, struct dentry, d_hash);
@@ -739,12 +778,17 @@ struct dentry * d_lookup(struct dentry * parent, struct qstr * name)
 			if (memcmp(dentry->d_name.name, str, len))
 				continue;
 		}
-		__dget_locked(dentry);
-		dentry->d_flags |= DCACHE_REFERENCED;
-		spin_unlock(&dcache_lock);
+		/*
+		 * Nobody can unhash it or drop its last reference
+		 * for good while we hold the read lock.
+		 */
+		atomic_inc(&dentry->d_count);
+		if (!test_bit(DCACHE_REFERENCED, &dentry->d_vfs_flags))
+			set_bit(DCACHE_REFERENCED, &dentry->d_vfs_flags);
+		br_read_unlock(BR_DCACHE_LOCK);
 		return dentry;
 	}
-	spin_unlock(&dcache_lock);
+	br_read_unlock(BR_DCACHE_LOCK);
 	return NULL;
 }
 
@@ -828,13 +872,29 @@ out:
 void d_delete(struct dentry * dentry)
 {
 	/*
-	 * Are we the only user?
+	 * Are we the only user?  Keep d_lookup() out until the
+	 * dentry has gone negative, or it could pick up the inode
+	 * we are about to release.
 	 */
 	spin_lock(&dcache_lock);
+	br_write_lock(BR_DCACHE_LOCK);
 	if (atomic_read(&dentry->d_count) == 1) {
-		dentry_iput(dentry);
+		struct inode *inode = dentry->d_inode;
+
+		dentry->d_inode = NULL;
+		br_write_unlock(BR_DCACHE_LOCK);
+		if (inode) {
+			list_del_init(&dentry->d_alias);
+			spin_unlock(&dcache_lock);
+			if (dentry->d_op && dentry->d_op->d_iput)
+				dentry->d_op->d_iput(dentry, inode);
+			else
+				iput(inode);
+		} else
+			spin_unlock(&dcache_lock);
 		return;
 	}
+	br_write_unlock(BR_DCACHE_LOCK);
 	spin_unlock(&dcache_lock);
 
 	/*
@@ -855,10 +915,27 @@ void d_rehash(struct dentry * entry)
 {
 	struct list_head *list = d_hash(entry->d_parent, entry->d_name.hash);
 	spin_lock(&dcache_lock);
+	br_write_lock(BR_DCACHE_LOCK);
 	list_add(&entry->d_hash, list);
+	br_write_unlock(BR_DCACHE_LOCK);
 	spin_unlock(&dcache_lock);
 }
 
+/**
+ * __d_drop - unhash a dentry
+ * @dentry: dentry to drop
+ *
+ * Same as d_drop(), for callers that already hold dcache_lock.
+ */
+
+void __d_drop(struct dentry * dentry)
+{
+	br_write_lock(BR_DCACHE_LOCK);
+	list_del(&dentry->d_hash);
+	INIT_LIST_HEAD(&dentry->d_hash);
+	br_write_unlock(BR_DCACHE_LOCK);
+}
+
 #define do_switch(x,y) do { \
 	__typeof__ (x) __tmp = x; \
 	x = y; y = __tmp; } while (0)
@@ -923,6 +1000,7 @@ void d_move(struct dentry * dentry, struct dentry * target)
 		printk(KERN_WARNING "VFS: moving negative dcache entry\n");
 
 	spin_lock(&dcache_lock);
+	br_write_lock(BR_DCACHE_LOCK);
 	/* Move the dentry to the target hash queue */
 	list_del(&dentry->d_hash);
 	list_add(&dentry->d_hash, &target->d_hash);
@@ -943,6 +1021,7 @@ void d_move(struct dentry * dentry, struct dentry * target)
 	/* And add them back to the (new) parent lists */
 	list_add(&target->d_child, &target->d_parent->d_subdirs);
 	list_add(&dentry->d_child, &dentry->d_parent->d_subdirs);
+	br_write_unlock(BR_DCACHE_LOCK);
 	spin_unlock(&dcache_lock);
 }
 
@@ -345,12 +345,37 @@ error_return:
 	return;
 }
 
+/*
+ * Look for @len consecutive free bytes (8 * @len free blocks) in a block
+ * bitmap of @size bits, starting at the first byte boundary at or after
+ * bit @start.  Returns the first bit of the run, or @size if none found.
+ */
+static int find_free_run (char * map, int start, int size, int len)
+{
+	int i, end = size >> 3, run = 0;
+
+	for (i = (start + 7) >> 3; i < end; i++) {
+		if (map[i]) {
+			run = 0;
+			continue;
+		}
+		if (++run == len)
+			return (i - len + 1) << 3;
+	}
+	return size;
+}
+
 /*
  * ext2_new_block uses a goal block to assist allocation.  If the goal is
  * free, or there is a free block within 32 blocks of the goal, that block
  * is allocated.  Otherwise a forward search is made for a free block; within 
  * each block group the search first looks for an entire free byte in the block
  * bitmap, and then for any free bit if that fails.
+ *
+ * If the caller wants a preallocation window bigger than the default, we
+ * skip the free blocks near the goal and look for a free run large enough
+ * for the whole window instead, so that concurrent writers in the same
+ * group do not end up interleaved.
  */
 int ext2_new_block (const struct inode * inode, unsigned long goal,
     u32 * prealloc_count, u32 * prealloc_block, int * err)
@@ -360,6 +385,7 @@ int ext2_new_block (const struct inode * inode, unsigned long goal,
 	char * p, * r;
 	int i, j, k, tmp;
 	int bitmap_nr;
+	int prealloc_goal = 0, want_run = 0;
 	struct super_block * sb;
 	struct ext2_group_desc * gdp;
 	struct ext2_super_block * es;
@@ -384,6 +410,19 @@ int ext2_new_block (const struct inode * inode, unsigned long goal,
 
 	ext2_debug ("goal=%lu.\n", goal);
 
+#ifdef EXT2_PREALLOCATE
+	/* Reader: ->i_prealloc* */
+	if (prealloc_count && !*prealloc_count) {
+		prealloc_goal = inode->u.ext2_i.i_prealloc_window;
+		if (!prealloc_goal)
+			prealloc_goal = es->s_prealloc_blocks ?
+				es->s_prealloc_blocks : EXT2_DEFAULT_PREALLOC_BLOCKS;
+		if (prealloc_goal > EXT2_DEFAULT_PREALLOC_BLOCKS)
+			want_run = prealloc_goal >> 3;
+	}
+	/* Reader: end */
+#endif
+
 repeat:
 	/*
 	 * First, test whether the goal block is free.
@@ -428,12 +467,21 @@ repeat:
 			 */
 			int end_goal = (j + 63) & ~63;
 			j = ext2_find_next_zero_bit(bh->b_data, end_goal, j);
-			if (j < end_goal)
+			if (j < end_goal && !want_run)
 				goto got_block;
 		}
 	
 		ext2_debug ("Bit not found near goal\n");
 
+		if (want_run) {
+			k = find_free_run (bh->b_data, j,
+					   EXT2_BLOCKS_PER_GROUP(sb), want_run);
+			if (k < EXT2_BLOCKS_PER_GROUP(sb)) {
+				j = k;
+				goto search_back;
+			}
+		}
+
 		/*
 		 * There has been no free block found in the near vicinity
 		 * of the goal: do a search forward through the block groups,
@@ -543,12 +591,8 @@ got_block:
 #ifdef EXT2_PREALLOCATE
 	/* Writer: ->i_prealloc* */
 	if (prealloc_count && !*prealloc_count) {
-		int	prealloc_goal;
 		unsigned long next_block = tmp + 1;
 
-		prealloc_goal = es->s_prealloc_blocks ?
-			es->s_prealloc_blocks : EXT2_DEFAULT_PREALLOC_BLOCKS;
-
 		*prealloc_block = next_block;
 		/* Writer: end */
 		for (k = 1;
@@ -32,11 +32,15 @@
 static int ext2_update_inode(struct inode * inode, int do_sync);
 
 /*
- * Called at each iput()
+ * Called at each iput().  While the file is open for writing, a stat()
+ * or open() must not throw away the writer's reservation window: the
+ * last writer's close discards it (ext2_release_file()).  Without
+ * writers, any iput() drops what is left.
  */
 void ext2_put_inode (struct inode * inode)
 {
-	ext2_discard_prealloc (inode);
+	if (atomic_read(&inode->i_writecount) <= 0)
+		ext2_discard_prealloc (inode);
 }
 
 /*
@@ -50,6 +54,7 @@ void ext2_delete_inode (struct inode * inode)
 	    inode->i_ino == EXT2_ACL_IDX_INO ||
 	    inode->i_ino == EXT2_ACL_DATA_INO)
 		goto no_delete;
+	ext2_discard_prealloc(inode);
 	inode->u.ext2_i.i_dtime	= CURRENT_TIME;
 	mark_inode_dirty(inode);
 	ext2_update_inode(inode, IS_SYNC(inode));
@@ -82,6 +87,31 @@ void ext2_discard_prealloc (struct inode * inode)
 #endif
 }
 
+#ifdef EXT2_PREALLOCATE
+/*
+ * The reservation window of a regular file starts at s_prealloc_blocks
+ * and doubles every time a sequential writer uses it up completely, so
+ * that streaming writers grab long contiguous runs and concurrent ones
+ * do not interleave their blocks.  Any non-sequential allocation shrinks
+ * it back to the default.
+ */
+static void ext2_update_prealloc_window(struct inode * inode, int sequential)
+{
+	struct ext2_super_block * es = inode->i_sb->u.ext2_sb.s_es;
+	unsigned long window = es->s_prealloc_blocks ?
+			es->s_prealloc_blocks : EXT2_DEFAULT_PREALLOC_BLOCKS;
+
+	if (sequential && inode->u.ext2_i.i_prealloc_window) {
+		window = inode->u.ext2_i.i_prealloc_window << 1;
+		if (window > EXT2_MAX_PREALLOC_BLOCKS)
+			window = EXT2_MAX_PREALLOC_BLOCKS;
+	}
+	/* Writer: ->i_prealloc* */
+	inode->u.ext2_i.i_prealloc_window = window;
+	/* Writer: end */
+}
+#endif
+
 static int ext2_alloc_block (struct inode * inode, unsigned long goal, int *err)
 {
 #ifdef EXT2FS_DEBUG
@@ -104,16 +134,31 @@ static int ext2_alloc_block (struct inode * inode, unsigned long goal, int *err)
 			    ++alloc_hits, ++alloc_attempts);
 #endif
 	} else {
+		/* Reader: ->i_prealloc* */
+		unsigned long next = inode->u.ext2_i.i_prealloc_block;
+		/* Reader: end */
+
 		ext2_discard_prealloc (inode);
 #ifdef EXT2FS_DEBUG
 		ext2_debug ("preallocation miss (%lu/%lu).\n",
 			    alloc_hits, ++alloc_attempts);
 #endif
-		if (S_ISREG(inode->i_mode))
+		/*
+		 * Writeback of a shared mapping after the file was closed
+		 * has no writer left whose close would hand back the window.
+		 */
+		if (S_ISREG(inode->i_mode) &&
+		    atomic_read(&inode->i_writecount) > 0) {
+			/*
+			 * If the window had been used up to its very end we
+			 * are continuing a sequential run.
+			 */
+			ext2_update_prealloc_window(inode, next &&
+				(goal == next || goal + 1 == next));
 			result = ext2_new_block (inode, goal, 
 				 &inode->u.ext2_i.i_prealloc_count,
 				 &inode->u.ext2_i.i_prealloc_block, err);
-		else
+		} else
 			result = ext2_new_block (inode, goal, 0, 0, err);
 	}
 #else
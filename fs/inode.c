@@ -64,6 +64,25 @@ static LIST_HEAD(anon_hash_chain); /* for inodes with NULL i_sb */
  */
 spinlock_t inode_lock = SPIN_LOCK_UNLOCKED;
 
+/*
+ * The hash chains have locks of their own, so that looking up an inode
+ * which is already in use does not have to touch inode_lock at all.
+ * Each lock covers every I_HASHLOCKS'th chain.
+ *
+ * Putting an inode on or taking it off a chain requires both the chain
+ * lock and inode_lock (in that order), so either of them is enough to
+ * look at ->i_hash.  The last iput() of a hashed inode drops i_count to
+ * zero under the chain lock, which keeps lookups from picking up an inode
+ * that is about to go away.
+ */
+#define I_HASHLOCKS	256
+
+static struct {
+	spinlock_t lock;
+} ____cacheline_aligned inode_hash_locks[I_HASHLOCKS];
+
+static spinlock_t anon_hash_lock = SPIN_LOCK_UNLOCKED;
+
 /*
  * Statistics gathering..
  */
@@ -75,6 +94,27 @@ struct {
 
 static kmem_cache_t * inode_cachep;
 
+static inline unsigned long hash(struct super_block *sb, unsigned long i_ino)
+{
+	unsigned long tmp = i_ino | ((unsigned long) sb / L1_CACHE_BYTES);
+	tmp = tmp + (tmp >> I_HASHBITS) + (tmp >> I_HASHBITS*2);
+	return tmp & I_HASHMASK;
+}
+
+static inline spinlock_t * chain_lock(struct list_head *head)
+{
+	if (head == &anon_hash_chain)
+		return &anon_hash_lock;
+	return &inode_hash_locks[(head - inode_hashtable) & (I_HASHLOCKS-1)].lock;
+}
+
+static inline spinlock_t * inode_hash_lock(struct inode *inode)
+{
+	if (!inode->i_sb)
+		return &anon_hash_lock;
+	return &inode_hash_locks[hash(inode->i_sb, inode->i_ino) & (I_HASHLOCKS-1)].lock;
+}
+
 #define alloc_inode() \
 	 ((struct inode *) kmem_cache_alloc(inode_cachep, SLAB_KERNEL))
 static void destroy_inode(struct inode *inode) 
@@ -135,6 +175,16 @@ void __mark_inode_dirty(struct inode *inode, int flags)
 {
 	struct super_block * sb = inode->i_sb;
 
+	/*
+	 * Don't bother with inode_lock if the inode is dirty already -
+	 * atime updates hit this on every read.  The barrier orders the
+	 * caller's changes to the inode against sync_one() clearing
+	 * I_DIRTY before it writes the inode out.
+	 */
+	smp_mb();
+	if ((inode->i_state & flags) == flags)
+		return;
+
 	if (sb) {
 		spin_lock(&inode_lock);
 		if ((inode->i_state & flags) != flags) {
@@ -177,6 +227,9 @@ static inline void write_inode(struct inode *inode, int sync)
 		inode->i_sb->s_op->write_inode(inode, sync);
 }
 
+/*
+ * Called with inode_lock held.
+ */
 static inline void __iget(struct inode * inode)
 {
 	if (atomic_read(&inode->i_count)) {
@@ -191,6 +244,23 @@ static inline void __iget(struct inode * inode)
 	inodes_stat.nr_unused--;
 }
 
+/*
+ * Same for an inode found in the hash, called with its chain lock held.
+ * Nobody can drop the last reference under us, so an inode in use only
+ * needs its count bumped; inode_lock is taken just to get an unused one
+ * off the unused list.
+ */
+static inline void __iget_hashed(struct inode * inode)
+{
+	if (atomic_read(&inode->i_count)) {
+		atomic_inc(&inode->i_count);
+		return;
+	}
+	spin_lock(&inode_lock);
+	__iget(inode);
+	spin_unlock(&inode_lock);
+}
+
 static inline void sync_one(struct inode *inode, int sync)
 {
 	if (inode->i_state & I_LOCK) {
@@ -429,8 +499,22 @@ static int invalidate_list(struct list_head *head, struct super_block * sb, stru
 			continue;
 		invalidate_inode_buffers(inode);
 		if (!atomic_read(&inode->i_count)) {
+			spinlock_t * lock = inode_hash_lock(inode);
+
+			if (!spin_trylock(lock)) {
+				/*
+				 * Chain locks nest outside inode_lock: wait
+				 * for the holder and rescan the list.
+				 */
+				spin_unlock(&inode_lock);
+				spin_unlock_wait(lock);
+				spin_lock(&inode_lock);
+				next = head->next;
+				continue;
+			}
 			list_del(&inode->i_hash);
 			INIT_LIST_HEAD(&inode->i_hash);
+			spin_unlock(lock);
 			list_del(&inode->i_list);
 			list_add(&inode->i_list, dispose);
 			inode->i_state |= I_FREEING;
@@ -508,6 +592,7 @@ void prune_icache(int goal)
 	while (entry != &inode_unused)
 	{
 		struct list_head *tmp = entry;
+		spinlock_t *lock;
 
 		entry = entry->prev;
 		inode = INODE(tmp);
@@ -517,9 +602,14 @@ void prune_icache(int goal)
 			continue;
 		if (atomic_read(&inode->i_count))
 			BUG();
+		/* Somebody is looking at its hash chain - leave it alone */
+		lock = inode_hash_lock(inode);
+		if (!spin_trylock(lock))
+			continue;
 		list_del(tmp);
 		list_del(&inode->i_hash);
 		INIT_LIST_HEAD(&inode->i_hash);
+		spin_unlock(lock);
 		list_add(tmp, freeable);
 		inode->i_state |= I_FREEING;
 		count++;
@@ -554,10 +644,10 @@ void shrink_icache_memory(int priority, int gfp_mask)
 }
 
 /*
- * Called with the inode lock held.
- * NOTE: we are not increasing the inode-refcount, you must call __iget()
- * by hand after calling find_inode now! This simplifies iunique and won't
- * add any additional branch in the common code.
+ * Called with the chain lock held.
+ * NOTE: we are not increasing the inode-refcount, you must call
+ * __iget_hashed() by hand after calling find_inode now! This simplifies
+ * iunique and won't add any additional branch in the common code.
  */
 static struct inode * find_inode(struct super_block * sb, unsigned long ino, struct list_head *head, find_inode_t find_actor, void *opaque)
 {
@@ -658,12 +748,14 @@ static struct inode * get_new_inode(struct super_block *sb, unsigned long ino, s
 
 	inode = alloc_inode();
 	if (inode) {
+		spinlock_t * lock = chain_lock(head);
 		struct inode * old;
 
-		spin_lock(&inode_lock);
+		spin_lock(lock);
 		/* We released the lock, so.. */
 		old = find_inode(sb, ino, head, find_actor, opaque);
 		if (!old) {
+			spin_lock(&inode_lock);
 			inodes_stat.nr_inodes++;
 			list_add(&inode->i_list, &inode_in_use);
 			list_add(&inode->i_hash, head);
@@ -674,6 +766,7 @@ static struct inode * get_new_inode(struct super_block *sb, unsigned long ino, s
 			atomic_set(&inode->i_count, 1);
 			inode->i_state = I_LOCK;
 			spin_unlock(&inode_lock);
+			spin_unlock(lock);
 
 			clean_inode(inode);
 			sb->s_op->read_inode(inode);
@@ -697,8 +790,8 @@ static struct inode * get_new_inode(struct super_block *sb, unsigned long ino, s
 		 * us. Use the old inode instead of the one we just
 		 * allocated.
 		 */
-		__iget(old);
-		spin_unlock(&inode_lock);
+		__iget_hashed(old);
+		spin_unlock(lock);
 		destroy_inode(inode);
 		inode = old;
 		wait_on_inode(inode);
@@ -706,13 +799,6 @@ static struct inode * get_new_inode(struct super_block *sb, unsigned long ino, s
 	return inode;
 }
 
-static inline unsigned long hash(struct super_block *sb, unsigned long i_ino)
-{
-	unsigned long tmp = i_ino | ((unsigned long) sb / L1_CACHE_BYTES);
-	tmp = tmp + (tmp >> I_HASHBITS) + (tmp >> I_HASHBITS*2);
-	return tmp & I_HASHMASK;
-}
-
 /* Yeah, I know about quadratic hash. Maybe, later. */
 
 /**
@@ -732,17 +818,20 @@ static inline unsigned long hash(struct super_block *sb, unsigned long i_ino)
  
 ino_t iunique(struct super_block *sb, ino_t max_reserved)
 {
+	static spinlock_t counter_lock = SPIN_LOCK_UNLOCKED;
 	static ino_t counter = 0;
 	struct inode *inode;
 	struct list_head * head;
 	ino_t res;
-	spin_lock(&inode_lock);
+	spin_lock(&counter_lock);
 retry:
 	if (counter > max_reserved) {
 		head = inode_hashtable + hash(sb,counter);
+		spin_lock(chain_lock(head));
 		inode = find_inode(sb, res = counter++, head, NULL, NULL);
+		spin_unlock(chain_lock(head));
 		if (!inode) {
-			spin_unlock(&inode_lock);
+			spin_unlock(&counter_lock);
 			return res;
 		}
 	} else {
@@ -754,6 +843,9 @@ retry:
 
 struct inode *igrab(struct inode *inode)
 {
+	spinlock_t * lock = inode_hash_lock(inode);
+
+	spin_lock(lock);
 	spin_lock(&inode_lock);
 	if (!(inode->i_state & I_FREEING))
 		__iget(inode);
@@ -765,6 +857,7 @@ struct inode *igrab(struct inode *inode)
 		 */
 		inode = NULL;
 	spin_unlock(&inode_lock);
+	spin_unlock(lock);
 	if (inode)
 		wait_on_inode(inode);
 	return inode;
@@ -774,17 +867,18 @@ struct inode *igrab(struct inode *inode)
 struct inode *iget4(struct super_block *sb, unsigned long ino, find_inode_t find_actor, void *opaque)
 {
 	struct list_head * head = inode_hashtable + hash(sb,ino);
+	spinlock_t * lock = chain_lock(head);
 	struct inode * inode;
 
-	spin_lock(&inode_lock);
+	spin_lock(lock);
 	inode = find_inode(sb, ino, head, find_actor, opaque);
 	if (inode) {
-		__iget(inode);
-		spin_unlock(&inode_lock);
+		__iget_hashed(inode);
+		spin_unlock(lock);
 		wait_on_inode(inode);
 		return inode;
 	}
-	spin_unlock(&inode_lock);
+	spin_unlock(lock);
 
 	/*
 	 * get_new_inode() will do the right thing, re-trying the search
@@ -806,9 +900,11 @@ void insert_inode_hash(struct inode *inode)
 	struct list_head *head = &anon_hash_chain;
 	if (inode->i_sb)
 		head = inode_hashtable + hash(inode->i_sb, inode->i_ino);
+	spin_lock(chain_lock(head));
 	spin_lock(&inode_lock);
 	list_add(&inode->i_hash, head);
 	spin_unlock(&inode_lock);
+	spin_unlock(chain_lock(head));
 }
 
 /**
@@ -820,10 +916,14 @@ void insert_inode_hash(struct inode *inode)
  
 void remove_inode_hash(struct inode *inode)
 {
+	spinlock_t * lock = inode_hash_lock(inode);
+
+	spin_lock(lock);
 	spin_lock(&inode_lock);
 	list_del(&inode->i_hash);
 	INIT_LIST_HEAD(&inode->i_hash);
 	spin_unlock(&inode_lock);
+	spin_unlock(lock);
 }
 
 /**
@@ -838,14 +938,28 @@ void iput(struct inode *inode)
 {
 	if (inode) {
 		struct super_operations *op = NULL;
+		spinlock_t *lock = inode_hash_lock(inode);
 
 		if (inode->i_sb && inode->i_sb->s_op)
 			op = inode->i_sb->s_op;
 		if (op && op->put_inode)
 			op->put_inode(inode);
 
-		if (!atomic_dec_and_lock(&inode->i_count, &inode_lock))
+		if (!atomic_dec_and_lock(&inode->i_count, lock))
 			return;
+		spin_lock(&inode_lock);
+
+		/*
+		 * sync_one() may have grabbed it off the dirty list before
+		 * we got inode_lock.  Its __iget() has already accounted
+		 * for the inode leaving the unused state we never put it in.
+		 */
+		if (atomic_read(&inode->i_count)) {
+			inodes_stat.nr_unused++;
+			spin_unlock(&inode_lock);
+			spin_unlock(lock);
+			return;
+		}
 
 		if (!inode->i_nlink) {
 			list_del(&inode->i_hash);
@@ -855,6 +969,7 @@ void iput(struct inode *inode)
 			inode->i_state|=I_FREEING;
 			inodes_stat.nr_inodes--;
 			spin_unlock(&inode_lock);
+			spin_unlock(lock);
 
 			if (inode->i_data.nrpages)
 				truncate_inode_pages(&inode->i_data, 0);
@@ -876,6 +991,7 @@ void iput(struct inode *inode)
 				}
 				inodes_stat.nr_unused++;
 				spin_unlock(&inode_lock);
+				spin_unlock(lock);
 				return;
 			} else {
 				/* magic nfs path */
@@ -884,6 +1000,7 @@ void iput(struct inode *inode)
 				inode->i_state|=I_FREEING;
 				inodes_stat.nr_inodes--;
 				spin_unlock(&inode_lock);
+				spin_unlock(lock);
 				clear_inode(inode);
 			}
 		}
@@ -966,6 +1083,9 @@ void __init inode_init(unsigned long mempages)
 		i--;
 	} while (i);
 
+	for (i = 0; i < I_HASHLOCKS; i++)
+		spin_lock_init(&inode_hash_locks[i].lock);
+
 	/* inode slab cache */
 	inode_cachep = kmem_cache_create("inode_cache", sizeof(struct inode),
 					 0, SLAB_HWCACHE_ALIGN, init_once,
@@ -422,6 +422,12 @@ nfs_read_super(struct super_block *sb, void *raw_data, int silent)
                 server->wsize = server->wpages << PAGE_CACHE_SHIFT;
 	}
 
+	/* Make room in the socket for a full window of WRITE calls and
+	 * READ replies, plus 1K of RPC header each. */
+	xprt_set_buffer_size(server->client->cl_xprt,
+			     RPC_MAXCONG * (server->wsize + 1024),
+			     RPC_MAXCONG * (server->rsize + 1024));
+
 	server->dtsize = nfs_block_size(fsinfo.dtpref, NULL);
 	if (server->dtsize > PAGE_CACHE_SIZE)
 		server->dtsize = PAGE_CACHE_SIZE;
@@ -18,6 +18,7 @@
 #include <linux/malloc.h>
 #include <linux/stat.h>
 #include <linux/in.h>
+#include <linux/spinlock.h>
 
 #include <linux/sunrpc/svc.h>
 #include <linux/nfsd/nfsd.h>
@@ -65,6 +66,14 @@ static int			want_lock;
 static int			hash_count;
 static DECLARE_WAIT_QUEUE_HEAD(	hash_wait );
 
+/*
+ * nfsd threads take the export read lock without holding the kernel
+ * lock, so the counters above are protected by exp_lock.  It also
+ * serializes readers moving clients to the front of a hash chain in
+ * exp_getclient.
+ */
+static spinlock_t		exp_lock = SPIN_LOCK_UNLOCKED;
+
 
 /*
  * Find a client's export for a device.
@@ -447,25 +456,34 @@ out:
 void
 exp_readlock(void)
 {
-	while (hash_lock || want_lock)
-		sleep_on(&hash_wait);
+	spin_lock(&exp_lock);
+	while (hash_lock || want_lock) {
+		spin_unlock(&exp_lock);
+		wait_event(hash_wait, !hash_lock && !want_lock);
+		spin_lock(&exp_lock);
+	}
 	hash_count++;
+	spin_unlock(&exp_lock);
 }
 
 int
 exp_writelock(void)
 {
+	spin_lock(&exp_lock);
 	/* fast track */
 	if (!hash_count && !hash_lock) {
 	lock_it:
 		hash_lock = 1;
+		spin_unlock(&exp_lock);
 		return 0;
 	}
 
 	current->sigpending = 0;
 	want_lock++;
 	while (hash_count || hash_lock) {
-		interruptible_sleep_on(&hash_wait);
+		spin_unlock(&exp_lock);
+		wait_event_interruptible(hash_wait, !hash_count && !hash_lock);
+		spin_lock(&exp_lock);
 		if (signal_pending(current))
 			break;
 	}
@@ -478,18 +496,24 @@ exp_writelock(void)
 
 	if (!hash_count && !hash_lock)
 		goto lock_it;
+	spin_unlock(&exp_lock);
+
+	/* readers may have been waiting behind us */
+	wake_up(&hash_wait);
 	return -EINTR;
 }
 
 void
 exp_unlock(void)
 {
+	spin_lock(&exp_lock);
 	if (!hash_count && !hash_lock)
 		printk(KERN_WARNING "exp_unlock: not locked!\n");
 	if (hash_count)
 		hash_count--;
 	else
 		hash_lock = 0;
+	spin_unlock(&exp_lock);
 	wake_up(&hash_wait);
 }
 
@@ -497,19 +521,22 @@ exp_unlock(void)
  * Find a valid client given an inet address. We always move the most
  * recently used client to the front of the hash chain to speed up
  * future lookups.
- * Locking against other processes is the responsibility of the caller.
+ * The caller must hold the export lock; since several readers may do
+ * this at once, the chain itself is walked under exp_lock.
  */
 struct svc_client *
 exp_getclient(struct sockaddr_in *sin)
 {
 	struct svc_clnthash	**hp, **head, *tmp;
 	unsigned long		addr = sin->sin_addr.s_addr;
+	struct svc_client	*clp = NULL;
 
 	if (!initialized)
 		return NULL;
 
 	head = &clnt_hash[CLIENT_HASH(addr)];
 
+	spin_lock(&exp_lock);
 	for (hp = head; (tmp = *hp) != NULL; hp = &(tmp->h_next)) {
 		if (tmp->h_addr.s_addr == addr) {
 			/* Move client to the front */
@@ -519,11 +546,13 @@ exp_getclient(struct sockaddr_in *sin)
 				*head = tmp;
 			}
 
-			return tmp->h_client;
+			clp = tmp->h_client;
+			break;
 		}
 	}
+	spin_unlock(&exp_lock);
 
-	return NULL;
+	return clp;
 }
 
 /*
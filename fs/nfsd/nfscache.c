@@ -7,37 +7,55 @@
  * This code is heavily inspired by the 44BSD implementation, although
  * it does things a bit differently.
  *
+ * The cache is split into hash buckets of RC_BUCKETSIZE entries each.
+ * Every bucket keeps its entries on its own LRU list under its own
+ * lock, and an entry never leaves the bucket it was set up in, so a
+ * request only ever touches the bucket its xid hashes to.
+ *
  * Copyright (C) 1995, 1996 Olaf Kirch <okir@monad.swb.de>
  */
 
 #include <linux/kernel.h>
 #include <linux/sched.h>
 #include <linux/malloc.h>
+#include <linux/vmalloc.h>
 #include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
 
 #include <linux/sunrpc/svc.h>
 #include <linux/nfsd/nfsd.h>
 #include <linux/nfsd/cache.h>
+#include <linux/nfsd/stats.h>
+#include <net/checksum.h>
 
 /* Size of reply cache. Common values are:
  * 4.3BSD:	128
  * 4.4BSD:	256
  * Solaris2:	1024
  * DEC Unix:	512-4096
+ * We use one entry per 16 pages of memory, within these bounds.
  */
-#define CACHESIZE		1024
-#define HASHSIZE		64
-#define REQHASH(xid)		((((xid) >> 24) ^ (xid)) & (HASHSIZE-1))
+#define RC_MINSIZE		1024
+#define RC_MAXSIZE		16384
+#define RC_BUCKETSIZE		16
+#define RC_EXPIRE		(120*HZ)
+
+/* Number of argument bytes checksummed to tell apart requests that
+ * happen to share an xid. */
+#define RC_CSUMLEN		256
+
+#define REQHASH(xid)		((((xid) >> 24) ^ ((xid) >> 12) ^ (xid)) & hash_mask)
 
 struct nfscache_head {
-	struct svc_cacherep *	next;
-	struct svc_cacherep *	prev;
+	struct list_head	lru;	/* most recently used first */
+	spinlock_t		lock;
 };
 
 static struct nfscache_head *	hash_list;
-static struct svc_cacherep *	lru_head;
-static struct svc_cacherep *	lru_tail;
 static struct svc_cacherep *	nfscache;
+static unsigned int		cache_size;
+static unsigned int		hash_mask;
 static int			cache_initialized;
 static int			cache_disabled = 1;
 
@@ -48,48 +66,51 @@ nfsd_cache_init(void)
 {
 	struct svc_cacherep	*rp;
 	struct nfscache_head	*rh;
-	size_t			i;
-	unsigned long		order;
+	unsigned int		nbuckets;
+	size_t			i, j;
 
 	if (cache_initialized)
 		return;
 
-	i = CACHESIZE * sizeof (struct svc_cacherep);
-	for (order = 0; (PAGE_SIZE << order) < i; order++)
+	i = num_physpages >> 4;
+	if (i < RC_MINSIZE)
+		i = RC_MINSIZE;
+	if (i > RC_MAXSIZE)
+		i = RC_MAXSIZE;
+	for (nbuckets = 1; nbuckets * 2 * RC_BUCKETSIZE <= i; nbuckets <<= 1)
 		;
-	nfscache = (struct svc_cacherep *)
-		__get_free_pages(GFP_KERNEL, order);
+	cache_size = nbuckets * RC_BUCKETSIZE;
+
+	i = cache_size * sizeof (struct svc_cacherep);
+	nfscache = (struct svc_cacherep *) vmalloc(i);
 	if (!nfscache) {
 		printk (KERN_ERR "nfsd: cannot allocate %Zd bytes for reply cache\n", i);
 		return;
 	}
 	memset(nfscache, 0, i);
 
-	i = HASHSIZE * sizeof (struct nfscache_head);
+	i = nbuckets * sizeof (struct nfscache_head);
 	hash_list = kmalloc (i, GFP_KERNEL);
 	if (!hash_list) {
-		free_pages ((unsigned long)nfscache, order);
+		vfree (nfscache);
 		nfscache = NULL;
 		printk (KERN_ERR "nfsd: cannot allocate %Zd bytes for hash list\n", i);
 		return;
 	}
+	hash_mask = nbuckets - 1;
 
-	for (i = 0, rh = hash_list; i < HASHSIZE; i++, rh++)
-		rh->next = rh->prev = (struct svc_cacherep *) rh;
-
-	for (i = 0, rp = nfscache; i < CACHESIZE; i++, rp++) {
-		rp->c_state = RC_UNUSED;
-		rp->c_type = RC_NOCACHE;
-		rp->c_hash_next =
-		rp->c_hash_prev = rp;
-		rp->c_lru_next = rp + 1;
-		rp->c_lru_prev = rp - 1;
+	rp = nfscache;
+	for (i = 0, rh = hash_list; i < nbuckets; i++, rh++) {
+		INIT_LIST_HEAD(&rh->lru);
+		spin_lock_init(&rh->lock);
+		for (j = 0; j < RC_BUCKETSIZE; j++, rp++) {
+			rp->c_state = RC_UNUSED;
+			rp->c_type = RC_NOCACHE;
+			list_add_tail(&rp->c_lru, &rh->lru);
+		}
 	}
-	lru_head = nfscache;
-	lru_tail = nfscache + CACHESIZE - 1;
-	lru_head->c_lru_prev = NULL;
-	lru_tail->c_lru_next = NULL;
 
+	nfsdstats.rcsize = cache_size;
 	cache_initialized = 1;
 	cache_disabled = 0;
 }
@@ -99,12 +120,11 @@ nfsd_cache_shutdown(void)
 {
 	struct svc_cacherep	*rp;
 	size_t			i;
-	unsigned long		order;
 
 	if (!cache_initialized)
 		return;
 
-	for (rp = lru_head; rp; rp = rp->c_lru_next) {
+	for (i = 0, rp = nfscache; i < cache_size; i++, rp++) {
 		if (rp->c_state == RC_DONE && rp->c_type == RC_REPLBUFF)
 			kfree(rp->c_replbuf.buf);
 	}
@@ -112,73 +132,69 @@ nfsd_cache_shutdown(void)
 	cache_initialized = 0;
 	cache_disabled = 1;
 
-	i = CACHESIZE * sizeof (struct svc_cacherep);
-	for (order = 0; (PAGE_SIZE << order) < i; order++)
-		;
-	free_pages ((unsigned long)nfscache, order);
+	vfree (nfscache);
 	nfscache = NULL;
 	kfree (hash_list);
 	hash_list = NULL;
+	nfsdstats.rcsize = 0;
 }
 
 /*
- * Move cache entry to front of LRU list
+ * The bucket an entry lives in. Entries are laid out bucket by bucket
+ * and never move between buckets.
  */
-static void
-lru_put_front(struct svc_cacherep *rp)
+static inline struct nfscache_head *
+rc_bucket(struct svc_cacherep *rp)
 {
-	struct svc_cacherep	*prev = rp->c_lru_prev,
-				*next = rp->c_lru_next;
-
-	if (prev)
-		prev->c_lru_next = next;
-	else
-		lru_head = next;
-	if (next)
-		next->c_lru_prev = prev;
-	else
-		lru_tail = prev;
-
-	rp->c_lru_next = lru_head;
-	rp->c_lru_prev = NULL;
-	if (lru_head)
-		lru_head->c_lru_prev = rp;
-	lru_head = rp;
+	return hash_list + (rp - nfscache) / RC_BUCKETSIZE;
 }
 
 /*
- * Move a cache entry from one hash list to another
+ * Move cache entry to front of its bucket's LRU list
  */
-static void
-hash_refile(struct svc_cacherep *rp)
+static inline void
+lru_put_front(struct nfscache_head *rh, struct svc_cacherep *rp)
 {
-	struct svc_cacherep	*prev = rp->c_hash_prev,
-				*next = rp->c_hash_next;
-	struct nfscache_head	*head = hash_list + REQHASH(rp->c_xid);
+	list_del(&rp->c_lru);
+	list_add(&rp->c_lru, &rh->lru);
+}
 
-	prev->c_hash_next = next;
-	next->c_hash_prev = prev;
+/*
+ * Checksum the start of the call arguments. Clients can reuse an xid
+ * (after a reboot, or across different mounts), and the xid, procedure
+ * and address alone would then hand back someone else's reply.
+ */
+static inline u32
+nfsd_cache_csum(struct svc_rqst *rqstp)
+{
+	struct svc_buf	*argp = &rqstp->rq_argbuf;
+	int		len = argp->len << 2;
 
-	rp->c_hash_next = head->next;
-	rp->c_hash_prev = (struct svc_cacherep *) head;
-	head->next->c_hash_prev = rp;
-	head->next = rp;
+	if (len > RC_CSUMLEN)
+		len = RC_CSUMLEN;
+	if (len <= 0)
+		return 0;
+	return csum_partial((unsigned char *) argp->buf, len, 0);
 }
 
 /*
  * Try to find an entry matching the current call in the cache. When none
- * is found, we grab the oldest unlocked entry off the LRU list.
- * Note that no operation within the loop may sleep.
+ * is found, we grab the oldest unlocked entry off the bucket's LRU list.
+ * Everything here runs under the bucket lock, so nothing may sleep.
  */
 int
 nfsd_cache_lookup(struct svc_rqst *rqstp, int type)
 {
-	struct svc_cacherep	*rh, *rp;
+	struct nfscache_head	*rh;
+	struct svc_cacherep	*rp;
+	struct list_head	*lp;
 	u32			xid = rqstp->rq_xid,
 				proto =  rqstp->rq_prot,
 				vers = rqstp->rq_vers,
-				proc = rqstp->rq_proc;
+				proc = rqstp->rq_proc,
+				csum;
 	unsigned long		age;
+	int			rtn;
 
 	rqstp->rq_cacherep = NULL;
 	if (cache_disabled || type == RC_NOCACHE) {
@@ -186,12 +202,18 @@ nfsd_cache_lookup(struct svc_rqst *rqstp, int type)
 		return RC_DOIT;
 	}
 
-	rp = rh = (struct svc_cacherep *) &hash_list[REQHASH(xid)];
-	while ((rp = rp->c_hash_next) != rh) {
+	csum = nfsd_cache_csum(rqstp);
+	rh = &hash_list[REQHASH(xid)];
+	spin_lock(&rh->lock);
+	rtn = RC_DOIT;
+
+	list_for_each(lp, &rh->lru) {
+		rp = list_entry(lp, struct svc_cacherep, c_lru);
 		if (rp->c_state != RC_UNUSED &&
 		    xid == rp->c_xid && proc == rp->c_proc &&
 		    proto == rp->c_prot && vers == rp->c_vers &&
-		    time_before(jiffies, rp->c_timestamp + 120*HZ) &&
+		    csum == rp->c_csum &&
+		    time_before(jiffies, rp->c_timestamp + RC_EXPIRE) &&
 		    memcmp((char*)&rqstp->rq_addr, (char*)&rp->c_addr, rqstp->rq_addrlen)==0) {
 			nfsdstats.rchits++;
 			goto found_entry;
@@ -199,31 +221,18 @@ nfsd_cache_lookup(struct svc_rqst *rqstp, int type)
 	}
 	nfsdstats.rcmisses++;
 
-	/* This loop shouldn't take more than a few iterations normally */
-	{
-	int	safe = 0;
-	for (rp = lru_tail; rp; rp = rp->c_lru_prev) {
+	/* Take the oldest entry that is not in progress. If all of this
+	 * bucket is busy, just run the request uncached. */
+	for (lp = rh->lru.prev; lp != &rh->lru; lp = lp->prev) {
+		rp = list_entry(lp, struct svc_cacherep, c_lru);
 		if (rp->c_state != RC_INPROG)
 			break;
-		if (safe++ > CACHESIZE) {
-			printk("nfsd: loop in repcache LRU list\n");
-			cache_disabled = 1;
-			return RC_DOIT;
-		}
-	}
 	}
+	if (lp == &rh->lru)
+		goto out;
 
-	/* This should not happen */
-	if (rp == NULL) {
-		static int	complaints;
-
-		printk(KERN_WARNING "nfsd: all repcache entries locked!\n");
-		if (++complaints > 5) {
-			printk(KERN_WARNING "nfsd: disabling repcache.\n");
-			cache_disabled = 1;
-		}
-		return RC_DOIT;
-	}
+	if (rp->c_state == RC_DONE)
+		nfsdstats.rcevictions++;
 
 	rqstp->rq_cacherep = rp;
 	rp->c_state = RC_INPROG;
@@ -232,9 +241,10 @@ nfsd_cache_lookup(struct svc_rqst *rqstp, int type)
 	rp->c_addr = rqstp->rq_addr;
 	rp->c_prot = proto;
 	rp->c_vers = vers;
+	rp->c_csum = csum;
 	rp->c_timestamp = jiffies;
 
-	hash_refile(rp);
+	lru_put_front(rh, rp);
 
 	/* release any buffer */
 	if (rp->c_type == RC_REPLBUFF) {
@@ -242,42 +252,46 @@ nfsd_cache_lookup(struct svc_rqst *rqstp, int type)
 		rp->c_replbuf.buf = NULL;
 	}
 	rp->c_type = RC_NOCACHE;
-
-	return RC_DOIT;
+ out:
+	spin_unlock(&rh->lock);
+	return rtn;
 
 found_entry:
 	/* We found a matching entry which is either in progress or done. */
 	age = jiffies - rp->c_timestamp;
 	rp->c_timestamp = jiffies;
-	lru_put_front(rp);
+	lru_put_front(rh, rp);
 
 	/* Request being processed or excessive rexmits */
+	rtn = RC_DROPIT;
 	if (rp->c_state == RC_INPROG || age < RC_DELAY)
-		return RC_DROPIT;
+		goto out;
 
 	/* From the hall of fame of impractical attacks:
 	 * Is this a user who tries to snoop on the cache? */
+	rtn = RC_DOIT;
 	if (!rqstp->rq_secure && rp->c_secure)
-		return RC_DOIT;
+		goto out;
 
 	/* Compose RPC reply header */
 	switch (rp->c_type) {
 	case RC_NOCACHE:
-		return RC_DOIT;
+		break;
 	case RC_REPLSTAT:
 		svc_putlong(&rqstp->rq_resbuf, rp->c_replstat);
+		rtn = RC_REPLY;
 		break;
 	case RC_REPLBUFF:
 		if (!nfsd_cache_append(rqstp, &rp->c_replbuf))
-			return RC_DOIT;	/* should not happen */
+			goto out;	/* should not happen */
+		rtn = RC_REPLY;
 		break;
 	default:
 		printk(KERN_WARNING "nfsd: bad repcache type %d\n", rp->c_type);
 		rp->c_state = RC_UNUSED;
-		return RC_DOIT;
 	}
 
-	return RC_REPLY;
+	goto out;
 }
 
 /*
@@ -299,21 +313,32 @@ found_entry:
 void
 nfsd_cache_update(struct svc_rqst *rqstp, int cachetype, u32 *statp)
 {
+	struct nfscache_head *rh;
 	struct svc_cacherep *rp;
-	struct svc_buf	*resp = &rqstp->rq_resbuf, *cachp;
+	struct svc_buf	*resp = &rqstp->rq_resbuf;
+	u32		*buf = NULL;
 	int		len;
 
 	if (!(rp = rqstp->rq_cacherep) || cache_disabled)
 		return;
+	rh = rc_bucket(rp);
 
 	len = resp->len - (statp - resp->base);
 	
 	/* Don't cache excessive amounts of data and XDR failures */
-	if (!statp || len > (256 >> 2)) {
-		rp->c_state = RC_UNUSED;
-		return;
+	if (!statp || len > (256 >> 2))
+		goto unused;
+
+	/* The entry is RC_INPROG and nobody else will touch it, but the
+	 * reply copy has to be allocated before we take the bucket lock. */
+	if (cachetype == RC_REPLBUFF) {
+		buf = (u32 *) kmalloc(len << 2, GFP_KERNEL);
+		if (!buf)
+			goto unused;
+		memcpy(buf, statp, len << 2);
 	}
 
+	spin_lock(&rh->lock);
 	switch (cachetype) {
 	case RC_REPLSTAT:
 		if (len != 1)
@@ -321,28 +346,28 @@ nfsd_cache_update(struct svc_rqst *rqstp, int cachetype, u32 *statp)
 		rp->c_replstat = *statp;
 		break;
 	case RC_REPLBUFF:
-		cachp = &rp->c_replbuf;
-		cachp->buf = (u32 *) kmalloc(len << 2, GFP_KERNEL);
-		if (!cachp->buf) {
-			rp->c_state = RC_UNUSED;
-			return;
-		}
-		cachp->len = len;
-		memcpy(cachp->buf, statp, len << 2);
+		rp->c_replbuf.buf = buf;
+		rp->c_replbuf.len = len;
 		break;
 	}
 
-	lru_put_front(rp);
+	lru_put_front(rh, rp);
 	rp->c_secure = rqstp->rq_secure;
 	rp->c_type = cachetype;
 	rp->c_state = RC_DONE;
 	rp->c_timestamp = jiffies;
-
+	spin_unlock(&rh->lock);
 	return;
+
+unused:
+	spin_lock(&rh->lock);
+	rp->c_state = RC_UNUSED;
+	spin_unlock(&rh->lock);
 }
 
 /*
  * Copy cached reply to current reply buffer. Should always fit.
+ * Called with the bucket lock held.
  */
 static int
 nfsd_cache_append(struct svc_rqst *rqstp, struct svc_buf *data)
@@ -79,6 +79,12 @@ nfsctl_svc(struct nfsctl_svc *data)
 	return nfsd_svc(data->svc_port, data->svc_nthreads);
 }
 
+static inline int
+nfsctl_svcpool(struct nfsctl_svcpool *data)
+{
+	return nfsd_pool_threads(data->pl_pool, data->pl_nthreads);
+}
+
 static inline int
 nfsctl_addclient(struct nfsctl_client *data)
 {
@@ -214,6 +220,7 @@ static struct {
 	/* NFSCTL_GETFH      */ { sizeof(struct nfsctl_fhparm), NFS_FHSIZE},
 	/* NFSCTL_GETFD      */ { sizeof(struct nfsctl_fdparm), NFS_FHSIZE},
 	/* NFSCTL_GETFS      */ { sizeof(struct nfsctl_fsparm), sizeof(struct knfsd_fh)},
+	/* NFSCTL_SVCPOOL    */ { sizeof(struct nfsctl_svcpool), 0 },
 };
 #define CMD_MAX (sizeof(sizes)/sizeof(sizes[0])-1)
 
@@ -289,6 +296,9 @@ asmlinkage handle_sys_nfsservctl(int cmd, void *opaque_argp, void *opaque_resp)
 		err = nfsctl_getfs(&arg->ca_getfs, &res->cr_getfs);
 		respsize = res->cr_getfs.fh_size+ (int)&((struct knfsd_fh*)0)->fh_base;
 		break;
+	case NFSCTL_SVCPOOL:
+		err = nfsctl_svcpool(&arg->ca_pool);
+		break;
 	default:
 		err = -EINVAL;
 	}
@@ -15,6 +15,7 @@
 #include <linux/string.h>
 #include <linux/stat.h>
 #include <linux/dcache.h>
+#include <linux/smp_lock.h>
 #include <asm/pgtable.h>
 
 #include <linux/sunrpc/svc.h>
@@ -134,7 +135,11 @@ static struct dentry *nfsd_iget(struct super_block *sb, unsigned long ino, __u32
 	struct inode *inode;
 	struct list_head *lp;
 	struct dentry *result;
+
+	/* read_inode expects the kernel lock, as it has it under lookup */
+	lock_kernel();
 	inode = iget(sb, ino);
+	unlock_kernel();
 	if (is_bad_inode(inode)
 	    || (generation && inode->i_generation != generation)
 		) {
@@ -352,6 +357,8 @@ find_fh_dentry(struct super_block *sb, ino_t ino, int generation, ino_t dirino,
 	 * joined together, which would be very confusing.
 	 * If there is ever an unconnected non-root directory, then this lock
 	 * must be held.
+	 * Reconnecting a path calls into the filesystem's lookup and readdir,
+	 * which still expect the kernel lock; the common case above does not.
 	 */
 
 
@@ -379,6 +386,7 @@ find_fh_dentry(struct super_block *sb, ino_t ino, int generation, ino_t dirino,
 	 * location in the tree.
 	 */
 	dprintk("nfs_fh: need to look harder for %d/%ld\n",sb->s_dev,ino);
+	lock_kernel();
 
 	found = 0;
 	if (!S_ISDIR(result->d_inode->i_mode)) {
@@ -457,6 +465,7 @@ find_fh_dentry(struct super_block *sb, ino_t ino, int generation, ino_t dirino,
 			dput(tmp);
 			dput(dentry);
 			dput(result);	/* this will discard the whole free path, so we can up the semaphore */
+			unlock_kernel();
 			up(&sb->s_nfsd_free_path_sem);
 			goto retry;
 		}
@@ -464,6 +473,7 @@ find_fh_dentry(struct super_block *sb, ino_t ino, int generation, ino_t dirino,
 		dentry = pdentry;
 	}
 	dput(dentry);
+	unlock_kernel();
 	up(&sb->s_nfsd_free_path_sem);
 	return result;
 
@@ -471,6 +481,7 @@ err_dentry:
 	dput(dentry);
 err_result:
 	dput(result);
+	unlock_kernel();
 	up(&sb->s_nfsd_free_path_sem);
 err_out:
 	if (err == -ESTALE)
@@ -648,6 +659,8 @@ fh_verify(struct svc_rqst *rqstp, struct svc_fh *fhp, int type, int access)
 		if (exp->ex_dentry != dentry) {
 			struct dentry *tdentry = dentry;
 
+			/* keep rename from moving the path under us */
+			spin_lock(&dcache_lock);
 			do {
 				tdentry = tdentry->d_parent;
 				if (exp->ex_dentry == tdentry)
@@ -666,6 +679,7 @@ fh_verify(struct svc_rqst *rqstp, struct svc_fh *fhp, int type, int access)
 					dprintk("fh_verify: no root_squashed access.\n");
 				}
 			} while ((tdentry != tdentry->d_parent));
+			spin_unlock(&dcache_lock);
 			if (exp->ex_dentry != tdentry) {
 				error = nfserr_stale;
 				nfsdstats.fh_stale++;
@@ -140,6 +140,11 @@ nfsd_proc_read(struct svc_rqst *rqstp, struct nfsd_readargs *argp,
 	 */
 	svcbuf_reserve(&rqstp->rq_resbuf, &buffer, &avail, 19);
 
+	/* NFSv2 replies carry at most NFS_MAXDATA bytes, whatever room
+	 * the reply buffer has.
+	 */
+	if (argp->count > NFS_MAXDATA)
+		argp->count = NFS_MAXDATA;
 	if ((avail << 2) < argp->count) {
 		printk(KERN_NOTICE
 			"oversized read request from %08x:%d (%d bytes)\n",
@@ -45,10 +45,12 @@ struct timeval			nfssvc_boot;
 static struct svc_serv 		*nfsd_serv;
 static int			nfsd_busy;
 static unsigned long		nfsd_last_call;
+static spinlock_t		nfsd_call_lock = SPIN_LOCK_UNLOCKED;
 
 struct nfsd_list {
 	struct list_head 	list;
 	struct task_struct	*task;
+	struct svc_rqst		*rqstp;
 };
 struct list_head nfsd_list = LIST_HEAD_INIT(nfsd_list);
 
@@ -117,6 +119,56 @@ nfsd_svc(unsigned short port, int nrservs)
 	return error;
 }
 
+/*
+ * Set the number of threads in one pool of a running server.
+ * nfsd_svc spreads its threads evenly over the pools; this lets the
+ * administrator weight them, e.g. towards the CPUs that take the
+ * network interrupts.
+ */
+int
+nfsd_pool_threads(int pool, int nrservs)
+{
+	int	error, room;
+	struct list_head *victim;
+
+	if (!nfsd_serv)
+		return -ENXIO;
+	if (pool < 0 || pool >= nfsd_serv->sv_nrpools)
+		return -EINVAL;
+	if (nrservs < 0)
+		nrservs = 0;
+
+	nfsd_serv->sv_nrthreads++;
+	nrservs -= nfsd_serv->sv_pools[pool].sp_nrthreads;
+	/* sv_nrthreads counts our reference too */
+	room = NFSD_MAXSERVS - (nfsd_serv->sv_nrthreads-1);
+	if (nrservs > room)
+		nrservs = room;
+	error = 0;
+	while (nrservs > 0) {
+		nrservs--;
+		error = svc_create_pooled_thread(nfsd, nfsd_serv, pool);
+		if (error < 0)
+			break;
+	}
+	victim = nfsd_list.next;
+	while (nrservs < 0 && victim != &nfsd_list) {
+		struct nfsd_list *nl =
+			list_entry(victim,struct nfsd_list, list);
+		victim = victim->next;
+		if (nl->rqstp->rq_pool != &nfsd_serv->sv_pools[pool])
+			continue;
+		send_sig(SIGKILL, nl->task, 1);
+		nrservs++;
+	}
+	svc_destroy(nfsd_serv);		/* Release server */
+	return error;
+}
+
+/*
+ * Account the time since the last call to the decile of busy threads.
+ * The caller holds nfsd_call_lock.
+ */
 static void inline
 update_thread_usage(int busy_threads)
 {
@@ -137,7 +189,14 @@ update_thread_usage(int busy_threads)
 }
 
 /*
- * This is the NFS server kernel thread
+ * This is the NFS server kernel thread.
+ *
+ * The big kernel lock is only held while the thread sets itself up
+ * and tears itself down, which is when the server and thread list
+ * are changed under nfsd_svc.  Requests are processed without it: the
+ * export tables, the reply cache and the readahead cache have locks
+ * of their own, and the VFS takes the kernel lock itself around the
+ * filesystem methods that still need it.
  */
 static void
 nfsd(struct svc_rqst *rqstp)
@@ -164,8 +223,14 @@ nfsd(struct svc_rqst *rqstp)
 	lockd_up();				/* start lockd */
 
 	me.task = current;
+	me.rqstp = rqstp;
 	list_add(&me.list, &nfsd_list);
 
+	unlock_kernel();
+
+	/* Stay on the CPU whose requests our pool serves */
+	svc_pool_bind(rqstp);
+
 	/*
 	 * The main request loop
 	 */
@@ -185,8 +250,10 @@ nfsd(struct svc_rqst *rqstp)
 		    ;
 		if (err < 0)
 			break;
+		spin_lock(&nfsd_call_lock);
 		update_thread_usage(nfsd_busy);
 		nfsd_busy++;
+		spin_unlock(&nfsd_call_lock);
 
 		/* Lock the export hash tables for reading. */
 		exp_readlock();
@@ -205,10 +272,14 @@ nfsd(struct svc_rqst *rqstp)
 
 		/* Unlock export hash tables */
 		exp_unlock();
+		spin_lock(&nfsd_call_lock);
 		update_thread_usage(nfsd_busy);
 		nfsd_busy--;
+		spin_unlock(&nfsd_call_lock);
 	}
 
+	lock_kernel();
+
 	if (err != -EINTR) {
 		printk(KERN_WARNING "nfsd: terminating on error %d\n", -err);
 	} else {
@@ -6,8 +6,9 @@
  * /proc/net/rpc/nfsd
  *
  * Format:
- *	rc <hits> <misses> <nocache>
- *			Statistsics for the reply cache
+ *	rc <hits> <misses> <nocache> <evictions> <size>
+ *			Statistsics for the reply cache. Evictions count
+ *			completed replies dropped to make room for new calls.
  *	fh <stale> <total-lookups> <anonlookups> <dir-not-in-dcache> <nondir-not-in-dcache>
  *			statistics for filehandle lookup
  *	io <bytes-read> <bytes-writtten>
@@ -45,10 +46,12 @@ nfsd_proc_read(char *buffer, char **start, off_t offset, int count,
 	int	len;
 	int	i;
 
-	len = sprintf(buffer, "rc %u %u %u\nfh %u %u %u %u %u\nio %u %u\n",
+	len = sprintf(buffer, "rc %u %u %u %u %u\nfh %u %u %u %u %u\nio %u %u\n",
 		      nfsdstats.rchits,
 		      nfsdstats.rcmisses,
 		      nfsdstats.rcnocache,
+		      nfsdstats.rcevictions,
+		      nfsdstats.rcsize,
 		      nfsdstats.fh_stale,
 		      nfsdstats.fh_lookup,
 		      nfsdstats.fh_anon,
@@ -31,6 +31,8 @@
 #include <linux/unistd.h>
 #include <linux/malloc.h>
 #include <linux/in.h>
+#include <linux/pagemap.h>
+#include <linux/smp_lock.h>
 #define __NO_VERSION__
 #include <linux/module.h>
 
@@ -76,6 +78,7 @@ struct raparms {
 
 static struct raparms *		raparml;
 static struct raparms *		raparm_cache;
+static spinlock_t		raparm_lock = SPIN_LOCK_UNLOCKED;
 
 /*
  * Look up one component of a pathname.
@@ -549,7 +552,7 @@ nfsd_sync_dir(struct dentry *dp)
 
 /*
  * Obtain the readahead parameters for the file
- * specified by (dev, ino).
+ * specified by (dev, ino). Called with raparm_lock held.
  */
 static inline struct raparms *
 nfsd_get_raparms(dev_t dev, ino_t ino)
@@ -583,9 +586,40 @@ found:
 	return ra;
 }
 
+/*
+ * Read actor for nfsd_read: rather than copying the data, take a
+ * reference on each page cache page and queue it on the reply, which
+ * the RPC layer sends straight from the page.
+ */
+static int
+nfsd_read_actor(read_descriptor_t *desc, struct page *page,
+		unsigned long offset, unsigned long size)
+{
+	struct svc_buf	*bufp = (struct svc_buf *) desc->buf;
+	struct svc_page	*sp;
+
+	if (size > desc->count)
+		size = desc->count;
+	/* Out of slots: stop here and return a short read */
+	if (bufp->nrpages >= RPCSVC_MAXIOV)
+		return 0;
+
+	page_cache_get(page);
+	sp = bufp->pages + bufp->nrpages++;
+	sp->page   = page;
+	sp->offset = offset;
+	sp->len    = size;
+
+	desc->count -= size;
+	desc->written += size;
+	return size;
+}
+
 /*
  * Read data from a file. count must contain the requested read count
  * on entry. On return, *count contains the number of bytes actually read.
+ * For files that live in the page cache the data is not copied to buf;
+ * the pages are attached to the reply instead (see nfsd_read_actor).
  * N.B. After this call fhp needs an fh_put
  */
 int
@@ -610,6 +644,7 @@ nfsd_read(struct svc_rqst *rqstp, struct svc_fh *fhp, loff_t offset,
 #endif
 
 	/* Get readahead parameters */
+	spin_lock(&raparm_lock);
 	ra = nfsd_get_raparms(fhp->fh_export->ex_dev, fhp->fh_dentry->d_inode->i_ino);
 	if (ra) {
 		file.f_reada = ra->p_reada;
@@ -618,23 +653,42 @@ nfsd_read(struct svc_rqst *rqstp, struct svc_fh *fhp, loff_t offset,
 		file.f_ralen = ra->p_ralen;
 		file.f_rawin = ra->p_rawin;
 	}
+	spin_unlock(&raparm_lock);
 	file.f_pos = offset;
 
-	oldfs = get_fs(); set_fs(KERNEL_DS);
-	err = file.f_op->read(&file, buf, *count, &file.f_pos);
-	set_fs(oldfs);
+	if (file.f_op->read == generic_file_read && *count &&
+	    !rqstp->rq_resbuf.nrpages) {
+		read_descriptor_t desc;
+
+		desc.written = 0;
+		desc.count = *count;
+		desc.buf = (char *) &rqstp->rq_resbuf;
+		desc.error = 0;
+		do_generic_file_read(&file, &file.f_pos, &desc, nfsd_read_actor);
+
+		err = desc.written;
+		if (!err)
+			err = desc.error;
+		rqstp->rq_resbuf.pagedata = (u32 *) buf;
+	} else {
+		oldfs = get_fs(); set_fs(KERNEL_DS);
+		err = file.f_op->read(&file, buf, *count, &file.f_pos);
+		set_fs(oldfs);
+	}
 
 	/* Write back readahead params */
 	if (ra != NULL) {
 		dprintk("nfsd: raparms %ld %ld %ld %ld %ld\n",
 			file.f_reada, file.f_ramax, file.f_raend,
 			file.f_ralen, file.f_rawin);
+		spin_lock(&raparm_lock);
 		ra->p_reada = file.f_reada;
 		ra->p_ramax = file.f_ramax;
 		ra->p_raend = file.f_raend;
 		ra->p_ralen = file.f_ralen;
 		ra->p_rawin = file.f_rawin;
 		ra->p_count -= 1;
+		spin_unlock(&raparm_lock);
 	}
 
 	if (err >= 0) {
@@ -1427,7 +1481,9 @@ nfsd_readdir(struct svc_rqst *rqstp, struct svc_fh *fhp, loff_t offset,
 			file.f_inode->i_dev, file.f_inode->i_ino,
 			(int) file.f_pos, (int) oldlen, (int) cd.buflen);
 		 */
+		lock_kernel();
 		err = file.f_op->readdir(&file, &cd, (filldir_t) func);
+		unlock_kernel();
 		if (err < 0)
 			goto out_nfserr;
 		if (oldlen == cd.buflen)
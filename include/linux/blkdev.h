@@ -41,6 +41,7 @@ struct request {
 	unsigned int nr_segments;
 	unsigned int nr_hw_segments;
 	unsigned long current_nr_sectors;
+	unsigned long start_time;	/* jiffies when queued */
 	void * special;
 	char * buffer;
 	struct semaphore * sem;
@@ -113,8 +114,14 @@ struct request_queue
 	char			head_active;
 
 	/*
-	 * Is meant to protect the queue in the future instead of
-	 * io_request_lock
+	 * Protects the queue: &io_request_lock unless the driver set
+	 * another one with blk_queue_lock(), such as request_lock below
+	 */
+	spinlock_t		* queue_lock;
+
+	/*
+	 * A lock of the queue's own, for drivers that don't need to
+	 * share theirs with other queues
 	 */
 	spinlock_t		request_lock;
 
@@ -162,6 +169,7 @@ extern void blk_cleanup_queue(request_queue_t *);
 extern void blk_queue_headactive(request_queue_t *, int);
 extern void blk_queue_pluggable(request_queue_t *, plug_device_fn *);
 extern void blk_queue_make_request(request_queue_t *, make_request_fn *);
+extern void blk_queue_lock(request_queue_t *, spinlock_t *);
 
 extern int * blk_size[MAX_BLKDEV];
 
@@ -193,6 +201,7 @@ extern int * max_segments[MAX_BLKDEV];
 
 extern void drive_stat_acct (kdev_t dev, int rw,
 					unsigned long nr_sectors, int new_io);
+extern void drive_stat_done (struct request *req);
 
 static inline int get_hardsect_size(kdev_t dev)
 {
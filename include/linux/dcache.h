@@ -59,11 +59,12 @@ static __inline__ unsigned int full_name_hash(const unsigned char * name, unsign
 struct dentry {
 	atomic_t d_count;
 	unsigned int d_flags;
+	unsigned long d_vfs_flags;	/* see below, atomic bitops only */
 	struct inode  * d_inode;	/* Where the name belongs to - NULL is negative */
 	struct dentry * d_parent;	/* parent directory */
 	struct list_head d_vfsmnt;
 	struct list_head d_hash;	/* lookup hash list */
-	struct list_head d_lru;		/* d_count = 0 LRU list */
+	struct list_head d_lru;		/* LRU list, see dput() */
 	struct list_head d_child;	/* child of parent list */
 	struct list_head d_subdirs;	/* our children */
 	struct list_head d_alias;	/* inode alias list */
@@ -115,10 +116,18 @@ d_iput:		no		no		yes
 					 * If this dentry points to a directory, then
 					 * s_nfsd_free_path semaphore will be down
 					 */
-#define DCACHE_REFERENCED	0x0008  /* Recently used, don't discard. */
+
+/*
+ * d_vfs_flags bits.  d_lookup() sets them without dcache_lock, so they
+ * live apart from d_flags and are only changed with atomic bitops.
+ */
+#define DCACHE_REFERENCED	0	/* Recently used, don't discard. */
 
 extern spinlock_t dcache_lock;
 
+/* unhash a dentry, called with dcache_lock held */
+extern void __d_drop(struct dentry *);
+
 /**
  * d_drop - drop a dentry
  * @dentry: dentry to drop
@@ -139,8 +148,7 @@ extern spinlock_t dcache_lock;
 static __inline__ void d_drop(struct dentry * dentry)
 {
 	spin_lock(&dcache_lock);
-	list_del(&dentry->d_hash);
-	INIT_LIST_HEAD(&dentry->d_hash);
+	__d_drop(dentry);
 	spin_unlock(&dcache_lock);
 }
 
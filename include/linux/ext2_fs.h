@@ -32,6 +32,7 @@
  */
 #define EXT2_PREALLOCATE
 #define EXT2_DEFAULT_PREALLOC_BLOCKS	8
+#define EXT2_MAX_PREALLOC_BLOCKS	256
 
 /*
  * The second extended file system version
@@ -224,6 +224,7 @@ struct buffer_head {
 	unsigned short b_size;		/* block size */
 	unsigned short b_list;		/* List that this buffer appears */
 	kdev_t b_dev;			/* device (B_FREE = free) */
+	unsigned short b_wb;		/* writeback slot, while on BUF_DIRTY */
 
 	atomic_t b_count;		/* users using this block */
 	kdev_t b_rdev;			/* Real device */
@@ -1007,9 +1008,12 @@ static inline void mark_buffer_uptodate(struct buffer_head * bh, int on)
 
 #define atomic_set_buffer_clean(bh) test_and_clear_bit(BH_Dirty, &(bh)->b_state)
 
+extern void clear_page_dirty_buffers(struct page *);
+
 static inline void __mark_buffer_clean(struct buffer_head *bh)
 {
 	refile_buffer(bh);
+	clear_page_dirty_buffers(bh->b_page);
 }
 
 static inline void mark_buffer_clean(struct buffer_head * bh)
@@ -1074,6 +1078,7 @@ extern int fsync_inode_buffers(struct inode *);
 extern int osync_inode_buffers(struct inode *);
 extern int inode_has_buffers(struct inode *);
 extern void filemap_fdatasync(struct address_space *);
+extern int filemap_write_cluster(struct page *, int);
 extern void filemap_fdatawait(struct address_space *);
 extern void sync_supers(kdev_t);
 extern int bmap(struct inode *, int);
@@ -1208,6 +1213,7 @@ extern struct buffer_head * get_hash_table(kdev_t, int, int);
 extern struct buffer_head * getblk(kdev_t, int, int);
 extern void ll_rw_block(int, int, struct buffer_head * bh[]);
 extern void submit_bh(int, struct buffer_head *);
+extern void submit_bh_vec(int, int, struct buffer_head * bh[]);
 extern int is_read_only(kdev_t);
 extern void __brelse(struct buffer_head *);
 static inline void brelse(struct buffer_head *buf)
@@ -24,6 +24,8 @@ struct kernel_stat {
 	unsigned int dk_drive_wio[DK_MAX_MAJOR][DK_MAX_DISK];
 	unsigned int dk_drive_rblk[DK_MAX_MAJOR][DK_MAX_DISK];
 	unsigned int dk_drive_wblk[DK_MAX_MAJOR][DK_MAX_DISK];
+	unsigned int dk_drive_done[DK_MAX_MAJOR][DK_MAX_DISK];	/* requests completed */
+	unsigned int dk_drive_ticks[DK_MAX_MAJOR][DK_MAX_DISK];	/* jiffies they took */
 	unsigned int pgpgin, pgpgout;
 	unsigned int pswpin, pswpout;
 #if !defined(CONFIG_ARCH_S390)
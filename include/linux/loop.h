@@ -16,7 +16,18 @@
 #define LO_KEY_SIZE	32
 
 #ifdef __KERNEL__
-       
+
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <asm/semaphore.h>
+
+/* Possible states of device */
+enum {
+	Lo_unbound,
+	Lo_bound,
+	Lo_rundown,
+};
+
 struct loop_device {
 	int		lo_number;
 	struct dentry	*lo_dentry;
@@ -39,6 +50,14 @@ struct loop_device {
 	struct file *	lo_backing_file;
 	void		*key_data; 
 	char		key_reserved[48]; /* for use by the filter modules */
+
+	/* buffers waiting for the loop thread, by READ/WRITE */
+	spinlock_t		lo_lock;
+	struct buffer_head	*lo_bh[2];
+	struct buffer_head	*lo_bhtail[2];
+	int			lo_state;
+	struct semaphore	lo_sem;		/* thread start/exit */
+	wait_queue_head_t	lo_wait;
 };
 
 typedef	int (* transfer_proc_t)(struct loop_device *, int cmd,
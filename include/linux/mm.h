@@ -167,6 +167,7 @@ typedef struct page {
 #define PG_skip			10
 #define PG_inactive_clean	11
 #define PG_highmem		12
+#define PG_dirty_buffers	13	/* PG_dirty only stands for dirty buffers */
 				/* bits 21-29 unused */
 #define PG_arch_1		30
 #define PG_reserved		31
@@ -181,12 +182,22 @@ typedef struct page {
 #define PageLocked(page)	test_bit(PG_locked, &(page)->flags)
 #define LockPage(page)		set_bit(PG_locked, &(page)->flags)
 #define TryLockPage(page)	test_and_set_bit(PG_locked, &(page)->flags)
+#define PageDirtyBuffers(page)	test_bit(PG_dirty_buffers, &(page)->flags)
+#define SetPageDirtyBuffers(page)	set_bit(PG_dirty_buffers, &(page)->flags)
+#define ClearPageDirtyBuffers(page)	clear_bit(PG_dirty_buffers, &(page)->flags)
 
 extern void __set_page_dirty(struct page *);
+extern void set_page_dirty_buffers(struct page *);
 
+/*
+ * A page with buffers may have been dirtied by write() alone, and then
+ * clear_page_dirty_buffers() cleans it with its last buffer.  Always take
+ * the slow path for those, so that __set_page_dirty() turns it into a
+ * page that is dirty in its own right.
+ */
 static inline void set_page_dirty(struct page * page)
 {
-	if (!test_and_set_bit(PG_dirty, &page->flags))
+	if (!test_and_set_bit(PG_dirty, &page->flags) || page->buffers)
 		__set_page_dirty(page);
 }
 
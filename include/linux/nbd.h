@@ -2,6 +2,7 @@
  * 1999 Copyright (C) Pavel Machek, pavel@ucw.cz. This code is GPL.
  * 1999/11/04 Copyright (C) 1999 VMware, Inc. (Regis "HPReg" Duchesne)
  *            Made nbd_end_request() use the io_request_lock
+ *            (now the queue's own lock)
  */
 
 #ifndef LINUX_NBD_H
@@ -31,38 +32,40 @@ extern int requests_in;
 extern int requests_out;
 #endif
 
-static int 
+/*
+ * The whole request, all of its buffers, went over the wire as one
+ * nbd request, so it completes as a whole, too.
+ */
+static void
 nbd_end_request(struct request *req)
 {
 	unsigned long flags;
-	int ret = 0;
+	int uptodate = !req->errors;
+	spinlock_t *lock = req->q->queue_lock;
 
 #ifdef PARANOIA
 	requests_out++;
 #endif
-	/*
-	 * This is a very dirty hack that we have to do to handle
-	 * merged requests because end_request stuff is a bit
-	 * broken. The fact we have to do this only if there
-	 * aren't errors looks even more silly.
-	 */
-	if (!req->errors) {
-		req->sector += req->current_nr_sectors;
-		req->nr_sectors -= req->current_nr_sectors;
-	}
-
-	spin_lock_irqsave(&io_request_lock, flags);
-	if (end_that_request_first( req, !req->errors, "nbd" ))
-		goto out;
-	ret = 1;
+	spin_lock_irqsave(lock, flags);
+	while (end_that_request_first( req, uptodate, "nbd" ))
+		;
 	end_that_request_last( req );
-
-out:
-	spin_unlock_irqrestore(&io_request_lock, flags);
-	return ret;
+	spin_unlock_irqrestore(lock, flags);
 }
 
 #define MAX_NBD 128
+#define NBD_MAX_CONNS 8		/* sockets per device */
+
+struct nbd_device;
+
+struct nbd_conn {
+	struct nbd_device * lo;
+	struct socket * sock;
+	struct file * file;
+	int dead;			/* receiver gave up, don't send	*/
+	struct list_head queue_head;	/* Requests waiting for a reply	*/
+	struct semaphore tx_lock;	/* One sender at a time		*/
+};
 
 struct nbd_device {
 	int refcnt;	
@@ -70,11 +73,13 @@ struct nbd_device {
 	int harderror;		/* Code of hard error			*/
 #define NBD_READ_ONLY 0x0001
 #define NBD_WRITE_NOCHK 0x0002
-	struct socket * sock;
-	struct file * file; 		/* If == NULL, device is not ready, yet	*/
+	int nr_conns;			/* If == 0, device is not ready, yet	*/
+	int next_conn;
+	int active;			/* NBD_DO_IT is running		*/
+	struct nbd_conn conns[NBD_MAX_CONNS];
 	int magic;			/* FIXME: not if debugging is off	*/
-	struct list_head queue_head;	/* Requests are added here...			*/
-	struct semaphore queue_lock;
+	spinlock_t queue_lock;		/* Protects the conns' queue_heads	*/
+	struct semaphore recv_done;	/* Receiver threads exiting	*/
 };
 #endif
 
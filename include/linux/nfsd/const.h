@@ -19,9 +19,10 @@
 #define NFSSVC_MAXVERS		3
 
 /*
- * Maximum blocksize supported by daemon currently at 8K
+ * Maximum blocksize supported by daemon, 32K. NFSv2 clients are
+ * limited to 8K by the protocol.
  */
-#define NFSSVC_MAXBLKSIZE	8192
+#define NFSSVC_MAXBLKSIZE	32768
 
 #ifdef __KERNEL__
 
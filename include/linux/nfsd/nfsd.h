@@ -73,6 +73,7 @@ extern struct svc_program	nfsd_program;
  * Function prototypes.
  */
 int		nfsd_svc(unsigned short port, int nrservs);
+int		nfsd_pool_threads(int pool, int nrservs);
 
 /* nfsd/vfs.c */
 int		fh_lock_parent(struct svc_fh *, struct dentry *);
@@ -11,8 +11,10 @@
 
 struct nfsd_stats {
 	unsigned int	rchits;		/* repcache hits */
-	unsigned int	rcmisses;	/* repcache hits */
+	unsigned int	rcmisses;	/* repcache misses */
 	unsigned int	rcnocache;	/* uncached reqs */
+	unsigned int	rcevictions;	/* completed replies reused */
+	unsigned int	rcsize;		/* repcache entries */
 	unsigned int	fh_stale;	/* FH stale error */
 	unsigned int	fh_lookup;	/* dentry cached */
 	unsigned int	fh_anon;	/* anon file dentry returned */
@@ -38,6 +38,7 @@
 #define NFSCTL_GETFH		6	/* get an fh by ino (used by mountd) */
 #define NFSCTL_GETFD		7	/* get an fh by path (used by mountd) */
 #define	NFSCTL_GETFS		8	/* get an fh by path with max FH len */
+#define NFSCTL_SVCPOOL		9	/* set # of threads in one pool. */
 
 /* SVC */
 struct nfsctl_svc {
@@ -45,6 +46,12 @@ struct nfsctl_svc {
 	int			svc_nthreads;
 };
 
+/* SVCPOOL */
+struct nfsctl_svcpool {
+	int			pl_pool;
+	int			pl_nthreads;
+};
+
 /* ADDCLIENT/DELCLIENT */
 struct nfsctl_client {
 	char			cl_ident[NFSCLNT_IDMAX+1];
@@ -112,6 +119,7 @@ struct nfsctl_arg {
 		struct nfsctl_fhparm	u_getfh;
 		struct nfsctl_fdparm	u_getfd;
 		struct nfsctl_fsparm	u_getfs;
+		struct nfsctl_svcpool	u_pool;
 	} u;
 #define ca_svc		u.u_svc
 #define ca_client	u.u_client
@@ -120,6 +128,7 @@ struct nfsctl_arg {
 #define ca_getfh	u.u_getfh
 #define ca_getfd	u.u_getfd
 #define	ca_getfs	u.u_getfs
+#define ca_pool		u.u_pool
 #define ca_authd	u.u_authd
 };
 
@@ -76,6 +76,10 @@ extern int md_do_sync(mddev_t *mddev, mdp_disk_t *spare);
 extern void md_done_sync(mddev_t *mddev, int blocks, int ok);
 extern void md_sync_acct(kdev_t dev, unsigned long nr_sectors);
 extern void md_recover_arrays (void);
+extern void md_bitmap_startwrite(mddev_t *mddev, unsigned long sector,
+					unsigned long nr_sectors);
+extern void md_bitmap_endwrite(mddev_t *mddev, unsigned long sector,
+					unsigned long nr_sectors);
 extern int md_check_ordering (mddev_t *mddev);
 extern struct gendisk * find_gendisk (kdev_t dev);
 extern int md_notify_reboot(struct notifier_block *this,
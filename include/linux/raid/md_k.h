@@ -23,7 +23,8 @@
 #define RAID5             4UL
 #define TRANSLUCENT       5UL
 #define HSM               6UL
-#define MAX_PERSONALITY   7UL
+#define RAID10            7UL
+#define MAX_PERSONALITY   8UL
 
 extern inline int pers_to_level (int pers)
 {
@@ -34,6 +35,7 @@ extern inline int pers_to_level (int pers)
 		case RAID0:		return 0;
 		case RAID1:		return 1;
 		case RAID5:		return 5;
+		case RAID10:		return 10;
 	}
 	panic("pers_to_level()");
 }
@@ -48,6 +50,7 @@ extern inline int level_to_pers (int level)
 		case 1: return RAID1;
 		case 4:
 		case 5: return RAID5;
+		case 10: return RAID10;
 	}
 	return MD_RESERVED;
 }
@@ -164,6 +167,8 @@ struct mdk_rdev_s
 	unsigned long size;		/* Device size (in blocks) */
 	mddev_t *mddev;			/* RAID array if running */
 	unsigned long last_events;	/* IO event timestamp */
+	unsigned long last_done;	/* requests completed, ditto */
+	unsigned long last_ticks;	/* and the time they took */
 
 	struct block_device *bdev;	/* block device handle */
 
@@ -186,6 +191,35 @@ struct mdk_rdev_s
 
 typedef struct mdk_personality_s mdk_personality_t;
 
+/*
+ * In-core write-intent bitmap, see md_bitmap_startwrite().
+ */
+typedef struct md_bitmap_s {
+	unsigned long		*map;		/* the on-disk bitmap */
+	unsigned long		*recent;	/* written since the last clean pass */
+	unsigned short		*pending;	/* writes in flight, per region */
+	unsigned long		nregions;
+	int			shift;		/* log2 of region size in kB */
+	int			nblocks;	/* MD_BITMAP_BLOCK_BYTES blocks */
+	int			resync_pending;	/* loaded bits not resynced yet */
+
+	/*
+	 * block_seq[] records when each block of the map was last
+	 * changed; everything up to seq_written is on disk.
+	 */
+	unsigned long		*block_seq;
+	unsigned long		seq_dirty;
+	unsigned long		seq_written;
+	int			flushing;
+
+	md_spinlock_t		lock;
+	md_wait_queue_head_t	wait;
+
+	struct buffer_head	*bhs;		/* for the flusher */
+	atomic_t		io_pending;
+	md_wait_queue_head_t	io_wait;
+} md_bitmap_t;
+
 struct mddev_s
 {
 	void				*private;
@@ -200,6 +234,10 @@ struct mddev_s
 	unsigned long			curr_resync;	/* blocks scheduled */
 	unsigned long			resync_mark;	/* a recent timestamp */
 	unsigned long			resync_mark_cnt;/* blocks written at resync_mark */
+	int				sync_speed_max;	/* KB/sec, 0: use speed_limit_max */
+	int				sync_target;	/* adaptive resync speed, KB/sec */
+	unsigned long			sync_fg_rate;	/* foreground I/O on members, KB/sec */
+	unsigned long			sync_latency;	/* average member request time, ms */
 	char				*name;
 	int				recovery_running;
 	struct semaphore		reconfig_sem;
@@ -210,6 +248,8 @@ struct mddev_s
 	atomic_t			recovery_active; /* blocks scheduled, but not written */
 	md_wait_queue_head_t		recovery_wait;
 
+	md_bitmap_t			*bitmap;	/* write-intent bitmap */
+
 	struct md_list_head		all_mddevs;
 };
 
@@ -53,6 +53,17 @@
 #define MD_SB_BLOCKS			(MD_SB_BYTES / BLOCK_SIZE)
 #define MD_SB_SECTORS			(MD_SB_BYTES / 512)
 
+/*
+ * The write-intent bitmap follows the superblock in the reserved area,
+ * one bit per (1 << bitmap_shift) kB region of the device, and is read
+ * and written in MD_BITMAP_BLOCK_BYTES units.  A bitmap_shift of zero
+ * in the superblock means the array has no bitmap.
+ */
+#define MD_BITMAP_BYTES			(MD_RESERVED_BYTES - MD_SB_BYTES)
+#define MD_BITMAP_BLOCK_BYTES		4096
+#define MD_BITMAP_BLOCK_BITS		(MD_BITMAP_BLOCK_BYTES * 8)
+#define MD_BITMAP_MIN_SHIFT		6
+
 /*
  * The following are counted in 32-bit words
  */
@@ -135,7 +146,8 @@ typedef struct mdp_superblock_s {
 	__u32 events_lo;	/*  7 low-order of superblock update count    */
 	__u32 events_hi;	/*  8 high-order of superblock update count   */
 #endif
-	__u32 gstate_sreserved[MD_SB_GENERIC_STATE_WORDS - 9];
+	__u32 bitmap_shift;	/*  9 log2 of write-intent bitmap region (kB) */
+	__u32 gstate_sreserved[MD_SB_GENERIC_STATE_WORDS - 10];
 
 	/*
 	 * Personality information
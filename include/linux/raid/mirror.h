@@ -0,0 +1,55 @@
+#ifndef _MIRROR_H
+#define _MIRROR_H
+
+#include <linux/raid/md.h>
+
+/*
+ * Helpers shared by the mirroring personalities, raid1 and raid10.
+ */
+
+/*
+ * The buffer_heads for the per-mirror requests.  Those we have
+ * pre-allocated have b_pprev -> &pool->freebh and are linked into a
+ * stack using b_next.  'wait' is the personality's wait queue for
+ * any of its buffers, it is woken whenever buffer_heads come back.
+ */
+struct mirror_bh_pool {
+	md_spinlock_t		lock;
+	struct buffer_head	*freebh;
+	int			freebh_cnt;	/* how many are on the list */
+	md_wait_queue_head_t	*wait;
+};
+
+extern void mirror_init_bh_pool(struct mirror_bh_pool *pool,
+				md_wait_queue_head_t *wait);
+extern struct buffer_head *mirror_alloc_bh(struct mirror_bh_pool *pool, int cnt);
+extern void mirror_free_bh(struct mirror_bh_pool *pool, struct buffer_head *bh);
+extern int mirror_grow_bh(struct mirror_bh_pool *pool, int cnt);
+extern int mirror_shrink_bh(struct mirror_bh_pool *pool, int cnt);
+
+/*
+ * The window that keeps normal I/O away from the blocks being
+ * synced, see mirror.c.  All sector numbers are in the address space
+ * the personality resyncs.
+ */
+struct mirror_window {
+	unsigned long	start_active, start_ready,
+		start_pending, start_future;
+	int	cnt_done, cnt_active, cnt_ready,
+		cnt_pending, cnt_future;
+	int	phase;
+	int	window;
+	md_wait_queue_head_t	wait_done;
+	md_wait_queue_head_t	wait_ready;
+	md_spinlock_t		segment_lock;
+};
+
+extern void mirror_init_window(struct mirror_window *w);
+extern int mirror_io_start(struct mirror_window *w, unsigned long sector);
+extern void mirror_io_done(struct mirror_window *w, unsigned long sector, int phase);
+extern void mirror_sync_begin(struct mirror_window *w, int window);
+extern void mirror_sync_start(struct mirror_window *w, unsigned long sector);
+extern void mirror_sync_done(struct mirror_window *w, unsigned long sector);
+extern void mirror_close_sync(struct mirror_window *w, unsigned long end);
+
+#endif
@@ -2,6 +2,7 @@
 #define _RAID1_H
 
 #include <linux/raid/md.h>
+#include <linux/raid/mirror.h>
 
 struct mirror_info {
 	int		number;
@@ -35,27 +36,17 @@ struct raid1_private_data {
 	md_spinlock_t		device_lock;
 
 	/* buffer pool */
-	/* buffer_heads that we have pre-allocated have b_pprev -> &freebh
-	 * and are linked into a stack using b_next
-	 * raid1_bh that are pre-allocated have R1BH_PreAlloc set.
-	 * All these variable are protected by device_lock
+	/* raid1_bh that are pre-allocated have R1BH_PreAlloc set.
+	 * freer1 and freebuf are protected by device_lock, the
+	 * buffer_heads in 'pool' by its own lock.
 	 */
-	struct buffer_head	*freebh;
-	int			freebh_cnt;	/* how many are on the list */
+	struct mirror_bh_pool	pool;
 	struct raid1_bh		*freer1;
 	struct raid1_bh		*freebuf; 	/* each bh_req has a page allocated */
 	md_wait_queue_head_t	wait_buffer;
 
 	/* for use when syncing mirrors: */
-	unsigned long	start_active, start_ready,
-		start_pending, start_future;
-	int	cnt_done, cnt_active, cnt_ready,
-		cnt_pending, cnt_future;
-	int	phase;
-	int	window;
-	md_wait_queue_head_t	wait_done;
-	md_wait_queue_head_t	wait_ready;
-	md_spinlock_t		segment_lock;
+	struct mirror_window	sync_window;
 };
 
 typedef struct raid1_private_data raid1_conf_t;
@@ -0,0 +1,101 @@
+#ifndef _RAID10_H
+#define _RAID10_H
+
+#include <linux/raid/md.h>
+#include <linux/raid/mirror.h>
+
+/*
+ * The superblock 'layout' field of a RAID10 array holds the number
+ * of near copies in the low byte and the number of far copies in the
+ * next byte.  A layout of 0 means two near copies, which is what
+ * most people want.
+ *
+ *  near copies: the copies of a chunk sit on consecutive devices at
+ *		 (nearly) the same offset, like raid0 over raid1 pairs.
+ *  far copies:  each device is cut into 'far' sections; the first
+ *		 holds a raid0 layout of the data, the others hold the
+ *		 same layout shifted by 'near' devices.
+ */
+#define RAID10_NEAR_COPIES(layout)	((layout) & 0xff ? (layout) & 0xff : 2)
+#define RAID10_FAR_COPIES(layout)	(((layout) >> 8) & 0xff ? ((layout) >> 8) & 0xff : 1)
+
+struct mirror_info {
+	int		number;
+	int		raid_disk;
+	kdev_t		dev;
+	unsigned long	head_position;
+
+	/*
+	 * State bits:
+	 */
+	int		operational;
+	int		write_only;
+	int		spare;
+
+	int		used_slot;
+};
+
+struct raid10_private_data {
+	mddev_t			*mddev;
+	struct mirror_info	mirrors[MD_SB_DISKS];
+	int			nr_disks;
+	int			raid_disks;
+	int			working_disks;
+	int			near_copies;
+	int			far_copies;
+	int			copies;		/* near_copies * far_copies */
+	int			chunk_shift;	/* log2 of chunk size in sectors */
+	unsigned long		chunk_mask;
+	unsigned long		stride;		/* sectors per far section of a device */
+	mdk_thread_t		*thread, *resync_thread;
+	int			resync_mirrors;
+	struct mirror_info	*spare;
+	int			spare_for;	/* the slot the spare is rebuilding */
+	md_spinlock_t		device_lock;
+
+	/* buffer pool, see raid1.h */
+	struct mirror_bh_pool	pool;
+	struct raid10_bh	*freer10;
+	struct raid10_bh	*freebuf;
+	md_wait_queue_head_t	wait_buffer;
+
+	/* for use when syncing mirrors, see mirror.c */
+	struct mirror_window	sync_window;
+};
+
+typedef struct raid10_private_data raid10_conf_t;
+
+#define mddev_to_conf(mddev) ((raid10_conf_t *) mddev->private)
+
+/*
+ * Where the copies of one block live: device slot and sector.
+ */
+struct raid10_copy {
+	int			devnum;
+	unsigned long		addr;
+};
+
+/*
+ * this is our 'private' RAID10 buffer head, the counterpart of
+ * struct raid1_bh.  'sector' is the array sector, devs[] lists
+ * every copy of it.
+ */
+struct raid10_bh {
+	atomic_t		remaining;
+	int			cmd;
+	unsigned long		state;
+	mddev_t			*mddev;
+	unsigned long		sector;
+	int			read_slot;	/* copy we read from */
+	unsigned long		tried;		/* copies we have read from */
+	struct buffer_head	*master_bh;
+	struct buffer_head	*mirror_bh_list;
+	struct buffer_head	bh_req;
+	struct raid10_bh	*next_r10;	/* next for retry or in free list */
+	struct raid10_copy	devs[MD_SB_DISKS];
+};
+/* bits for raid10_bh.state */
+#define	R10BH_Uptodate	1
+#define	R10BH_SyncPhase	2
+#define	R10BH_PreAlloc	3	/* this was pre-allocated, add to free list */
+#endif
@@ -118,6 +118,21 @@
  *  release an active stripe (release_stripe())
  *     lockdev if (!--cnt) { if  STRIPE_HANDLE, add to handle_list else add to inactive-list } unlockdev
  *
+ * A partial-stripe write that would have to pre-read old data or
+ * parity is not started at once.  handle_stripe() sets STRIPE_DELAYED
+ * instead, and on release the stripe goes onto the "delayed_list"
+ * (still counted in active_stripes) in the hope that the rest of the
+ * stripe arrives and a reconstruct-write with no reads can be done.
+ * raid5d moves delayed stripes to the handle_list with
+ * STRIPE_PREREAD_ACTIVE set once they have waited RAID5_WRITE_DELAY,
+ * or earlier when the stripe cache is running short.  A stripe with
+ * STRIPE_PREREAD_ACTIVE set is never delayed again.
+ *
+ * On SMP the handle_list is drained by raid5d and by up to
+ * RAID5_MAX_WORKERS helper threads.  A stripe is on the handle_list
+ * at most once and handle_stripe() runs under the stripe lock, so
+ * work on any one stripe stays in order whichever thread picks it up.
+ *
  * The refcount counts each thread that have activated the stripe,
  * plus raid5d if it is handling it, plus one for each active request
  * on a cached buffer.
@@ -137,6 +152,7 @@ struct stripe_head {
 	atomic_t		count;			/* nr of active thread/requests */
 	spinlock_t		lock;
 	int			sync_redone;
+	unsigned long		expires;		/* delayed write deadline */
 };
 
 
@@ -155,6 +171,8 @@ struct stripe_head {
 #define STRIPE_HANDLE		2
 #define	STRIPE_SYNCING		3
 #define	STRIPE_INSYNC		4
+#define	STRIPE_DELAYED		5
+#define	STRIPE_PREREAD_ACTIVE	6
 
 struct disk_info {
 	kdev_t	dev;
@@ -166,10 +184,14 @@ struct disk_info {
 	int	used_slot;
 };
 
+#define RAID5_MAX_WORKERS	8
+
 struct raid5_private_data {
 	struct stripe_head	**stripe_hashtbl;
 	mddev_t			*mddev;
 	mdk_thread_t		*thread, *resync_thread;
+	mdk_thread_t		*workers[RAID5_MAX_WORKERS];
+	int			nr_workers, next_worker;
 	struct disk_info	disks[MD_SB_DISKS];
 	struct disk_info	*spare;
 	int			buffer_size;
@@ -179,6 +201,8 @@ struct raid5_private_data {
 	int			max_nr_stripes;
 
 	struct list_head	handle_list; /* stripes needing handling */
+	struct list_head	delayed_list; /* partial writes waiting for the rest of the stripe */
+	struct timer_list	delay_timer;
 	/*
 	 * Free stripes pool
 	 */
@@ -187,6 +211,13 @@ struct raid5_private_data {
 	md_wait_queue_head_t	wait_for_stripe;
 
 	md_spinlock_t		device_lock;
+
+	/*
+	 * Stripe cache statistics, shown in /proc/mdstat
+	 */
+	atomic_t		cache_hits, cache_misses;
+	atomic_t		rmw_writes, rcw_writes, full_writes;
+	atomic_t		delayed_writes;
 };
 
 typedef struct raid5_private_data raid5_conf_t;
@@ -76,6 +76,7 @@ struct rpc_task {
 	struct timer_list	tk_timer;	/* kernel timer */
 	wait_queue_head_t	tk_wait;	/* sync: sleep on this q */
 	unsigned long		tk_timeout;	/* timeout for rpc_sleep() */
+	unsigned long		tk_qstart;	/* started waiting for a slot */
 	unsigned short		tk_flags;	/* misc flags */
 	unsigned short		tk_lock;	/* Task lock counter */
 	unsigned char		tk_active   : 1,/* Task has been activated */
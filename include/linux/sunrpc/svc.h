@@ -11,23 +11,39 @@
 #define SUNRPC_SVC_H
 
 #include <linux/in.h>
+#include <linux/threads.h>
+#include <linux/cache.h>
 #include <linux/sunrpc/types.h>
 #include <linux/sunrpc/xdr.h>
 #include <linux/sunrpc/svcauth.h>
 
+/*
+ * A pool of server threads.
+ *
+ * There is one pool per CPU. A socket that becomes ready is queued on
+ * the pool of the CPU its data arrived on, and handed to one of that
+ * pool's idle threads if there is one. Pool threads are bound to their
+ * CPU, so the request is processed where the packet is still in cache,
+ * and the pools do not share a lock.
+ */
+struct svc_pool {
+	struct svc_rqst *	sp_threads;	/* idle server threads */
+	struct svc_sock *	sp_sockets;	/* pending sockets */
+	unsigned int		sp_nrthreads;	/* # of threads in pool */
+	spinlock_t		sp_lock;
+} ____cacheline_aligned;
+
 /*
  * RPC service.
  *
  * An RPC service is a ``daemon,'' possibly multithreaded, which
  * receives and processes incoming RPC messages.
  * It has one or more transport sockets associated with it, and maintains
- * a list of idle threads waiting for input.
+ * lists of idle threads waiting for input, one per pool.
  *
  * We currently do not support more than one RPC program per daemon.
  */
 struct svc_serv {
-	struct svc_rqst *	sv_threads;	/* idle server threads */
-	struct svc_sock *	sv_sockets;	/* pending sockets */
 	struct svc_program *	sv_program;	/* RPC program */
 	struct svc_stat *	sv_stats;	/* RPC statistics */
 	spinlock_t		sv_lock;
@@ -38,6 +54,9 @@ struct svc_serv {
 	struct svc_sock *	sv_allsocks;	/* all sockets */
 
 	char *			sv_name;	/* service name */
+
+	unsigned int		sv_nrpools;	/* # of thread pools */
+	struct svc_pool		sv_pools[NR_CPUS];
 };
 
 /*
@@ -45,7 +64,7 @@ struct svc_serv {
  * This is use to determine the max number of pages nfsd is
  * willing to return in a single READ operation.
  */
-#define RPCSVC_MAXPAYLOAD	16384u
+#define RPCSVC_MAXPAYLOAD	32768u
 
 /*
  * Buffer to store RPC requests or replies in.
@@ -66,8 +85,21 @@ struct svc_serv {
  * On the receiving end of the RPC server, the iovec may be used to hold
  * the list of IP fragments once we get to process fragmented UDP
  * datagrams directly.
+ *
+ * NFS READ fills the pages list instead: it holds references to the
+ * page cache pages with the file data, and pagedata points at the
+ * words of the reply those pages stand in for. The send routines use
+ * the pages in place of that part of the buffer, so the data is only
+ * copied once, into the socket buffers. The references are dropped
+ * when the request is finished.
  */
 #define RPCSVC_MAXIOV		((RPCSVC_MAXPAYLOAD+PAGE_SIZE-1)/PAGE_SIZE + 1)
+struct svc_page {
+	struct page *		page;
+	unsigned int		offset;
+	unsigned int		len;
+};
+
 struct svc_buf {
 	u32 *			area;	/* allocated memory */
 	u32 *			base;	/* base of RPC datagram */
@@ -78,6 +110,11 @@ struct svc_buf {
 	/* iovec for zero-copy NFS READs */
 	struct iovec		iov[RPCSVC_MAXIOV];
 	int			nriov;
+
+	/* page cache data sent in place of part of the reply */
+	struct svc_page		pages[RPCSVC_MAXIOV];
+	int			nrpages;
+	u32 *			pagedata;
 };
 #define svc_getlong(argp, val)	{ (val) = *(argp)->buf++; (argp)->len--; }
 #define svc_putlong(resp, val)	{ *(resp)->buf++ = (val); (resp)->len++; }
@@ -95,6 +132,7 @@ struct svc_rqst {
 	int			rq_addrlen;
 
 	struct svc_serv *	rq_server;	/* RPC service definition */
+	struct svc_pool *	rq_pool;	/* thread pool */
 	struct svc_procedure *	rq_procinfo;	/* procedure info */
 	struct svc_cred		rq_cred;	/* auth info */
 	struct sk_buff *	rq_skbuff;	/* fast recv inet buffer */
@@ -174,6 +212,8 @@ typedef void		(*svc_thread_fn)(struct svc_rqst *);
  */
 struct svc_serv *  svc_create(struct svc_program *, unsigned int, unsigned int);
 int		   svc_create_thread(svc_thread_fn, struct svc_serv *);
+int		   svc_create_pooled_thread(svc_thread_fn, struct svc_serv *, int);
+void		   svc_pool_bind(struct svc_rqst *);
 void		   svc_exit_thread(struct svc_rqst *);
 void		   svc_destroy(struct svc_serv *);
 int		   svc_process(struct svc_serv *, struct svc_rqst *);
@@ -24,13 +24,14 @@ struct svc_sock {
 	spinlock_t		sk_lock;
 
 	struct svc_serv *	sk_server;	/* service for this socket */
+	struct svc_pool *	sk_pool;	/* pool it is queued on */
 	unsigned char		sk_inuse;	/* use count */
 	unsigned char		sk_busy;	/* enqueued/receiving */
 	unsigned char		sk_conn;	/* conn pending */
 	unsigned char		sk_close;	/* dead or dying */
 	int			sk_data;	/* data pending */
 	unsigned int		sk_temp : 1,	/* temp socket */
-				sk_qued : 1,	/* on serv->sk_sockets */
+				sk_qued : 1,	/* on sk_pool->sp_sockets */
 				sk_dead : 1;	/* socket closed */
 	int			(*sk_recvfrom)(struct svc_rqst *rqstp);
 	int			(*sk_sendto)(struct svc_rqst *rqstp);
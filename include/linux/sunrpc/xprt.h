@@ -33,6 +33,12 @@
  * Upper procedures may check whether a request would block waiting for
  * a free RPC slot by using the RPC_CONGESTED() macro.
  *
+ * The first RPC_MAXREQS request slots live in the transport itself.
+ * TCP does its own congestion control, so a TCP transport is not
+ * limited by the window above; it allocates further slots as it needs
+ * them, up to RPC_MAXREQS_TCP, and frees them again when they have
+ * been idle.
+ *
  * Note: on machines with low memory we should probably use a smaller
  * MAXREQS value: At 32 outstanding reqs with 8 megs of RAM, fragment
  * reassembly will frequently run out of memory.
@@ -40,6 +46,7 @@
  */
 #define RPC_MAXCONG		16
 #define RPC_MAXREQS		(RPC_MAXCONG + 1)
+#define RPC_MAXREQS_TCP		128
 #define RPC_CWNDSCALE		256
 #define RPC_MAXCWND		(RPC_MAXCONG * RPC_CWNDSCALE)
 #define RPC_INITCWND		RPC_CWNDSCALE
@@ -138,7 +145,12 @@ struct rpc_xprt {
 	struct rpc_wait_queue	reconn;		/* waiting for reconnect */
 	struct rpc_rqst *	free;		/* free slots */
 	struct rpc_rqst		slot[RPC_MAXREQS];
+	unsigned int		nslots,		/* slots allocated */
+				nfree,		/* slots on the free list */
+				max_reqs;	/* limit on nslots */
 	unsigned int		sockstate;	/* Socket state */
+	unsigned int		sndsize,	/* socket send buffer */
+				rcvsize;	/* ... and receive buffer */
 	unsigned char		shutdown   : 1,	/* being shut down */
 				nocong	   : 1,	/* no congestion control */
 				stream     : 1,	/* TCP */
@@ -166,6 +178,15 @@ struct rpc_xprt {
 	void			(*old_write_space)(struct sock *);
 
 	wait_queue_head_t	cong_wait;
+
+	/*
+	 * Slot statistics, see /proc/net/rpc/xprt
+	 */
+	struct list_head	xprt_list;	/* all transports */
+	unsigned long		st_reqs,	/* slots handed out */
+				st_backlog,	/* ... after waiting */
+				st_qtime;	/* jiffies spent waiting */
+	unsigned int		st_maxout;	/* most requests outstanding */
 };
 
 #ifdef __KERNEL__
@@ -177,6 +198,8 @@ void			xprt_shutdown(struct rpc_xprt *);
 void			xprt_default_timeout(struct rpc_timeout *, int);
 void			xprt_set_timeout(struct rpc_timeout *, unsigned int,
 					unsigned long);
+void			xprt_set_buffer_size(struct rpc_xprt *, unsigned int,
+					unsigned int);
 
 int			xprt_reserve(struct rpc_task *);
 void			xprt_transmit(struct rpc_task *);
@@ -186,6 +209,8 @@ void			xprt_release(struct rpc_task *);
 void			xprt_reconnect(struct rpc_task *);
 int			xprt_clear_backlog(struct rpc_xprt *);
 void			__rpciod_tcp_dispatcher(void);
+int			xprt_proc_read(char *, char **, off_t, int,
+					int *, void *);
 
 extern struct list_head	rpc_xprt_pending;
 
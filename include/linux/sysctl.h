@@ -480,7 +480,11 @@ enum {
 	NET_KHTTPD_DYNAMICSTRING= 10,
 	NET_KHTTPD_SLOPPYMIME   = 11,
 	NET_KHTTPD_THREADS	= 12,
-	NET_KHTTPD_MAXCONNECT	= 13
+	NET_KHTTPD_MAXCONNECT	= 13,
+	NET_KHTTPD_KEEPALIVE_TIMEOUT = 14,
+	NET_KHTTPD_KEEPALIVE_MAX = 15,
+	NET_KHTTPD_KEEPALIVE_HITS = 16,
+	NET_KHTTPD_KEEPALIVE_TIMEOUTS = 17
 };
 
 /* /proc/sys/net/decnet/conf/<dev> */
@@ -557,7 +561,8 @@ enum {
 /* /proc/sys/dev/raid */
 enum {
 	DEV_RAID_SPEED_LIMIT_MIN=1,
-	DEV_RAID_SPEED_LIMIT_MAX=2
+	DEV_RAID_SPEED_LIMIT_MAX=2,
+	DEV_RAID_LATENCY_TARGET=3
 };
 
 /* /proc/sys/dev/parport/default */
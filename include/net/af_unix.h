@@ -5,6 +5,7 @@ extern void unix_inflight(struct file *fp);
 extern void unix_notinflight(struct file *fp);
 typedef struct sock unix_socket;
 extern void unix_gc(void);
+extern void unix_gc_barrier(void);
 
 #define UNIX_HASH_SIZE	256
 
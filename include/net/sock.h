@@ -111,7 +111,9 @@ struct unix_opt {
 	struct semaphore	readsem;
 	struct sock *		other;
 	struct sock **		list;
-	struct sock *		gc_tree;
+	struct list_head	gc_link;	/* in-flight or GC candidate list */
+	unsigned char		gc_candidate;
+	unsigned char		gc_maybe_cycle;
 	atomic_t		inflight;
 	rwlock_t		lock;
 	wait_queue_head_t	peer_wait;
@@ -152,6 +152,7 @@ EXPORT_SYMBOL(d_delete);
 EXPORT_SYMBOL(dget_locked);
 EXPORT_SYMBOL(d_validate);
 EXPORT_SYMBOL(d_rehash);
+EXPORT_SYMBOL(__d_drop);
 EXPORT_SYMBOL(d_invalidate);	/* May be it will be better in dcache.h? */
 EXPORT_SYMBOL(d_move);
 EXPORT_SYMBOL(d_instantiate);
@@ -189,6 +190,7 @@ EXPORT_SYMBOL(__brelse);
 EXPORT_SYMBOL(__bforget);
 EXPORT_SYMBOL(ll_rw_block);
 EXPORT_SYMBOL(submit_bh);
+EXPORT_SYMBOL(submit_bh_vec);
 EXPORT_SYMBOL(__wait_on_buffer);
 EXPORT_SYMBOL(___wait_on_page);
 EXPORT_SYMBOL(block_write_full_page);
@@ -132,13 +132,20 @@ static inline int sync_page(struct page *page)
 }
 
 /*
- * Add a page to the dirty page list.
+ * Add a page to the dirty page list.  PG_dirty is set again under the
+ * lock: clear_page_dirty_buffers() may have cleared it since the caller
+ * looked.
  */
 void __set_page_dirty(struct page *page)
 {
 	struct address_space *mapping = page->mapping;
 
+	/* a truncated page that is still mapped keeps its buffers a while */
+	if (!mapping)
+		return;
 	spin_lock(&pagecache_lock);
+	SetPageDirty(page);
+	ClearPageDirtyBuffers(page);
 	list_del(&page->list);
 	list_add(&page->list, &mapping->dirty_pages);
 	spin_unlock(&pagecache_lock);
@@ -146,6 +153,72 @@ void __set_page_dirty(struct page *page)
 	mark_inode_dirty_pages(mapping->host);
 }
 
+/*
+ * A write() dirtied buffers on a page: put the page on the dirty list
+ * of its mapping, so that writeback can go a page cluster at a time.
+ * Unlike set_page_dirty() the inode is not marked, the buffers still
+ * age on the BUF_DIRTY list and it is bdflush and kupdate which send
+ * them out, through filemap_write_cluster().
+ */
+void set_page_dirty_buffers(struct page *page)
+{
+	struct address_space *mapping = page->mapping;
+
+	if (!mapping || PageDirty(page))
+		return;
+	spin_lock(&pagecache_lock);
+	if (!PageDirty(page)) {
+		SetPageDirty(page);
+		SetPageDirtyBuffers(page);
+		list_del(&page->list);
+		list_add(&page->list, &mapping->dirty_pages);
+	}
+	spin_unlock(&pagecache_lock);
+}
+
+/*
+ * One of the buffers of a page went clean without the page being written
+ * as a whole: ll_rw_block() from bdflush, sync_buffers() or
+ * fsync_inode_buffers().  If set_page_dirty_buffers() is the only reason
+ * the page is dirty and that was its last dirty buffer, the page is clean
+ * now, and must come off the dirty list or it is written a second time.
+ *
+ * PG_dirty is cleared before the buffers are looked at, so a write()
+ * that dirties one of them meanwhile finds the page clean and puts it
+ * back itself.
+ */
+void clear_page_dirty_buffers(struct page *page)
+{
+	struct buffer_head *bh, *head;
+
+	if (!PageDirtyBuffers(page))
+		return;
+
+	spin_lock(&pagecache_lock);
+	if (!page->mapping || !PageDirtyBuffers(page) || !PageDirty(page))
+		goto out;
+	head = page->buffers;
+	if (!head)
+		goto out;
+
+	ClearPageDirty(page);
+	smp_mb__after_clear_bit();
+	bh = head;
+	do {
+		if (buffer_dirty(bh)) {
+			SetPageDirty(page);
+			goto out;
+		}
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+	ClearPageDirtyBuffers(page);
+	list_del(&page->list);
+	list_add(&page->list, &page->mapping->clean_pages);
+out:
+	spin_unlock(&pagecache_lock);
+}
+
 /**
  * invalidate_inode_pages - Invalidate all the unlocked pages of one inode
  * @inode: the inode which pages we want to invalidate
@@ -403,21 +476,74 @@ int generic_buffer_fdatasync(struct inode *inode, unsigned long start_idx, unsig
 	return retval;
 }
 
+/**
+ *      filemap_write_cluster - write out a dirty page and the ones after it
+ *      @page: locked page to start with, the caller holds a reference
+ *      @max: write at most this many pages
+ *
+ *      The dirty pages following @page in its mapping are written out in
+ *      index order behind it, so the elevator gets one long run of
+ *      adjacent blocks rather than a page (or a buffer) at a time.  The
+ *      cluster ends at the first page that is not cached, not dirty or
+ *      locked by somebody else.  @page is unlocked and released.
+ *      Returns the number of pages written.
+ */
+int filemap_write_cluster(struct page *page, int max)
+{
+	struct address_space *mapping = page->mapping;
+	int (*writepage)(struct page *);
+	unsigned long index = page->index;
+	int written = 0;
+
+	if (!mapping || !PageDirty(page)) {
+		UnlockPage(page);
+		page_cache_release(page);
+		return 0;
+	}
+	/* the locked page pins the mapping */
+	writepage = mapping->a_ops->writepage;
+
+	for (;;) {
+		spin_lock(&pagecache_lock);
+		list_del(&page->list);
+		list_add(&page->list, &mapping->locked_pages);
+		ClearPageDirty(page);
+		ClearPageDirtyBuffers(page);
+		spin_unlock(&pagecache_lock);
+
+		writepage(page);
+		page_cache_release(page);
+		if (++written >= max)
+			break;
+
+		index++;
+		spin_lock(&pagecache_lock);
+		page = __find_page_nolock(mapping, index, *page_hash(mapping, index));
+		if (!page || !PageDirty(page) || TryLockPage(page)) {
+			spin_unlock(&pagecache_lock);
+			break;
+		}
+		page_cache_get(page);
+		spin_unlock(&pagecache_lock);
+	}
+	return written;
+}
+
 /**
  *      filemap_fdatasync - walk the list of dirty pages of the given address space
  *     	and writepage() all of them.
  * 
  *      @mapping: address space structure to write
  *
+ *      We start from the oldest dirty page and write a cluster from there,
+ *      which for files written sequentially means ascending order.
  */
 void filemap_fdatasync(struct address_space * mapping)
 {
-	int (*writepage)(struct page *) = mapping->a_ops->writepage;
-
 	spin_lock(&pagecache_lock);
 
         while (!list_empty(&mapping->dirty_pages)) {
-		struct page *page = list_entry(mapping->dirty_pages.next, struct page, list);
+		struct page *page = list_entry(mapping->dirty_pages.prev, struct page, list);
 
 		list_del(&page->list);
 		list_add(&page->list, &mapping->locked_pages);
@@ -429,14 +555,8 @@ void filemap_fdatasync(struct address_space * mapping)
 		spin_unlock(&pagecache_lock);
 
 		lock_page(page);
+		filemap_write_cluster(page, INT_MAX);
 
-		if (PageDirty(page)) {
-			ClearPageDirty(page);
-			writepage(page);
-		} else
-			UnlockPage(page);
-
-		page_cache_release(page);
 		spin_lock(&pagecache_lock);
 	}
 	spin_unlock(&pagecache_lock);
@@ -87,7 +87,7 @@ static void __free_pages_ok (struct page *page, unsigned long order)
 	if (PageInactiveClean(page))
 		BUG();
 
-	page->flags &= ~((1<<PG_referenced) | (1<<PG_dirty));
+	page->flags &= ~((1<<PG_referenced) | (1<<PG_dirty) | (1<<PG_dirty_buffers));
 	page->age = PAGE_AGE_START;
 	
 	zone = page->zone;
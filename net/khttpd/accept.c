@@ -107,12 +107,15 @@ int AcceptConnections(const int CPUNR, struct socket *Socket)
 		memset(NewRequest,0,sizeof(struct http_request));  
 		
 		NewRequest->sock = NewSock;
+		NewRequest->CPUNR = CPUNR;
+		InitIdleTimer(NewRequest);
 		
 		NewRequest->Next = threadinfo[CPUNR].WaitForHeaderQueue;
 		
-		init_waitqueue_entry(&NewRequest->sleep,current);
+		StartSocketEvents(NewRequest);
 		
-		add_wait_queue(NewSock->sk->sleep,&(NewRequest->sleep));
+		/* The headers may have arrived before the callbacks were set */
+		NewRequest->Ready = 1;
 		
 		threadinfo[CPUNR].WaitForHeaderQueue = NewRequest;
 		
@@ -0,0 +1,387 @@
+/*
+
+kHTTPd -- the next generation
+
+Per-thread response cache
+
+*/
+/****************************************************************
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2, or (at your option)
+ *	any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ ****************************************************************/
+
+/*
+
+Purpose:
+
+Without the cache, every request does a full path lookup and the
+security checks (OpenFileForSecurity), resolves the mime-type and
+formats the Content-type, Last-modified and Content-length lines again.
+For a busy server most requests are for the same few files, so each
+thread keeps the results of this work for the last KHTTPD_CACHE_SIZE
+files it has served.
+
+A cache entry holds a reference to the dentry (and therefore the inode
+and its page cache) and the ready-made header. A hit only needs a new
+"struct file" for the dentry, which is cheap.
+
+An entry is thrown away and rebuilt when:
+
+1) The dentry has been unhashed (the file was deleted or renamed)
+2) The size or the mtime of the file changed
+3) The file no longer passes the permission checks
+   (the sysctls may have changed)
+4) A dynamic string was added (see AddDynamicString)
+5) It is older than KHTTPD_CACHE_TIMEOUT, which catches everything else
+   (changed symlinks or mime-settings, a new file mounted over the old one)
+
+Entries that fail these rules are also dropped by SweepCache, once every
+sweep interval, so that the cache doesn't keep deleted files or a
+filesystem that is to be unmounted busy for longer than
+KHTTPD_CACHE_TIMEOUT.
+
+Each thread only ever touches its own cache, so no locking is needed.
+
+*/
+
+#include <linux/kernel.h>
+
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/file.h>
+#include <linux/vmalloc.h>
+#include <linux/dcache.h>
+#include <linux/mount.h>
+
+#include "structure.h"
+#include "prototypes.h"
+
+#define KHTTPD_CACHE_SIZE	64	/* Files per thread */
+#define KHTTPD_CACHE_HASH	64	/* Must be a power of two */
+#define KHTTPD_CACHE_TIMEOUT	(10*HZ)
+
+struct khttpd_cache
+{
+	struct khttpd_cache_entry *Hash[KHTTPD_CACHE_HASH];
+	struct khttpd_cache_entry Entries[KHTTPD_CACHE_SIZE];
+};
+
+static struct khttpd_cache *Cache[CONFIG_KHTTPD_NUMCPU];
+
+static int CacheGeneration;
+
+
+static unsigned int HashName(const char *Name)
+{
+	unsigned int Hash = 0;
+
+	while (*Name!=0)
+		Hash = Hash*31 + (unsigned char)*Name++;
+
+	return Hash;
+}
+
+
+/*
+
+DropEntry removes an entry from its hash-chain and releases the dentry.
+
+*/
+static void DropEntry(struct khttpd_cache *C, struct khttpd_cache_entry *Entry)
+{
+	struct khttpd_cache_entry **Prev;
+
+	EnterFunction("DropEntry");
+
+	if (Entry->dentry==NULL)
+		return;
+
+	Prev = &(C->Hash[Entry->Hash & (KHTTPD_CACHE_HASH-1)]);
+	while (*Prev!=NULL)
+	{
+		if (*Prev==Entry)
+		{
+			*Prev = Entry->Next;
+			break;
+		}
+		Prev = &((*Prev)->Next);
+	}
+	Entry->Next = NULL;
+
+	dput(Entry->dentry);
+	mntput(Entry->mnt);
+	Entry->dentry = NULL;
+	Entry->mnt = NULL;
+
+	LeaveFunction("DropEntry");
+}
+
+
+/*
+
+EntryIsValid checks the rules from the top of this file.
+Returns 1 if the entry can be used.
+
+*/
+static int EntryIsValid(struct khttpd_cache_entry *Entry)
+{
+	struct inode *inode;
+
+	if (d_unhashed(Entry->dentry))
+		return 0;
+
+	inode = Entry->dentry->d_inode;
+	if (inode==NULL)
+		return 0;
+
+	if ((int)inode->i_size!=Entry->FileLength || inode->i_mtime!=Entry->Time)
+		return 0;
+
+	if (!CheckPermissions(inode->i_mode))
+		return 0;
+
+	if (Entry->Generation!=CacheGeneration)
+		return 0;
+
+	if (time_after(jiffies,Entry->Expires))
+		return 0;
+
+	return 1;
+}
+
+
+/*
+
+FillEntry does the work of an uncached request: the security checks,
+the mime-type and the header. On success, the file is opened in
+Request->filp and the new entry is returned.
+
+*/
+static struct khttpd_cache_entry *FillEntry(struct khttpd_cache *C, struct http_request *Request, const unsigned int Hash)
+{
+	struct khttpd_cache_entry *Entry,*Victim;
+	struct inode *inode;
+	int I;
+
+	EnterFunction("FillEntry");
+
+	/* Find a free entry, or else the least recently used one */
+
+	Victim = &(C->Entries[0]);
+	for (I=0;I<KHTTPD_CACHE_SIZE;I++)
+	{
+		Entry = &(C->Entries[I]);
+		if (Entry->dentry==NULL)
+		{
+			Victim = Entry;
+			break;
+		}
+		if (time_before(Entry->LastUsed,Victim->LastUsed))
+			Victim = Entry;
+	}
+	Entry = Victim;
+	DropEntry(C,Entry);
+
+	/* The cache is indexed by the name as it came from the client.
+	   OpenFileForSecurity() decodes Request->FileName in place, so copy
+	   it first. */
+
+	strncpy(Entry->FileName,Request->FileName,sizeof(Entry->FileName));
+	Entry->FileName[sizeof(Entry->FileName)-1] = 0;
+	Entry->Hash = Hash;
+
+	Request->filp = OpenFileForSecurity(Request->FileName);
+	if (Request->filp==NULL)
+		return NULL;
+
+	Entry->MimeType = ResolveMimeType(Request->FileName,&Entry->MimeLength);
+	if (Entry->MimeType==NULL) /* Unknown mime-type */
+	{
+		fput(Request->filp);
+		Request->filp = NULL;
+		return NULL;
+	}
+
+	inode = Request->filp->f_dentry->d_inode;
+	Entry->FileLength = (int)inode->i_size;
+	Entry->Time       = inode->i_mtime;
+	Entry->Generation = CacheGeneration;
+	Entry->Expires    = jiffies + KHTTPD_CACHE_TIMEOUT;
+	Entry->LastUsed   = jiffies;
+
+	Entry->HeaderLength = BuildHTTPHeader(Entry->Header,Entry->MimeType,Entry->MimeLength,
+					      Entry->Time,Entry->FileLength);
+
+	Entry->dentry = dget(Request->filp->f_dentry);
+	Entry->mnt    = mntget(Request->filp->f_vfsmnt);
+
+	Entry->Next = C->Hash[Hash & (KHTTPD_CACHE_HASH-1)];
+	C->Hash[Hash & (KHTTPD_CACHE_HASH-1)] = Entry;
+
+	LeaveFunction("FillEntry");
+	return Entry;
+}
+
+
+/*
+
+LookupCache finds (or creates) the cache entry for Request->FileName and
+fills in Request->filp, FileLength, Time, MimeType and Header from it.
+
+A NULL return means "let userspace handle it".
+
+*/
+struct khttpd_cache_entry *LookupCache(const int CPUNR, struct http_request *Request)
+{
+	struct khttpd_cache *C;
+	struct khttpd_cache_entry *Entry;
+	unsigned int Hash;
+
+	EnterFunction("LookupCache");
+
+	C = Cache[CPUNR];
+	if (C==NULL)
+		return NULL;
+
+	Hash = HashName(Request->FileName);
+
+	Entry = C->Hash[Hash & (KHTTPD_CACHE_HASH-1)];
+	while (Entry!=NULL)
+	{
+		if (Entry->Hash==Hash && strcmp(Entry->FileName,Request->FileName)==0)
+			break;
+		Entry = Entry->Next;
+	}
+
+	if (Entry!=NULL)
+	{
+		Request->filp = NULL;
+		if (EntryIsValid(Entry))
+		{
+			struct file *filp;
+
+			filp = dentry_open(dget(Entry->dentry),mntget(Entry->mnt),O_RDONLY);
+			if (!IS_ERR(filp))
+				Request->filp = filp;
+		}
+		if (Request->filp==NULL)
+		{
+			DropEntry(C,Entry);
+			Entry = NULL;
+		}
+	}
+
+	if (Entry==NULL)
+		Entry = FillEntry(C,Request,Hash);
+
+	if (Entry==NULL)
+	{
+		LeaveFunction("LookupCache - not cacheable");
+		return NULL;
+	}
+
+	Entry->LastUsed = jiffies;
+
+	Request->FileLength   = Entry->FileLength;
+	Request->Time         = Entry->Time;
+	Request->MimeType     = Entry->MimeType;
+	Request->MimeLength   = Entry->MimeLength;
+	Request->Header       = Entry->Header;
+	Request->HeaderLength = Entry->HeaderLength;
+
+	LeaveFunction("LookupCache");
+	return Entry;
+}
+
+
+/*
+
+SweepCache drops the entries of this thread that can no longer be used,
+which releases their dentry and vfsmount.
+
+*/
+void SweepCache(const int CPUNR)
+{
+	struct khttpd_cache *C;
+	int I;
+
+	EnterFunction("SweepCache");
+
+	C = Cache[CPUNR];
+	if (C==NULL)
+		return;
+
+	for (I=0;I<KHTTPD_CACHE_SIZE;I++)
+		if (C->Entries[I].dentry!=NULL && !EntryIsValid(&(C->Entries[I])))
+			DropEntry(C,&(C->Entries[I]));
+
+	LeaveFunction("SweepCache");
+}
+
+
+/*
+
+InvalidateCache makes all entries of all threads stale; they are rebuilt
+on their next use.
+
+*/
+void InvalidateCache(void)
+{
+	CacheGeneration++;
+}
+
+
+/*
+
+InitCache and StopCache are called by each thread for its own cache.
+If the allocation fails, the thread simply runs without a cache and
+hands all requests to userspace.
+
+*/
+int InitCache(const int CPUNR)
+{
+	EnterFunction("InitCache");
+
+	Cache[CPUNR] = vmalloc(sizeof(struct khttpd_cache));
+	if (Cache[CPUNR]==NULL)
+	{
+		printk(KERN_ERR "kHTTPd: Not enough memory for the cache of thread %i\n",CPUNR);
+		return -1;
+	}
+
+	memset(Cache[CPUNR],0,sizeof(struct khttpd_cache));
+
+	LeaveFunction("InitCache");
+	return 0;
+}
+
+void StopCache(const int CPUNR)
+{
+	int I;
+
+	EnterFunction("StopCache");
+
+	if (Cache[CPUNR]==NULL)
+		return;
+
+	for (I=0;I<KHTTPD_CACHE_SIZE;I++)
+		DropEntry(Cache[CPUNR],&(Cache[CPUNR]->Entries[I]));
+
+	vfree(Cache[CPUNR]);
+	Cache[CPUNR] = NULL;
+
+	LeaveFunction("StopCache");
+}
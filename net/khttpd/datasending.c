@@ -99,6 +99,16 @@ int DataSending(const int CPUNR)
 		int retval;
 
 
+		/* Nothing happened on this socket, skip it */
+		
+		if (CurrentRequest->Ready==0 && threadinfo[CPUNR].Sweep==0)
+		{
+			Prev = &(CurrentRequest->Next);	
+			CurrentRequest = CurrentRequest->Next;
+			continue;
+		}
+		CurrentRequest->Ready = 0;
+
 		/* First, test if the socket has any buffer-space left.
 		   If not, no need to actually try to send something.  */
 		  
@@ -106,6 +116,16 @@ int DataSending(const int CPUNR)
 		Space = sock_wspace(CurrentRequest->sock->sk);
 		
 		ReadSize = min(4*4096,CurrentRequest->FileLength - CurrentRequest->BytesSent);
+		
+		if (Space<ReadSize)
+		{
+			/* Ask TCP for a write_space callback when the buffer
+			   drains, then look again so that an ACK that came in
+			   between cannot be missed. */
+			set_bit(SOCK_NOSPACE,&(CurrentRequest->sock->flags));
+			Space = sock_wspace(CurrentRequest->sock->sk);
+		}
+		
 		ReadSize = min(ReadSize , Space );
 
 		if (ReadSize>0)
@@ -133,6 +153,8 @@ int DataSending(const int CPUNR)
 					CurrentRequest->BytesSent += desc.written;
 					count++;
 				}			
+				if (desc.written==ReadSize)
+					CurrentRequest->Ready = 1; /* There may be room for more */
 			} 
 			else  /* FS doesn't support sendfile() */
 			{
@@ -151,6 +173,8 @@ int DataSending(const int CPUNR)
 						CurrentRequest->BytesSent += retval;
 						count++;				
 					}
+					if (retval==ReadSize)
+						CurrentRequest->Ready = 1;
 				}
 			}
 		
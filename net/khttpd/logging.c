@@ -35,11 +35,12 @@ logging.c takes care of shutting down a connection.
 Purpose:
 
 Logging() terminates "finished" connections and will eventually log them to a 
-userspace daemon.
+userspace daemon. Persistent connections are not terminated but go back to
+the WaitForHeaderQueue for the next request.
 
 Return value:
 	The number of requests that changed status, thus the number of connections
-	that shut down.
+	that shut down or were reused.
 */
 
 
@@ -60,9 +61,21 @@ int Logging(const int CPUNR)
 
 		Req = CurrentRequest->Next;
 
-		CleanUpRequest(CurrentRequest);
-		
 		threadinfo[CPUNR].LoggingQueue = Req;
+		
+		/* A persistent connection goes back to wait for the next
+		   request, if the client is still there and got everything */
+		   
+		if (CurrentRequest->KeepAlive &&
+		    CurrentRequest->BytesSent>=CurrentRequest->FileLength &&
+		    CurrentRequest->sock->sk->state==TCP_ESTABLISHED)
+		{
+			RecycleRequest(CurrentRequest);
+			CurrentRequest->Next = threadinfo[CPUNR].WaitForHeaderQueue;
+			threadinfo[CPUNR].WaitForHeaderQueue = CurrentRequest;
+		}
+		else
+			CleanUpRequest(CurrentRequest);
 			
 		CurrentRequest = Req;
 	
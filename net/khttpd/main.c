@@ -17,6 +17,11 @@ DataSending		-	Headers decoded, sending file-data
 Userspace		-	Requires userspace daemon 
 Logging			-	The request is finished, cleanup and logging
 
+The thread does not poll the queues: the socket callbacks (see misc.c) mark
+a request as Ready and wake the thread, and each stage only looks at the
+Ready requests. Once every KHTTPD_SWEEP_INTERVAL all requests are looked at,
+as a safety net.
+
 A typical flow for a request would be:
 
 <not accepted>
@@ -30,6 +35,17 @@ or
 WaitForHeaders
 Userspace
 
+On a persistent (keep-alive) connection, Logging puts the request back in
+WaitForHeaders for the next request on the same connection:
+
+<not accepted>
+WaitForHeaders
+DataSending
+Logging
+WaitForHeaders
+DataSending
+Logging
+
 
 
 */
@@ -70,6 +86,8 @@ static int errno;
 
 struct khttpd_threadinfo threadinfo[CONFIG_KHTTPD_NUMCPU];  /* The actual work-queues */
 
+#define KHTTPD_SWEEP_INTERVAL	HZ
+
 
 atomic_t	ConnectCount;
 atomic_t	DaemonCount;
@@ -88,15 +106,16 @@ static int ConnectionsPending(int CPUNR)
 
 
 
-static wait_queue_head_t DummyWQ[CONFIG_KHTTPD_NUMCPU];
 static atomic_t Running[CONFIG_KHTTPD_NUMCPU]; 
 
 static int MainDaemon(void *cpu_pointer)
 {
 	int CPUNR;
 	sigset_t tmpsig;
+	unsigned long NextSweep;
 	
 	DECLARE_WAITQUEUE(main_wait,current);
+	DECLARE_WAITQUEUE(event_wait,current);
 	
 	MOD_INC_USE_COUNT;
 
@@ -108,7 +127,9 @@ static int MainDaemon(void *cpu_pointer)
 	sprintf(current->comm,"khttpd - %i",CPUNR);
 	daemonize();
 	
-	init_waitqueue_head(&(DummyWQ[CPUNR]));
+	init_waitqueue_head(&(threadinfo[CPUNR].WQ));
+	atomic_set(&(threadinfo[CPUNR].Events),0);
+	threadinfo[CPUNR].Sweep = 0;
 	
 
 	/* Block all signals except SIGKILL, SIGSTOP and SIGHUP */
@@ -121,15 +142,30 @@ static int MainDaemon(void *cpu_pointer)
 	
 	if (MainSocket->sk==NULL)
 	 	return 0;
+	(void)InitCache(CPUNR);
+	
 	add_wait_queue_exclusive(MainSocket->sk->sleep,&(main_wait));
+	add_wait_queue(&(threadinfo[CPUNR].WQ),&(event_wait));
 	atomic_inc(&DaemonCount);
 	atomic_set(&Running[CPUNR],1);
 	
+	NextSweep = jiffies + KHTTPD_SWEEP_INTERVAL;
+	
 	while (sysctl_khttpd_stop==0)
 	{
 		int changes = 0;
 				
-
+		/* Events that arrive from now on make us do another pass */
+		atomic_set(&(threadinfo[CPUNR].Events),0);
+		
+		if (time_after_eq(jiffies,NextSweep))
+		{
+			threadinfo[CPUNR].Sweep = 1;
+			NextSweep = jiffies + KHTTPD_SWEEP_INTERVAL;
+			SweepCache(CPUNR);
+			if (CPUNR==0) 
+				UpdateCurrentDate();
+		}
 		
 		changes +=AcceptConnections(CPUNR,MainSocket);
 		if (ConnectionsPending(CPUNR))
@@ -144,10 +180,19 @@ static int MainDaemon(void *cpu_pointer)
 			*/
 			changes +=AcceptConnections(CPUNR,MainSocket);
 		}
+		threadinfo[CPUNR].Sweep = 0;
 		
 		if (changes==0) 
 		{
-			(void)interruptible_sleep_on_timeout(&(DummyWQ[CPUNR]),1);	
+			/* Sleep until a socket event, a new connection or the
+			   next sweep. Checking after setting the state closes
+			   the race with a wakeup during the pass. */
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (atomic_read(&(threadinfo[CPUNR].Events))==0 &&
+			    MainSocket->sk->tp_pinfo.af_tcp.accept_queue==NULL &&
+			    time_before(jiffies,NextSweep))
+				(void)schedule_timeout(NextSweep-jiffies);
+			set_current_state(TASK_RUNNING);
 			if (CPUNR==0) 
 				UpdateCurrentDate();
 		}
@@ -166,6 +211,9 @@ static int MainDaemon(void *cpu_pointer)
 	StopDataSending(CPUNR);
 	StopUserspace(CPUNR);
 	StopLogging(CPUNR);
+	StopCache(CPUNR);
+	
+	remove_wait_queue(&(threadinfo[CPUNR].WQ),&(event_wait));
 	
 	atomic_set(&Running[CPUNR],0);
 	atomic_dec(&DaemonCount);
@@ -264,7 +312,7 @@ static int ManagementDaemon(void *unused)
 		}
 	
 		/* Clean all queues */
-		memset(threadinfo, 0, sizeof(struct khttpd_threadinfo));
+		memset(threadinfo, 0, sizeof(threadinfo));
 
 
 		 	
@@ -45,6 +45,7 @@ General functions
 
 #include "structure.h"
 #include "prototypes.h"
+#include "sysctl.h"
 
 #ifndef ECONNRESET
 #define ECONNRESET 102
@@ -99,6 +100,173 @@ static void ReadRest(struct socket *sock)
 }
 
 
+/*
+
+Socket events.
+
+Instead of polling every connection, the threads sleep until one of their
+sockets has something to report. StartSocketEvents hooks the data_ready,
+write_space and state_change callbacks of the socket of a request; the
+callbacks mark the request as Ready and wake the thread that owns it.
+The original callbacks still run, so anything else waiting on the socket
+keeps working.
+
+All TCP sockets have the same callbacks, so one copy of the originals is
+enough.
+
+*/
+
+static void (*OldDataReady)(struct sock *sk, int bytes);
+static void (*OldWriteSpace)(struct sock *sk);
+static void (*OldStateChange)(struct sock *sk);
+
+static void WakeRequest(struct http_request *Req)
+{
+	Req->Ready = 1;
+	atomic_inc(&threadinfo[Req->CPUNR].Events);
+	wake_up_interruptible(&threadinfo[Req->CPUNR].WQ);
+}
+
+static void RequestEvent(struct sock *sk)
+{
+	struct http_request *Req;
+	
+	read_lock(&sk->callback_lock);
+	Req = (struct http_request *)sk->user_data;
+	if (Req!=NULL)
+		WakeRequest(Req);
+	read_unlock(&sk->callback_lock);
+}
+
+static void RequestDataReady(struct sock *sk, int bytes)
+{
+	RequestEvent(sk);
+	OldDataReady(sk,bytes);
+}
+
+static void RequestWriteSpace(struct sock *sk)
+{
+	RequestEvent(sk);
+	OldWriteSpace(sk);
+}
+
+static void RequestStateChange(struct sock *sk)
+{
+	RequestEvent(sk);
+	OldStateChange(sk);
+}
+
+void StartSocketEvents(struct http_request *Req)
+{
+	struct sock *sk = Req->sock->sk;
+	
+	EnterFunction("StartSocketEvents");
+	
+	write_lock_bh(&sk->callback_lock);
+	OldDataReady   = sk->data_ready;
+	OldWriteSpace  = sk->write_space;
+	OldStateChange = sk->state_change;
+	sk->user_data    = Req;
+	sk->data_ready   = RequestDataReady;
+	sk->write_space  = RequestWriteSpace;
+	sk->state_change = RequestStateChange;
+	write_unlock_bh(&sk->callback_lock);
+	
+	LeaveFunction("StartSocketEvents");
+}
+
+/*
+
+StopSocketEvents puts the original callbacks back. Once it returns, no
+callback can reach the request anymore. Calling it twice is harmless.
+
+*/
+void StopSocketEvents(struct http_request *Req)
+{
+	struct sock *sk;
+	
+	EnterFunction("StopSocketEvents");
+	
+	if ((Req->sock==NULL)||(Req->sock->sk==NULL))
+		return;
+	sk = Req->sock->sk;
+	
+	write_lock_bh(&sk->callback_lock);
+	if (sk->user_data==Req)
+	{
+		sk->data_ready   = OldDataReady;
+		sk->write_space  = OldWriteSpace;
+		sk->state_change = OldStateChange;
+		sk->user_data    = NULL;
+	}
+	write_unlock_bh(&sk->callback_lock);
+	
+	LeaveFunction("StopSocketEvents");
+}
+
+
+/*
+
+Persistent connections.
+
+When a request on a persistent connection is finished, RecycleRequest
+clears it for the next request on the same socket and starts the idle
+timer. If no complete request arrives before the timer expires, the
+request is marked TimedOut and WaitForHeaders closes the connection.
+
+*/
+
+static void IdleTimeout(unsigned long Data)
+{
+	struct http_request *Req = (struct http_request *)Data;
+	
+	Req->TimedOut = 1;
+	WakeRequest(Req);
+}
+
+void InitIdleTimer(struct http_request *Req)
+{
+	init_timer(&Req->Timer);
+	Req->Timer.function = IdleTimeout;
+	Req->Timer.data = (unsigned long)Req;
+}
+
+void RecycleRequest(struct http_request *Req)
+{
+	struct socket *sock;
+	int CPUNR,Requests;
+	
+	EnterFunction("RecycleRequest");
+	
+	if (Req->filp!=NULL)
+	{
+	    	fput(Req->filp);
+	    	Req->filp = NULL;
+	}
+	
+	/* The idle timer is never pending here: it only runs while the
+	   request waits for headers. */
+	   
+	sock = Req->sock;
+	CPUNR = Req->CPUNR;
+	Requests = Req->Requests;
+	
+	memset(Req,0,sizeof(struct http_request));
+	
+	Req->sock = sock;
+	Req->CPUNR = CPUNR;
+	Req->Requests = Requests+1;
+	
+	/* A pipelined request may be waiting already */
+	Req->Ready = 1;
+	
+	InitIdleTimer(Req);
+	mod_timer(&Req->Timer,jiffies + sysctl_khttpd_keepalive_timeout*HZ);
+	
+	LeaveFunction("RecycleRequest");
+}
+
+
 /*
 
 CleanUpRequest takes care of shutting down the connection, closing the file-pointer
@@ -109,11 +277,13 @@ void CleanUpRequest(struct http_request *Req)
 {
 	EnterFunction("CleanUpRequest");	
 	
+	del_timer_sync(&Req->Timer);
+	
 	/* Close the socket ....*/
 	if ((Req->sock!=NULL)&&(Req->sock->sk!=NULL))
 	{
+		StopSocketEvents(Req);
 		ReadRest(Req->sock);
-		remove_wait_queue(Req->sock->sk->sleep,&(Req->sleep));
 	    	sock_release(Req->sock);
 	}
 	
@@ -217,6 +387,7 @@ situation, and they don't change anyhow.
 static char NoPerm[] = "HTTP/1.0 403 Forbidden\r\nServer: kHTTPd 0.1.6\r\n\r\n";
 static char TryLater[] = "HTTP/1.0 503 Service Unavailable\r\nServer: kHTTPd 0.1.6\r\nContent-Length: 15\r\n\r\nTry again later";
 static char NotModified[] = "HTTP/1.0 304 Not Modified\r\nServer: kHTTPd 0.1.6\r\n\r\n";
+static char NotModifiedKeepAlive[] = "HTTP/1.0 304 Not Modified\r\nServer: kHTTPd 0.1.6\r\nConnection: Keep-Alive\r\n\r\n";
 
 
 void Send403(struct socket *sock)
@@ -226,10 +397,13 @@ void Send403(struct socket *sock)
 	LeaveFunction("Send403");
 }
 
-void Send304(struct socket *sock)
+void Send304(struct socket *sock,const int KeepAlive)
 {
 	EnterFunction("Send304");
-	(void)SendBuffer(sock,NotModified,strlen(NotModified));
+	if (KeepAlive)
+		(void)SendBuffer(sock,NotModifiedKeepAlive,strlen(NotModifiedKeepAlive));
+	else
+		(void)SendBuffer(sock,NotModified,strlen(NotModified));
 	LeaveFunction("Send304");
 }
 
@@ -65,10 +65,14 @@ extern struct wait_queue main_wait[CONFIG_KHTTPD_NUMCPU];
 /* misc.c */
 
 void CleanUpRequest(struct http_request *Req);
+void StartSocketEvents(struct http_request *Req);
+void StopSocketEvents(struct http_request *Req);
+void InitIdleTimer(struct http_request *Req);
+void RecycleRequest(struct http_request *Req);
 int SendBuffer(struct socket *sock, const char *Buffer,const size_t Length);
 int SendBuffer_async(struct socket *sock, const char *Buffer,const size_t Length);
 void Send403(struct socket *sock);
-void Send304(struct socket *sock);
+void Send304(struct socket *sock,const int KeepAlive);
 void Send50x(struct socket *sock);
 
 /* accept.c */
@@ -107,6 +111,8 @@ extern int CurrentTime_i;
 void ParseHeader(char *Buffer,const int length, struct http_request *Head);
 char *ResolveMimeType(const char *File,__kernel_size_t *Len);
 void AddMimeType(const char *Ident,const char *Type);
+int BuildHTTPHeader(char *Buffer,const char *MimeType,const __kernel_size_t MimeLength,
+		    const int Time,const int Length);
 void SendHTTPHeader(struct http_request *Request);
 
 
@@ -114,10 +120,20 @@ void SendHTTPHeader(struct http_request *Request);
 /* security.c */
 
 struct file *OpenFileForSecurity(char *Filename);
+int CheckPermissions(const umode_t Mode);
 void AddDynamicString(const char *String);
 void GetSecureString(char *String);
 
 
+/* cache.c */
+
+struct khttpd_cache_entry *LookupCache(const int CPUNR, struct http_request *Request);
+void SweepCache(const int CPUNR);
+void InvalidateCache(void);
+int InitCache(const int CPUNR);
+void StopCache(const int CPUNR);
+
+
 /* logging.c */
 
 int Logging(const int CPUNR);
@@ -160,102 +160,101 @@ static char HeaderPart1[] = "HTTP/1.0 200 OK\r\nServer: kHTTPd/0.1.6\r\nDate: ";
 static char HeaderPart1b[] ="HTTP/1.0 200 OK";
 #endif
 static char HeaderPart3[] = "\r\nContent-type: ";
+#ifndef BENCHMARK
 static char HeaderPart5[] = "\r\nLast-modified: ";
+#endif
 static char HeaderPart7[] = "\r\nContent-length: ";
 static char HeaderPart9[] = "\r\n\r\n";
+static char HeaderPart9k[] = "\r\nConnection: Keep-Alive\r\n\r\n";
 
-#ifdef BENCHMARK
-/* In BENCHMARK-mode, just send the bare essentials */
-void SendHTTPHeader(struct http_request *Request)
+/*
+
+BuildHTTPHeader formats the part of the header that only depends on the file
+into "Buffer", which must hold at least 192 bytes: everything from the end
+of the Date: line up to the end of the Content-length line (without the
+line-break, so that a Connection: line can follow). The response cache
+keeps the result, so this is done once per file instead of once per request.
+
+Returns the length of the result.
+
+*/
+int BuildHTTPHeader(char *Buffer,const char *MimeType,const __kernel_size_t MimeLength,
+		    const int Time,const int Length)
 {
-	struct msghdr	msg;
-	mm_segment_t	oldfs;
-	struct iovec	iov[9];
-	int 		len,len2;
-	
-	
-	EnterFunction("SendHTTPHeader");
-		
-	msg.msg_name     = 0;
-	msg.msg_namelen  = 0;
-	msg.msg_iov	 = &iov[0];
-	msg.msg_iovlen   = 6;
-	msg.msg_control  = NULL;
-	msg.msg_controllen = 0;
-	msg.msg_flags    = 0;  /* Synchronous for now */
-	
-	iov[0].iov_base = HeaderPart1b;
-	iov[0].iov_len  = 15;
-	iov[1].iov_base = HeaderPart3;
-	iov[1].iov_len  = 16;
-	iov[2].iov_base = Request->MimeType;
-	iov[2].iov_len  = Request->MimeLength;
-	
-	iov[3].iov_base = HeaderPart7;
-	iov[3].iov_len  = 18;
-	
+	char *P;
 	
-	sprintf(Request->LengthS,"%i",Request->FileLength);
-	iov[4].iov_base = Request->LengthS;
-	iov[4].iov_len  = strlen(Request->LengthS);
-	iov[5].iov_base = HeaderPart9;
-	iov[5].iov_len  = 4;
+	EnterFunction("BuildHTTPHeader");
 	
-	len2=15+16+18+iov[2].iov_len+iov[4].iov_len+4;
+	P = Buffer;
 	
+	memcpy(P,HeaderPart3,16);
+	P += 16;
+	memcpy(P,MimeType,MimeLength);
+	P += MimeLength;
 	
-	len = 0;
-	
-
-	oldfs = get_fs(); set_fs(KERNEL_DS);
-	len = sock_sendmsg(Request->sock,&msg,len2);
-	set_fs(oldfs);
+#ifndef BENCHMARK
+	memcpy(P,HeaderPart5,17);
+	P += 17;
+	time_Unix2RFC(min(Time,CurrentTime_i),P);
+   	/* The min() is required by rfc1945, section 10.10:
+   	   It is not allowed to send a filetime in the future */
+	P += 29;
+#endif
 
+	memcpy(P,HeaderPart7,18);
+	P += 18;
+	P += sprintf(P,"%i",Length);
 	
-	return;	
+	LeaveFunction("BuildHTTPHeader");
+	return P-Buffer;
 }
-#else
+
 void SendHTTPHeader(struct http_request *Request)
 {
 	struct msghdr	msg;
 	mm_segment_t	oldfs;
-	struct iovec	iov[9];
+	struct iovec	iov[4];
 	int 		len,len2;
-	__kernel_size_t	slen;
 	
 	EnterFunction("SendHTTPHeader");
 	
 	msg.msg_name     = 0;
 	msg.msg_namelen  = 0;
 	msg.msg_iov	 = &(iov[0]);
-	msg.msg_iovlen   = 9;
 	msg.msg_control  = NULL;
 	msg.msg_controllen = 0;
 	msg.msg_flags    = 0;  /* Synchronous for now */
 	
+#ifdef BENCHMARK
+	/* In BENCHMARK-mode, just send the bare essentials */
+	msg.msg_iovlen   = 3;
+	iov[0].iov_base = HeaderPart1b;
+	iov[0].iov_len  = 15;
+	iov[1].iov_base = Request->Header;
+	iov[1].iov_len  = Request->HeaderLength;
+	
+	len2=15+Request->HeaderLength;
+#else
+	msg.msg_iovlen   = 4;
 	iov[0].iov_base = HeaderPart1;
 	iov[0].iov_len  = 45;
 	iov[1].iov_base = CurrentTime;
 	iov[1].iov_len  = 29;
-	iov[2].iov_base = HeaderPart3;
-	iov[2].iov_len  = 16;
-	
-	iov[3].iov_base = Request->MimeType;
-	iov[3].iov_len  = Request->MimeLength;
-	
-	iov[4].iov_base = HeaderPart5;
-	iov[4].iov_len  = 17;
-	iov[5].iov_base = &(Request->TimeS[0]);
-	iov[5].iov_len  = 29;
-	iov[6].iov_base = HeaderPart7;
-	iov[6].iov_len  = 18;
-	iov[7].iov_base = &(Request->LengthS[0]);
-	slen = strlen(Request->LengthS); 
-	iov[7].iov_len  = slen;
-	iov[8].iov_base = HeaderPart9;
-	iov[8].iov_len  = 4;
+	iov[2].iov_base = Request->Header;
+	iov[2].iov_len  = Request->HeaderLength;
 	
-	len2=45+2*29+16+17+18+slen+4+iov[3].iov_len;
+	len2=45+29+Request->HeaderLength;
+#endif
+	if (Request->KeepAlive)
+	{
+		iov[msg.msg_iovlen-1].iov_base = HeaderPart9k;
+		iov[msg.msg_iovlen-1].iov_len  = 28;
+	} else
+	{
+		iov[msg.msg_iovlen-1].iov_base = HeaderPart9;
+		iov[msg.msg_iovlen-1].iov_len  = 4;
+	}
+	len2 += iov[msg.msg_iovlen-1].iov_len;
 	
 	len = 0;
 
@@ -267,7 +266,6 @@ void SendHTTPHeader(struct http_request *Request)
 
 	return;	
 }
-#endif
 
 
 
@@ -319,8 +317,14 @@ void ParseHeader(char *Buffer,const int length, struct http_request *Head)
 			{
 				tmp=EOL-1;
 				Head->HTTPVER = 9;
-			} else
+			} else if (strncmp(tmp+1,"HTTP/1.1",8)==0)
+				Head->HTTPVER = 11;
+			else
 				Head->HTTPVER = 10;
+				
+			/* HTTP/1.1 connections are persistent unless the client
+			   says otherwise, HTTP/1.0 ones only if it asks */
+			Head->KeepAlive = (Head->HTTPVER==11);
 			
 			if (tmp>Endval) continue;
 			
@@ -358,6 +362,19 @@ void ParseHeader(char *Buffer,const int length, struct http_request *Head)
 		}
 		
 
+		if (strncmp("Connection: ",Buffer,12)==0)
+		{
+			Buffer+=12;
+			
+			if (strnicmp(Buffer,"close",5)==0)
+				Head->KeepAlive = 0;
+			else if (strnicmp(Buffer,"keep-alive",10)==0)
+				Head->KeepAlive = 1;
+					
+			Buffer=EOL+1;	
+			continue;
+		}
+
 		if (strncmp("Host: ",Buffer,6)==0)
 		{
 			Buffer+=6;
@@ -85,7 +85,6 @@ struct file *OpenFileForSecurity(char *Filename)
 {
 	struct file *filp;
 	struct DynamicString *List;
-	umode_t permission;
 	
 	
 
@@ -118,31 +117,15 @@ struct file *OpenFileForSecurity(char *Filename)
 	if (IS_ERR(filp))
 		return NULL;
 
-#ifndef BENCHMARK		
-	permission = filp->f_dentry->d_inode->i_mode;
-	
-	/* Rule no. 4 : must have enough permissions */
-	
-	
-	if ((permission & sysctl_khttpd_permreq)==0)
-	{
-		if (filp!=NULL)
-			fput(filp);
-		filp=NULL;
-		return NULL;
-	}
-		
-	/* Rule no. 5 : cannot have "forbidden" permission */
-	
+	/* Rule no. 4 and 5 -- permissions */
 	
-	if ((permission & sysctl_khttpd_permforbid)!=0)
+	if (!CheckPermissions(filp->f_dentry->d_inode->i_mode))
 	{
-		if (filp!=NULL)
-			fput(filp);
-		filp=NULL;
+		fput(filp);
 		return NULL;
 	}
-		
+
+#ifndef BENCHMARK		
 	/* Rule no. 6 : No string in DynamicList can be a
 			substring of the filename */
 			
@@ -167,6 +150,29 @@ struct file *OpenFileForSecurity(char *Filename)
 	return filp;
 }
 
+/*
+
+CheckPermissions applies rules 4 and 5 to the mode of a file. The response
+cache uses it to re-check cached files against the current sysctl values.
+Returns 1 if the file may be sent.
+
+*/
+int CheckPermissions(const umode_t Mode)
+{
+#ifndef BENCHMARK
+	/* Rule no. 4 : must have enough permissions */
+	
+	if ((Mode & sysctl_khttpd_permreq)==0)
+		return 0;
+		
+	/* Rule no. 5 : cannot have "forbidden" permission */
+	
+	if ((Mode & sysctl_khttpd_permforbid)!=0)
+		return 0;
+#endif
+	return 1;
+}
+
 /* 
 
 DecodeHexChars does the actual %HEX decoding, in place. 
@@ -238,6 +244,9 @@ void AddDynamicString(const char *String)
 	Temp->Next = DynamicList;
 	DynamicList = Temp;
 	
+	/* Files that were allowed before might not be anymore */
+	InvalidateCache();
+	
 	LeaveFunction("AddDynamicString");
 }
 
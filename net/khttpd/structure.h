@@ -3,6 +3,9 @@
 
 #include <linux/time.h>
 #include <linux/wait.h>
+#include <linux/cache.h>
+#include <linux/timer.h>
+#include <asm/atomic.h>
 
 
 struct http_request;
@@ -23,9 +26,18 @@ struct http_request
 	int		BytesSent;	/* The number of bytes already sent */
 	int		IsForUserspace;	/* 1 means let Userspace handle this one */
 	
-	/* Wait queue */
+	/* Socket events */
 	
-	wait_queue_t sleep;		/* For putting in the socket's waitqueue */
+	int		CPUNR;		/* The thread that owns this request */
+	int		Ready;		/* The socket had an event since we last looked */
+	
+	/* Persistent connections */
+	
+	int		KeepAlive;	/* 1 means keep the connection open afterwards */
+	int		HeaderSize;	/* The length of this request on the socket */
+	int		Requests;	/* Requests already served on this connection */
+	int		TimedOut;	/* The idle timer expired */
+	struct timer_list Timer;	/* Idle timer, while waiting for the next request */
 	
 	/* HTTP request information */
 	char		FileName[256];	/* The requested filename */
@@ -38,20 +50,50 @@ struct http_request
 
 	/* Derived date from the above fields */	
 	int		IMS_Time;	/* if-modified-since time, unix format */
-	char		TimeS[64];	/* File mtime, rfc string representation */
-	char		LengthS[14];	/* File length, string representation */
 	char		*MimeType;	/* Pointer to a string with the mime-type 
 					   based on the filename */
 	__kernel_size_t	MimeLength;	/* The length of this string */
+	char		*Header;	/* The HTTP-header after the Date: line, */
+	int		HeaderLength;	/* owned by the response cache */
 	
 };
 
 
+/*
+
+struct khttpd_cache_entry is one file in the per-thread response cache,
+see cache.c.
+
+*/
+struct khttpd_cache_entry
+{
+	struct khttpd_cache_entry *Next;	/* Hash chain */
+	
+	struct dentry	*dentry;	/* The file; NULL if the entry is unused */
+	struct vfsmount	*mnt;
+	
+	char		FileName[256];	/* The filename as requested */
+	unsigned int	Hash;
+	int		Generation;	/* CacheGeneration when filled */
+	unsigned long	Expires;	/* jiffies */
+	unsigned long	LastUsed;	/* jiffies */
+	
+	int		FileLength;	/* i_size when filled */
+	int		Time;		/* i_mtime when filled */
+	char		*MimeType;
+	__kernel_size_t	MimeLength;
+	
+	char		Header[192];	/* Everything after the Date: line */
+	int		HeaderLength;
+};
+
+
 
 /*
 
-struct khttpd_threadinfo represents the four queues that 1 thread has to deal with.
-It is padded to occupy 1 (Intel) cache-line, to avoid "cacheline-pingpong".
+struct khttpd_threadinfo represents the four queues that 1 thread has to deal with,
+and the wait queue the socket callbacks use to wake the thread.
+It is aligned to the cache-line size, to avoid "cacheline-pingpong".
 
 */
 struct khttpd_threadinfo
@@ -60,8 +102,14 @@ struct khttpd_threadinfo
 	struct http_request* DataSendingQueue;
 	struct http_request* LoggingQueue;
 	struct http_request* UserspaceQueue;
-	char  dummy[16];  /* Padding for cache-lines */
-};
+	
+	wait_queue_head_t	WQ;	/* The thread sleeps here */
+	atomic_t		Events;	/* Socket events since the last pass */
+	int			Sweep;	/* Look at all requests, not just Ready ones */
+	
+	unsigned int		KeepAliveHits;	   /* Requests on a reused connection */
+	unsigned int		KeepAliveTimeouts; /* Idle connections closed */
+} ____cacheline_aligned;
 
 
 
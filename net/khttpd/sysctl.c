@@ -63,6 +63,12 @@ char	sysctl_khttpd_dynamicstring[200];
 int 	sysctl_khttpd_sloppymime= 0;
 int	sysctl_khttpd_threads	= 2;
 int	sysctl_khttpd_maxconnect = 1000;
+int	sysctl_khttpd_keepalive_timeout = 15;	/* seconds */
+int	sysctl_khttpd_keepalive_max = 100;	/* requests per connection */
+
+/* Read-only statistics, summed over the threads when read */
+static int	sysctl_khttpd_keepalive_hits;
+static int	sysctl_khttpd_keepalive_timeouts;
 
 
 static struct ctl_table_header *khttpd_table_header;
@@ -72,6 +78,8 @@ static int sysctl_SecureString(ctl_table *table, int *name, int nlen,
 		  void *newval, size_t newlen, void **context);
 static int proc_dosecurestring(ctl_table *table, int write, struct file *filp,
 		  void *buffer, size_t *lenp);
+static int proc_dokeepalivestats(ctl_table *table, int write, struct file *filp,
+		  void *buffer, size_t *lenp);
 
 
 static ctl_table khttpd_table[] = {
@@ -219,6 +227,54 @@ static ctl_table khttpd_table[] = {
 		NULL,
 		NULL
 	},
+	{	NET_KHTTPD_KEEPALIVE_TIMEOUT,
+		"keepalive_timeout",
+		&sysctl_khttpd_keepalive_timeout,
+		sizeof(int),
+		0644,
+		NULL,
+		proc_dointvec,
+		&sysctl_intvec,
+		NULL,
+		NULL,
+		NULL
+	},
+	{	NET_KHTTPD_KEEPALIVE_MAX,
+		"keepalive_max",
+		&sysctl_khttpd_keepalive_max,
+		sizeof(int),
+		0644,
+		NULL,
+		proc_dointvec,
+		&sysctl_intvec,
+		NULL,
+		NULL,
+		NULL
+	},
+	{	NET_KHTTPD_KEEPALIVE_HITS,
+		"keepalive_hits",
+		&sysctl_khttpd_keepalive_hits,
+		sizeof(int),
+		0444,
+		NULL,
+		proc_dokeepalivestats,
+		NULL,
+		NULL,
+		NULL,
+		NULL
+	},
+	{	NET_KHTTPD_KEEPALIVE_TIMEOUTS,
+		"keepalive_timeouts",
+		&sysctl_khttpd_keepalive_timeouts,
+		sizeof(int),
+		0444,
+		NULL,
+		proc_dokeepalivestats,
+		NULL,
+		NULL,
+		NULL,
+		NULL
+	},
 	{	NET_KHTTPD_DYNAMICSTRING,
 		"dynamic",
 		&sysctl_khttpd_dynamicstring,
@@ -307,6 +363,28 @@ static int proc_dosecurestring(ctl_table *table, int write, struct file *filp,
 	return 0;
 }
 
+/*
+
+The keep-alive counters are kept per thread, so that the threads don't
+fight over a cache-line. Add them up when somebody looks.
+
+*/
+static int proc_dokeepalivestats(ctl_table *table, int write, struct file *filp,
+		  void *buffer, size_t *lenp)
+{
+	int I;
+	
+	sysctl_khttpd_keepalive_hits = 0;
+	sysctl_khttpd_keepalive_timeouts = 0;
+	for (I=0;I<CONFIG_KHTTPD_NUMCPU;I++)
+	{
+		sysctl_khttpd_keepalive_hits += threadinfo[I].KeepAliveHits;
+		sysctl_khttpd_keepalive_timeouts += threadinfo[I].KeepAliveTimeouts;
+	}
+	
+	return proc_dointvec(table,write,filp,buffer,lenp);
+}
+
 static int sysctl_SecureString (/*@unused@*/ctl_table *table, 
 				/*@unused@*/int *name, 
 				/*@unused@*/int nlen,
@@ -13,5 +13,7 @@ extern int 	sysctl_khttpd_serverport;
 extern int 	sysctl_khttpd_sloppymime;
 extern int 	sysctl_khttpd_threads;
 extern int	sysctl_khttpd_maxconnect;
+extern int	sysctl_khttpd_keepalive_timeout;
+extern int	sysctl_khttpd_keepalive_max;
 
 #endif
@@ -79,15 +79,9 @@ int Userspace(const int CPUNR)
 	while (CurrentRequest!=NULL)
 	{
 
-		/* Clean-up the waitqueue of the socket.. Bad things happen if
+		/* Give the socket its own callbacks back. Bad things happen if
 		   this is forgotten. */
-		if (CurrentRequest->sock!=NULL)
-		{
-			if ((CurrentRequest->sock!=NULL)&&(CurrentRequest->sock->sk!=NULL))
-			{
-				remove_wait_queue(CurrentRequest->sock->sk->sleep,&(CurrentRequest->sleep));
-			}
-		} 
+		StopSocketEvents(CurrentRequest);
 		
 
 		if  (AddSocketToAcceptQueue(CurrentRequest->sock,sysctl_khttpd_clientport)>=0)
@@ -26,9 +26,10 @@ Wait for headers on the accepted connections
 
 Purpose:
 
-WaitForHeaders polls all connections in "WaitForHeaderQueue" to see if
-headers have arived. If so, the headers are decoded and the request is
-moved to either the "SendingDataQueue" or the "UserspaceQueue".
+WaitForHeaders looks at the connections in "WaitForHeaderQueue" that had
+a socket event (or at all of them during a sweep) to see if headers have
+arived. If so, the headers are decoded and the request is moved to either
+the "SendingDataQueue" or the "UserspaceQueue".
 
 Return value:
 	The number of requests that changed status
@@ -44,6 +45,7 @@ Return value:
 
 #include "structure.h"
 #include "prototypes.h"
+#include "sysctl.h"
 
 static	char			*Buffer[CONFIG_KHTTPD_NUMCPU];
 
@@ -55,7 +57,7 @@ int WaitForHeaders(const int CPUNR)
 {
 	struct http_request *CurrentRequest,**Prev;
 	struct sock *sk;
-	int count = 0;
+	int count = 0, ClientClosed;
 	
 	EnterFunction("WaitForHeaders");
 	
@@ -66,10 +68,32 @@ int WaitForHeaders(const int CPUNR)
 	while (CurrentRequest!=NULL)
 	{
 		
-		/* If the connection is lost, remove from queue */
+		/* Nothing happened on this socket, skip it */
 		
-		if (CurrentRequest->sock->sk->state != TCP_ESTABLISHED
-		    && CurrentRequest->sock->sk->state != TCP_CLOSE_WAIT)
+		if (CurrentRequest->Ready==0 && threadinfo[CPUNR].Sweep==0)
+		{
+			Prev = &(CurrentRequest->Next);
+			CurrentRequest = CurrentRequest->Next;
+			continue;
+		}
+		CurrentRequest->Ready = 0;
+		
+		/* If the connection is lost or was idle for too long,
+		   remove from queue. A client that closes an idle
+		   persistent connection leaves it in CLOSE_WAIT with
+		   nothing to read: that one is done, not timed out. */
+		
+		sk = CurrentRequest->sock->sk;
+		ClientClosed = CurrentRequest->Requests>0 &&
+			       sk->state == TCP_CLOSE_WAIT &&
+			       skb_queue_empty(&(sk->receive_queue));
+		
+		if (CurrentRequest->TimedOut && !ClientClosed)
+			threadinfo[CPUNR].KeepAliveTimeouts++;
+		
+		if ((sk->state != TCP_ESTABLISHED
+		     && sk->state != TCP_CLOSE_WAIT)
+		    || CurrentRequest->TimedOut || ClientClosed)
 		{
 			struct http_request *Next;
 			
@@ -100,6 +124,7 @@ int WaitForHeaders(const int CPUNR)
 			
 			if (DecodeHeader(CPUNR,CurrentRequest)<0)
 			{
+				Prev = &(CurrentRequest->Next);
 				CurrentRequest = CurrentRequest->Next;
 				continue;
 			} 
@@ -112,6 +137,10 @@ int WaitForHeaders(const int CPUNR)
 			*Prev = Next;
 			count++;
 			
+			del_timer_sync(&CurrentRequest->Timer);
+			if (CurrentRequest->Requests>0)
+				threadinfo[CPUNR].KeepAliveHits++;
+			
 			/* Add to either the UserspaceQueue or the DataSendingQueue */
 			
 			if (CurrentRequest->IsForUserspace!=0)
@@ -120,6 +149,7 @@ int WaitForHeaders(const int CPUNR)
 				threadinfo[CPUNR].UserspaceQueue = CurrentRequest;	
 			} else
 			{
+				CurrentRequest->Ready = 1; /* Start sending right away */
 				CurrentRequest->Next = threadinfo[CPUNR].DataSendingQueue;
 				threadinfo[CPUNR].DataSendingQueue = CurrentRequest;	
 			} 	
@@ -166,6 +196,10 @@ void StopWaitingForHeaders(const int CPUNR)
 DecodeHeader peeks at the TCP/IP data, determines what the request is, 
 fills the request-structure and sends the HTTP-header when apropriate.
 
+On a persistent connection, the request is read from the socket once it is
+served, so that the next (pipelined) request is at the front. A negative
+return value means "not the complete request yet, try again later".
+
 */
 
 static int DecodeHeader(const int CPUNR, struct http_request *Request)
@@ -173,6 +207,7 @@ static int DecodeHeader(const int CPUNR, struct http_request *Request)
 	struct msghdr		msg;
 	struct iovec		iov;
 	int			len;
+	char			*EndOfHeader;
 
 	mm_segment_t		oldfs;
 	
@@ -210,47 +245,41 @@ static int DecodeHeader(const int CPUNR, struct http_request *Request)
 		return 0;
 	}
 	
-	/* Then, decode the header */
+	Buffer[CPUNR][len] = 0;
 	
+	/* Find where this request ends and the next one begins */
 	
-	ParseHeader(Buffer[CPUNR],len,Request);
+	EndOfHeader = strstr(Buffer[CPUNR],"\r\n\r\n");
+	if (EndOfHeader!=NULL)
+		Request->HeaderSize = EndOfHeader + 4 - Buffer[CPUNR];
+	else if (Request->Requests>0)
+		return -1;	/* The idle timer protects us from waiting forever */
+	else
+		Request->HeaderSize = 0;
 	
-	Request->filp = OpenFileForSecurity(Request->FileName);
+	/* Then, decode the header */
 	
 	
-	Request->MimeType = ResolveMimeType(Request->FileName,&Request->MimeLength);
+	ParseHeader(Buffer[CPUNR],len,Request);
 	
+	if (Request->HeaderSize==0 || Request->Requests+1>=sysctl_khttpd_keepalive_max)
+		Request->KeepAlive = 0;
 	
-	if (Request->MimeType==NULL) /* Unknown mime-type */
-	{
-		if (Request->filp!=NULL)
-		{
-			fput(Request->filp);
-			Request->filp = NULL;
-		}
-		Request->IsForUserspace = 1;
-		
-		return 0;
-	}
-
-	if (Request->filp==NULL)
+	/* Open the file and get the mime-type and the header, from the
+	   cache if possible */
+	   
+	if (LookupCache(CPUNR,Request)==NULL)
 	{
 		Request->IsForUserspace = 1;
 		return 0;
 	}
 	else
 	{
-		Request->FileLength = (int)Request->filp->f_dentry->d_inode->i_size;
-		Request->Time       = Request->filp->f_dentry->d_inode->i_mtime;
 		Request->IMS_Time   = mimeTime_to_UnixTime(Request->IMS);
-		sprintf(Request->LengthS,"%i",Request->FileLength);
-		time_Unix2RFC(min(Request->Time,CurrentTime_i),Request->TimeS);
-   	        /* The min() is required by rfc1945, section 10.10:
-   	           It is not allowed to send a filetime in the future */
 
 		if (Request->IMS_Time>Request->Time)
 		{	/* Not modified since last time */
-			Send304(Request->sock);
+			Send304(Request->sock,Request->KeepAlive);
 			Request->FileLength=0;
 		}
 		else   /* Normal Case */
@@ -260,6 +289,21 @@ static int DecodeHeader(const int CPUNR, struct http_request *Request)
 				SendHTTPHeader(Request);
 		}
 		
+		/* Take this request off the socket, leaving the next one.
+		   HeaderSize is at most the len peeked above, so the bytes
+		   fit in our buffer again; sock_recvmsg() advanced the iovec
+		   and set msg_flags, so start over. */
+		if (Request->KeepAlive)
+		{
+			msg.msg_iov	 = &iov;
+			msg.msg_iovlen   = 1;
+			msg.msg_flags    = 0;
+			msg.msg_iov->iov_base = &Buffer[CPUNR][0];
+			msg.msg_iov->iov_len  = (size_t)Request->HeaderSize;
+			oldfs = get_fs(); set_fs(KERNEL_DS);
+			(void)sock_recvmsg(Request->sock,&msg,Request->HeaderSize,MSG_DONTWAIT);
+			set_fs(oldfs);
+		}
 	
 	}
 	
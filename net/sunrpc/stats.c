@@ -167,6 +167,10 @@ rpc_proc_init(void)
 		if (ent) {
 			ent->owner = THIS_MODULE;
 			proc_net_rpc = ent;
+			ent = create_proc_read_entry("xprt", 0, proc_net_rpc,
+						     xprt_proc_read, NULL);
+			if (ent)
+				ent->owner = THIS_MODULE;
 		}
 	}
 }
@@ -176,6 +180,7 @@ rpc_proc_exit(void)
 {
 	dprintk("RPC: unregistering /proc/net/rpc\n");
 	if (proc_net_rpc) {
+		remove_proc_entry("xprt", proc_net_rpc);
 		proc_net_rpc = NULL;
 		remove_proc_entry("net/rpc", 0);
 	}
@@ -54,6 +54,7 @@ EXPORT_SYMBOL(rpc_restart_call);
 EXPORT_SYMBOL(xprt_create_proto);
 EXPORT_SYMBOL(xprt_destroy);
 EXPORT_SYMBOL(xprt_set_timeout);
+EXPORT_SYMBOL(xprt_set_buffer_size);
 
 /* Client credential cache */
 EXPORT_SYMBOL(rpcauth_register);
@@ -69,6 +70,8 @@ EXPORT_SYMBOL(rpcauth_releasecred);
 /* RPC server stuff */
 EXPORT_SYMBOL(svc_create);
 EXPORT_SYMBOL(svc_create_thread);
+EXPORT_SYMBOL(svc_create_pooled_thread);
+EXPORT_SYMBOL(svc_pool_bind);
 EXPORT_SYMBOL(svc_exit_thread);
 EXPORT_SYMBOL(svc_destroy);
 EXPORT_SYMBOL(svc_drop);
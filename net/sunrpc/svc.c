@@ -30,6 +30,7 @@ struct svc_serv *
 svc_create(struct svc_program *prog, unsigned int bufsize, unsigned int xdrsize)
 {
 	struct svc_serv	*serv;
+	int		i;
 
 	xdr_init();
 #ifdef RPC_DEBUG
@@ -49,6 +50,10 @@ svc_create(struct svc_program *prog, unsigned int bufsize, unsigned int xdrsize)
 
 	serv->sv_name      = prog->pg_name;
 
+	serv->sv_nrpools   = smp_num_cpus;
+	for (i = 0; i < serv->sv_nrpools; i++)
+		spin_lock_init(&serv->sv_pools[i].sp_lock);
+
 	/* Remove any stale portmap registrations */
 	svc_register(serv, 0, 0);
 
@@ -99,6 +104,7 @@ svc_init_buffer(struct svc_buf *bufp, unsigned int size)
 	bufp->iov[0].iov_base = bufp->area;
 	bufp->iov[0].iov_len  = size;
 	bufp->nriov = 1;
+	bufp->nrpages = 0;
 
 	return 1;
 }
@@ -114,13 +120,28 @@ svc_release_buffer(struct svc_buf *bufp)
 }
 
 /*
- * Create a server thread
+ * Create a server thread in the given pool, or in the pool with the
+ * fewest threads if pool is negative.
  */
 int
-svc_create_thread(svc_thread_fn func, struct svc_serv *serv)
+svc_create_pooled_thread(svc_thread_fn func, struct svc_serv *serv, int pool)
 {
 	struct svc_rqst	*rqstp;
-	int		error = -ENOMEM;
+	struct svc_pool	*poolp;
+	int		i, error = -EINVAL;
+
+	if (pool >= (int) serv->sv_nrpools)
+		goto out;
+	if (pool < 0) {
+		pool = 0;
+		for (i = 1; i < serv->sv_nrpools; i++)
+			if (serv->sv_pools[i].sp_nrthreads <
+			    serv->sv_pools[pool].sp_nrthreads)
+				pool = i;
+	}
+	poolp = &serv->sv_pools[pool];
+
+	error = -ENOMEM;
 
 	rqstp = kmalloc(sizeof(*rqstp), GFP_KERNEL);
 	if (!rqstp)
@@ -136,6 +157,12 @@ svc_create_thread(svc_thread_fn func, struct svc_serv *serv)
 
 	serv->sv_nrthreads++;
 	rqstp->rq_server = serv;
+
+	spin_lock_bh(&poolp->sp_lock);
+	poolp->sp_nrthreads++;
+	spin_unlock_bh(&poolp->sp_lock);
+	rqstp->rq_pool = poolp;
+
 	error = kernel_thread((int (*)(void *)) func, rqstp, 0);
 	if (error < 0)
 		goto out_thread;
@@ -148,6 +175,33 @@ out_thread:
 	goto out;
 }
 
+/*
+ * Create a server thread
+ */
+int
+svc_create_thread(svc_thread_fn func, struct svc_serv *serv)
+{
+	return svc_create_pooled_thread(func, serv, -1);
+}
+
+/*
+ * Bind the calling server thread to the CPU of its pool. Services
+ * that want their requests processed where they arrived call this
+ * once when the thread starts.
+ */
+void
+svc_pool_bind(struct svc_rqst *rqstp)
+{
+	struct svc_serv	*serv = rqstp->rq_server;
+	int		cpu = rqstp->rq_pool - serv->sv_pools;
+
+	if (serv->sv_nrpools <= 1)
+		return;
+	current->cpus_allowed = 1UL << cpu;
+	if (current->processor != cpu)
+		schedule();
+}
+
 /*
  * Destroy an RPC server thread
  */
@@ -155,6 +209,19 @@ void
 svc_exit_thread(struct svc_rqst *rqstp)
 {
 	struct svc_serv	*serv = rqstp->rq_server;
+	struct svc_pool	*pool = rqstp->rq_pool;
+	int		orphans = 0;
+
+	/* If this was the last thread of its pool, sockets still queued
+	 * there are picked up by a thread of another pool. Wake one. */
+	if (pool) {
+		spin_lock_bh(&pool->sp_lock);
+		if (--(pool->sp_nrthreads) == 0 && pool->sp_sockets)
+			orphans = 1;
+		spin_unlock_bh(&pool->sp_lock);
+		if (orphans)
+			svc_wake_up(serv);
+	}
 
 	svc_release_buffer(&rqstp->rq_defbuf);
 	if (rqstp->rq_resp)
@@ -29,6 +29,8 @@
 #include <linux/version.h>
 #include <linux/unistd.h>
 #include <linux/malloc.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
 #include <linux/netdevice.h>
 #include <linux/skbuff.h>
 #include <net/sock.h>
@@ -43,10 +45,13 @@
 
 /* SMP locking strategy:
  *
- * 	svc_sock->sk_lock and svc_serv->sv_lock protect their
- *	respective structures.
+ * 	svc_sock->sk_lock, svc_pool->sp_lock and svc_serv->sv_lock
+ *	protect their respective structures. sv_lock only covers the
+ *	list of all sockets; the idle threads and ready sockets are
+ *	kept per pool under sp_lock.
  *
- *	Antideadlock ordering is sk_lock --> sv_lock.
+ *	Antideadlock ordering is sk_lock --> sp_lock, and
+ *	sk_lock --> sv_lock. No two sp_locks are held at once.
  */
 
 #define RPCDBG_FACILITY	RPCDBG_SVCSOCK
@@ -60,21 +65,37 @@ static int		svc_udp_sendto(struct svc_rqst *);
 
 
 /*
- * Queue up an idle server thread.  Must have serv->sv_lock held.
+ * Queue up an idle server thread.  Must have pool->sp_lock held.
  */
 static inline void
-svc_serv_enqueue(struct svc_serv *serv, struct svc_rqst *rqstp)
+svc_serv_enqueue(struct svc_pool *pool, struct svc_rqst *rqstp)
 {
-	rpc_append_list(&serv->sv_threads, rqstp);
+	rpc_append_list(&pool->sp_threads, rqstp);
 }
 
 /*
- * Dequeue an nfsd thread.  Must have serv->sv_lock held.
+ * Dequeue an nfsd thread.  Must have pool->sp_lock held.
  */
 static inline void
-svc_serv_dequeue(struct svc_serv *serv, struct svc_rqst *rqstp)
+svc_serv_dequeue(struct svc_pool *pool, struct svc_rqst *rqstp)
 {
-	rpc_remove_list(&serv->sv_threads, rqstp);
+	rpc_remove_list(&pool->sp_threads, rqstp);
+}
+
+/*
+ * Pick the pool for data arriving on this CPU: the CPU's own pool,
+ * or the next one that has threads if it has none.
+ */
+static inline struct svc_pool *
+svc_pool_for_cpu(struct svc_serv *serv, int cpu)
+{
+	int	i, n = serv->sv_nrpools;
+
+	for (i = 0; i < n; i++, cpu++) {
+		if (serv->sv_pools[cpu % n].sp_nrthreads)
+			break;
+	}
+	return &serv->sv_pools[cpu % n];
 }
 
 /*
@@ -93,6 +114,52 @@ svc_release_skb(struct svc_rqst *rqstp)
 	skb_free_datagram(rqstp->rq_sock->sk_sk, skb);
 }
 
+/*
+ * Give a socket to an idle thread and wake it.  Must have pool->sp_lock
+ * held: svc_recv() looks at rq_sock under it when the thread wakes up.
+ */
+static inline void
+svc_thread_give(struct svc_pool *pool, struct svc_rqst *rqstp,
+		struct svc_sock *svsk)
+{
+	dprintk("svc: socket %p served by daemon %p\n",
+		svsk->sk_sk, rqstp);
+	svc_serv_dequeue(pool, rqstp);
+	if (rqstp->rq_sock)
+		printk(KERN_ERR 
+			"svc_sock_enqueue: server %p, rq_sock=%p!\n",
+			rqstp, rqstp->rq_sock);
+	rqstp->rq_sock = svsk;
+	svsk->sk_inuse++;
+	wake_up(&rqstp->rq_wait);
+}
+
+/*
+ * Give a socket to an idle thread of another pool.  Returns 0 if all
+ * threads are busy.  Must not have any sp_lock held.
+ */
+static int
+svc_thread_steal(struct svc_serv *serv, struct svc_pool *mine,
+		 struct svc_sock *svsk)
+{
+	struct svc_pool	*pool;
+	struct svc_rqst	*rqstp;
+	int		i;
+
+	for (i = 0; i < serv->sv_nrpools; i++) {
+		pool = &serv->sv_pools[i];
+		if (pool == mine || !pool->sp_threads)
+			continue;
+		spin_lock(&pool->sp_lock);
+		if ((rqstp = pool->sp_threads) != NULL)
+			svc_thread_give(pool, rqstp, svsk);
+		spin_unlock(&pool->sp_lock);
+		if (rqstp)
+			return 1;
+	}
+	return 0;
+}
+
 /*
  * Queue up a socket with data pending. If there are idle nfsd
  * processes, wake 'em up.
@@ -103,12 +170,15 @@ static void
 svc_sock_enqueue(struct svc_sock *svsk)
 {
 	struct svc_serv	*serv = svsk->sk_server;
+	struct svc_pool	*pool;
 	struct svc_rqst	*rqstp;
 
+	pool = svc_pool_for_cpu(serv, smp_processor_id());
+
 	/* NOTE: Local BH is already disabled by our caller. */
-	spin_lock(&serv->sv_lock);
+	spin_lock(&pool->sp_lock);
 
-	if (serv->sv_threads && serv->sv_sockets)
+	if (pool->sp_threads && pool->sp_sockets)
 		printk(KERN_ERR
 			"svc_sock_enqueue: threads and sockets both waiting??\n");
 
@@ -124,37 +194,43 @@ svc_sock_enqueue(struct svc_sock *svsk)
 	 */
 	svsk->sk_busy = 1;
 
-	if ((rqstp = serv->sv_threads) != NULL) {
-		dprintk("svc: socket %p served by daemon %p\n",
-			svsk->sk_sk, rqstp);
-		svc_serv_dequeue(serv, rqstp);
-		if (rqstp->rq_sock)
-			printk(KERN_ERR 
-				"svc_sock_enqueue: server %p, rq_sock=%p!\n",
-				rqstp, rqstp->rq_sock);
-		rqstp->rq_sock = svsk;
-		svsk->sk_inuse++;
-		wake_up(&rqstp->rq_wait);
+	if ((rqstp = pool->sp_threads) != NULL) {
+		svc_thread_give(pool, rqstp, svsk);
+		goto out_unlock;
+	}
+
+	/* No thread of ours is idle.  Rather than have the socket wait
+	 * until one is, give it to an idle thread of another pool. The
+	 * busy flag keeps it from being enqueued twice meanwhile.
+	 */
+	spin_unlock(&pool->sp_lock);
+	if (svc_thread_steal(serv, pool, svsk))
+		return;
+	spin_lock(&pool->sp_lock);
+
+	if ((rqstp = pool->sp_threads) != NULL) {
+		svc_thread_give(pool, rqstp, svsk);
 	} else {
 		dprintk("svc: socket %p put into queue\n", svsk->sk_sk);
-		rpc_append_list(&serv->sv_sockets, svsk);
+		rpc_append_list(&pool->sp_sockets, svsk);
+		svsk->sk_pool = pool;
 		svsk->sk_qued = 1;
 	}
 
 out_unlock:
-	spin_unlock(&serv->sv_lock);
+	spin_unlock(&pool->sp_lock);
 }
 
 /*
- * Dequeue the first socket.  Must be called with the serv->sv_lock held.
+ * Dequeue the first socket.  Must be called with the pool->sp_lock held.
  */
 static inline struct svc_sock *
-svc_sock_dequeue(struct svc_serv *serv)
+svc_sock_dequeue(struct svc_pool *pool)
 {
 	struct svc_sock	*svsk;
 
-	if ((svsk = serv->sv_sockets) != NULL)
-		rpc_remove_list(&serv->sv_sockets, svsk);
+	if ((svsk = pool->sp_sockets) != NULL)
+		rpc_remove_list(&pool->sp_sockets, svsk);
 
 	if (svsk) {
 		dprintk("svc: socket %p dequeued, inuse=%d\n",
@@ -204,6 +280,19 @@ svc_sock_accepted(struct svc_sock *svsk)
 	spin_unlock_bh(&svsk->sk_lock);
 }
 
+/*
+ * Drop the page cache references held by a reply.
+ */
+static inline void
+svc_release_pages(struct svc_buf *bufp)
+{
+	int	i;
+
+	for (i = 0; i < bufp->nrpages; i++)
+		page_cache_release(bufp->pages[i].page);
+	bufp->nrpages = 0;
+}
+
 /*
  * Release a socket after use.
  */
@@ -212,6 +301,7 @@ svc_sock_release(struct svc_rqst *rqstp)
 {
 	struct svc_sock	*svsk = rqstp->rq_sock;
 
+	svc_release_pages(&rqstp->rq_resbuf);
 	if (!svsk)
 		return;
 	svc_release_skb(rqstp);
@@ -229,18 +319,48 @@ svc_sock_release(struct svc_rqst *rqstp)
 void
 svc_wake_up(struct svc_serv *serv)
 {
+	struct svc_pool	*pool;
 	struct svc_rqst	*rqstp;
+	int		i;
+
+	for (i = 0; i < serv->sv_nrpools; i++) {
+		pool = &serv->sv_pools[i];
+		spin_lock_bh(&pool->sp_lock);
+		if ((rqstp = pool->sp_threads) != NULL) {
+			dprintk("svc: daemon %p woken up.\n", rqstp);
+			/*
+			svc_serv_dequeue(pool, rqstp);
+			rqstp->rq_sock = NULL;
+			 */
+			wake_up(&rqstp->rq_wait);
+		}
+		spin_unlock_bh(&pool->sp_lock);
+		if (rqstp)
+			break;
+	}
+}
 
-	spin_lock_bh(&serv->sv_lock);
-	if ((rqstp = serv->sv_threads) != NULL) {
-		dprintk("svc: daemon %p woken up.\n", rqstp);
-		/*
-		svc_serv_dequeue(serv, rqstp);
-		rqstp->rq_sock = NULL;
-		 */
-		wake_up(&rqstp->rq_wait);
+/*
+ * Take a ready socket from another pool, for a thread that found
+ * nothing to do in its own.
+ */
+static struct svc_sock *
+svc_sock_steal(struct svc_serv *serv, struct svc_pool *mine)
+{
+	struct svc_pool	*pool;
+	struct svc_sock	*svsk = NULL;
+	int		i;
+
+	for (i = 0; i < serv->sv_nrpools && !svsk; i++) {
+		pool = &serv->sv_pools[i];
+		if (pool == mine || !pool->sp_sockets)
+			continue;
+		spin_lock_bh(&pool->sp_lock);
+		if ((svsk = svc_sock_dequeue(pool)) != NULL)
+			svsk->sk_inuse++;
+		spin_unlock_bh(&pool->sp_lock);
 	}
-	spin_unlock_bh(&serv->sv_lock);
+	return svsk;
 }
 
 /*
@@ -277,6 +397,61 @@ svc_sendto(struct svc_rqst *rqstp, struct iovec *iov, int nr)
 	return len;
 }
 
+/*
+ * Send a reply buffer. When the server left page cache data in
+ * bufp->pages, that part of the reply is sent from the pages, followed
+ * by the XDR padding and whatever the buffer holds after the data.
+ */
+static int
+svc_sendto_buf(struct svc_rqst *rqstp, struct svc_buf *bufp)
+{
+	static u32	xdr_zero;
+	struct iovec	iov[RPCSVC_MAXIOV + 3];
+	struct svc_page	*sp;
+	int		i, nr, head, datalen, total, len;
+
+	total = bufp->len << 2;
+	if (!bufp->nrpages)
+		goto linear;
+
+	head = (bufp->pagedata - bufp->base) << 2;
+	for (i = datalen = 0; i < bufp->nrpages; i++)
+		datalen += bufp->pages[i].len;
+	/* An error after the read may have cut the reply short */
+	if (head < 0 || head + (XDR_QUADLEN(datalen) << 2) > total)
+		goto linear;
+
+	iov[0].iov_base = bufp->base;
+	iov[0].iov_len  = head;
+	nr = 1;
+	for (i = 0, sp = bufp->pages; i < bufp->nrpages; i++, sp++, nr++) {
+		iov[nr].iov_base = (char *) kmap(sp->page) + sp->offset;
+		iov[nr].iov_len  = sp->len;
+	}
+	if (datalen & 3) {
+		iov[nr].iov_base = &xdr_zero;
+		iov[nr].iov_len  = 4 - (datalen & 3);
+		nr++;
+	}
+	head += XDR_QUADLEN(datalen) << 2;
+	if (head < total) {
+		iov[nr].iov_base = (char *) bufp->base + head;
+		iov[nr].iov_len  = total - head;
+		nr++;
+	}
+
+	len = svc_sendto(rqstp, iov, nr);
+
+	for (i = 0; i < bufp->nrpages; i++)
+		kunmap(bufp->pages[i].page);
+	return len;
+
+linear:
+	bufp->iov[0].iov_base = bufp->base;
+	bufp->iov[0].iov_len  = total;
+	return svc_sendto(rqstp, bufp->iov, bufp->nriov);
+}
+
 /*
  * Check input queue length
  */
@@ -355,6 +530,23 @@ svc_udp_data_ready(struct sock *sk, int count)
 		wake_up_interruptible(sk->sleep);
 }
 
+/*
+ * Set socket buffer sizes. A UDP socket must be able to queue a
+ * datagram of the largest size for every thread that may pick it up,
+ * or large WRITEs are dropped before they get to a thread.
+ */
+static void
+svc_sock_setbufsize(struct socket *sock, unsigned int snd, unsigned int rcv)
+{
+	struct sock	*sk = sock->sk;
+
+	lock_sock(sk);
+	sk->sndbuf = snd * 2;
+	sk->rcvbuf = rcv * 2;
+	sk->userlocks |= SOCK_SNDBUF_LOCK|SOCK_RCVBUF_LOCK;
+	release_sock(sk);
+}
+
 /*
  * Receive a datagram from a UDP socket.
  */
@@ -366,6 +558,12 @@ svc_udp_recvfrom(struct svc_rqst *rqstp)
 	struct sk_buff	*skb;
 	u32		*data;
 	int		err, len;
+	unsigned int	bufsz;
+
+	/* Threads may have been added since we last looked */
+	bufsz = (serv->sv_nrthreads + 3) * serv->sv_bufsz;
+	if (svsk->sk_sk->rcvbuf < bufsz * 2)
+		svc_sock_setbufsize(svsk->sk_sock, bufsz, bufsz);
 
 	svsk->sk_data = 0;
 	while ((skb = skb_recv_datagram(svsk->sk_sk, 0, 1, &err)) == NULL) {
@@ -420,18 +618,11 @@ svc_udp_sendto(struct svc_rqst *rqstp)
 	struct svc_buf	*bufp = &rqstp->rq_resbuf;
 	int		error;
 
-	/* Set up the first element of the reply iovec.
-	 * Any other iovecs that may be in use have been taken
-	 * care of by the server implementation itself.
-	 */
 	/* bufp->base = bufp->area; */
-	bufp->iov[0].iov_base = bufp->base;
-	bufp->iov[0].iov_len  = bufp->len << 2;
-
-	error = svc_sendto(rqstp, bufp->iov, bufp->nriov);
+	error = svc_sendto_buf(rqstp, bufp);
 	if (error == -ECONNREFUSED)
 		/* ICMP error on earlier request. */
-		error = svc_sendto(rqstp, bufp->iov, bufp->nriov);
+		error = svc_sendto_buf(rqstp, bufp);
 	else if (error == -EAGAIN)
 		/* Ignore and wait for re-xmit */
 		error = 0;
@@ -734,15 +925,9 @@ svc_tcp_sendto(struct svc_rqst *rqstp)
 	struct svc_buf	*bufp = &rqstp->rq_resbuf;
 	int sent;
 
-	/* Set up the first element of the reply iovec.
-	 * Any other iovecs that may be in use have been taken
-	 * care of by the server implementation itself.
-	 */
-	bufp->iov[0].iov_base = bufp->base;
-	bufp->iov[0].iov_len  = bufp->len << 2;
 	bufp->base[0] = htonl(0x80000000|((bufp->len << 2) - 4));
 
-	sent = svc_sendto(rqstp, bufp->iov, bufp->nriov);
+	sent = svc_sendto_buf(rqstp, bufp);
 	if (sent != bufp->len<<2) {
 		printk(KERN_NOTICE "rpc-srv/tcp: %s: sent only %d bytes of %d - should shutdown socket\n",
 		       rqstp->rq_sock->sk_server->sv_name,
@@ -784,6 +969,7 @@ svc_tcp_init(struct svc_sock *svsk)
 int
 svc_recv(struct svc_serv *serv, struct svc_rqst *rqstp, long timeout)
 {
+	struct svc_pool		*pool = rqstp->rq_pool;
 	struct svc_sock		*svsk;
 	int			len;
 	DECLARE_WAITQUEUE(wait, current);
@@ -807,13 +993,31 @@ svc_recv(struct svc_serv *serv, struct svc_rqst *rqstp, long timeout)
 	if (signalled())
 		return -EINTR;
 
-	spin_lock_bh(&serv->sv_lock);
-	if ((svsk = svc_sock_dequeue(serv)) != NULL) {
+	/* Sockets that became ready on our CPU come first. Before going
+	 * to sleep, help out a pool that has more work than threads; then
+	 * look at our own pool once more, as a socket may have been
+	 * queued there while we weren't holding its lock.
+	 */
+	spin_lock_bh(&pool->sp_lock);
+	if ((svsk = svc_sock_dequeue(pool)) != NULL) {
+		rqstp->rq_sock = svsk;
+		svsk->sk_inuse++;
+		goto got_sock;
+	}
+	spin_unlock_bh(&pool->sp_lock);
+
+	if ((svsk = svc_sock_steal(serv, pool)) != NULL) {
+		rqstp->rq_sock = svsk;
+		goto have_sock;
+	}
+
+	spin_lock_bh(&pool->sp_lock);
+	if ((svsk = svc_sock_dequeue(pool)) != NULL) {
 		rqstp->rq_sock = svsk;
 		svsk->sk_inuse++;
 	} else {
 		/* No data pending. Go to sleep */
-		svc_serv_enqueue(serv, rqstp);
+		svc_serv_enqueue(pool, rqstp);
 
 		/*
 		 * We have to be able to interrupt this wait
@@ -821,21 +1025,23 @@ svc_recv(struct svc_serv *serv, struct svc_rqst *rqstp, long timeout)
 		 */
 		set_current_state(TASK_INTERRUPTIBLE);
 		add_wait_queue(&rqstp->rq_wait, &wait);
-		spin_unlock_bh(&serv->sv_lock);
+		spin_unlock_bh(&pool->sp_lock);
 
 		schedule_timeout(timeout);
 
-		spin_lock_bh(&serv->sv_lock);
+		spin_lock_bh(&pool->sp_lock);
 		remove_wait_queue(&rqstp->rq_wait, &wait);
 
 		if (!(svsk = rqstp->rq_sock)) {
-			svc_serv_dequeue(serv, rqstp);
-			spin_unlock_bh(&serv->sv_lock);
+			svc_serv_dequeue(pool, rqstp);
+			spin_unlock_bh(&pool->sp_lock);
 			dprintk("svc: server %p, no data yet\n", rqstp);
 			return signalled()? -EINTR : -EAGAIN;
 		}
 	}
-	spin_unlock_bh(&serv->sv_lock);
+got_sock:
+	spin_unlock_bh(&pool->sp_lock);
+have_sock:
 
 	dprintk("svc: server %p, socket %p, inuse=%d\n",
 		 rqstp, svsk, svsk->sk_inuse);
@@ -857,6 +1063,7 @@ svc_recv(struct svc_serv *serv, struct svc_rqst *rqstp, long timeout)
 
 	/* Assume that the reply consists of a single buffer. */
 	rqstp->rq_resbuf.nriov = 1;
+	rqstp->rq_resbuf.nrpages = 0;
 
 	if (serv->sv_stats)
 		serv->sv_stats->netcnt++;
@@ -1030,11 +1237,22 @@ svc_delete_socket(struct svc_sock *svsk)
 		return;
 	}
 	*rsk = svsk->sk_list;
-	if (svsk->sk_qued)
-		rpc_remove_list(&serv->sv_sockets, svsk);
-
 	spin_unlock_bh(&serv->sv_lock);
 
+	/* sk_pool only changes under sk_lock, in svc_sock_enqueue */
+	spin_lock_bh(&svsk->sk_lock);
+	if (svsk->sk_qued) {
+		struct svc_pool	*pool = svsk->sk_pool;
+
+		spin_lock(&pool->sp_lock);
+		if (svsk->sk_qued) {
+			rpc_remove_list(&pool->sp_sockets, svsk);
+			svsk->sk_qued = 0;
+		}
+		spin_unlock(&pool->sp_lock);
+	}
+	spin_unlock_bh(&svsk->sk_lock);
+
 	svsk->sk_dead = 1;
 
 	if (!svsk->sk_inuse) {
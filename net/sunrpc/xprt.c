@@ -79,6 +79,9 @@ extern spinlock_t rpc_queue_lock;
 spinlock_t xprt_sock_lock = SPIN_LOCK_UNLOCKED;
 spinlock_t xprt_lock = SPIN_LOCK_UNLOCKED;
 
+/* All transports, for /proc/net/rpc/xprt. Protected by xprt_lock. */
+static LIST_HEAD(all_xprts);
+
 #ifdef RPC_DEBUG
 # undef  RPC_DEBUG_DATA
 # define RPCDBG_FACILITY	RPCDBG_XPRT
@@ -527,7 +530,7 @@ xprt_lookup_rqst(struct rpc_xprt *xprt, u32 xid)
 			if ((req = task->tk_rqstp) && req->rq_xid == xid)
 				goto out;
 			task = task->tk_next;
-			if (++safe > 100) {
+			if (++safe > xprt->max_reqs) {
 				printk("xprt_lookup_rqst: loop in Q!\n");
 				goto out_bad;
 			}
@@ -1322,6 +1325,8 @@ xprt_reserve(struct rpc_task *task)
 		task->tk_status = -ENOBUFS;
 	} else {
 		dprintk("RPC:      xprt_reserve waiting on backlog\n");
+		if (!task->tk_qstart)
+			task->tk_qstart = jiffies;
 		task->tk_status = -EAGAIN;
 		rpc_sleep_on(&xprt->backlog, task, NULL, NULL);
 	}
@@ -1331,6 +1336,41 @@ xprt_reserve(struct rpc_task *task)
 	return task->tk_status;
 }
 
+/*
+ * Is this one of the slots allocated beyond the transport's own?
+ */
+static inline int
+xprt_slot_extra(struct rpc_xprt *xprt, struct rpc_rqst *req)
+{
+	return req < xprt->slot || req >= xprt->slot + RPC_MAXREQS;
+}
+
+/*
+ * Take a slot off the free list, or allocate a new one if the
+ * transport may have more. Called with xprt_sock_lock held.
+ */
+static inline struct rpc_rqst *
+xprt_get_slot(struct rpc_xprt *xprt)
+{
+	struct rpc_rqst	*req;
+
+	if ((req = xprt->free) != NULL) {
+		xprt->free = req->rq_next;
+		xprt->nfree--;
+		return req;
+	}
+	if (xprt->nslots >= xprt->max_reqs)
+		return NULL;
+	req = (struct rpc_rqst *) kmalloc(sizeof(*req), GFP_ATOMIC);
+	if (req) {
+		memset(req, 0, sizeof(*req));
+		xprt->nslots++;
+		dprintk("RPC:      transport %p grows to %u slots\n",
+				xprt, xprt->nslots);
+	}
+	return req;
+}
+
 /*
  * Reservation callback
  */
@@ -1339,6 +1379,7 @@ xprt_reserve_status(struct rpc_task *task)
 {
 	struct rpc_xprt	*xprt = task->tk_xprt;
 	struct rpc_rqst	*req;
+	unsigned int	out;
 
 	if (xprt->shutdown) {
 		task->tk_status = -EIO;
@@ -1347,17 +1388,26 @@ xprt_reserve_status(struct rpc_task *task)
 	} else if (task->tk_rqstp) {
 		/* We've already been given a request slot: NOP */
 	} else {
-		if (RPCXPRT_CONGESTED(xprt) || !(req = xprt->free))
+		if (RPCXPRT_CONGESTED(xprt) || !(req = xprt_get_slot(xprt)))
 			goto out_nofree;
 		/* OK: There's room for us. Grab a free slot and bump
 		 * congestion value */
-		xprt->free     = req->rq_next;
 		req->rq_next   = NULL;
 		xprt->cong    += RPC_CWNDSCALE;
 		task->tk_rqstp = req;
 		xprt_request_init(task, xprt);
 
-		if (xprt->free)
+		xprt->st_reqs++;
+		if (task->tk_qstart) {
+			xprt->st_backlog++;
+			xprt->st_qtime += jiffies - task->tk_qstart;
+			task->tk_qstart = 0;
+		}
+		out = xprt->cong / RPC_CWNDSCALE;
+		if (out > xprt->st_maxout)
+			xprt->st_maxout = out;
+
+		if (xprt->free || xprt->nslots < xprt->max_reqs)
 			xprt_clear_backlog(xprt);
 	}
 
@@ -1413,8 +1463,15 @@ xprt_release(struct rpc_task *task)
 	}
 
 	spin_lock_bh(&xprt_sock_lock);
-	req->rq_next = xprt->free;
-	xprt->free   = req;
+	if (xprt_slot_extra(xprt, req) && xprt->nfree >= RPC_MAXREQS) {
+		/* Plenty of idle slots: give this one back */
+		xprt->nslots--;
+		kfree(req);
+	} else {
+		req->rq_next = xprt->free;
+		xprt->free   = req;
+		xprt->nfree++;
+	}
 
 	/* Decrease congestion value. */
 	xprt->cong -= RPC_CWNDSCALE;
@@ -1472,10 +1529,13 @@ xprt_setup(struct socket *sock, int proto,
 	xprt->prot = proto;
 	xprt->stream = (proto == IPPROTO_TCP)? 1 : 0;
 	if (xprt->stream) {
-		xprt->cwnd = RPC_MAXCWND;
+		xprt->max_reqs = RPC_MAXREQS_TCP;
+		xprt->cwnd = RPC_MAXREQS_TCP * RPC_CWNDSCALE;
 		xprt->nocong = 1;
-	} else
+	} else {
+		xprt->max_reqs = RPC_MAXREQS;
 		xprt->cwnd = RPC_INITCWND;
+	}
 	xprt->congtime = jiffies;
 	init_waitqueue_head(&xprt->cong_wait);
 
@@ -1497,9 +1557,14 @@ xprt_setup(struct socket *sock, int proto,
 		req->rq_next = req + 1;
 	req->rq_next = NULL;
 	xprt->free = xprt->slot;
+	xprt->nslots = xprt->nfree = RPC_MAXREQS;
 
 	INIT_LIST_HEAD(&xprt->rx_pending);
 
+	spin_lock(&xprt_lock);
+	list_add(&xprt->xprt_list, &all_xprts);
+	spin_unlock(&xprt_lock);
+
 	dprintk("RPC:      created transport %p\n", xprt);
 	
 	xprt_bind_socket(xprt, sock);
@@ -1530,6 +1595,43 @@ xprt_bindresvport(struct socket *sock)
 	return err;
 }
 
+/*
+ * Apply the socket buffer sizes requested by the upper layer. The
+ * defaults are too small to hold a window of large UDP replies.
+ */
+static void
+xprt_sock_setbufsize(struct rpc_xprt *xprt)
+{
+	struct sock	*sk = xprt->inet;
+
+	if (!sk)
+		return;
+	lock_sock(sk);
+	if (xprt->sndsize) {
+		sk->userlocks |= SOCK_SNDBUF_LOCK;
+		sk->sndbuf = xprt->sndsize;
+		sk->write_space(sk);
+	}
+	if (xprt->rcvsize) {
+		sk->userlocks |= SOCK_RCVBUF_LOCK;
+		sk->rcvbuf = xprt->rcvsize;
+	}
+	release_sock(sk);
+}
+
+/*
+ * Set the socket buffer sizes of a transport. They are kept across
+ * reconnects.
+ */
+void
+xprt_set_buffer_size(struct rpc_xprt *xprt, unsigned int sndsize,
+		     unsigned int rcvsize)
+{
+	xprt->sndsize = sndsize;
+	xprt->rcvsize = rcvsize;
+	xprt_sock_setbufsize(xprt);
+}
+
 static int 
 xprt_bind_socket(struct rpc_xprt *xprt, struct socket *sock)
 {
@@ -1557,6 +1659,7 @@ xprt_bind_socket(struct rpc_xprt *xprt, struct socket *sock)
 	/* Reset to new socket */
 	xprt->sock = sock;
 	xprt->inet = sk;
+	xprt_sock_setbufsize(xprt);
 	/*
 	 *	TCP requires the rpc I/O daemon is present
 	 */
@@ -1650,10 +1753,71 @@ xprt_clear_backlog(struct rpc_xprt *xprt) {
 int
 xprt_destroy(struct rpc_xprt *xprt)
 {
+	struct rpc_rqst	*req;
+
 	dprintk("RPC:      destroying transport %p\n", xprt);
 	xprt_shutdown(xprt);
 	xprt_close(xprt);
+
+	spin_lock(&xprt_lock);
+	list_del(&xprt->xprt_list);
+	spin_unlock(&xprt_lock);
+
+	while ((req = xprt->free) != NULL) {
+		xprt->free = req->rq_next;
+		if (xprt_slot_extra(xprt, req))
+			kfree(req);
+	}
 	kfree(xprt);
 
 	return 0;
 }
+
+/*
+ * /proc/net/rpc/xprt: one line per transport,
+ *
+ *	<proto> <addr>:<port> <slots> <in use> <max in use>
+ *		<requests> <waited> <wait ms>
+ *
+ * where <waited> counts the requests that had to wait for a slot and
+ * <wait ms> is the total time they waited.
+ */
+int
+xprt_proc_read(char *buffer, char **start, off_t offset, int count,
+				int *eof, void *data)
+{
+	struct list_head *lp;
+	struct rpc_xprt	*xprt;
+	int		len = 0;
+
+	spin_lock(&xprt_lock);
+	list_for_each(lp, &all_xprts) {
+		/* keep to one page, like the other stats files */
+		if (len > PAGE_SIZE - 128)
+			break;
+		xprt = list_entry(lp, struct rpc_xprt, xprt_list);
+		len += sprintf(buffer + len,
+			"%s %08x:%d %u %lu %u %lu %lu %lu\n",
+			xprt->stream? "tcp" : "udp",
+			ntohl(xprt->addr.sin_addr.s_addr),
+			ntohs(xprt->addr.sin_port),
+			xprt->nslots,
+			xprt->cong / RPC_CWNDSCALE,
+			xprt->st_maxout,
+			xprt->st_reqs,
+			xprt->st_backlog,
+			xprt->st_qtime * 1000 / HZ);
+	}
+	spin_unlock(&xprt_lock);
+
+	if (offset >= len) {
+		*start = buffer;
+		*eof = 1;
+		return 0;
+	}
+	*start = buffer + offset;
+	if ((len -= offset) > count)
+		return count;
+	*eof = 1;
+	return len;
+}
@@ -296,6 +296,20 @@ static __inline__ int unix_writable(struct sock *sk)
 	return ((atomic_read(&sk->wmem_alloc)<<2) <= sk->sndbuf);
 }
 
+/* Wake the reader without kicking another CPU awake, for a writer that
+ * is about to sleep for send space anyway - as pipe_write() does when
+ * the pipe is full.  The reader then runs here, with the data still in
+ * the cache.  Everybody else uses the asynchronous sk->data_ready().
+ */
+static void unix_data_ready_sync(struct sock *sk)
+{
+	read_lock(&sk->callback_lock);
+	if (sk->sleep && waitqueue_active(sk->sleep))
+		wake_up_interruptible_sync(sk->sleep);
+	sk_wake_async(sk, 1, POLL_IN);
+	read_unlock(&sk->callback_lock);
+}
+
 static void unix_write_space(struct sock *sk)
 {
 	read_lock(&sk->callback_lock);
@@ -334,6 +348,7 @@ static void unix_sock_destructor(struct sock *sk)
 
 	BUG_TRAP(atomic_read(&sk->wmem_alloc) == 0);
 	BUG_TRAP(sk->protinfo.af_unix.list==NULL);
+	BUG_TRAP(list_empty(&sk->protinfo.af_unix.gc_link));
 	BUG_TRAP(sk->socket==NULL);
 	if (sk->dead==0) {
 		printk("Attempt to release alive unix socket: %p\n", sk);
@@ -487,6 +502,7 @@ static struct sock * unix_create1(struct socket *sock)
 	sk->protinfo.af_unix.mnt=NULL;
 	sk->protinfo.af_unix.lock = RW_LOCK_UNLOCKED;
 	atomic_set(&sk->protinfo.af_unix.inflight, 0);
+	INIT_LIST_HEAD(&sk->protinfo.af_unix.gc_link);
 	init_MUTEX(&sk->protinfo.af_unix.readsem);/* single task reading lock */
 	init_waitqueue_head(&sk->protinfo.af_unix.peer_wait);
 	sk->protinfo.af_unix.list=NULL;
@@ -1142,6 +1158,16 @@ static void unix_attach_fds(struct scm_cookie *scm, struct sk_buff *skb)
 	scm->fp = NULL;
 }
 
+/*
+ *	Give a copy of the descriptors to a MSG_PEEK reader. They stay in
+ *	flight, so keep clear of the garbage collector.
+ */
+static void unix_peek_fds(struct scm_cookie *scm, struct sk_buff *skb)
+{
+	scm->fp = scm_fp_dup(UNIXCB(skb).fp);
+	unix_gc_barrier();
+}
+
 /*
  *	Send AF_UNIX data.
  */
@@ -1277,6 +1303,60 @@ out:
 	return err;
 }
 
+/*
+ *	Small writes to a stream whose reader is behind are appended to
+ *	the last skb on the reader's queue, if it is ours and has room,
+ *	instead of costing an skb each. Holding the reader's readsem keeps
+ *	recvmsg() away from the skb while we copy into it; if a reader has
+ *	it, we don't wait but queue a new skb as usual.
+ *
+ *	Returns the number of bytes appended (0 if nothing could be) or
+ *	an error.
+ */
+
+#define UNIX_STREAM_BATCH	1024
+
+static int unix_stream_append(unix_socket *sk, unix_socket *other,
+			      struct msghdr *msg, int size,
+			      struct scm_cookie *scm)
+{
+	struct sk_buff *skb = NULL;
+	unsigned long flags;
+	int copy = 0;
+	int err;
+
+	if (down_trylock(&other->protinfo.af_unix.readsem))
+		return 0;
+
+	unix_state_rlock(other);
+	if (other->dead || (other->shutdown & RCV_SHUTDOWN)) {
+		unix_state_runlock(other);
+		up(&other->protinfo.af_unix.readsem);
+		return -EPIPE;
+	}
+
+	spin_lock_irqsave(&other->receive_queue.lock, flags);
+	skb = skb_peek_tail(&other->receive_queue);
+	if (skb && skb->sk == sk && skb_tailroom(skb) > 0 && !UNIXCB(skb).fp &&
+	    memcmp(UNIXCREDS(skb), &scm->creds, sizeof(struct ucred)) == 0) {
+		copy = min(size, skb_tailroom(skb));
+		skb_get(skb);
+	}
+	spin_unlock_irqrestore(&other->receive_queue.lock, flags);
+	unix_state_runlock(other);
+
+	if (copy) {
+		err = memcpy_fromiovec(skb->tail, msg->msg_iov, copy);
+		if (err == 0)
+			skb_put(skb, copy);
+		else
+			copy = err;
+		kfree_skb(skb);
+	}
+
+	up(&other->protinfo.af_unix.readsem);
+	return copy;
+}
 		
 static int unix_stream_sendmsg(struct socket *sock, struct msghdr *msg, int len,
 			       struct scm_cookie *scm)
@@ -1288,6 +1368,7 @@ static int unix_stream_sendmsg(struct socket *sock, struct msghdr *msg, int len,
 	struct sk_buff *skb;
 	int limit=0;
 	int sent=0;
+	int alloc;
 
 	err = -EOPNOTSUPP;
 	if (msg->msg_flags&MSG_OOB)
@@ -1320,13 +1401,37 @@ static int unix_stream_sendmsg(struct socket *sock, struct msghdr *msg, int len,
 		if (size > sk->sndbuf/2 - 16)
 			size = sk->sndbuf/2 - 16;
 
+		/*
+		 *	If the reader is behind, try to add to the data it
+		 *	has not read yet.
+		 */
+
+		if (!scm->fp && skb_queue_len(&other->receive_queue)) {
+			err = unix_stream_append(sk, other, msg, size, scm);
+			if (err == -EPIPE)
+				goto pipe_err;
+			if (err < 0)
+				goto out_err;
+			if (err > 0) {
+				other->data_ready(other, err);
+				sent+=err;
+				continue;
+			}
+
+			/* Leave room in the new skb for the next small writes */
+			alloc = min(UNIX_STREAM_BATCH, sk->sndbuf/2 - 16);
+			if (alloc < size)
+				alloc = size;
+		} else
+			alloc = size;
+
 		/*
 		 *	Keep to page sized kmalloc()'s as various people
 		 *	have suggested. Big mallocs stress the vm too
 		 *	much.
 		 */
 
-		if (size > PAGE_SIZE-16)
+		if (alloc > PAGE_SIZE-16)
 			limit = PAGE_SIZE-16; /* Fall back to a page if we can't grab a big buffer this instant */
 		else
 			limit = 0;	/* Otherwise just grab and wait */
@@ -1335,7 +1440,7 @@ static int unix_stream_sendmsg(struct socket *sock, struct msghdr *msg, int len,
 		 *	Grab a buffer
 		 */
 		 
-		skb=sock_alloc_send_skb(sk,size,limit,msg->msg_flags&MSG_DONTWAIT, &err);
+		skb=sock_alloc_send_skb(sk,alloc,limit,msg->msg_flags&MSG_DONTWAIT, &err);
 
 		if (skb==NULL)
 			goto out_err;
@@ -1365,8 +1470,15 @@ static int unix_stream_sendmsg(struct socket *sock, struct msghdr *msg, int len,
 
 		skb_queue_tail(&other->receive_queue, skb);
 		unix_state_runlock(other);
-		other->data_ready(other, size);
 		sent+=size;
+
+		/* Out of send space with more to go: we sleep in
+		   sock_alloc_send_skb() next, let the reader have the CPU */
+		if (sent < len && !(msg->msg_flags&MSG_DONTWAIT) &&
+		    atomic_read(&sk->wmem_alloc) >= sk->sndbuf)
+			unix_data_ready_sync(other);
+		else
+			other->data_ready(other, size);
 	}
 	sock_put(other);
 	return sent;
@@ -1449,7 +1561,7 @@ static int unix_dgram_recvmsg(struct socket *sock, struct msghdr *msg, int size,
 		   
 		*/
 		if (UNIXCB(skb).fp)
-			scm->fp = scm_fp_dup(UNIXCB(skb).fp);
+			unix_peek_fds(scm, skb);
 	}
 	err = size;
 
@@ -1614,7 +1726,7 @@ static int unix_stream_recvmsg(struct socket *sock, struct msghdr *msg, int size
 			/* It is questionable, see note in unix_dgram_recvmsg.
 			 */
 			if (UNIXCB(skb).fp)
-				scm->fp = scm_fp_dup(UNIXCB(skb).fp);
+				unix_peek_fds(scm, skb);
 
 			/* put message back and return */
 			skb_queue_head(&sk->receive_queue, skb);
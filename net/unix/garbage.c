@@ -15,14 +15,8 @@
  *
  * Current optimizations:
  *
- *  - explicit stack instead of recursion
- *  - tail recurse on first born instead of immediate push/pop
- *  - we gather the stuff that should not be killed into tree
- *    and stack is just a path from root to the current pointer.
- *
- *  Future optimizations:
- *
- *  - don't just push entire root set; process in place
+ *  - only sockets with descriptors in flight are looked at, not
+ *    every unix socket in the system (see below)
  *
  *	This program is free software; you can redistribute it and/or
  *	modify it under the terms of the GNU General Public License
@@ -62,6 +56,15 @@
  *	AV		1 Mar 1999
  *		Damn. Added missing check for ->dead in listen queues scanning.
  *
+ *	In-flight only collector
+ *		Replaced the mark & sweep over all sockets. Only sockets
+ *		with descriptors in flight are looked at; they are kept on
+ *		gc_inflight_list by unix_inflight()/unix_notinflight(),
+ *		under unix_gc_lock. A socket all of whose references are
+ *		in flight is a candidate. Subtract the references the
+ *		candidates hold on each other, give back (recursively) the
+ *		ones of candidates still referenced from outside, and what
+ *		is left are cycles. unix_table_lock is not taken any more.
  */
  
 #include <linux/kernel.h>
@@ -84,10 +87,11 @@
 
 /* Internal data structures and random procedures: */
 
-#define GC_HEAD		((unix_socket *)(-1))
-#define GC_ORPHAN	((unix_socket *)(-3))
-
-static unix_socket *gc_current=GC_HEAD;	/* stack of objects to mark */
+static LIST_HEAD(gc_inflight_list);	/* sockets with inflight > 0 */
+static LIST_HEAD(gc_candidates);	/* during GC: maybe garbage */
+static spinlock_t unix_gc_lock = SPIN_LOCK_UNLOCKED;
+static int gc_in_progress;
+static DECLARE_WAIT_QUEUE_HEAD(unix_gc_wait);
 
 atomic_t unix_tot_inflight = ATOMIC_INIT(0);
 
@@ -122,8 +126,14 @@ void unix_inflight(struct file *fp)
 {
 	unix_socket *s=unix_get_socket(fp);
 	if(s) {
+		spin_lock(&unix_gc_lock);
 		atomic_inc(&s->protinfo.af_unix.inflight);
+		if (atomic_read(&s->protinfo.af_unix.inflight) == 1) {
+			BUG_TRAP(list_empty(&s->protinfo.af_unix.gc_link));
+			list_add_tail(&s->protinfo.af_unix.gc_link, &gc_inflight_list);
+		}
 		atomic_inc(&unix_tot_inflight);
+		spin_unlock(&unix_gc_lock);
 	}
 }
 
@@ -131,35 +141,151 @@ void unix_notinflight(struct file *fp)
 {
 	unix_socket *s=unix_get_socket(fp);
 	if(s) {
-		atomic_dec(&s->protinfo.af_unix.inflight);
+		spin_lock(&unix_gc_lock);
+		BUG_TRAP(!list_empty(&s->protinfo.af_unix.gc_link));
+		if (atomic_dec_and_test(&s->protinfo.af_unix.inflight))
+			list_del_init(&s->protinfo.af_unix.gc_link);
 		atomic_dec(&unix_tot_inflight);
+		spin_unlock(&unix_gc_lock);
 	}
 }
 
 
 /*
- *	Garbage Collector Support Functions
+ *	A MSG_PEEK hands out new references to descriptors that stay in
+ *	flight, without going through unix_notinflight(). Called after
+ *	the descriptors have been duplicated, it waits for a collection
+ *	that may have missed the new references to finish. A collection
+ *	that starts later sees them in the file counts.
  */
 
-extern inline unix_socket *pop_stack(void)
+void unix_gc_barrier(void)
 {
-	unix_socket *p=gc_current;
-	gc_current = p->protinfo.af_unix.gc_tree;
-	return p;
+	int running;
+
+	spin_lock(&unix_gc_lock);
+	running = gc_in_progress;
+	spin_unlock(&unix_gc_lock);
+
+	if (running)
+		wait_event(unix_gc_wait, !gc_in_progress);
 }
 
-extern inline int empty_stack(void)
+
+/*
+ *	Garbage Collector Support Functions
+ */
+
+#define gc_entry(p)	list_entry(p, unix_socket, protinfo.af_unix.gc_link)
+
+/*
+ *	Call func for every candidate referenced from the descriptors on
+ *	x's queue. If hitlist is given, the skbs carrying such references
+ *	are moved onto it.
+ */
+
+static void scan_inflight(unix_socket *x, void (*func)(unix_socket *),
+			  struct sk_buff_head *hitlist)
 {
-	return gc_current == GC_HEAD;
+	struct sk_buff *skb, *next;
+
+	spin_lock(&x->receive_queue.lock);
+	skb=skb_peek(&x->receive_queue);
+	while(skb && skb != (struct sk_buff *)&x->receive_queue)
+	{
+		next=skb->next;
+		/*
+		 *	Do we have file descriptors ?
+		 */
+		if(UNIXCB(skb).fp)
+		{
+			int hit=0;
+			int nfd=UNIXCB(skb).fp->count;
+			struct file **fp = UNIXCB(skb).fp->fp;
+			unix_socket *sk;
+
+			while(nfd--)
+			{
+				/*
+				 *	Get the socket the fd matches if
+				 *	it indeed does so
+				 */
+				if((sk=unix_get_socket(*fp++))!=NULL &&
+				   sk->protinfo.af_unix.gc_candidate)
+				{
+					hit=1;
+					func(sk);
+				}
+			}
+			if (hit && hitlist) {
+				__skb_unlink(skb, skb->list);
+				__skb_queue_tail(hitlist,skb);
+			}
+		}
+		skb=next;
+	}
+	spin_unlock(&x->receive_queue.lock);
 }
 
-extern inline void maybe_unmark_and_push(unix_socket *x)
+/*
+ *	Like scan_inflight(), but for a listening socket scan the
+ *	not-yet-accepted ones instead: they can hold descriptors too.
+ */
+
+static void scan_children(unix_socket *x, void (*func)(unix_socket *),
+			  struct sk_buff_head *hitlist)
 {
-	if (x->protinfo.af_unix.gc_tree != GC_ORPHAN)
+	struct sk_buff *skb;
+	unix_socket *u;
+	LIST_HEAD(embryos);
+
+	if (x->state != TCP_LISTEN) {
+		scan_inflight(x, func, hitlist);
 		return;
-	sock_hold(x);
-	x->protinfo.af_unix.gc_tree = gc_current;
-	gc_current = x;
+	}
+
+	spin_lock(&x->receive_queue.lock);
+	skb=skb_peek(&x->receive_queue);
+	while(skb && skb != (struct sk_buff *)&x->receive_queue)
+	{
+		/* An embryo has no file, so it can't be in flight and its
+		 * gc_link is free to use. */
+		u = skb->sk;
+		BUG_TRAP(list_empty(&u->protinfo.af_unix.gc_link));
+		list_add_tail(&u->protinfo.af_unix.gc_link, &embryos);
+		skb=skb->next;
+	}
+	spin_unlock(&x->receive_queue.lock);
+
+	while (!list_empty(&embryos)) {
+		u = gc_entry(embryos.next);
+		scan_inflight(u, func, hitlist);
+		list_del_init(&u->protinfo.af_unix.gc_link);
+	}
+}
+
+static void dec_inflight(unix_socket *u)
+{
+	atomic_dec(&u->protinfo.af_unix.inflight);
+}
+
+static void inc_inflight(unix_socket *u)
+{
+	atomic_inc(&u->protinfo.af_unix.inflight);
+}
+
+static void inc_inflight_move_tail(unix_socket *u)
+{
+	atomic_inc(&u->protinfo.af_unix.inflight);
+	/*
+	 *	If it may still be part of a cycle, move it to the end of
+	 *	the list, so that it is looked at again even if the walk
+	 *	already passed it.
+	 */
+	if (u->protinfo.af_unix.gc_maybe_cycle) {
+		list_del(&u->protinfo.af_unix.gc_link);
+		list_add_tail(&u->protinfo.af_unix.gc_link, &gc_candidates);
+	}
 }
 
 
@@ -167,130 +293,110 @@ extern inline void maybe_unmark_and_push(unix_socket *x)
 
 void unix_gc(void)
 {
-	static DECLARE_MUTEX(unix_gc_sem);
-	int i;
-	unix_socket *s;
+	struct list_head *p, *next;
+	struct list_head cursor;
+	LIST_HEAD(not_cycle_list);
 	struct sk_buff_head hitlist;
 	struct sk_buff *skb;
+	unix_socket *u;
+
+	spin_lock(&unix_gc_lock);
 
 	/*
 	 *	Avoid a recursive GC.
 	 */
 
-	if (down_trylock(&unix_gc_sem))
-		return;
+	if (gc_in_progress)
+		goto out;
+	gc_in_progress = 1;
 
-	read_lock(&unix_table_lock);
+	/*
+	 *	Select the candidates: in-flight sockets without any
+	 *	reference from outside the in-flight descriptors.
+	 *
+	 *	Nobody holds a candidate's file, so nobody can read its
+	 *	queue. A candidate could only gain an outside reference by a
+	 *	descriptor of it being received from another socket: for a
+	 *	real receive unix_notinflight() waits for unix_gc_lock, and a
+	 *	MSG_PEEK waits in unix_gc_barrier() until we are done. So
+	 *	everything on the candidates' queues stays put. Other sockets
+	 *	may still queue to them, but not descriptors of candidates.
+	 */
 
-	forall_unix_sockets(i, s)
-	{
-		s->protinfo.af_unix.gc_tree=GC_ORPHAN;
+	for (p = gc_inflight_list.next; p != &gc_inflight_list; p = next) {
+		int total_refs, inflight_refs;
+
+		next = p->next;
+		u = gc_entry(p);
+		if (!u->socket || !u->socket->file)
+			continue;
+
+		total_refs = file_count(u->socket->file);
+		inflight_refs = atomic_read(&u->protinfo.af_unix.inflight);
+
+		BUG_TRAP(inflight_refs >= 1);
+		BUG_TRAP(total_refs >= inflight_refs);
+		if (total_refs == inflight_refs) {
+			list_del(p);
+			list_add_tail(p, &gc_candidates);
+			u->protinfo.af_unix.gc_candidate = 1;
+			u->protinfo.af_unix.gc_maybe_cycle = 1;
+		}
 	}
+
 	/*
-	 *	Everything is now marked 
+	 *	Remove the references the candidates hold on each other.
 	 */
 
-	/* Invariant to be maintained:
-		- everything unmarked is either:
-		-- (a) on the stack, or
-		-- (b) has all of its children unmarked
-		- everything on the stack is always unmarked
-		- nothing is ever pushed onto the stack twice, because:
-		-- nothing previously unmarked is ever pushed on the stack
-	 */
+	list_for_each(p, &gc_candidates)
+		scan_children(gc_entry(p), dec_inflight, NULL);
 
 	/*
-	 *	Push root set
+	 *	A candidate that still has references is reachable from
+	 *	outside; give back the references it holds, recursively, so
+	 *	that only the sockets forming cycles remain. The cursor keeps
+	 *	our place while entries are moved around.
 	 */
 
-	forall_unix_sockets(i, s)
-	{
-		/*
-		 *	If all instances of the descriptor are not
-		 *	in flight we are in use.
-		 */
-		if(s->socket && s->socket->file &&
-		   file_count(s->socket->file) > atomic_read(&s->protinfo.af_unix.inflight))
-			maybe_unmark_and_push(s);
+	list_add(&cursor, &gc_candidates);
+	while (cursor.next != &gc_candidates) {
+		p = cursor.next;
+		u = gc_entry(p);
+
+		/* Move the cursor past the current entry */
+		list_del(&cursor);
+		list_add(&cursor, p);
+
+		if (atomic_read(&u->protinfo.af_unix.inflight) > 0) {
+			list_del(p);
+			list_add_tail(p, &not_cycle_list);
+			u->protinfo.af_unix.gc_maybe_cycle = 0;
+			scan_children(u, inc_inflight_move_tail, NULL);
+		}
 	}
+	list_del(&cursor);
 
 	/*
-	 *	Mark phase 
+	 *	Those are live, put them back.
 	 */
 
-	while (!empty_stack())
-	{
-		unix_socket *x = pop_stack();
-		unix_socket *sk;
-
-		spin_lock(&x->receive_queue.lock);
-		skb=skb_peek(&x->receive_queue);
-		
-		/*
-		 *	Loop through all but first born 
-		 */
-		
-		while(skb && skb != (struct sk_buff *)&x->receive_queue)
-		{
-			/*
-			 *	Do we have file descriptors ?
-			 */
-			if(UNIXCB(skb).fp)
-			{
-				/*
-				 *	Process the descriptors of this socket
-				 */
-				int nfd=UNIXCB(skb).fp->count;
-				struct file **fp = UNIXCB(skb).fp->fp;
-				while(nfd--)
-				{
-					/*
-					 *	Get the socket the fd matches if
-					 *	it indeed does so
-					 */
-					if((sk=unix_get_socket(*fp++))!=NULL)
-					{
-						maybe_unmark_and_push(sk);
-					}
-				}
-			}
-			/* We have to scan not-yet-accepted ones too */
-			if (x->state == TCP_LISTEN) {
-				maybe_unmark_and_push(skb->sk);
-			}
-			skb=skb->next;
-		}
-		spin_unlock(&x->receive_queue.lock);
-		sock_put(x);
+	while (!list_empty(&not_cycle_list)) {
+		p = not_cycle_list.next;
+		gc_entry(p)->protinfo.af_unix.gc_candidate = 0;
+		list_del(p);
+		list_add_tail(p, &gc_inflight_list);
 	}
 
+	/*
+	 *	The rest is garbage. Restore its counters as well and take
+	 *	the skbs that make up the cycles.
+	 */
+
 	skb_queue_head_init(&hitlist);
+	list_for_each(p, &gc_candidates)
+		scan_children(gc_entry(p), inc_inflight, &hitlist);
 
-	forall_unix_sockets(i, s)
-	{
-		if (s->protinfo.af_unix.gc_tree == GC_ORPHAN)
-		{
-			struct sk_buff *nextsk;
-			spin_lock(&s->receive_queue.lock);
-			skb=skb_peek(&s->receive_queue);
-			while(skb && skb != (struct sk_buff *)&s->receive_queue)
-			{
-				nextsk=skb->next;
-				/*
-				 *	Do we have file descriptors ?
-				 */
-				if(UNIXCB(skb).fp)
-				{
-					__skb_unlink(skb, skb->list);
-					__skb_queue_tail(&hitlist,skb);
-				}
-				skb=nextsk;
-			}
-			spin_unlock(&s->receive_queue.lock);
-		}
-		s->protinfo.af_unix.gc_tree = GC_ORPHAN;
-	}
-	read_unlock(&unix_table_lock);
+	spin_unlock(&unix_gc_lock);
 
 	/*
 	 *	Here we are. Hitlist is filled. Die.
@@ -300,5 +406,25 @@ void unix_gc(void)
 		kfree_skb(skb);
 	}
 
-	up(&unix_gc_sem);
+	spin_lock(&unix_gc_lock);
+
+	/*
+	 *	Freeing the hitlist took the candidates out of flight and off
+	 *	the list. Anything still here is not garbage after all.
+	 */
+
+	BUG_TRAP(list_empty(&gc_candidates));
+	while (!list_empty(&gc_candidates)) {
+		p = gc_candidates.next;
+		gc_entry(p)->protinfo.af_unix.gc_candidate = 0;
+		list_del(p);
+		list_add_tail(p, &gc_inflight_list);
+	}
+	gc_in_progress = 0;
+	spin_unlock(&unix_gc_lock);
+	wake_up(&unix_gc_wait);
+	return;
+
+out:
+	spin_unlock(&unix_gc_lock);
 }